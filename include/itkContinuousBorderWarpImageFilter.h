@@ -19,6 +19,7 @@
 #define itkContinuousBorderWarpImageFilter_h
 
 #include "itkWarpImageFilter.h"
+#include "itkVariationalRegistrationWorkspace.h"
 
 namespace itk
 {
@@ -38,6 +39,10 @@ namespace itk
  *  The input image is set via SetInput(). The input displacement field
  *  is set via SetDisplacementField().
  *
+ *  If a Workspace is set, the output is written into the workspace buffer
+ *  with the name WorkspaceBufferName instead of allocating a new buffer
+ *  on each update.
+ *
  *  This filter is implemented as a multithreaded filter.
  *
  *  \sa WarpImageFilter
@@ -109,10 +114,29 @@ public:
   /** Point type */
   typedef typename Superclass::PointType              PointType;
 
+  /** Workspace type for the output buffer. */
+  typedef VariationalRegistrationWorkspace< DisplacementFieldType > WorkspaceType;
+
+  /** Set/Get the workspace the output is written to. If NULL (default),
+   *  the output is allocated as usual. */
+  itkSetObjectMacro( Workspace, WorkspaceType );
+  itkGetObjectMacro( Workspace, WorkspaceType );
+
+  /** Set/Get the name of the workspace buffer used for the output. */
+  itkSetStringMacro( WorkspaceBufferName );
+  itkGetStringMacro( WorkspaceBufferName );
+
 protected:
-  ContinuousBorderWarpImageFilter() {};
+  ContinuousBorderWarpImageFilter();
   ~ContinuousBorderWarpImageFilter() {};
 
+  /** Print information about the filter. */
+  virtual void PrintSelf(std::ostream& os, Indent indent) const ITK_OVERRIDE;
+
+  /** Allocate the output, using the workspace buffer if a workspace is
+   *  set. */
+  virtual void AllocateOutputs() ITK_OVERRIDE;
+
   /** WarpImageFilter is implemented as a multi-threaded filter.
    * As such, it needs to provide and implementation for
    * ThreadedGenerateData(). */
@@ -123,6 +147,10 @@ private:
   ContinuousBorderWarpImageFilter(const Self&); //purposely not implemented
   void operator=(const Self&); //purposely not implemented
 
+  /** Workspace and buffer name for the output. */
+  typename WorkspaceType::Pointer m_Workspace;
+  std::string                     m_WorkspaceBufferName;
+
 };
 
 } // end namespace itk
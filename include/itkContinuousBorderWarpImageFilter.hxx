@@ -22,6 +22,37 @@
 namespace itk
 {
 
+/**
+ * Default constructor
+ */
+template<class TInputImage, class TOutputImage, class TDisplacementField>
+ContinuousBorderWarpImageFilter<TInputImage, TOutputImage, TDisplacementField>
+::ContinuousBorderWarpImageFilter()
+{
+  m_Workspace = NULL;
+  m_WorkspaceBufferName = "WarpedImage";
+}
+
+/**
+ * Allocate the output in the workspace buffer, if a workspace is set.
+ */
+template<class TInputImage, class TOutputImage, class TDisplacementField>
+void ContinuousBorderWarpImageFilter<TInputImage, TOutputImage, TDisplacementField>
+::AllocateOutputs()
+{
+  if( !m_Workspace )
+    {
+    this->Superclass::AllocateOutputs();
+    return;
+    }
+
+  // The buffer is attached after PrepareOutputs() has reset the output, so
+  // Allocate() only adjusts the size of the attached container.
+  OutputImagePointer outputPtr = this->GetOutput();
+  m_Workspace->AttachBuffer( outputPtr.GetPointer(), m_WorkspaceBufferName );
+  outputPtr->SetBufferedRegion( outputPtr->GetRequestedRegion() );
+  outputPtr->Allocate();
+}
 
 /**
  * Compute the output for the region specified by outputRegionForThread.
@@ -144,6 +175,19 @@ void ContinuousBorderWarpImageFilter<TInputImage, TOutputImage, TDisplacementFie
     }
 }
 
+/**
+ * Standard PrintSelf method.
+ */
+template<class TInputImage, class TOutputImage, class TDisplacementField>
+void ContinuousBorderWarpImageFilter<TInputImage, TOutputImage, TDisplacementField>
+::PrintSelf( std::ostream& os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+
+  os << indent << "Workspace: " << m_Workspace.GetPointer() << std::endl;
+  os << indent << "WorkspaceBufferName: " << m_WorkspaceBufferName << std::endl;
+}
+
 } // end namespace itk
 
 #endif
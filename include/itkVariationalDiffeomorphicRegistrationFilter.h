@@ -110,6 +110,8 @@ public:
   /** Deformation field type. */
   typedef TDisplacementField                       DisplacementFieldType;
   typedef typename DisplacementFieldType::Pointer  DisplacementFieldPointer;
+  typedef typename Superclass::DisplacementFieldRegionType
+                                                   DisplacementFieldRegionType;
 
   /** Types inherited from the superclass */
   typedef typename Superclass::OutputImageType     OutputImageType;
@@ -129,10 +131,10 @@ public:
   /** Get the desired number of iterations for the exponentiator. */
   itkGetConstMacro( NumberOfExponentiatorIterations, unsigned int );
 
-  /** Set initial deformation field. \warning This can't be used for diffeomorphic registration.*/
+  /** Set initial deformation field. \warning This can't be used for diffeomorphic registration.*/
   virtual void SetInitialDisplacementField( DisplacementFieldType * ptr ) ITK_OVERRIDE;
 
-  /** Get output deformation field. Returns the displacement field of the current transformation.*/
+  /** Get output deformation field. Returns the displacement field of the current transformation.*/
   virtual DisplacementFieldType * GetDisplacementField() ITK_OVERRIDE
     { return m_DisplacementField; }
 
@@ -144,6 +146,20 @@ public:
   virtual DisplacementFieldType * GetVelocityField()
     { return this->GetOutput(); }
 
+  /** Set the number of threads of the filter, its components and the
+   *  exponentiator. */
+  virtual void SetNumberOfThreads( ThreadIdType numberOfThreads ) ITK_OVERRIDE;
+
+  /** Get the number of bytes allocated for the fields, including the
+   *  displacement field. */
+  virtual SizeValueType GetAllocatedBytes() ITK_OVERRIDE;
+
+  /** Get an estimate of the number of bytes allocated for a field of the
+   *  given region, including the displacement field and the intermediate
+   *  fields of the exponentiator. */
+  virtual SizeValueType EstimateAllocatedBytes(
+      const DisplacementFieldRegionType & region ) const ITK_OVERRIDE;
+
 protected:
   VariationalDiffeomorphicRegistrationFilter();
   ~VariationalDiffeomorphicRegistrationFilter() {}
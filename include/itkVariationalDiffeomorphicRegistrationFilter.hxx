@@ -39,6 +39,21 @@ VariationalDiffeomorphicRegistrationFilter< TFixedImage, TMovingImage, TDisplace
   m_NumberOfExponentiatorIterations = 4;
 }
 
+/*
+ * Set the number of threads of the filter and the exponentiator.
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+void
+VariationalDiffeomorphicRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::SetNumberOfThreads( ThreadIdType numberOfThreads )
+{
+  Superclass::SetNumberOfThreads( numberOfThreads );
+  if( m_Exponentiator )
+    {
+    m_Exponentiator->SetNumberOfThreads( this->GetNumberOfThreads() );
+    }
+}
+
 /*
  * Set the mask image.
  */
@@ -77,20 +92,7 @@ VariationalDiffeomorphicRegistrationFilter< TFixedImage, TMovingImage, TDisplace
   else
     {
     // Initialize deformation field with zero vectors.
-    typename TDisplacementField::PixelType zeros;
-    for( unsigned int j = 0; j < ImageDimension; j++ )
-      {
-      zeros[j] = 0;
-      }
-
-    ImageRegionIterator< OutputImageType > defIterator(
-        m_DisplacementField, m_DisplacementField->GetRequestedRegion() );
-
-    while( !defIterator.IsAtEnd() )
-      {
-      defIterator.Value() = zeros;
-      ++defIterator;
-      }
+    this->CopyOrZeroFillField( NULL, m_DisplacementField );
     }
 
   this->Superclass::Initialize();
@@ -109,7 +111,40 @@ VariationalDiffeomorphicRegistrationFilter< TFixedImage, TMovingImage, TDisplace
   this->GetVelocityField()->Modified();
 
   // Calculate deformation field from velocity field exponential
+  this->StartPhase( VariationalRegistrationInstrumentation::ExponentiationPhase );
   this->CalcDeformationFromVelocityField( this->GetVelocityField() );
+  this->StopPhase( VariationalRegistrationInstrumentation::ExponentiationPhase );
+}
+
+/*
+ * Get the number of bytes allocated for the fields
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+SizeValueType
+VariationalDiffeomorphicRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::GetAllocatedBytes()
+{
+  SizeValueType bytes = this->Superclass::GetAllocatedBytes();
+  if( m_DisplacementField && m_DisplacementField->GetPixelContainer() )
+    {
+    bytes += m_DisplacementField->GetPixelContainer()->Capacity()
+        * sizeof( typename DisplacementFieldType::PixelType );
+    }
+  return bytes;
+}
+
+/*
+ * Estimate the number of bytes allocated for a field of the given region
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+SizeValueType
+VariationalDiffeomorphicRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::EstimateAllocatedBytes( const DisplacementFieldRegionType & region ) const
+{
+  // Displacement field and the two intermediate fields of the exponentiator
+  // (scaled velocity field and warped field of the squaring steps).
+  return this->Superclass::EstimateAllocatedBytes( region )
+      + 3 * region.GetNumberOfPixels() * sizeof( typename DisplacementFieldType::PixelType );
 }
 
 /*
@@ -25,6 +25,8 @@
 
 // other includes:
 #include "itkFFTWCommon.h"
+#include "itkFFTWGlobalConfiguration.h"
+#include "itkVariationalRegistrationFFTPadding.h"
 
 namespace itk {
 
@@ -84,6 +86,8 @@ public:
   typedef typename Superclass::DisplacementFieldConstPointer DisplacementFieldConstPointer;
   typedef typename Superclass::PixelType                     PixelType;
   typedef typename Superclass::ValueType                     ValueType;
+  typedef typename Superclass::WorkspaceType                 WorkspaceType;
+  typedef typename Superclass::RegionType                    RegionType;
   typedef typename DisplacementFieldType::SizeType::SizeValueType
                                                              OffsetValueType;
 
@@ -108,6 +112,39 @@ public:
   /** Get the regularization weight alpha */
   itkGetConstMacro( Alpha, ValueType );
 
+  /** Padding helper and boundary extension types. */
+  typedef VariationalRegistrationFFTPadding< TDisplacementField > PaddingType;
+  typedef typename PaddingType::BoundaryExtensionType             BoundaryExtensionType;
+
+  /** Set whether the field is padded to the next size of the form
+   *  2^a 3^b 5^c 7^d for the DCT, which is faster for FFTW than sizes with
+   *  large prime factors. The result is cropped back to the size of the
+   *  field. Default is off. */
+  itkSetMacro( UsePaddedSize, bool );
+
+  /** Get whether the field is padded for the DCT. */
+  itkGetConstMacro( UsePaddedSize, bool );
+
+  /** Set whether the field is padded for the DCT. */
+  itkBooleanMacro( UsePaddedSize );
+
+  /** Set the boundary extension that fills the padding. Default is
+   *  PaddingType::BOUNDARY_MIRROR. */
+  itkSetMacro( BoundaryExtension, BoundaryExtensionType );
+
+  /** Get the boundary extension that fills the padding. */
+  itkGetConstMacro( BoundaryExtension, BoundaryExtensionType );
+
+  /** Get an estimate of the number of bytes of the DCT buffers needed to
+   *  regularize a field with the given region. */
+  virtual SizeValueType EstimateBufferBytes( const RegionType & region ) const;
+
+  /** Get the number of bytes of the DCT buffers. */
+  virtual SizeValueType GetAllocatedBytes() const;
+
+  /** Free the DCT buffers and plans. */
+  virtual void ReleaseBuffers();
+
 protected:
   VariationalRegistrationCurvatureRegularizer();
   ~VariationalRegistrationCurvatureRegularizer();
@@ -152,10 +189,22 @@ private:
   /** The spacing of the displacement field. */
   typename DisplacementFieldType::SpacingType m_Spacing;
 
+  /** Pad the field to a fast DCT size. */
+  bool m_UsePaddedSize;
+
+  /** Boundary extension that fills the padding. */
+  BoundaryExtensionType m_BoundaryExtension;
+
   /** The size of the displacement field. */
+  typename DisplacementFieldType::SizeType    m_FieldSize;
+
+  /** The size of the DCT, i.e. the padded size of the displacement field. */
   typename DisplacementFieldType::SizeType    m_Size;
 
-  /** Number of pixels of the displacement field. */
+  /** Time for creating the plans in the last update, zero if reused. */
+  double m_PlanTime;
+
+  /** Number of pixels of the DCT. */
   OffsetValueType m_TotalSize;
 
   /** offset table needed to compute image index from array index */
@@ -25,6 +25,7 @@
 #include "itkImageRegionConstIterator.h"
 #include "itkImageRegionConstIteratorWithIndex.h"
 #include "itkNeighborhoodAlgorithm.h"
+#include "itkTimeProbe.h"
 
 namespace itk
 {
@@ -38,14 +39,20 @@ VariationalRegistrationCurvatureRegularizer<TDisplacementField>::VariationalRegi
   for( unsigned int i = 0; i < ImageDimension; ++i )
   {
     m_Size[i] = 0;
+    m_FieldSize[i] = 0;
     m_Spacing[i] = 1.0;
     m_OffsetTable[i] = 0;
   }
   m_TotalSize = 0;
+  m_PlanTime = 0.0;
 
   // Initialize regularization weights
   m_Alpha = 1.0;
 
+  // Do not pad by default
+  m_UsePaddedSize = false;
+  m_BoundaryExtension = PaddingType::BOUNDARY_MIRROR;
+
   for( unsigned int i = 0; i < ImageDimension; ++i )
   {
     this->m_DiagonalMatrix[i] = NULL;
@@ -114,11 +121,21 @@ void VariationalRegistrationCurvatureRegularizer<TDisplacementField>::Initialize
 
   this->m_Spacing = DisplacementField->GetSpacing();
 
-  typename DisplacementFieldType::SizeType size = DisplacementField->GetRequestedRegion().GetSize();
+  this->m_FieldSize = DisplacementField->GetRequestedRegion().GetSize();
+
+  // The DCT size is cached together with the plans; changing the field size
+  // or the padding only reinitializes if the DCT size changes.
+  typename DisplacementFieldType::SizeType size =
+      PaddingType::ComputePaddedSize( this->m_FieldSize, this->m_UsePaddedSize );
+
+  this->m_PlanTime = 0.0;
 
   // Only reinitialize FFT plans if size has changed since last Initialize()
   if( size != this->m_Size )
   {
+    TimeProbe planProbe;
+    planProbe.Start();
+
     // Set new image size and complex buffer size including total sizes.
     // According to the FFTW manual, the complex buffer has the size
     // [n_0/2+1 , n_1, ..., n_d].
@@ -146,7 +163,68 @@ void VariationalRegistrationCurvatureRegularizer<TDisplacementField>::Initialize
       itkExceptionMacro( << "Initializing Curvature Plans for FFT failed!" );
       return;
     }
+
+    planProbe.Stop();
+    this->m_PlanTime = planProbe.GetTotal();
+    itkDebugMacro( << "Initializing DCT size " << this->m_Size << " for field size "
+        << this->m_FieldSize << " took " << planProbe.GetTotal() << " s." );
+  }
+}
+
+/**
+ * Estimate the number of bytes of the DCT buffers
+ */
+template<class TDisplacementField>
+SizeValueType VariationalRegistrationCurvatureRegularizer<TDisplacementField>::EstimateBufferBytes( const RegionType & region ) const
+{
+  // Input and output buffer of the real-to-real transform of the (padded)
+  // DCT size.
+  const typename DisplacementFieldType::SizeType size =
+      PaddingType::ComputePaddedSize( region.GetSize(), this->m_UsePaddedSize );
+  SizeValueType totalSize = 1;
+  for( unsigned int i = 0; i < ImageDimension; ++i )
+  {
+    totalSize *= size[i];
+  }
+  return 2 * totalSize * sizeof( typename FFTWProxyType::PixelType );
+}
+
+/**
+ * Get the number of bytes of the DCT buffers
+ */
+template<class TDisplacementField>
+SizeValueType VariationalRegistrationCurvatureRegularizer<TDisplacementField>::GetAllocatedBytes() const
+{
+  if( this->m_VectorFieldComponentBuffer == NULL )
+  {
+    return 0;
   }
+  return 2 * this->m_TotalSize * sizeof( typename FFTWProxyType::PixelType );
+}
+
+/**
+ * Free the DCT buffers and plans
+ */
+template<class TDisplacementField>
+void VariationalRegistrationCurvatureRegularizer<TDisplacementField>::ReleaseBuffers()
+{
+  if( this->m_VectorFieldComponentBuffer != NULL )
+    delete[] this->m_VectorFieldComponentBuffer;
+  if( this->m_DCTVectorFieldComponentBuffer != NULL )
+    delete[] this->m_DCTVectorFieldComponentBuffer;
+
+  if( this->m_PlanForward != NULL )
+    FFTWProxyType::DestroyPlan( this->m_PlanForward );
+  if( this->m_PlanBackward != NULL )
+    FFTWProxyType::DestroyPlan( this->m_PlanBackward );
+
+  this->m_VectorFieldComponentBuffer = NULL;
+  this->m_DCTVectorFieldComponentBuffer = NULL;
+  this->m_PlanForward = NULL;
+  this->m_PlanBackward = NULL;
+
+  // Force reinitialization on the next update.
+  this->m_Size.Fill( 0 );
 }
 
 /**
@@ -169,11 +247,20 @@ bool VariationalRegistrationCurvatureRegularizer<TDisplacementField>::Initialize
     FFTWProxyType::DestroyPlan( this->m_PlanForward );
   if( this->m_PlanBackward != NULL )
     FFTWProxyType::DestroyPlan( this->m_PlanBackward );
+  this->m_PlanForward = NULL;
+  this->m_PlanBackward = NULL;
 
   // Allocate input and output buffers for DCT
   this->m_VectorFieldComponentBuffer = new FFTWProxyType::PixelType[this->m_TotalSize];
   this->m_DCTVectorFieldComponentBuffer = new FFTWProxyType::PixelType[this->m_TotalSize];
 
+  // Touch the buffers first with the threads that will later process them
+  // (NUMA first touch).
+  WorkspaceType::FirstTouch( this->m_VectorFieldComponentBuffer,
+      this->m_TotalSize * sizeof( typename FFTWProxyType::PixelType ), this->GetNumberOfThreads() );
+  WorkspaceType::FirstTouch( this->m_DCTVectorFieldComponentBuffer,
+      this->m_TotalSize * sizeof( typename FFTWProxyType::PixelType ), this->GetNumberOfThreads() );
+
   //
   // different methods for the DCT are available in FFTW
   // (look here: http://www.fftw.org/doc/Real_002dto_002dReal-Transforms.html)
@@ -195,24 +282,22 @@ bool VariationalRegistrationCurvatureRegularizer<TDisplacementField>::Initialize
   // Create the plan for the FFT
   // We need only one plan forward and backward because we reuse the input and output buffers
   // fftw_plan_r2r transforms are not available in FFTWProxyType, so we have to call FFTW functions
-  // directly
+  // directly. The FFTW planner is not thread-safe, so the plans are created
+  // under the global FFTW lock that is also used by FFTWProxyType.
+  FFTWGlobalConfiguration::GetLockMutex().Lock();
 
   // first set multi-threading
   fftw_plan_with_nthreads( this->GetNumberOfThreads() );
 
   this->m_PlanForward = fftw_plan_r2r( ImageDimension, size, this->m_VectorFieldComponentBuffer, this->m_DCTVectorFieldComponentBuffer, fftForwardKind, FFTW_MEASURE | FFTW_DESTROY_INPUT );
-  if( this->m_PlanForward == NULL )
+  if( this->m_PlanForward != NULL )
   {
-    return false;
+    this->m_PlanBackward = fftw_plan_r2r( ImageDimension, size, this->m_DCTVectorFieldComponentBuffer, this->m_VectorFieldComponentBuffer, fftBackwardKind, FFTW_MEASURE | FFTW_DESTROY_INPUT );
   }
 
-  this->m_PlanBackward = fftw_plan_r2r( ImageDimension, size, this->m_DCTVectorFieldComponentBuffer, this->m_VectorFieldComponentBuffer, fftBackwardKind, FFTW_MEASURE | FFTW_DESTROY_INPUT );
-  if( this->m_PlanBackward == NULL )
-  {
-    return false;
-  }
+  FFTWGlobalConfiguration::GetLockMutex().Unlock();
 
-  return true;
+  return this->m_PlanForward != NULL && this->m_PlanBackward != NULL;
 }
 
 /**
@@ -301,13 +386,28 @@ void VariationalRegistrationCurvatureRegularizer<TDisplacementField>::Regularize
     normalizationFactor *= 0.5;
   }
 
+  TimeProbe probe;
+  probe.Start();
+
+  // If the field is padded, the components are extended to the DCT size
+  // and the results are cropped.
+  const bool padded = ( this->m_Size != this->m_FieldSize );
+
   unsigned int n;
   for( unsigned int dim = 0; dim < ImageDimension; ++dim )
   {
     // Copy vector component into input buffer for FFT
-    for( n = 0, inputIt.GoToBegin(); !inputIt.IsAtEnd(); ++n, ++inputIt )
+    if( padded )
     {
-      m_VectorFieldComponentBuffer[n] = inputIt.Get()[dim];
+      PaddingType::CopyComponentToBuffer( inputField.GetPointer(), outField->GetRequestedRegion(),
+          dim, this->m_Size, this->m_BoundaryExtension, this->m_VectorFieldComponentBuffer );
+    }
+    else
+    {
+      for( n = 0, inputIt.GoToBegin(); !inputIt.IsAtEnd(); ++n, ++inputIt )
+      {
+        m_VectorFieldComponentBuffer[n] = inputIt.Get()[dim];
+      }
     }
 
     // Perform Forward FFT for input field
@@ -326,16 +426,34 @@ void VariationalRegistrationCurvatureRegularizer<TDisplacementField>::Regularize
     FFTWProxyType::Execute( this->m_PlanBackward );
 
     // Copy buffer from inverse DCT to component of field
-    for( n = 0, outIt.GoToBegin(); !outIt.IsAtEnd(); ++n, ++outIt )
+    if( padded )
+    {
+      PaddingType::CopyBufferToComponent( this->m_VectorFieldComponentBuffer, this->m_Size,
+          normalizationFactor, dim, outField.GetPointer(), outField->GetRequestedRegion() );
+    }
+    else
     {
-      PixelType vec = outIt.Get();
-      vec[dim] = m_VectorFieldComponentBuffer[n] * normalizationFactor;
-      outIt.Set( vec );
+      for( n = 0, outIt.GoToBegin(); !outIt.IsAtEnd(); ++n, ++outIt )
+      {
+        PixelType vec = outIt.Get();
+        vec[dim] = m_VectorFieldComponentBuffer[n] * normalizationFactor;
+        outIt.Set( vec );
+      }
     }
 
   }
 
   outField->Modified();
+
+  probe.Stop();
+  itkDebugMacro( << "Regularization with DCT size " << this->m_Size << " for field size "
+      << this->m_FieldSize << " took " << probe.GetTotal() << " s." );
+
+  if( this->GetInstrumentation() )
+    {
+    this->GetInstrumentation()->AddTransformRecord( this->m_FieldSize, this->m_Size,
+        this->m_PlanTime, probe.GetTotal() );
+    }
 }
 
 /**
@@ -469,6 +587,12 @@ void VariationalRegistrationCurvatureRegularizer<TDisplacementField>::PrintSelf(
 
   os << indent << "Size: ";
   os << m_Size << std::endl;
+  os << indent << "FieldSize: ";
+  os << m_FieldSize << std::endl;
+  os << indent << "UsePaddedSize: ";
+  os << m_UsePaddedSize << std::endl;
+  os << indent << "BoundaryExtension: ";
+  os << m_BoundaryExtension << std::endl;
   os << indent << "Spacing: ";
   os << m_Spacing << std::endl;
 }
@@ -116,6 +116,12 @@ VariationalRegistrationDemonsFunction< TFixedImage, TMovingImage, TDisplacementF
     return m_ZeroUpdateReturn;
     }
 
+  // Check if the force is computed at the index
+  if( !this->IsForceSampled( index ) )
+    {
+    return m_ZeroUpdateReturn;
+    }
+
   const double warpedValue = (double) this->GetWarpedImage()->GetPixel( index );
   const double fixedValue = (double) this->GetFixedImage()->GetPixel( index );
 
@@ -182,7 +188,7 @@ VariationalRegistrationDemonsFunction< TFixedImage, TMovingImage, TDisplacementF
 
   // Update the global data (metric etc.)
   GlobalDataStruct *globalData = (GlobalDataStruct *) gd;
-  if( globalData )
+  if( this->SampleMetric( globalData ) )
     {
     globalData->m_NumberOfPixelsProcessed += 1;
     globalData->m_SumOfMetricValues += sqr_speedValue;
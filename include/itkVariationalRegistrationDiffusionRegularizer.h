@@ -74,6 +74,7 @@ public:
   typedef typename Superclass::DisplacementFieldConstPointer DisplacementFieldConstPointer;
   typedef typename Superclass::PixelType                     PixelType;
   typedef typename Superclass::ValueType                     ValueType;
+  typedef typename Superclass::RegionType                    RegionType;
 
   /** Types for buffer image. */
   typedef Image<ValueType, ImageDimension>                   BufferImageType;
@@ -86,6 +87,16 @@ public:
   /** Get the regularization weight alpha */
   itkGetConstMacro( Alpha, ValueType );
 
+  /** Get an estimate of the number of bytes of the buffer images needed to
+   *  regularize a field with the given region. */
+  virtual SizeValueType EstimateBufferBytes( const RegionType & region ) const ITK_OVERRIDE;
+
+  /** Get the number of bytes of the buffer images, if no workspace is used. */
+  virtual SizeValueType GetAllocatedBytes() const ITK_OVERRIDE;
+
+  /** Free the buffer images. */
+  virtual void ReleaseBuffers() ITK_OVERRIDE;
+
 protected:
   VariationalRegistrationDiffusionRegularizer();
   ~VariationalRegistrationDiffusionRegularizer() {}
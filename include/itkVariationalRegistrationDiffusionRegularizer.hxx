@@ -21,6 +21,7 @@
 
 #include "itkImageRegionConstIterator.h"
 #include "itkImageRegionIteratorWithIndex.h"
+#include <sstream>
 
 namespace itk
 {
@@ -89,6 +90,10 @@ VariationalRegistrationDiffusionRegularizer< TDisplacementField >
     m_BufferImage->CopyInformation( DisplacementField );
     m_BufferImage->SetRequestedRegion( DisplacementField->GetRequestedRegion() );
     m_BufferImage->SetBufferedRegion( DisplacementField->GetBufferedRegion() );
+    if( this->GetWorkspace() )
+      {
+      this->GetWorkspace()->AttachBuffer( m_BufferImage.GetPointer(), "DiffusionBuffer" );
+      }
     m_BufferImage->Allocate();
 
     // Initialize Matrices for AOS scheme
@@ -99,6 +104,12 @@ VariationalRegistrationDiffusionRegularizer< TDisplacementField >
       m_V[dim]->CopyInformation( DisplacementField );
       m_V[dim]->SetRequestedRegion( DisplacementField->GetRequestedRegion() );
       m_V[dim]->SetBufferedRegion( DisplacementField->GetBufferedRegion() );
+      if( this->GetWorkspace() )
+        {
+        std::ostringstream name;
+        name << "DiffusionV" << dim;
+        this->GetWorkspace()->AttachBuffer( m_V[dim].GetPointer(), name.str() );
+        }
       m_V[dim]->Allocate();
 
       this->InitLUMatrices( &m_MatrixAlpha[dim], &m_MatrixBeta[dim], &m_MatrixGamma[dim], m_Size[dim], dim );
@@ -482,6 +493,61 @@ VariationalRegistrationDiffusionRegularizer< TDisplacementField >
   return maxThreadIdUsed + 1;
 }
 
+/**
+ * Estimate the number of bytes of the buffer images
+ */
+template< class TDisplacementField >
+SizeValueType
+VariationalRegistrationDiffusionRegularizer< TDisplacementField >
+::EstimateBufferBytes( const RegionType & region ) const
+{
+  // One buffer for the force component and one per direction.
+  return ( ImageDimension + 1 ) * region.GetNumberOfPixels() * sizeof( ValueType );
+}
+
+/**
+ * Get the number of bytes of the buffer images
+ */
+template< class TDisplacementField >
+SizeValueType
+VariationalRegistrationDiffusionRegularizer< TDisplacementField >
+::GetAllocatedBytes() const
+{
+  // Buffers attached to the workspace are accounted for by the workspace.
+  if( this->GetWorkspace() || m_BufferImage.IsNull() )
+    {
+    return 0;
+    }
+
+  SizeValueType bytes = m_BufferImage->GetPixelContainer()->Capacity();
+  for( unsigned int dim = 0; dim < ImageDimension; ++dim )
+    {
+    if( m_V[dim] )
+      {
+      bytes += m_V[dim]->GetPixelContainer()->Capacity();
+      }
+    }
+  return bytes * sizeof( ValueType );
+}
+
+/**
+ * Free the buffer images
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationDiffusionRegularizer< TDisplacementField >
+::ReleaseBuffers()
+{
+  m_BufferImage = NULL;
+  for( unsigned int dim = 0; dim < ImageDimension; ++dim )
+    {
+    m_V[dim] = NULL;
+    }
+
+  // Force reinitialization on the next update.
+  m_Size.Fill( 0 );
+}
+
 /*
  * Print status information
  */
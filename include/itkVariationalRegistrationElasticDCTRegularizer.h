@@ -0,0 +1,252 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkVariationalRegistrationElasticDCTRegularizer_h
+#define itkVariationalRegistrationElasticDCTRegularizer_h
+
+#include "itkVariationalRegistrationRegularizer.h"
+#include "itkMultiThreader.h"
+
+#if defined( ITK_USE_FFTWD ) || defined( ITK_USE_FFTWF )
+
+// other includes:
+#include "itkFFTWCommon.h"
+#include "itkFFTWGlobalConfiguration.h"
+#include "itkVariationalRegistrationFFTPadding.h"
+
+namespace itk {
+
+/** \class itk::VariationalRegistrationElasticDCTRegularizer
+ *
+ *  \brief This class performs linear elastic regularization of a vector field using real-to-real transforms.
+ *
+ *  Like VariationalRegistrationElasticRegularizer, this class computes
+ *  \f$u^{out}=(Id - A)^{-1}[u^{in}]\f$ with
+ *  \f$A[u]=\mu\Delta u + (\mu+\lambda)\nabla(\nabla\cdot u)\f$ and the same
+ *  finite difference discretization, but instead of complex FFTs with
+ *  periodic boundaries it uses real-to-real transforms: component
+ *  \f$u_i\f$ is transformed with a DST-II in direction i and with a DCT-II
+ *  in all other directions. These transforms diagonalize the Laplacian and
+ *  map the mixed derivatives of the other components onto the same basis,
+ *  so that the system decouples into one small symmetric positive definite
+ *  system per frequency.
+ *
+ *  The implied boundary conditions are those of a sliding boundary: at the
+ *  image border, the tangential components are mirrored (Neumann) and the
+ *  normal component is mirrored with opposite sign, i.e. vanishes half a
+ *  pixel outside of the image. Thus there are no wrap-around artifacts
+ *  between opposite borders. Only one real buffer per component is needed,
+ *  which is transformed in place, instead of one complex buffer per
+ *  component and two real buffers.
+ *
+ *  \sa VariationalRegistrationFilter
+ *  \sa VariationalRegistrationRegularizer
+ *  \sa VariationalRegistrationElasticRegularizer
+ *
+ *  \ingroup VariationalRegistration
+ */
+template< class TDisplacementField >
+class VariationalRegistrationElasticDCTRegularizer
+  : public VariationalRegistrationRegularizer< TDisplacementField >
+{
+public:
+  /** Standard class typedefs */
+  typedef VariationalRegistrationElasticDCTRegularizer  Self;
+  typedef VariationalRegistrationRegularizer<
+      TDisplacementField >                              Superclass;
+  typedef SmartPointer< Self >                          Pointer;
+  typedef SmartPointer< const Self >                    ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro( VariationalRegistrationElasticDCTRegularizer, VariationalRegistrationRegularizer);
+
+  /** Dimensionality of input and output data is assumed to be the same. */
+  itkStaticConstMacro(ImageDimension, unsigned int, TDisplacementField::ImageDimension);
+
+  /** Deformation field types, inherited from Superclass. */
+  typedef typename Superclass::DisplacementFieldType         DisplacementFieldType;
+  typedef typename Superclass::DisplacementFieldPointer      DisplacementFieldPointer;
+  typedef typename Superclass::DisplacementFieldConstPointer DisplacementFieldConstPointer;
+  typedef typename Superclass::PixelType                     PixelType;
+  typedef typename Superclass::ValueType                     ValueType;
+  typedef typename Superclass::WorkspaceType                 WorkspaceType;
+  typedef typename Superclass::RegionType                    RegionType;
+  typedef typename DisplacementFieldType::SizeType::SizeValueType
+                                                             OffsetValueType;
+
+  /** Types for FFTW proxy */
+
+  #if defined( ITK_USE_FFTWD )
+  //Prefer to use double precision
+  typedef double RealTypeFFT;
+  #else
+    #if defined( ITK_USE_FFTWF )
+      //Allow to use single precision
+      #warning "Using single precision for FFT computations!"
+  typedef float RealTypeFFT;
+    #endif
+  #endif
+
+  typedef typename fftw::Proxy<RealTypeFFT> FFTWProxyType;
+
+  /** Set the regularization weight lambda. */
+  itkSetMacro( Lambda, ValueType );
+
+  /** Get the regularization weight lambda. */
+  itkGetConstMacro( Lambda, ValueType );
+
+  /** Set the regularization weight mu. */
+  itkSetMacro( Mu, ValueType );
+
+  /** Get the regularization weight mu. */
+  itkGetConstMacro( Mu, ValueType );
+
+  /** Padding helper and boundary extension types. */
+  typedef VariationalRegistrationFFTPadding< TDisplacementField > PaddingType;
+  typedef typename PaddingType::BoundaryExtensionType             BoundaryExtensionType;
+
+  /** Set whether the field is padded to the next size of the form
+   *  2^a 3^b 5^c 7^d for the DCT, which is faster for FFTW than sizes with
+   *  large prime factors. The result is cropped back to the size of the
+   *  field. Default is off. */
+  itkSetMacro( UsePaddedSize, bool );
+
+  /** Get whether the field is padded for the DCT. */
+  itkGetConstMacro( UsePaddedSize, bool );
+
+  /** Set whether the field is padded for the DCT. */
+  itkBooleanMacro( UsePaddedSize );
+
+  /** Set the boundary extension that fills the padding. Default is
+   *  PaddingType::BOUNDARY_MIRROR. */
+  itkSetMacro( BoundaryExtension, BoundaryExtensionType );
+
+  /** Get the boundary extension that fills the padding. */
+  itkGetConstMacro( BoundaryExtension, BoundaryExtensionType );
+
+  /** Get an estimate of the number of bytes of the transform buffers needed
+   *  to regularize a field with the given region. */
+  virtual SizeValueType EstimateBufferBytes( const RegionType & region ) const;
+
+  /** Get the number of bytes of the transform buffers. */
+  virtual SizeValueType GetAllocatedBytes() const;
+
+  /** Free the transform buffers and plans. */
+  virtual void ReleaseBuffers();
+
+protected:
+  VariationalRegistrationElasticDCTRegularizer();
+  ~VariationalRegistrationElasticDCTRegularizer();
+
+  /** Print information about the filter. */
+  virtual void PrintSelf(std::ostream& os, Indent indent) const;
+
+  /** Execute regularization. This method is multi-threaded but does not
+   * use ThreadedGenerateData(). */
+  virtual void GenerateData();
+
+  /** Method for initialization. Buffers and plans are allocated and the
+   * matrices calculated in this method. */
+  virtual void Initialize();
+
+  /** Initialize the plans of the real-to-real transforms and allocate the
+   *  buffers. */
+  virtual bool InitializeElasticDCTPlans();
+
+  /** Precompute sine and cosine values for solving the LES */
+  virtual bool InitializeElasticMatrix();
+
+  /** Delete all data allocated during Initialize() */
+  virtual void FreeData();
+
+  /** Regularize the deformation field. This is called by GenerateData(). */
+  virtual void Regularize();
+
+  /** Solve the LES after the forward transforms. */
+  virtual void SolveElasticLES();
+
+  /** Solve the LES for the frequencies from the given range of the
+   *  frequency grid of size [n_0+1, ..., n_d+1]. Multithreaded method. */
+  virtual void ThreadedSolveElasticLES( OffsetValueType from, OffsetValueType to );
+
+private:
+  VariationalRegistrationElasticDCTRegularizer(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  /** Weight of the regularization term. */
+  ValueType m_Lambda;
+
+  /** Weight of the regularization term. */
+  ValueType m_Mu;
+
+  /** The spacing of the displacement field. */
+  typename DisplacementFieldType::SpacingType m_Spacing;
+
+  /** Pad the field to a fast DCT size. */
+  bool m_UsePaddedSize;
+
+  /** Boundary extension that fills the padding. */
+  BoundaryExtensionType m_BoundaryExtension;
+
+  /** The size of the displacement field. */
+  typename DisplacementFieldType::SizeType    m_FieldSize;
+
+  /** The size of the DCT, i.e. the padded size of the displacement field. */
+  typename DisplacementFieldType::SizeType    m_Size;
+
+  /** Time for creating the plans in the last update, zero if reused. */
+  double m_PlanTime;
+
+  /** Number of pixels of the DCT. */
+  OffsetValueType m_TotalSize;
+
+  /** Offset table of the displacement field. */
+  OffsetValueType m_OffsetTable[ImageDimension];
+
+  /** Number of frequencies, i.e. the number of pixels of the frequency
+   *  grid of size [n_0+1, ..., n_d+1]. */
+  OffsetValueType m_TotalFrequencySize;
+
+  /** Values 2 - 2cos(pi k / n) and sin(pi k / n) for k = 0, ..., n. */
+  double * m_MatrixCos[ImageDimension];
+  double * m_MatrixSin[ImageDimension];
+
+  /** Plans and buffers. The transform of each component is computed in place. */
+  typename FFTWProxyType::PlanType     m_PlanForward[ImageDimension];   /** forward plan  */
+  typename FFTWProxyType::PlanType     m_PlanBackward[ImageDimension];  /** backward plan */
+  typename FFTWProxyType::PixelType*   m_ComponentBuffer[ImageDimension]; /** memory space of the components */
+
+  struct ElasticDCTThreadStruct
+    {
+    VariationalRegistrationElasticDCTRegularizer *Filter;
+    OffsetValueType totalFrequencySize;
+    };
+
+  static ITK_THREAD_RETURN_TYPE SolveElasticLESThreaderCallback(void *vargs);
+};
+
+}
+
+#ifndef ITK_MANUAL_INSTANTIATION
+# include "itkVariationalRegistrationElasticDCTRegularizer.hxx"
+#endif
+
+#endif
+#endif
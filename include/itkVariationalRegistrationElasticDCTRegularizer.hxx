@@ -0,0 +1,655 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkVariationalRegistrationElasticDCTRegularizer_hxx
+#define itkVariationalRegistrationElasticDCTRegularizer_hxx
+
+#if defined( ITK_USE_FFTWD ) || defined( ITK_USE_FFTWF )
+
+#include "itkVariationalRegistrationElasticDCTRegularizer.h"
+
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
+#include "itkTimeProbe.h"
+
+namespace itk
+{
+
+/**
+ * Default constructor
+ */
+template< class TDisplacementField >
+VariationalRegistrationElasticDCTRegularizer< TDisplacementField >
+::VariationalRegistrationElasticDCTRegularizer()
+{
+  for( unsigned int i = 0; i < ImageDimension; ++i )
+    {
+    m_Size[i] = 0;
+    m_FieldSize[i] = 0;
+    m_Spacing[i] = 1.0;
+    m_OffsetTable[i] = 0;
+    }
+  m_TotalSize = 0;
+  m_PlanTime = 0.0;
+  m_TotalFrequencySize = 0;
+
+  // Initialize regularization weights
+  m_Lambda = 1.0;
+  m_Mu = 1.0;
+
+  // Do not pad by default
+  m_UsePaddedSize = false;
+  m_BoundaryExtension = PaddingType::BOUNDARY_MIRROR;
+
+  for( unsigned int i = 0; i < ImageDimension; ++i )
+    {
+    this->m_MatrixCos[i] = NULL;
+    this->m_MatrixSin[i] = NULL;
+    this->m_ComponentBuffer[i] = NULL;
+    this->m_PlanForward[i] = NULL;
+    this->m_PlanBackward[i] = NULL;
+    }
+}
+
+/**
+ * Default destructor
+ */
+template< class TDisplacementField >
+VariationalRegistrationElasticDCTRegularizer< TDisplacementField >
+::~VariationalRegistrationElasticDCTRegularizer()
+{
+  this->FreeData();
+}
+
+/**
+ * Generate data
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationElasticDCTRegularizer< TDisplacementField >
+::GenerateData()
+{
+  // Allocate the output image
+  this->AllocateOutputs();
+
+  // Initialize and allocate data
+  this->Initialize();
+
+  // Execute regularization
+  this->Regularize();
+}
+
+/*
+ * Initialize flags
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationElasticDCTRegularizer< TDisplacementField >
+::Initialize()
+{
+  this->Superclass::Initialize();
+  DisplacementFieldPointer DisplacementField = this->GetOutput();
+
+  this->m_Spacing = DisplacementField->GetSpacing();
+
+  this->m_FieldSize = DisplacementField->GetRequestedRegion().GetSize();
+
+  // The DCT size is cached together with the plans; changing the field size
+  // or the padding only reinitializes if the DCT size changes.
+  typename DisplacementFieldType::SizeType size =
+      PaddingType::ComputePaddedSize( this->m_FieldSize, this->m_UsePaddedSize );
+
+  this->m_PlanTime = 0.0;
+
+  // Only reinitialize the plans if size has changed since last Initialize()
+  if( size != this->m_Size )
+    {
+    TimeProbe planProbe;
+    planProbe.Start();
+
+    this->m_Size = size;
+
+    // Calculate offset table and total number of pixels. The frequency grid
+    // has one additional entry per direction, because the DCT-II covers the
+    // frequencies pi*k/n with k = 0, ..., n-1 and the DST-II those with
+    // k = 1, ..., n.
+    this->m_OffsetTable[0] = 1;
+    this->m_TotalSize = this->m_Size[0];
+    this->m_TotalFrequencySize = this->m_Size[0] + 1;
+    for( unsigned int j = 1; j < ImageDimension; j++ )
+      {
+      this->m_OffsetTable[j] = this->m_OffsetTable[j - 1] * this->m_Size[j - 1];
+      this->m_TotalSize *= this->m_Size[j];
+      this->m_TotalFrequencySize *= this->m_Size[j] + 1;
+      }
+
+    // Reset old data
+    FreeData();
+
+    // initialize matrix and FFTW plans
+    if( !InitializeElasticMatrix() )
+      {
+      itkExceptionMacro( << "Initializing Elastic Matrix failed!" );
+      return;
+      }
+
+    if( !InitializeElasticDCTPlans() )
+      {
+      itkExceptionMacro( << "Initializing Elastic Plans for DCT failed!" );
+      return;
+      }
+
+    planProbe.Stop();
+    this->m_PlanTime = planProbe.GetTotal();
+    itkDebugMacro( << "Initializing DCT size " << this->m_Size << " for field size "
+        << this->m_FieldSize << " took " << planProbe.GetTotal() << " s." );
+    }
+}
+
+/*
+ * Reset data
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationElasticDCTRegularizer< TDisplacementField >
+::FreeData()
+{
+  for( unsigned int i = 0; i < ImageDimension; ++i )
+    {
+    if( this->m_MatrixCos[i] != NULL )
+      delete[] this->m_MatrixCos[i];
+    if( this->m_MatrixSin[i] != NULL )
+      delete[] this->m_MatrixSin[i];
+
+    if( this->m_PlanForward[i] != NULL )
+      FFTWProxyType::DestroyPlan( this->m_PlanForward[i] );
+    if( this->m_PlanBackward[i] != NULL )
+      FFTWProxyType::DestroyPlan( this->m_PlanBackward[i] );
+
+    if( this->m_ComponentBuffer[i] != NULL )
+      delete[] this->m_ComponentBuffer[i];
+
+    this->m_MatrixCos[i] = NULL;
+    this->m_MatrixSin[i] = NULL;
+    this->m_PlanForward[i] = NULL;
+    this->m_PlanBackward[i] = NULL;
+    this->m_ComponentBuffer[i] = NULL;
+    }
+}
+
+/*
+ * Estimate the number of bytes of the DCT buffers
+ */
+template< class TDisplacementField >
+SizeValueType
+VariationalRegistrationElasticDCTRegularizer< TDisplacementField >
+::EstimateBufferBytes( const RegionType & region ) const
+{
+  // One real buffer per dimension of the (padded) DCT size, transformed in
+  // place.
+  const typename DisplacementFieldType::SizeType size =
+      PaddingType::ComputePaddedSize( region.GetSize(), this->m_UsePaddedSize );
+  SizeValueType totalSize = 1;
+  for( unsigned int i = 0; i < ImageDimension; ++i )
+    {
+    totalSize *= size[i];
+    }
+  return ImageDimension * totalSize * sizeof( typename FFTWProxyType::PixelType );
+}
+
+/*
+ * Get the number of bytes of the DCT buffers
+ */
+template< class TDisplacementField >
+SizeValueType
+VariationalRegistrationElasticDCTRegularizer< TDisplacementField >
+::GetAllocatedBytes() const
+{
+  if( this->m_ComponentBuffer[0] == NULL )
+    {
+    return 0;
+    }
+  return ImageDimension * this->m_TotalSize * sizeof( typename FFTWProxyType::PixelType );
+}
+
+/*
+ * Free the DCT buffers and plans
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationElasticDCTRegularizer< TDisplacementField >
+::ReleaseBuffers()
+{
+  this->FreeData();
+
+  // Force reinitialization on the next update.
+  this->m_Size.Fill( 0 );
+}
+
+/**
+ * Initialize DCT plans
+ */
+template< class TDisplacementField >
+bool
+VariationalRegistrationElasticDCTRegularizer< TDisplacementField >
+::InitializeElasticDCTPlans()
+{
+  itkDebugMacro( << "Initializing elastic plans for DCT..." );
+
+  // Get image size in reverse order for FFTW
+  int size[ImageDimension];
+  for( unsigned int i = 0; i < ImageDimension; ++i )
+    {
+    size[(ImageDimension - 1) - i] = this->m_Size[i];
+    }
+
+  // Allocate buffers and touch them first with the threads that
+  // will later process them (NUMA first touch).
+  for( unsigned int i = 0; i < ImageDimension; ++i )
+    {
+    this->m_ComponentBuffer[i] = new typename FFTWProxyType::PixelType[this->m_TotalSize];
+    WorkspaceType::FirstTouch( this->m_ComponentBuffer[i],
+        this->m_TotalSize * sizeof( typename FFTWProxyType::PixelType ), this->GetNumberOfThreads() );
+    }
+
+  // Component i is transformed with a DST-II (RODFT10) in direction i and
+  // a DCT-II (REDFT10) in all other directions; the inverse transforms are
+  // RODFT01 and REDFT01. fftw_plan_r2r transforms are not available in
+  // FFTWProxyType, so we have to call FFTW functions directly. The FFTW
+  // planner is not thread-safe, so the plans are created under the global
+  // FFTW lock that is also used by FFTWProxyType.
+  FFTWGlobalConfiguration::GetLockMutex().Lock();
+#if defined( ITK_USE_FFTWD )
+  fftw_plan_with_nthreads( this->GetNumberOfThreads() );
+#else
+  fftwf_plan_with_nthreads( this->GetNumberOfThreads() );
+#endif
+
+  fftw_r2r_kind forwardKind[ImageDimension];
+  fftw_r2r_kind backwardKind[ImageDimension];
+  bool planned = true;
+  for( unsigned int i = 0; i < ImageDimension && planned; ++i )
+    {
+    for( unsigned int j = 0; j < ImageDimension; ++j )
+      {
+      forwardKind[(ImageDimension - 1) - j] = ( i == j ) ? FFTW_RODFT10 : FFTW_REDFT10;
+      backwardKind[(ImageDimension - 1) - j] = ( i == j ) ? FFTW_RODFT01 : FFTW_REDFT01;
+      }
+
+#if defined( ITK_USE_FFTWD )
+    this->m_PlanForward[i] = fftw_plan_r2r( ImageDimension, size,
+        this->m_ComponentBuffer[i], this->m_ComponentBuffer[i], forwardKind, FFTW_MEASURE );
+    this->m_PlanBackward[i] = fftw_plan_r2r( ImageDimension, size,
+        this->m_ComponentBuffer[i], this->m_ComponentBuffer[i], backwardKind, FFTW_MEASURE );
+#else
+    this->m_PlanForward[i] = fftwf_plan_r2r( ImageDimension, size,
+        this->m_ComponentBuffer[i], this->m_ComponentBuffer[i], forwardKind, FFTW_MEASURE );
+    this->m_PlanBackward[i] = fftwf_plan_r2r( ImageDimension, size,
+        this->m_ComponentBuffer[i], this->m_ComponentBuffer[i], backwardKind, FFTW_MEASURE );
+#endif
+
+    planned = this->m_PlanForward[i] != NULL && this->m_PlanBackward[i] != NULL;
+    }
+  FFTWGlobalConfiguration::GetLockMutex().Unlock();
+
+  return planned;
+}
+
+/**
+ * Initialize elastic matrix
+ */
+template< class TDisplacementField >
+bool
+VariationalRegistrationElasticDCTRegularizer< TDisplacementField >
+::InitializeElasticMatrix()
+{
+  itkDebugMacro( << "Initializing elastic matrix for DCT..." );
+
+  // Calculate the eigenvalues 2 - 2cos(a) of the negative second
+  // derivative and the eigenvalues sin(a) of the central first derivative
+  // for the frequencies a = pi*k/n, k = 0, ..., n.
+  double a = 0.0;
+  for( unsigned int i = 0; i < ImageDimension; ++i )
+    {
+    this->m_MatrixCos[i] = new double[this->m_Size[i] + 1];
+    this->m_MatrixSin[i] = new double[this->m_Size[i] + 1];
+
+    for( unsigned int n = 0; n <= this->m_Size[i]; n++ )
+      {
+      a = (vnl_math::pi * n) / static_cast< double >( this->m_Size[i] );
+
+      this->m_MatrixCos[i][n] = 2.0 - 2.0 * vcl_cos( a );
+      this->m_MatrixSin[i][n] = vcl_sin( a );
+      }
+    }
+
+  return true;
+}
+
+/**
+ * Execute regularization
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationElasticDCTRegularizer< TDisplacementField >
+::Regularize()
+{
+  DisplacementFieldConstPointer inputField = this->GetInput();
+
+  if( !inputField )
+    {
+    itkExceptionMacro( << "input displacement field is NULL!" );
+    return;
+    }
+
+  TimeProbe probe;
+  probe.Start();
+
+  // If the field is padded, the components are extended to the DCT size
+  // and the results are cropped.
+  const bool padded = ( this->m_Size != this->m_FieldSize );
+
+  // Perform forward transforms for input field
+  itkDebugMacro( << "Performing forward DCT..." );
+  typedef ImageRegionConstIterator< DisplacementFieldType > ConstIteratorType;
+  ConstIteratorType inputIt( inputField, inputField->GetRequestedRegion() );
+
+  unsigned int n; //Counter for field copying
+  for( unsigned int i = 0; i < ImageDimension; ++i )
+    {
+    // Copy vector component into its buffer
+    if( padded )
+      {
+      PaddingType::CopyComponentToBuffer( inputField.GetPointer(), inputField->GetRequestedRegion(),
+          i, this->m_Size, this->m_BoundaryExtension, this->m_ComponentBuffer[i] );
+      }
+    else
+      {
+      for( n = 0, inputIt.GoToBegin(); !inputIt.IsAtEnd(); ++n, ++inputIt )
+        {
+        m_ComponentBuffer[i][n] = inputIt.Get()[i];
+        }
+      }
+
+    // Execute transform for component
+    FFTWProxyType::Execute( this->m_PlanForward[i] );
+    }
+
+  // Solve the LES in the frequency domain
+  itkDebugMacro( << "Solving Elastic LES..." );
+  this->SolveElasticLES();
+
+  // Perform backward transforms
+  itkDebugMacro( << "Performing backward DCT..." );
+  DisplacementFieldPointer outField = this->GetOutput();
+
+  typedef ImageRegionIterator< DisplacementFieldType > IteratorType;
+  IteratorType outIt( outField, outField->GetRequestedRegion() );
+
+  // Each pair of 1D transforms is scaled by 2n.
+  double normalization = 1.0;
+  for( unsigned int i = 0; i < ImageDimension; ++i )
+    {
+    normalization /= 2.0 * this->m_Size[i];
+    }
+
+  for( unsigned int i = 0; i < ImageDimension; ++i )
+    {
+    // Execute transform for component
+    FFTWProxyType::Execute( this->m_PlanBackward[i] );
+
+    // Copy buffer to component of field
+    if( padded )
+      {
+      PaddingType::CopyBufferToComponent( this->m_ComponentBuffer[i], this->m_Size,
+          normalization, i, outField.GetPointer(), outField->GetRequestedRegion() );
+      }
+    else
+      {
+      for( n = 0, outIt.GoToBegin(); !outIt.IsAtEnd(); ++n, ++outIt )
+        {
+        PixelType vec = outIt.Get();
+        vec[i] = m_ComponentBuffer[i][n] * normalization;
+        outIt.Set( vec );
+        }
+      }
+    }
+
+  outField->Modified();
+
+  probe.Stop();
+  itkDebugMacro( << "Regularization with DCT size " << this->m_Size << " for field size "
+      << this->m_FieldSize << " took " << probe.GetTotal() << " s." );
+
+  if( this->GetInstrumentation() )
+    {
+    this->GetInstrumentation()->AddTransformRecord( this->m_FieldSize, this->m_Size,
+        this->m_PlanTime, probe.GetTotal() );
+    }
+}
+
+/**
+ * Solve elastic LES
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationElasticDCTRegularizer< TDisplacementField >
+::SolveElasticLES()
+{
+  // Declare thread data struct and set filter
+  ElasticDCTThreadStruct elasticLESStr;
+  elasticLESStr.Filter = this;
+  elasticLESStr.totalFrequencySize = this->m_TotalFrequencySize;
+
+  // Setup MultiThreader
+  this->GetMultiThreader()->SetNumberOfThreads( this->GetNumberOfThreads() );
+  this->GetMultiThreader()->SetSingleMethod(
+      this->SolveElasticLESThreaderCallback, &elasticLESStr );
+
+  // Execute MultiThreader
+  this->GetMultiThreader()->SingleMethodExecute();
+}
+
+/**
+ * Solve elastic LES
+ */
+template< class TDisplacementField >
+ITK_THREAD_RETURN_TYPE
+VariationalRegistrationElasticDCTRegularizer< TDisplacementField >
+::SolveElasticLESThreaderCallback( void * arg )
+{
+  //Get MultiThreader struct
+  MultiThreader::ThreadInfoStruct* threadStruct =
+      (MultiThreader::ThreadInfoStruct *) arg;
+  int threadId = threadStruct->ThreadID;
+  int threadCount = threadStruct->NumberOfThreads;
+
+  ElasticDCTThreadStruct* userStruct =
+      (ElasticDCTThreadStruct*) threadStruct->UserData;
+
+  // Calculate the range in the frequency grid of the thread
+  OffsetValueType threadRange = userStruct->totalFrequencySize / threadCount;
+  OffsetValueType from = threadId * threadRange;
+  OffsetValueType to = (threadId == threadCount - 1) ?
+                                                       userStruct->totalFrequencySize :
+                                                       (threadId + 1) * threadRange;
+
+  // Solve LES for thread
+  userStruct->Filter->ThreadedSolveElasticLES( from, to );
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/**
+ * Solve elastic LES
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationElasticDCTRegularizer< TDisplacementField >
+::ThreadedSolveElasticLES( OffsetValueType from, OffsetValueType to )
+{
+  const double lp2m = m_Lambda + 2 * m_Mu;
+  const double lpm = m_Lambda + m_Mu;
+
+  // Weights h^2 / h_i^2 of the derivatives in direction i, where h^2 is the
+  // mean squared spacing.
+  double weight[ImageDimension];
+  if( this->GetUseImageSpacing() )
+    {
+    double meanSquaredSpacing = 0.0;
+    for( unsigned int i = 0; i < ImageDimension; ++i )
+      {
+      meanSquaredSpacing += vnl_math_sqr( m_Spacing[i] );
+      }
+    meanSquaredSpacing /= ImageDimension;
+    for( unsigned int i = 0; i < ImageDimension; ++i )
+      {
+      weight[i] = meanSquaredSpacing / vnl_math_sqr( m_Spacing[i] );
+      }
+    }
+  else
+    {
+    for( unsigned int i = 0; i < ImageDimension; ++i )
+      {
+      weight[i] = 1.0;
+      }
+    }
+
+  double d[ImageDimension][ImageDimension];
+  double rhs[ImageDimension];
+  double sinWeighted[ImageDimension];
+  OffsetValueType k[ImageDimension];
+  OffsetValueType offset[ImageDimension];
+  bool valid[ImageDimension];
+
+  // Iterate over each frequency in thread range
+  for( OffsetValueType f = from; f < to; ++f )
+    {
+    // Get the frequency index k, i.e. the frequency pi*k_j/n_j in direction j
+    OffsetValueType rest = f;
+    for( unsigned int j = 0; j < ImageDimension; ++j )
+      {
+      k[j] = rest % ( m_Size[j] + 1 );
+      rest /= m_Size[j] + 1;
+      sinWeighted[j] = vcl_sqrt( weight[j] ) * m_MatrixSin[j][k[j]];
+      }
+
+    // Find the coefficient of each component for this frequency. The DST-II
+    // of component i in direction i stores frequency k_i at position k_i-1
+    // and has no frequency 0; the DCT-II in the other directions j stores
+    // k_j at position k_j and has no frequency n_j. A component without the
+    // frequency is not coupled to the others, because the corresponding
+    // sine is zero.
+    bool anyValid = false;
+    for( unsigned int i = 0; i < ImageDimension; ++i )
+      {
+      valid[i] = true;
+      offset[i] = 0;
+      for( unsigned int j = 0; j < ImageDimension; ++j )
+        {
+        if( ( i == j && k[j] == 0 ) || ( i != j && k[j] == m_Size[j] ) )
+          {
+          valid[i] = false;
+          break;
+          }
+        offset[i] += ( i == j ? k[j] - 1 : k[j] ) * m_OffsetTable[j];
+        }
+      rhs[i] = valid[i] ? m_ComponentBuffer[i][offset[i]] : 0.0;
+      anyValid |= valid[i];
+      }
+    if( !anyValid )
+      {
+      continue;
+      }
+
+    // Calculate Id - h^2 * M, which is symmetric positive definite.
+    for( unsigned int i = 0; i < ImageDimension; ++i )
+      {
+      d[i][i] = 1.0;
+      for( unsigned int j = 0; j < ImageDimension; ++j )
+        {
+        d[i][i] += ( i == j ? lp2m : m_Mu ) * weight[j] * m_MatrixCos[j][k[j]];
+        if( j != i )
+          {
+          d[i][j] = lpm * sinWeighted[i] * sinWeighted[j];
+          }
+        }
+      }
+
+    // Solve by Gaussian elimination without pivoting
+    for( unsigned int p = 0; p < ImageDimension; ++p )
+      {
+      for( unsigned int r = p + 1; r < ImageDimension; ++r )
+        {
+        const double factor = d[r][p] / d[p][p];
+        for( unsigned int q = p; q < ImageDimension; ++q )
+          {
+          d[r][q] -= factor * d[p][q];
+          }
+        rhs[r] -= factor * rhs[p];
+        }
+      }
+    for( unsigned int p = ImageDimension; p-- > 0; )
+      {
+      for( unsigned int q = p + 1; q < ImageDimension; ++q )
+        {
+        rhs[p] -= d[p][q] * rhs[q];
+        }
+      rhs[p] /= d[p][p];
+      }
+
+    for( unsigned int i = 0; i < ImageDimension; ++i )
+      {
+      if( valid[i] )
+        {
+        m_ComponentBuffer[i][offset[i]] = rhs[i];
+        }
+      }
+    }
+}
+
+/*
+ * Print status information
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationElasticDCTRegularizer< TDisplacementField >
+::PrintSelf( std::ostream& os, Indent indent ) const
+    {
+  Superclass::PrintSelf( os, indent );
+
+  os << indent << "Lambda: ";
+  os << m_Lambda << std::endl;
+  os << indent << "Mu: ";
+  os << m_Mu << std::endl;
+  os << indent << "Size: ";
+  os << m_Size << std::endl;
+  os << indent << "FieldSize: ";
+  os << m_FieldSize << std::endl;
+  os << indent << "UsePaddedSize: ";
+  os << m_UsePaddedSize << std::endl;
+  os << indent << "BoundaryExtension: ";
+  os << m_BoundaryExtension << std::endl;
+  os << indent << "Spacing: ";
+  os << m_Spacing << std::endl;
+}
+
+}      // end namespace itk
+
+#endif
+
+#endif
@@ -25,6 +25,7 @@
 
 // other includes:
 #include "itkFFTWCommon.h"
+#include "itkVariationalRegistrationFFTPadding.h"
 
 namespace itk {
 
@@ -81,6 +82,8 @@ public:
   typedef typename Superclass::DisplacementFieldConstPointer DisplacementFieldConstPointer;
   typedef typename Superclass::PixelType                     PixelType;
   typedef typename Superclass::ValueType                     ValueType;
+  typedef typename Superclass::WorkspaceType                 WorkspaceType;
+  typedef typename Superclass::RegionType                    RegionType;
   typedef typename DisplacementFieldType::SizeType::SizeValueType
                                                              OffsetValueType;
 
@@ -111,6 +114,39 @@ public:
   /** Get the regularization weight mu. */
   itkGetConstMacro( Mu, ValueType );
 
+  /** Padding helper and boundary extension types. */
+  typedef VariationalRegistrationFFTPadding< TDisplacementField > PaddingType;
+  typedef typename PaddingType::BoundaryExtensionType             BoundaryExtensionType;
+
+  /** Set whether the field is padded to the next size of the form
+   *  2^a 3^b 5^c 7^d for the FFT, which is faster for FFTW than sizes with
+   *  large prime factors. The result is cropped back to the size of the
+   *  field. Default is off. */
+  itkSetMacro( UsePaddedSize, bool );
+
+  /** Get whether the field is padded for the FFT. */
+  itkGetConstMacro( UsePaddedSize, bool );
+
+  /** Set whether the field is padded for the FFT. */
+  itkBooleanMacro( UsePaddedSize );
+
+  /** Set the boundary extension that fills the padding. Default is
+   *  PaddingType::BOUNDARY_MIRROR. */
+  itkSetMacro( BoundaryExtension, BoundaryExtensionType );
+
+  /** Get the boundary extension that fills the padding. */
+  itkGetConstMacro( BoundaryExtension, BoundaryExtensionType );
+
+  /** Get an estimate of the number of bytes of the FFT buffers needed to
+   *  regularize a field with the given region. */
+  virtual SizeValueType EstimateBufferBytes( const RegionType & region ) const;
+
+  /** Get the number of bytes of the FFT buffers. */
+  virtual SizeValueType GetAllocatedBytes() const;
+
+  /** Free the FFT buffers and plans. */
+  virtual void ReleaseBuffers();
+
 protected:
   VariationalRegistrationElasticRegularizer();
   ~VariationalRegistrationElasticRegularizer() {}
@@ -161,10 +197,22 @@ private:
   /** The spacing of the displacement field. */
   typename DisplacementFieldType::SpacingType m_Spacing;
 
+  /** Pad the field to a fast FFT size. */
+  bool m_UsePaddedSize;
+
+  /** Boundary extension that fills the padding. */
+  BoundaryExtensionType m_BoundaryExtension;
+
   /** The size of the displacement field. */
+  typename DisplacementFieldType::SizeType    m_FieldSize;
+
+  /** The size of the FFT, i.e. the padded size of the displacement field. */
   typename DisplacementFieldType::SizeType    m_Size;
 
-  /** Number of pixels of the displacement field. */
+  /** Time for creating the plans in the last update, zero if reused. */
+  double m_PlanTime;
+
+  /** Number of pixels of the FFT. */
   OffsetValueType m_TotalSize;
 
   /** The size of the complex buffer. */
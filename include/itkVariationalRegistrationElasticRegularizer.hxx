@@ -25,6 +25,7 @@
 #include "itkImageRegionConstIterator.h"
 #include "itkImageRegionConstIteratorWithIndex.h"
 #include "itkNeighborhoodAlgorithm.h"
+#include "itkTimeProbe.h"
 
 namespace itk
 {
@@ -39,17 +40,23 @@ VariationalRegistrationElasticRegularizer< TDisplacementField >
   for( unsigned int i = 0; i < ImageDimension; ++i )
     {
     m_Size[i] = 0;
+    m_FieldSize[i] = 0;
     m_ComplexSize[i] = 0;
     m_Spacing[i] = 1.0;
     m_ComplexOffsetTable[i] = 0;
     }
   m_TotalComplexSize = 0;
   m_TotalSize = 0;
+  m_PlanTime = 0.0;
 
   // Initialize regularization weights
   m_Lambda = 1.0;
   m_Mu = 1.0;
 
+  // Do not pad by default
+  m_UsePaddedSize = false;
+  m_BoundaryExtension = PaddingType::BOUNDARY_MIRROR;
+
   for( unsigned int i = 0; i < ImageDimension; ++i )
     {
     this->m_MatrixCos[i] = NULL;
@@ -93,12 +100,21 @@ VariationalRegistrationElasticRegularizer< TDisplacementField >
 
   this->m_Spacing = DisplacementField->GetSpacing();
 
+  this->m_FieldSize = DisplacementField->GetRequestedRegion().GetSize();
+
+  // The FFT size is cached together with the plans; changing the field size
+  // or the padding only reinitializes if the FFT size changes.
   typename DisplacementFieldType::SizeType size =
-      DisplacementField->GetRequestedRegion().GetSize();
+      PaddingType::ComputePaddedSize( this->m_FieldSize, this->m_UsePaddedSize );
+
+  this->m_PlanTime = 0.0;
 
   // Only reinitialize FFT plans if size has changed since last Initialize()
   if( size != this->m_Size )
     {
+    TimeProbe planProbe;
+    planProbe.Start();
+
     // Set new image size and complex buffer size including total sizes.
     // According to the FFTW manual, the complex buffer has the size
     // [n_0/2+1 , n_1, ..., n_d].
@@ -141,6 +157,11 @@ VariationalRegistrationElasticRegularizer< TDisplacementField >
       itkExceptionMacro( << "Initializing Elastic Plans for FFT failed!" );
       return;
       }
+
+    planProbe.Stop();
+    this->m_PlanTime = planProbe.GetTotal();
+    itkDebugMacro( << "Initializing FFT size " << this->m_Size << " for field size "
+        << this->m_FieldSize << " took " << planProbe.GetTotal() << " s." );
     }
 }
 
@@ -166,11 +187,73 @@ VariationalRegistrationElasticRegularizer< TDisplacementField >
 
     if( this->m_ComplexBuffer[i] != NULL )
       delete[] this->m_ComplexBuffer[i];
+
+    this->m_MatrixCos[i] = NULL;
+    this->m_MatrixSin[i] = NULL;
+    this->m_PlanForward[i] = NULL;
+    this->m_PlanBackward[i] = NULL;
+    this->m_ComplexBuffer[i] = NULL;
     }
   if( this->m_InputBuffer != NULL )
     delete[] this->m_InputBuffer;
   if( this->m_OutputBuffer != NULL )
     delete[] this->m_OutputBuffer;
+
+  this->m_InputBuffer = NULL;
+  this->m_OutputBuffer = NULL;
+}
+
+/*
+ * Estimate the number of bytes of the FFT buffers
+ */
+template< class TDisplacementField >
+SizeValueType
+VariationalRegistrationElasticRegularizer< TDisplacementField >
+::EstimateBufferBytes( const RegionType & region ) const
+{
+  // Real input and output buffer and one complex buffer per dimension of
+  // size [n_0/2+1 , n_1, ..., n_d], where n is the (padded) FFT size.
+  const typename DisplacementFieldType::SizeType size =
+      PaddingType::ComputePaddedSize( region.GetSize(), this->m_UsePaddedSize );
+  SizeValueType totalSize = 1;
+  for( unsigned int i = 0; i < ImageDimension; ++i )
+    {
+    totalSize *= size[i];
+    }
+  const SizeValueType totalComplexSize = totalSize / size[0] * ( size[0] / 2 + 1 );
+
+  return 2 * totalSize * sizeof( typename FFTWProxyType::PixelType )
+      + ImageDimension * totalComplexSize * sizeof( typename FFTWProxyType::ComplexType );
+}
+
+/*
+ * Get the number of bytes of the FFT buffers
+ */
+template< class TDisplacementField >
+SizeValueType
+VariationalRegistrationElasticRegularizer< TDisplacementField >
+::GetAllocatedBytes() const
+{
+  if( this->m_InputBuffer == NULL )
+    {
+    return 0;
+    }
+  return 2 * this->m_TotalSize * sizeof( typename FFTWProxyType::PixelType )
+      + ImageDimension * this->m_TotalComplexSize * sizeof( typename FFTWProxyType::ComplexType );
+}
+
+/*
+ * Free the FFT buffers and plans
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationElasticRegularizer< TDisplacementField >
+::ReleaseBuffers()
+{
+  this->FreeData();
+
+  // Force reinitialization on the next update.
+  this->m_Size.Fill( 0 );
 }
 
 /**
@@ -190,13 +273,21 @@ VariationalRegistrationElasticRegularizer< TDisplacementField >
     n[(ImageDimension - 1) - i] = this->m_Size[i];
     }
 
-  // Allocate buffers
+  // Allocate buffers and touch them first with the threads that
+  // will later process them (NUMA first touch).
   this->m_InputBuffer = new  FFTWProxyType::PixelType[this->m_TotalSize];
   this->m_OutputBuffer = new  FFTWProxyType::PixelType[this->m_TotalSize];
+  WorkspaceType::FirstTouch( this->m_InputBuffer,
+      this->m_TotalSize * sizeof( typename FFTWProxyType::PixelType ), this->GetNumberOfThreads() );
+  WorkspaceType::FirstTouch( this->m_OutputBuffer,
+      this->m_TotalSize * sizeof( typename FFTWProxyType::PixelType ), this->GetNumberOfThreads() );
   for( unsigned int i = 0; i < ImageDimension; ++i )
     {
     this->m_ComplexBuffer[i] =
         new typename FFTWProxyType::ComplexType[this->m_TotalComplexSize];
+    WorkspaceType::FirstTouch( this->m_ComplexBuffer[i],
+        this->m_TotalComplexSize * sizeof( typename FFTWProxyType::ComplexType ),
+        this->GetNumberOfThreads() );
     }
 
   // Create the plans for the FFT
@@ -268,6 +359,13 @@ VariationalRegistrationElasticRegularizer< TDisplacementField >
     return;
     }
 
+  TimeProbe probe;
+  probe.Start();
+
+  // If the field is padded, the components are extended to the FFT size
+  // and the results are cropped.
+  const bool padded = ( this->m_Size != this->m_FieldSize );
+
   // Perform Forward FFT for input field
   itkDebugMacro( << "Performing Forward FFT..." );
   typedef ImageRegionConstIterator< DisplacementFieldType > ConstIteratorType;
@@ -277,9 +375,17 @@ VariationalRegistrationElasticRegularizer< TDisplacementField >
   for( unsigned int i = 0; i < ImageDimension; ++i )
     {
     // Copy vector component into input buffer for FFT
-    for( n = 0, inputIt.GoToBegin(); !inputIt.IsAtEnd(); ++n, ++inputIt )
+    if( padded )
       {
-      m_InputBuffer[n] = inputIt.Get()[i];
+      PaddingType::CopyComponentToBuffer( inputField.GetPointer(), inputField->GetRequestedRegion(),
+          i, this->m_Size, this->m_BoundaryExtension, this->m_InputBuffer );
+      }
+    else
+      {
+      for( n = 0, inputIt.GoToBegin(); !inputIt.IsAtEnd(); ++n, ++inputIt )
+        {
+        m_InputBuffer[n] = inputIt.Get()[i];
+        }
       }
 
     // Execute FFT for component
@@ -303,15 +409,34 @@ VariationalRegistrationElasticRegularizer< TDisplacementField >
     FFTWProxyType::Execute( this->m_PlanBackward[i] );
 
     // Copy complex buffer for component to component of field
-    for( n = 0, outIt.GoToBegin(); !outIt.IsAtEnd(); ++n, ++outIt )
+    if( padded )
+      {
+      PaddingType::CopyBufferToComponent( this->m_OutputBuffer, this->m_Size,
+          1.0 / static_cast< double >( this->m_TotalSize ), i, outField.GetPointer(),
+          outField->GetRequestedRegion() );
+      }
+    else
       {
-      PixelType vec = outIt.Get();
-      vec[i] = m_OutputBuffer[n] / static_cast< double >( this->m_TotalSize );
-      outIt.Set( vec );
+      for( n = 0, outIt.GoToBegin(); !outIt.IsAtEnd(); ++n, ++outIt )
+        {
+        PixelType vec = outIt.Get();
+        vec[i] = m_OutputBuffer[n] / static_cast< double >( this->m_TotalSize );
+        outIt.Set( vec );
+        }
       }
     }
 
   outField->Modified();
+
+  probe.Stop();
+  itkDebugMacro( << "Regularization with FFT size " << this->m_Size << " for field size "
+      << this->m_FieldSize << " took " << probe.GetTotal() << " s." );
+
+  if( this->GetInstrumentation() )
+    {
+    this->GetInstrumentation()->AddTransformRecord( this->m_FieldSize, this->m_Size,
+        this->m_PlanTime, probe.GetTotal() );
+    }
 }
 
 /**
@@ -670,6 +795,12 @@ VariationalRegistrationElasticRegularizer< TDisplacementField >
 
   os << indent << "Size: ";
   os << m_Size << std::endl;
+  os << indent << "FieldSize: ";
+  os << m_FieldSize << std::endl;
+  os << indent << "UsePaddedSize: ";
+  os << m_UsePaddedSize << std::endl;
+  os << indent << "BoundaryExtension: ";
+  os << m_BoundaryExtension << std::endl;
   os << indent << "Spacing: ";
   os << m_Spacing << std::endl;
 }
@@ -0,0 +1,94 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkVariationalRegistrationFFTPadding_h
+#define itkVariationalRegistrationFFTPadding_h
+
+#include "itkMacro.h"
+#include "itkIntTypes.h"
+
+namespace itk {
+
+/** \class itk::VariationalRegistrationFFTPadding
+ *
+ *  \brief Helper functions for padding a displacement field to sizes that are fast for FFTW.
+ *
+ *  FFTW is fastest for sizes with small prime factors and can be several
+ *  times slower for sizes like 131 or 257. The FFT based regularizers
+ *  can therefore pad each component of the field to the next size of the
+ *  form \f$2^a 3^b 5^c 7^d\f$ before the transform and crop the result back
+ *  to the original size.
+ *
+ *  The padding is appended after the last pixel in each direction and
+ *  filled according to the boundary extension: with zeros, by replicating
+ *  the border pixel, or by mirroring the field at its border.
+ *
+ *  \sa VariationalRegistrationElasticRegularizer
+ *  \sa VariationalRegistrationElasticDCTRegularizer
+ *  \sa VariationalRegistrationCurvatureRegularizer
+ *
+ *  \ingroup VariationalRegistration
+ */
+template< class TDisplacementField >
+class VariationalRegistrationFFTPadding
+{
+public:
+  /** Dimensionality of the displacement field. */
+  itkStaticConstMacro(ImageDimension, unsigned int, TDisplacementField::ImageDimension);
+
+  /** Displacement field types. */
+  typedef TDisplacementField                          DisplacementFieldType;
+  typedef typename DisplacementFieldType::SizeType    SizeType;
+  typedef typename DisplacementFieldType::RegionType  RegionType;
+
+  /** Boundary extensions for the padded part of the buffer. */
+  typedef enum {
+    BOUNDARY_ZERO = 0,
+    BOUNDARY_REPLICATE = 1,
+    BOUNDARY_MIRROR = 2
+  } BoundaryExtensionType;
+
+  /** Get the smallest size not smaller than n without prime factors
+   *  other than 2, 3, 5 and 7. */
+  static SizeValueType ComputeFastSize( SizeValueType n );
+
+  /** Get the transform size for a field of the given size; if usePadding
+   *  is false, the size itself is returned. */
+  static SizeType ComputePaddedSize( const SizeType & size, bool usePadding );
+
+  /** Copy one component of the field in the region into the buffer of
+   *  size paddedSize and fill the padding according to the extension. */
+  template< class TBufferValue >
+  static void CopyComponentToBuffer( const DisplacementFieldType * field,
+    const RegionType & region, unsigned int component, const SizeType & paddedSize,
+    BoundaryExtensionType extension, TBufferValue * buffer );
+
+  /** Copy the part of the buffer of size paddedSize that corresponds to the
+   *  region into one component of the field, multiplied by scale. */
+  template< class TBufferValue >
+  static void CopyBufferToComponent( const TBufferValue * buffer,
+    const SizeType & paddedSize, double scale, unsigned int component,
+    DisplacementFieldType * field, const RegionType & region );
+};
+
+}
+
+#ifndef ITK_MANUAL_INSTANTIATION
+# include "itkVariationalRegistrationFFTPadding.hxx"
+#endif
+
+#endif
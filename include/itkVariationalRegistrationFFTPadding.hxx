@@ -0,0 +1,213 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkVariationalRegistrationFFTPadding_hxx
+#define itkVariationalRegistrationFFTPadding_hxx
+
+#include "itkVariationalRegistrationFFTPadding.h"
+
+#include <vector>
+
+namespace itk
+{
+
+/**
+ * Get the next size with only the prime factors 2, 3, 5 and 7
+ */
+template< class TDisplacementField >
+SizeValueType
+VariationalRegistrationFFTPadding< TDisplacementField >
+::ComputeFastSize( SizeValueType n )
+{
+  if( n == 0 )
+    {
+    return 0;
+    }
+
+  // A power of two below 2n exists, so this loop ends before 2n.
+  const SizeValueType factors[4] = { 2, 3, 5, 7 };
+  for( SizeValueType size = n;; ++size )
+    {
+    SizeValueType rest = size;
+    for( unsigned int i = 0; i < 4; ++i )
+      {
+      while( rest % factors[i] == 0 )
+        {
+        rest /= factors[i];
+        }
+      }
+    if( rest == 1 )
+      {
+      return size;
+      }
+    }
+}
+
+/**
+ * Get the padded size of the field
+ */
+template< class TDisplacementField >
+typename VariationalRegistrationFFTPadding< TDisplacementField >::SizeType
+VariationalRegistrationFFTPadding< TDisplacementField >
+::ComputePaddedSize( const SizeType & size, bool usePadding )
+{
+  SizeType paddedSize = size;
+  if( usePadding )
+    {
+    for( unsigned int i = 0; i < ImageDimension; ++i )
+      {
+      paddedSize[i] = ComputeFastSize( size[i] );
+      }
+    }
+  return paddedSize;
+}
+
+/**
+ * Copy a component of the field into the padded buffer
+ */
+template< class TDisplacementField >
+template< class TBufferValue >
+void
+VariationalRegistrationFFTPadding< TDisplacementField >
+::CopyComponentToBuffer( const DisplacementFieldType * field,
+  const RegionType & region, unsigned int component, const SizeType & paddedSize,
+  BoundaryExtensionType extension, TBufferValue * buffer )
+{
+  const OffsetValueType * offsetTable = field->GetOffsetTable();
+  const typename DisplacementFieldType::IndexType bufferedIndex =
+      field->GetBufferedRegion().GetIndex();
+
+  // For each direction, compute the offsets in the field buffer of the
+  // pixels that fill the positions of the padded buffer; -1 marks zeros.
+  std::vector< OffsetValueType > sourceOffset[ImageDimension];
+  for( unsigned int d = 0; d < ImageDimension; ++d )
+    {
+    const OffsetValueType n = region.GetSize()[d];
+    sourceOffset[d].resize( paddedSize[d] );
+    for( OffsetValueType j = 0; j < static_cast< OffsetValueType >( paddedSize[d] ); ++j )
+      {
+      OffsetValueType source = j;
+      if( j >= n )
+        {
+        switch( extension )
+          {
+          case BOUNDARY_REPLICATE:
+            source = n - 1;
+            break;
+          case BOUNDARY_MIRROR:
+            source = 2 * n - 1 - j;
+            break;
+          default:
+            source = -1;
+          }
+        }
+      sourceOffset[d][j] = ( source < 0 ) ? -1 :
+          ( region.GetIndex()[d] + source - bufferedIndex[d] ) * offsetTable[d];
+      }
+    }
+
+  // Iterate over the padded buffer
+  const typename DisplacementFieldType::PixelType * input = field->GetBufferPointer();
+  SizeValueType totalSize = 1;
+  OffsetValueType index[ImageDimension];
+  for( unsigned int d = 0; d < ImageDimension; ++d )
+    {
+    totalSize *= paddedSize[d];
+    index[d] = 0;
+    }
+
+  for( SizeValueType n = 0; n < totalSize; ++n )
+    {
+    OffsetValueType offset = 0;
+    bool zero = false;
+    for( unsigned int d = 0; d < ImageDimension; ++d )
+      {
+      if( sourceOffset[d][index[d]] < 0 )
+        {
+        zero = true;
+        break;
+        }
+      offset += sourceOffset[d][index[d]];
+      }
+    buffer[n] = zero ? 0 : static_cast< TBufferValue >( input[offset][component] );
+
+    for( unsigned int d = 0; d < ImageDimension && ++index[d] == static_cast< OffsetValueType >( paddedSize[d] ); ++d )
+      {
+      index[d] = 0;
+      }
+    }
+}
+
+/**
+ * Copy the cropped buffer into a component of the field
+ */
+template< class TDisplacementField >
+template< class TBufferValue >
+void
+VariationalRegistrationFFTPadding< TDisplacementField >
+::CopyBufferToComponent( const TBufferValue * buffer,
+  const SizeType & paddedSize, double scale, unsigned int component,
+  DisplacementFieldType * field, const RegionType & region )
+{
+  const OffsetValueType * offsetTable = field->GetOffsetTable();
+  const typename DisplacementFieldType::IndexType bufferedIndex =
+      field->GetBufferedRegion().GetIndex();
+  typename DisplacementFieldType::PixelType * output = field->GetBufferPointer();
+
+  // Offset of the first pixel of the region in the field buffer
+  OffsetValueType regionOffset = 0;
+  for( unsigned int d = 0; d < ImageDimension; ++d )
+    {
+    regionOffset += ( region.GetIndex()[d] - bufferedIndex[d] ) * offsetTable[d];
+    }
+
+  // Iterate over the region, line by line along the first direction
+  const SizeValueType lineLength = region.GetSize()[0];
+  const SizeValueType numberOfLines = region.GetNumberOfPixels() / lineLength;
+  OffsetValueType index[ImageDimension];
+  for( unsigned int d = 0; d < ImageDimension; ++d )
+    {
+    index[d] = 0;
+    }
+
+  for( SizeValueType line = 0; line < numberOfLines; ++line )
+    {
+    OffsetValueType bufferOffset = 0;
+    OffsetValueType fieldOffset = regionOffset;
+    OffsetValueType bufferStride = 1;
+    for( unsigned int d = 0; d < ImageDimension; ++d )
+      {
+      bufferOffset += index[d] * bufferStride;
+      fieldOffset += index[d] * offsetTable[d];
+      bufferStride *= paddedSize[d];
+      }
+
+    for( SizeValueType i = 0; i < lineLength; ++i )
+      {
+      output[fieldOffset + i][component] = buffer[bufferOffset + i] * scale;
+      }
+
+    for( unsigned int d = 1; d < ImageDimension && ++index[d] == static_cast< OffsetValueType >( region.GetSize()[d] ); ++d )
+      {
+      index[d] = 0;
+      }
+    }
+}
+
+}      // end namespace itk
+
+#endif
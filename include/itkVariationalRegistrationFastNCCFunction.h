@@ -142,6 +142,8 @@ protected:
     double          m_SumOfMetricValues;
     SizeValueType   m_NumberOfPixelsProcessed;
     double          m_SumOfSquaredChange;
+    SizeValueType   m_MetricStride;
+    SizeValueType   m_MetricCountdown;
     IndexType       m_LastIndex;
     bool bValuesAreValid;
     unsigned int lastSliceIndex;
@@ -342,7 +342,7 @@ VariationalRegistrationFastNCCFunction<TFixedImage, TMovingImage, TDisplacementF
   }
 
   // Update the global data (metric etc.)
-  if( globalData )
+  if( this->SampleMetric( globalData ) )
   {
     globalData->m_NumberOfPixelsProcessed += 1;
 // use 1 - CC to get a decreasing metric value
@@ -366,6 +366,8 @@ VariationalRegistrationFastNCCFunction<TFixedImage, TMovingImage, TDisplacementF
   globalData->m_SumOfMetricValues = 0.0;
   globalData->m_NumberOfPixelsProcessed = 0L;
   globalData->m_SumOfSquaredChange = 0;
+  globalData->m_MetricStride = this->GetGlobalDataMetricStride();
+  globalData->m_MetricCountdown = 1;
 
   unsigned int numSlices = this->GetRadius()[0] * 2 +1;
   globalData->sfSliceValueList.resize(numSlices);
@@ -401,6 +403,8 @@ void VariationalRegistrationFastNCCFunction<TFixedImage, TMovingImage, TDisplace
   baseRegFunctionGlobalData->m_SumOfMetricValues = globalData->m_SumOfMetricValues;
   baseRegFunctionGlobalData->m_NumberOfPixelsProcessed = globalData->m_NumberOfPixelsProcessed;
   baseRegFunctionGlobalData->m_SumOfSquaredChange = globalData->m_SumOfSquaredChange;
+  baseRegFunctionGlobalData->m_MetricStride = globalData->m_MetricStride;
+  baseRegFunctionGlobalData->m_MetricCountdown = globalData->m_MetricCountdown;
 
   VariationalRegistrationFunction<TFixedImage, TMovingImage, TDisplacementField>::ReleaseGlobalDataPointer( baseRegFunctionGlobalData );
 
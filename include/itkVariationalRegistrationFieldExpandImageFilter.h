@@ -0,0 +1,243 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkVariationalRegistrationFieldExpandImageFilter_h
+#define itkVariationalRegistrationFieldExpandImageFilter_h
+
+#include "itkImageToImageFilter.h"
+#include "itkFixedArray.h"
+#include "itkMultiThreader.h"
+#include "itkVariationalRegistrationWorkspace.h"
+#include <vector>
+
+namespace itk
+{
+
+/** \class itk::VariationalRegistrationFieldExpandImageFilter
+ *
+ *  \brief Fused smoothing and resampling of a vector field between pyramid levels.
+ *
+ *  This filter resamples a displacement (or velocity) field onto the grid
+ *  of a reference image whose spacing differs from the field spacing by an
+ *  integer factor in each dimension, as it is the case between the levels
+ *  of a MultiResolutionPyramidImageFilter. Optionally, the field is smoothed
+ *  with a Gaussian kernel of standard deviation Sigma (in physical units)
+ *  before resampling.
+ *
+ *  Because the direction cosines of the field and reference grid are equal,
+ *  the mapping between output and input indices is separable. For each
+ *  dimension, the input positions and weights of the combined Gaussian and
+ *  linear interpolation kernel are precomputed once per update. The kernel
+ *  is then applied with one multi-threaded pass per dimension, without
+ *  transforming indices into physical space, so that the cost per output
+ *  pixel grows with the sum and not with the product of the kernel widths.
+ *  The passes write into two intermediate buffers, the last pass into the
+ *  output. With a zero sigma the result equals a VectorResampleImageFilter
+ *  with linear interpolation up to rounding errors.
+ *
+ *  Note that the smoothing uses a discrete Gaussian kernel truncated at
+ *  three standard deviations and replicates the border pixels. This is not
+ *  numerically identical to the RecursiveGaussianImageFilter, which
+ *  approximates the Gaussian by a recursive filter; the results differ
+ *  slightly, in particular close to the image border.
+ *
+ *  If a Workspace is set, the output is written into the workspace buffer
+ *  with the name WorkspaceBufferName instead of allocating a new buffer.
+ *  The output then shares its memory with the workspace and is overwritten
+ *  by the next update using the same buffer.
+ *
+ *  Use CanExpand() to check whether a field and reference grid fulfill
+ *  the requirements of this filter.
+ *
+ *  \sa VariationalRegistrationMultiResolutionFilter
+ *  \sa VectorResampleImageFilter
+ *
+ *  \ingroup VariationalRegistration
+ *  \ingroup MultiThreaded
+ */
+template< class TDisplacementField >
+class VariationalRegistrationFieldExpandImageFilter
+  : public ImageToImageFilter< TDisplacementField, TDisplacementField >
+{
+public:
+  /** Standard class typedefs */
+  typedef VariationalRegistrationFieldExpandImageFilter Self;
+  typedef ImageToImageFilter<
+      TDisplacementField, TDisplacementField >          Superclass;
+  typedef SmartPointer< Self >                          Pointer;
+  typedef SmartPointer< const Self >                    ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro(VariationalRegistrationFieldExpandImageFilter, ImageToImageFilter);
+
+  /** Dimensionality of input and output data is assumed to be the same. */
+  itkStaticConstMacro(ImageDimension, unsigned int, TDisplacementField::ImageDimension);
+
+  /** Deformation field types. */
+  typedef TDisplacementField                              DisplacementFieldType;
+  typedef typename DisplacementFieldType::Pointer         DisplacementFieldPointer;
+  typedef typename DisplacementFieldType::ConstPointer    DisplacementFieldConstPointer;
+  typedef typename DisplacementFieldType::PixelType       PixelType;
+  typedef typename DisplacementFieldType::RegionType      RegionType;
+  typedef typename DisplacementFieldType::SizeType        SizeType;
+  typedef typename DisplacementFieldType::IndexType       IndexType;
+  typedef typename DisplacementFieldType::SpacingType     SpacingType;
+  typedef typename DisplacementFieldType::PointType       PointType;
+  typedef typename DisplacementFieldType::DirectionType   DirectionType;
+  typedef typename DisplacementFieldType::OffsetValueType OffsetValueType;
+
+  /** Image base type used to define the output grid. */
+  typedef ImageBase< ImageDimension >                     ImageBaseType;
+
+  /** Array type for the standard deviation of the Gaussian kernel. */
+  typedef FixedArray< double, ImageDimension >            SigmaArrayType;
+
+  /** Workspace type for the output buffer. */
+  typedef VariationalRegistrationWorkspace< DisplacementFieldType >
+                                                          WorkspaceType;
+
+  /** Set/Get the size of the output field. */
+  itkSetMacro( Size, SizeType );
+  itkGetConstReferenceMacro( Size, SizeType );
+
+  /** Set/Get the start index of the output field. */
+  itkSetMacro( OutputStartIndex, IndexType );
+  itkGetConstReferenceMacro( OutputStartIndex, IndexType );
+
+  /** Set/Get the output spacing. */
+  itkSetMacro( OutputSpacing, SpacingType );
+  itkGetConstReferenceMacro( OutputSpacing, SpacingType );
+
+  /** Set/Get the output origin. */
+  itkSetMacro( OutputOrigin, PointType );
+  itkGetConstReferenceMacro( OutputOrigin, PointType );
+
+  /** Set/Get the output direction. */
+  itkSetMacro( OutputDirection, DirectionType );
+  itkGetConstReferenceMacro( OutputDirection, DirectionType );
+
+  /** Copy size, start index, spacing, origin and direction of the output
+   *  from the largest possible region of an image. */
+  void SetOutputParametersFromImage( const ImageBaseType * image );
+
+  /** Set/Get the standard deviation of the Gaussian smoothing applied
+   *  before resampling (physical units). Zero disables smoothing. */
+  itkSetMacro( Sigma, SigmaArrayType );
+  itkGetConstReferenceMacro( Sigma, SigmaArrayType );
+
+  /** Set/Get the workspace the output is written to. If NULL (default),
+   *  the output is allocated as usual. */
+  itkSetObjectMacro( Workspace, WorkspaceType );
+  itkGetObjectMacro( Workspace, WorkspaceType );
+
+  /** Set/Get the name of the workspace buffer used for the output. */
+  itkSetStringMacro( WorkspaceBufferName );
+  itkGetStringMacro( WorkspaceBufferName );
+
+  /** Returns true, if a field can be resampled to the grid of the reference
+   *  image with this filter, i.e. if the directions are equal and the ratio
+   *  of the spacings is an integer value in each dimension. */
+  static bool CanExpand( const ImageBaseType * field, const ImageBaseType * reference );
+
+protected:
+  VariationalRegistrationFieldExpandImageFilter();
+  ~VariationalRegistrationFieldExpandImageFilter() {}
+
+  /** Print information about the filter. */
+  virtual void PrintSelf(std::ostream& os, Indent indent) const ITK_OVERRIDE;
+
+  /** Set the output grid from the user-defined parameters. */
+  virtual void GenerateOutputInformation() ITK_OVERRIDE;
+
+  /** Allocate the output, using the workspace buffer if a workspace is
+   *  set. */
+  virtual void AllocateOutputs() ITK_OVERRIDE;
+
+  /** The whole input field is required. */
+  virtual void GenerateInputRequestedRegion() ITK_OVERRIDE;
+
+  /** Precompute the per-dimension input positions and kernel weights. */
+  virtual void BeforeThreadedGenerateData() ITK_OVERRIDE;
+
+  /** Compute the output field with one pass per dimension. This method is
+   *  multi-threaded but does not use ThreadedGenerateData(). */
+  virtual void GenerateData() ITK_OVERRIDE;
+
+  /** Data of one pass, which applies the kernel of one dimension to a
+   *  buffer. The buffers consist of rows of InnerSize pixels, i.e. all
+   *  pixels with the same indices in the dimensions from Dimension on. */
+  struct ExpandThreadStruct
+    {
+    VariationalRegistrationFieldExpandImageFilter * Filter;
+    const PixelType * Source;
+    PixelType *       Destination;
+    unsigned int      Dimension;
+    SizeValueType     InnerSize;
+    SizeValueType     InputLength;
+    SizeValueType     OutputLength;
+    SizeValueType     OutputStart;
+    SizeValueType     NumberOfRows;
+    };
+
+  /** Apply the kernel of one dimension to the destination rows in the
+   *  range [from, to). Called by the threads of GenerateData(). */
+  virtual void ThreadedExpandDimension( const ExpandThreadStruct & str,
+      SizeValueType from, SizeValueType to );
+
+  /** Static callback for the passes of GenerateData(). */
+  static ITK_THREAD_RETURN_TYPE ExpandDimensionThreaderCallback( void * arg );
+
+private:
+  VariationalRegistrationFieldExpandImageFilter(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  /** Output grid parameters. */
+  SizeType       m_Size;
+  IndexType      m_OutputStartIndex;
+  SpacingType    m_OutputSpacing;
+  PointType      m_OutputOrigin;
+  DirectionType  m_OutputDirection;
+
+  /** Standard deviation of the Gaussian kernel. */
+  SigmaArrayType m_Sigma;
+
+  /** Workspace and buffer name for the output. */
+  typename WorkspaceType::Pointer m_Workspace;
+  std::string                     m_WorkspaceBufferName;
+
+  /** Number of kernel taps in each dimension. */
+  unsigned int m_KernelWidth[ImageDimension];
+
+  /** Positions in the input buffer along each dimension of the input
+   *  pixels contributing to each output index (m_KernelWidth entries per
+   *  output index). */
+  std::vector< SizeValueType > m_InputPositions[ImageDimension];
+
+  /** Weights of the input pixels contributing to each output index. */
+  std::vector< double > m_Weights[ImageDimension];
+};
+
+}
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkVariationalRegistrationFieldExpandImageFilter.hxx"
+#endif
+
+#endif
@@ -0,0 +1,453 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkVariationalRegistrationFieldExpandImageFilter_hxx
+#define itkVariationalRegistrationFieldExpandImageFilter_hxx
+#include "itkVariationalRegistrationFieldExpandImageFilter.h"
+
+#include "vnl/vnl_math.h"
+#include <algorithm>
+#include <cmath>
+
+namespace itk
+{
+
+/**
+ * Default constructor
+ */
+template< class TDisplacementField >
+VariationalRegistrationFieldExpandImageFilter< TDisplacementField >
+::VariationalRegistrationFieldExpandImageFilter()
+{
+  m_Size.Fill( 0 );
+  m_OutputStartIndex.Fill( 0 );
+  m_OutputSpacing.Fill( 1.0 );
+  m_OutputOrigin.Fill( 0.0 );
+  m_OutputDirection.SetIdentity();
+  m_Sigma.Fill( 0.0 );
+  m_Workspace = NULL;
+  m_WorkspaceBufferName = "ExpandedField";
+
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    m_KernelWidth[d] = 0;
+    }
+}
+
+/*
+ * Copy the output grid from an image.
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationFieldExpandImageFilter< TDisplacementField >
+::SetOutputParametersFromImage( const ImageBaseType * image )
+{
+  this->SetSize( image->GetLargestPossibleRegion().GetSize() );
+  this->SetOutputStartIndex( image->GetLargestPossibleRegion().GetIndex() );
+  this->SetOutputSpacing( image->GetSpacing() );
+  this->SetOutputOrigin( image->GetOrigin() );
+  this->SetOutputDirection( image->GetDirection() );
+}
+
+/*
+ * Check directions and spacing ratios of field and reference grid.
+ */
+template< class TDisplacementField >
+bool
+VariationalRegistrationFieldExpandImageFilter< TDisplacementField >
+::CanExpand( const ImageBaseType * field, const ImageBaseType * reference )
+{
+  if( !field || !reference )
+    {
+    return false;
+    }
+
+  const double tolerance = 1e-4;
+
+  for( unsigned int i = 0; i < ImageDimension; i++ )
+    {
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      if( std::fabs( field->GetDirection()[i][j]
+          - reference->GetDirection()[i][j] ) > tolerance )
+        {
+        return false;
+        }
+      }
+
+    double ratio = field->GetSpacing()[i] / reference->GetSpacing()[i];
+    if( ratio < 1.0 )
+      {
+      ratio = 1.0 / ratio;
+      }
+    if( std::fabs( ratio - std::floor( ratio + 0.5 ) ) > tolerance )
+      {
+      return false;
+      }
+    }
+
+  return true;
+}
+
+/*
+ * Set the output grid from the user-defined parameters.
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationFieldExpandImageFilter< TDisplacementField >
+::GenerateOutputInformation()
+{
+  // call the superclass' implementation of this method
+  Superclass::GenerateOutputInformation();
+
+  DisplacementFieldPointer outputPtr = this->GetOutput();
+  if( !outputPtr )
+    {
+    return;
+    }
+
+  RegionType outputLargestPossibleRegion;
+  outputLargestPossibleRegion.SetSize( m_Size );
+  outputLargestPossibleRegion.SetIndex( m_OutputStartIndex );
+
+  outputPtr->SetLargestPossibleRegion( outputLargestPossibleRegion );
+  outputPtr->SetSpacing( m_OutputSpacing );
+  outputPtr->SetOrigin( m_OutputOrigin );
+  outputPtr->SetDirection( m_OutputDirection );
+}
+
+/*
+ * Allocate the output in the workspace buffer, if a workspace is set.
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationFieldExpandImageFilter< TDisplacementField >
+::AllocateOutputs()
+{
+  if( !m_Workspace )
+    {
+    this->Superclass::AllocateOutputs();
+    return;
+    }
+
+  // Allocate() only adjusts the size of the attached container, unless the
+  // output is larger than the workspace buffers.
+  DisplacementFieldPointer outputPtr = this->GetOutput();
+  m_Workspace->AttachBuffer( outputPtr.GetPointer(), m_WorkspaceBufferName );
+  outputPtr->SetBufferedRegion( outputPtr->GetRequestedRegion() );
+  outputPtr->Allocate();
+}
+
+/*
+ * Request the largest possible region of the input field.
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationFieldExpandImageFilter< TDisplacementField >
+::GenerateInputRequestedRegion()
+{
+  // call the superclass' implementation of this method
+  Superclass::GenerateInputRequestedRegion();
+
+  DisplacementFieldPointer inputPtr =
+      const_cast< DisplacementFieldType * >( this->GetInput() );
+  if( inputPtr )
+    {
+    inputPtr->SetRequestedRegionToLargestPossibleRegion();
+    }
+}
+
+/*
+ * Precompute positions and weights of the separable kernel. Each weight
+ * combines the discrete Gaussian with the linear interpolation between
+ * the two neighbouring smoothed input samples.
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationFieldExpandImageFilter< TDisplacementField >
+::BeforeThreadedGenerateData()
+{
+  DisplacementFieldConstPointer inputPtr = this->GetInput();
+  DisplacementFieldPointer outputPtr = this->GetOutput();
+
+  if( !CanExpand( inputPtr, outputPtr ) )
+    {
+    itkExceptionMacro( << "Directions of input and output differ or spacing ratio is not integer" );
+    }
+
+  const RegionType inputRegion = inputPtr->GetBufferedRegion();
+  const SpacingType inputSpacing = inputPtr->GetSpacing();
+
+  // Position of the output origin in the index space of the input
+  typename PointType::VectorType originOffset =
+      inputPtr->GetInverseDirection() * ( m_OutputOrigin - inputPtr->GetOrigin() );
+
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    const double scale = m_OutputSpacing[d] / inputSpacing[d];
+    const double shift = originOffset[d] / inputSpacing[d];
+    const OffsetValueType inputStart = inputRegion.GetIndex()[d];
+    const OffsetValueType inputEnd = inputStart
+        + static_cast< OffsetValueType >( inputRegion.GetSize()[d] ) - 1;
+
+    // Normalized discrete Gaussian in input pixel units
+    const double sigma = m_Sigma[d] / inputSpacing[d];
+    int radius = 0;
+    std::vector< double > gaussian( 1, 1.0 );
+    if( sigma > 0.0 )
+      {
+      radius = static_cast< int >( std::ceil( 3.0 * sigma ) );
+      gaussian.resize( 2 * radius + 1 );
+
+      double sum = 0.0;
+      for( int k = -radius; k <= radius; k++ )
+        {
+        gaussian[k + radius] = std::exp( -0.5 * k * k / ( sigma * sigma ) );
+        sum += gaussian[k + radius];
+        }
+      for( unsigned int k = 0; k < gaussian.size(); k++ )
+        {
+        gaussian[k] /= sum;
+        }
+      }
+
+    const unsigned int width = 2 * radius + 2;
+    m_KernelWidth[d] = width;
+    m_InputPositions[d].assign( m_Size[d] * width, 0 );
+    m_Weights[d].assign( m_Size[d] * width, 0.0 );
+
+    for( unsigned int i = 0; i < m_Size[d]; i++ )
+      {
+      const double contIndex = shift + scale * ( m_OutputStartIndex[d] + i );
+
+      // Positions outside of the input buffer get zero weights, as in
+      // VectorResampleImageFilter.
+      if( contIndex < inputStart - 0.5 || contIndex > inputEnd + 0.5 )
+        {
+        continue;
+        }
+
+      const OffsetValueType base =
+          static_cast< OffsetValueType >( std::floor( contIndex ) );
+      const double frac = contIndex - base;
+
+      for( unsigned int k = 0; k < width; k++ )
+        {
+        double weight = 0.0;
+        if( k + 1 < width )
+          {
+          weight += ( 1.0 - frac ) * gaussian[k];
+          }
+        if( k > 0 )
+          {
+          weight += frac * gaussian[k - 1];
+          }
+
+        // Replicate the boundary pixels.
+        OffsetValueType index = base - radius + k;
+        if( index < inputStart )
+          {
+          index = inputStart;
+          }
+        if( index > inputEnd )
+          {
+          index = inputEnd;
+          }
+
+        m_InputPositions[d][i * width + k] = index - inputStart;
+        m_Weights[d][i * width + k] = weight;
+        }
+      }
+    }
+}
+
+/*
+ * Compute the output field with one pass per dimension.
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationFieldExpandImageFilter< TDisplacementField >
+::GenerateData()
+{
+  this->AllocateOutputs();
+  this->BeforeThreadedGenerateData();
+
+  DisplacementFieldConstPointer inputPtr = this->GetInput();
+  DisplacementFieldPointer outputPtr = this->GetOutput();
+
+  const RegionType outputRegion = outputPtr->GetBufferedRegion();
+  if( outputRegion.GetNumberOfPixels() == 0 )
+    {
+    return;
+    }
+
+  // Size of the buffer before each pass: the output size in the dimensions
+  // processed so far, the input size in the others.
+  SizeType size = inputPtr->GetBufferedRegion().GetSize();
+
+  // Pass d reads from the result of pass d-1 and writes into the other
+  // intermediate buffer; the first pass reads the input, the last writes
+  // the output.
+  std::vector< PixelType > passBuffer[2];
+  ExpandThreadStruct str;
+  str.Filter = this;
+  str.Source = inputPtr->GetBufferPointer();
+
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    str.Dimension = d;
+    str.InnerSize = 1;
+    SizeValueType outerSize = 1;
+    for( unsigned int k = 0; k < ImageDimension; k++ )
+      {
+      if( k < d )
+        {
+        str.InnerSize *= size[k];
+        }
+      else if( k > d )
+        {
+        outerSize *= size[k];
+        }
+      }
+    str.InputLength = size[d];
+    str.OutputLength = outputRegion.GetSize()[d];
+    str.OutputStart = outputRegion.GetIndex()[d] - m_OutputStartIndex[d];
+    str.NumberOfRows = outerSize * str.OutputLength;
+
+    if( d + 1 == ImageDimension )
+      {
+      str.Destination = outputPtr->GetBufferPointer();
+      }
+    else
+      {
+      passBuffer[d % 2].resize( str.NumberOfRows * str.InnerSize );
+      str.Destination = &passBuffer[d % 2][0];
+      }
+
+    this->GetMultiThreader()->SetNumberOfThreads( this->GetNumberOfThreads() );
+    this->GetMultiThreader()->SetSingleMethod( this->ExpandDimensionThreaderCallback, &str );
+    this->GetMultiThreader()->SingleMethodExecute();
+
+    size[d] = str.OutputLength;
+    str.Source = str.Destination;
+    this->UpdateProgress( static_cast< float >( d + 1 ) / ImageDimension );
+    }
+}
+
+/*
+ * Split the rows of a pass between the threads.
+ */
+template< class TDisplacementField >
+ITK_THREAD_RETURN_TYPE
+VariationalRegistrationFieldExpandImageFilter< TDisplacementField >
+::ExpandDimensionThreaderCallback( void * arg )
+{
+  MultiThreader::ThreadInfoStruct* threadStruct =
+      (MultiThreader::ThreadInfoStruct *) arg;
+  const ThreadIdType threadId = threadStruct->ThreadID;
+  const ThreadIdType threadCount = threadStruct->NumberOfThreads;
+
+  const ExpandThreadStruct* str = (const ExpandThreadStruct*) threadStruct->UserData;
+
+  const SizeValueType chunk = ( str->NumberOfRows + threadCount - 1 ) / threadCount;
+  const SizeValueType from = vnl_math_min( threadId * chunk, str->NumberOfRows );
+  const SizeValueType to = vnl_math_min( from + chunk, str->NumberOfRows );
+
+  if( from < to )
+    {
+    str->Filter->ThreadedExpandDimension( *str, from, to );
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/*
+ * Apply the kernel of one dimension to a range of rows.
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationFieldExpandImageFilter< TDisplacementField >
+::ThreadedExpandDimension( const ExpandThreadStruct & str,
+  SizeValueType from, SizeValueType to )
+{
+  const unsigned int components = PixelType::Dimension;
+  const unsigned int width = m_KernelWidth[str.Dimension];
+  const SizeValueType * positions = &m_InputPositions[str.Dimension][0];
+  const double * weights = &m_Weights[str.Dimension][0];
+
+  // Sums of one row in double precision
+  std::vector< double > sum( str.InnerSize * components );
+
+  for( SizeValueType row = from; row < to; row++ )
+    {
+    const SizeValueType outer = row / str.OutputLength;
+    const SizeValueType entry = ( str.OutputStart + row % str.OutputLength ) * width;
+    const PixelType * source = str.Source + outer * str.InputLength * str.InnerSize;
+
+    std::fill( sum.begin(), sum.end(), 0.0 );
+    for( unsigned int k = 0; k < width; k++ )
+      {
+      const double weight = weights[entry + k];
+      if( weight == 0.0 )
+        {
+        continue;
+        }
+      const PixelType * sourceRow = source + positions[entry + k] * str.InnerSize;
+      for( SizeValueType i = 0; i < str.InnerSize; i++ )
+        {
+        for( unsigned int c = 0; c < components; c++ )
+          {
+          sum[i * components + c] += weight * sourceRow[i][c];
+          }
+        }
+      }
+
+    PixelType * destinationRow = str.Destination + row * str.InnerSize;
+    for( SizeValueType i = 0; i < str.InnerSize; i++ )
+      {
+      for( unsigned int c = 0; c < components; c++ )
+        {
+        destinationRow[i][c] =
+            static_cast< typename PixelType::ValueType >( sum[i * components + c] );
+        }
+      }
+    }
+}
+
+/*
+ * Standard PrintSelf method.
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationFieldExpandImageFilter< TDisplacementField >
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf( os, indent );
+
+  os << indent << "Size: " << m_Size << std::endl;
+  os << indent << "OutputStartIndex: " << m_OutputStartIndex << std::endl;
+  os << indent << "OutputSpacing: " << m_OutputSpacing << std::endl;
+  os << indent << "OutputOrigin: " << m_OutputOrigin << std::endl;
+  os << indent << "OutputDirection: " << m_OutputDirection << std::endl;
+  os << indent << "Sigma: " << m_Sigma << std::endl;
+  os << indent << "Workspace: " << m_Workspace.GetPointer() << std::endl;
+  os << indent << "WorkspaceBufferName: " << m_WorkspaceBufferName << std::endl;
+}
+
+} // end namespace itk
+
+#endif
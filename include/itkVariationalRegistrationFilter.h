@@ -25,6 +25,9 @@
 #include "itkVariationalRegistrationDemonsFunction.h"
 #include "itkVariationalRegistrationRegularizer.h"
 #include "itkVariationalRegistrationDiffusionRegularizer.h"
+#include "itkVariationalRegistrationInstrumentation.h"
+
+#include <vector>
 
 namespace itk {
 
@@ -132,6 +135,8 @@ public:
   /** Deformation field type. */
   typedef TDisplacementField                       DisplacementFieldType;
   typedef typename DisplacementFieldType::Pointer  DisplacementFieldPointer;
+  typedef typename DisplacementFieldType::RegionType
+                                                   DisplacementFieldRegionType;
 
   /** MovingImage image type. */
   typedef unsigned char                            MaskImagePixelType;
@@ -142,6 +147,7 @@ public:
 
   /** Types inherited from the superclass */
   typedef typename Superclass::OutputImageType     OutputImageType;
+  typedef typename Superclass::UpdateBufferType    UpdateBufferType;
 
   /** The value type of a time step.  Inherited from the superclass. */
   typedef typename Superclass::TimeStepType        TimeStepType;
@@ -159,12 +165,45 @@ public:
   typedef VariationalRegistrationDiffusionRegularizer< DisplacementFieldType >
                                                    DefaultRegularizerType;
 
+  /** Workspace type. */
+  typedef VariationalRegistrationWorkspace< DisplacementFieldType >
+                                                   WorkspaceType;
+  typedef typename WorkspaceType::Pointer          WorkspacePointer;
+
   /** Set the regularizer. */
   itkSetObjectMacro( Regularizer, RegularizerType );
 
   /** Get the regularizer. */
   itkGetConstReferenceObjectMacro( Regularizer, RegularizerType );
 
+  /** Set the number of threads of the filter, its regularizer and the
+   *  moving image warper of its registration function. Subclasses also set
+   *  it for their internal filters. Regularizer and function set later keep
+   *  their own number of threads. */
+  virtual void SetNumberOfThreads( ThreadIdType numberOfThreads ) ITK_OVERRIDE;
+
+  /** Set the workspace used for the update buffer, the fields of the
+   *  update schemes and the internal buffers of regularizer and
+   *  registration function. The output is not part of the workspace. If no
+   *  workspace is set, the buffers are allocated by the filters. */
+  itkSetObjectMacro( Workspace, WorkspaceType );
+
+  /** Get the workspace. */
+  itkGetObjectMacro( Workspace, WorkspaceType );
+
+  /** Instrumentation type. */
+  typedef VariationalRegistrationInstrumentation   InstrumentationType;
+  typedef InstrumentationType::Pointer             InstrumentationPointer;
+  typedef InstrumentationType::PhaseType           PhaseType;
+
+  /** Set the instrumentation that records the time of the phases of each
+   *  iteration. If no instrumentation is set (default), nothing is timed. */
+  itkSetObjectMacro( Instrumentation, InstrumentationType );
+
+  /** Get the instrumentation. */
+  itkGetObjectMacro( Instrumentation, InstrumentationType );
+  itkGetConstObjectMacro( Instrumentation, InstrumentationType );
+
   /** Set the fixed image. */
   virtual void SetFixedImage( const FixedImageType * ptr );
 
@@ -240,6 +279,185 @@ public:
   virtual void StopRegistration()
     { m_StopRegistrationFlag = true; }
 
+  /** Get whether a stop of the registration after the current iteration
+   *  has been requested. */
+  itkGetConstMacro( StopRegistrationFlag, bool );
+
+  /** Set/Get whether the metric and the RMS change are computed in the
+   *  following iterations. If off, the force computation skips the
+   *  reduction of the metric, and GetMetric() returns the value of the last
+   *  iteration in which it was computed. Observers of the IterationEvent
+   *  (e.g. the stop criterion) may switch it off for iterations in which
+   *  they do not need the metric. It is switched on at the start of each
+   *  update. */
+  itkSetMacro( ComputeMetric, bool );
+  itkGetConstMacro( ComputeMetric, bool );
+  itkBooleanMacro( ComputeMetric );
+
+  /** Get whether the metric was computed in the last iteration. */
+  itkGetConstMacro( MetricUpdated, bool );
+
+  /** Set/Get the metric sampling stride. The metric and the RMS change are
+   *  estimated from every stride-th pixel of each thread, so that the force
+   *  loop only performs the reduction for a subsample of the pixels.
+   *  Default is 1, i.e. all pixels are used. */
+  itkSetClampMacro( MetricSamplingStride, SizeValueType, 1, NumericTraits< SizeValueType >::max() );
+  itkGetConstMacro( MetricSamplingStride, SizeValueType );
+
+  /** Set/Get the fraction of pixels at which the force is computed (see
+   *  VariationalRegistrationFunction::SetForceSamplingFraction()). The
+   *  sampled pixels change in every iteration and are determined by the
+   *  ForceSamplingSeed and the iteration number. If the update or the
+   *  displacement field is regularized, the step is scaled by the inverse
+   *  fraction. Default is 1, i.e. dense forces. */
+  itkSetClampMacro( ForceSamplingFraction, double, NumericTraits< double >::min(), 1.0 );
+  itkGetConstMacro( ForceSamplingFraction, double );
+
+  /** Set/Get the seed of the force sampling. Default is 0. */
+  itkSetMacro( ForceSamplingSeed, uint32_t );
+  itkGetConstMacro( ForceSamplingSeed, uint32_t );
+
+  /** Set/Get the force sampling fraction of the following iterations. It is
+   *  reset to ForceSamplingFraction at the start of each update and may be
+   *  increased by observers of the IterationEvent, e.g. the stop criterion
+   *  (see VariationalRegistrationStopCriterion::SetAdaptForceSampling()). */
+  itkSetClampMacro( CurrentForceSamplingFraction, double, NumericTraits< double >::min(), 1.0 );
+  itkGetConstMacro( CurrentForceSamplingFraction, double );
+
+  /** Set/Get whether the force computation and the update are restricted to
+   *  the blocks of MaskBlockSize^ImageDimension pixels that contain
+   *  foreground pixels of the mask image. The blocks are determined from
+   *  the mask at the start of each update, i.e. once per level in
+   *  multi-resolution registration. Has no effect without mask image.
+   *  Default is off. */
+  itkSetMacro( UseMaskBlocks, bool );
+  itkGetConstMacro( UseMaskBlocks, bool );
+  itkBooleanMacro( UseMaskBlocks );
+
+  /** Set/Get the edge length of the mask blocks in pixels. Default is 16. */
+  itkSetClampMacro( MaskBlockSize, SizeValueType, 1, NumericTraits< SizeValueType >::max() );
+  itkGetConstMacro( MaskBlockSize, SizeValueType );
+
+  /** Get the number of mask blocks of the current update containing
+   *  foreground pixels (all blocks if no mask is used). Zero if blocks are
+   *  not used. */
+  virtual SizeValueType GetNumberOfActiveMaskBlocks() const
+    { return m_ActiveMaskBlocks.size(); }
+
+  /** Get the total number of mask blocks of the current update. Zero if
+   *  blocks are not used. */
+  virtual SizeValueType GetNumberOfMaskBlocks() const
+    { return m_ActiveMaskBlocks.size() + m_InactiveMaskBlocks.size(); }
+
+  /** Set/Get whether blocks in which the field has converged are frozen.
+   *  The output region is split into blocks of MaskBlockSize^ImageDimension
+   *  pixels (restricted to the mask foreground if UseMaskBlocks is on). A
+   *  block is converged if the maximum norm of the displacement change
+   *  (time step times update) in the block stayed below FreezeThreshold for
+   *  FreezeIterations iterations. Converged blocks are frozen, i.e. their
+   *  forces are no longer computed, unless a face-adjacent block has not
+   *  converged. The regularization is still applied to the whole field, so
+   *  that changes propagate into frozen blocks, and frozen blocks are
+   *  reactivated if a neighbor starts to change again. If all blocks are
+   *  frozen, the registration is stopped. Default is off. */
+  itkSetMacro( FreezeConvergedBlocks, bool );
+  itkGetConstMacro( FreezeConvergedBlocks, bool );
+  itkBooleanMacro( FreezeConvergedBlocks );
+
+  /** Set/Get the threshold for the displacement change of converged blocks.
+   *  Default is 0.01. */
+  itkSetMacro( FreezeThreshold, double );
+  itkGetConstMacro( FreezeThreshold, double );
+
+  /** Set/Get the number of iterations the displacement change of a block
+   *  must stay below the threshold to converge. Default is 5. */
+  itkSetClampMacro( FreezeIterations, unsigned int, 1, NumericTraits< unsigned int >::max() );
+  itkGetConstMacro( FreezeIterations, unsigned int );
+
+  /** Enumerate for the update schemes. */
+  enum UpdateScheme {
+    UPDATE_SCHEME_GRADIENT_DESCENT = 0,
+    UPDATE_SCHEME_NESTEROV = 1
+  };
+
+  /** Set the update scheme. Two schemes are provided:
+   * - Gradient descent: Each iteration performs the step (2) (default)
+   * - Nesterov: After the step and the regularization of the output field,
+   *   the output is extrapolated along the last step,
+   *   u <- u + beta_k (u - u_prev), with the momentum
+   *   beta_k = (t_k - 1) / t_{k+1}, t_{k+1} = (1 + sqrt(1 + 4 t_k^2)) / 2,
+   *   limited by MaximumMomentum. u_prev is the regularized output of the
+   *   last iteration before its extrapolation. The momentum is restarted
+   *   (t_k = 1) if the metric increases or if the adaptive time step of the
+   *   registration function rejects the output. In diffeomorphic
+   *   registration the velocity field is extrapolated. One additional field
+   *   is allocated, from the buffer "PreviousField" of the workspace if one
+   *   is set. */
+  itkSetEnumMacro( UpdateScheme, UpdateScheme );
+
+  /** Get the update scheme. */
+  itkGetEnumMacro( UpdateScheme, UpdateScheme );
+
+  /** Use plain gradient descent steps. */
+  virtual void SetUpdateSchemeToGradientDescent()
+    { this->SetUpdateScheme( UPDATE_SCHEME_GRADIENT_DESCENT ); }
+
+  /** Use Nesterov momentum. */
+  virtual void SetUpdateSchemeToNesterov()
+    { this->SetUpdateScheme( UPDATE_SCHEME_NESTEROV ); }
+
+  /** Set/Get the maximum momentum of the Nesterov scheme. Default is 0.95. */
+  itkSetClampMacro( MaximumMomentum, double, 0.0, 1.0 );
+  itkGetConstMacro( MaximumMomentum, double );
+
+  /** Set/Get whether the momentum is restarted if the metric increases.
+   *  Only iterations in which the metric is computed are compared. Default
+   *  is on. */
+  itkSetMacro( MomentumRestart, bool );
+  itkGetConstMacro( MomentumRestart, bool );
+  itkBooleanMacro( MomentumRestart );
+
+  /** Get the momentum of the last iteration. */
+  itkGetConstMacro( Momentum, double );
+
+  /** Get the number of momentum restarts of the current update. */
+  itkGetConstMacro( NumberOfMomentumRestarts, SizeValueType );
+
+  /** Get the number of iterations of the current update in which the
+   *  output was moved back towards the last accepted field, because the
+   *  adaptive time step of the registration function rejected it (see
+   *  VariationalRegistrationFunction::AdaptTimeStep()). */
+  itkGetConstMacro( NumberOfBacktrackingSteps, SizeValueType );
+
+  /** Get the fraction of the pixels of the output region whose forces were
+   *  computed in the last iteration. One if blocks are not used. */
+  itkGetConstMacro( ActiveBlockFraction, double );
+
+  /** Get the mean active block fraction over the iterations of the current
+   *  update, i.e. of the current level in multi-resolution registration. */
+  virtual double GetMeanActiveBlockFraction() const
+    {
+    return m_NumberOfActiveBlockFractions > 0
+        ? m_SumOfActiveBlockFractions / m_NumberOfActiveBlockFractions
+        : m_ActiveBlockFraction;
+    }
+
+  /** Get the number of bytes allocated for output, update buffer, workspace
+   *  and the internal buffers of the regularizer. */
+  virtual SizeValueType GetAllocatedBytes();
+
+  /** Free the update buffer, the fields of the update schemes, the warped
+   *  moving image of the registration function and the buffers of the
+   *  regularizer. They are allocated again by the next update. Output and
+   *  displacement field are kept. Buffers in the workspace are not freed. */
+  virtual void ReleaseBuffers();
+
+  /** Get an estimate of the number of bytes the filter, its registration
+   *  function and its regularizer allocate to compute a field with the given
+   *  region: output, update buffer, warped image, regularizer buffers and
+   *  further fields of subclasses. The input field is not included. */
+  virtual SizeValueType EstimateAllocatedBytes( const DisplacementFieldRegionType & region ) const;
+
 protected:
   VariationalRegistrationFilter();
   ~VariationalRegistrationFilter() {}
@@ -265,16 +483,133 @@ protected:
    * If the input does not exist, a zero field is written to the output. */
   virtual void CopyInputToOutput() ITK_OVERRIDE;
 
+  /** Copy the source field into the target field or, if source is NULL,
+   *  fill the target field with zero vectors. The target is split into the
+   *  same regions as the output for the solver threads, so that each thread
+   *  first touches the memory it processes later. */
+  virtual void CopyOrZeroFillField( const DisplacementFieldType * source,
+      DisplacementFieldType * target );
+
+  /** A struct to store parameters for multithreaded function call. */
+  struct CopyOrZeroFillThreadStruct
+  {
+    VariationalRegistrationFilter *Filter;
+    const DisplacementFieldType *source;  // Field to copy or NULL.
+    DisplacementFieldType *target;        // Field to write.
+  };
+
+  /** Method for multi-threaded copying or zero filling of a field. */
+  static ITK_THREAD_RETURN_TYPE CopyOrZeroFillCallback( void *arg );
+
+  /** Split the output requested region into blocks and sort them into
+   *  active blocks, which contain mask foreground pixels, and inactive
+   *  blocks. */
+  virtual void BuildMaskBlocks();
+
+  /** Compute the update buffer in the live blocks. The inactive and frozen
+   *  blocks are set to zero if the update field is smoothed. */
+  virtual TimeStepType CalculateChangeInMaskBlocks();
+
+  /** Count the iterations in which the displacement change of the live
+   *  blocks stayed below the freeze threshold and determine the live blocks
+   *  of the next iteration. */
+  virtual void UpdateLiveBlocks( const TimeStepType& dt );
+
+  /** Extrapolate the output along the last step with the momentum of the
+   *  Nesterov scheme and store the output before extrapolation. */
+  virtual void ApplyMomentum();
+
+  /** Set the output to reference + factor * (output - reference). If
+   *  storeOutput is set, the output before extrapolation is copied into
+   *  the reference. */
+  virtual void ExtrapolateOutput( DisplacementFieldType * reference,
+      double factor, bool storeOutput );
+
+  /** A struct to store parameters for the multithreaded extrapolation. */
+  struct ExtrapolateThreadStruct
+  {
+    VariationalRegistrationFilter *Filter;
+    DisplacementFieldType *Reference;
+    double Factor;
+    bool StoreOutput;
+  };
+
+  /** Method for multi-threaded extrapolation of the output. */
+  static ITK_THREAD_RETURN_TYPE ExtrapolateOutputCallback( void *arg );
+
+  /** Exchange the pixel containers of the output and the last accepted
+   *  field. Keeps the accepted output without copying it. */
+  virtual void SwapOutputAndLastAcceptedField();
+
+  /** Get the field to which the update is added. This is the last accepted
+   *  field during a step after SwapOutputAndLastAcceptedField(), otherwise
+   *  the output itself, i.e. the update is added in place. */
+  DisplacementFieldType * GetUpdateSource()
+    { return m_UpdateSource ? m_UpdateSource : this->GetOutput(); }
+
+  /** The type of region used for multithreading */
+  typedef typename UpdateBufferType::RegionType ThreadRegionType;
+
+  /** Set the output to the update source plus the update buffer times the
+   *  time step in the given region. */
+  virtual void ThreadedApplyUpdate( const TimeStepType &dt,
+                                    const ThreadRegionType &regionToProcess,
+                                    ThreadIdType threadId ) ITK_OVERRIDE;
+
+  /** Add the update buffer to the output in the live blocks. */
+  virtual void ApplyUpdateInMaskBlocks( const TimeStepType& dt );
+
+  /** A struct to store parameters for the multithreaded processing of the
+   *  mask blocks. */
+  struct MaskBlockThreadStruct
+  {
+    VariationalRegistrationFilter *Filter;
+    TimeStepType TimeStep;                    // Time step for the update.
+    std::vector< TimeStepType > TimeStepList; // Time steps of the threads.
+    std::vector< bool > ValidTimeStepList;    // Threads that computed a time step.
+  };
+
+  /** Methods for multi-threaded computation and application of the update
+   *  in the mask blocks. */
+  static ITK_THREAD_RETURN_TYPE CalculateChangeInMaskBlocksCallback( void *arg );
+  static ITK_THREAD_RETURN_TYPE ApplyUpdateInMaskBlocksCallback( void *arg );
+
   /** This method is called before iterating the solution. */
   virtual void Initialize() ITK_OVERRIDE;
 
+  /** Allocate the update buffer, using the workspace if set. */
+  virtual void AllocateUpdateBuffer() ITK_OVERRIDE;
+
   /** Initialize the state of filter and equation before each iteration.
    * Progress feedback is implemented as part of this method. */
   virtual void InitializeIteration() ITK_OVERRIDE;
 
+  /** Compute the update buffer. */
+  virtual TimeStepType CalculateChange() ITK_OVERRIDE;
+
   /** Apply update. */
   virtual void ApplyUpdate( const TimeStepType& dt ) ITK_OVERRIDE;
 
+  /** Finish the record of the last iteration. */
+  virtual void PostProcessOutput() ITK_OVERRIDE;
+
+  /** Start and stop timing a phase of the current iteration, if an
+   *  instrumentation is set. */
+  void StartPhase( PhaseType phase )
+    {
+    if( m_Instrumentation )
+      {
+      m_Instrumentation->StartPhase( phase );
+      }
+    }
+  void StopPhase( PhaseType phase )
+    {
+    if( m_Instrumentation )
+      {
+      m_Instrumentation->StopPhase( phase );
+      }
+    }
+
   /** Override VerifyInputInformation() since this filter's inputs do
    * not need to occupy the same physical space.
    *
@@ -300,9 +635,67 @@ private:
   /** Regularizer for the smoothing of the displacement field. */
   RegularizerPointer m_Regularizer;
 
+  /** Workspace for the internal buffers. */
+  WorkspacePointer   m_Workspace;
+
+  /** Instrumentation for timing the iterations. */
+  InstrumentationPointer m_Instrumentation;
+
   /** Flag to indicate user stop registration request. */
   bool               m_StopRegistrationFlag;
 
+  /** Flags and stride for the metric computation. */
+  bool               m_ComputeMetric;
+  bool               m_MetricUpdated;
+  SizeValueType      m_MetricSamplingStride;
+
+  /** Parameters of the force sampling. */
+  double             m_ForceSamplingFraction;
+  double             m_CurrentForceSamplingFraction;
+  uint32_t           m_ForceSamplingSeed;
+
+  /** Mask blocks of the current update. */
+  bool               m_UseMaskBlocks;
+  SizeValueType      m_MaskBlockSize;
+  std::vector< DisplacementFieldRegionType > m_ActiveMaskBlocks;
+  std::vector< DisplacementFieldRegionType > m_InactiveMaskBlocks;
+
+  /** Active set of the blocks. Live and frozen blocks are given as indices
+   *  into m_ActiveMaskBlocks. */
+  bool               m_FreezeConvergedBlocks;
+  double             m_FreezeThreshold;
+  unsigned int       m_FreezeIterations;
+  std::vector< SizeValueType > m_LiveBlocks;
+  std::vector< SizeValueType > m_FrozenBlocks;
+  std::vector< double >        m_BlockUpdateNorms;     // Max. squared update norm.
+  std::vector< unsigned int >  m_BlockQuietIterations; // Iterations below threshold.
+  std::vector< SizeValueType > m_BlockGridPositions;   // Linear index in the block grid.
+  std::vector< OffsetValueType > m_BlockGridToActive;  // Active block or -1.
+  SizeValueType      m_BlockGridSize[ImageDimension];
+
+  /** Parameters and state of the update scheme. m_PreviousField is the
+   *  regularized output of the last iteration before extrapolation. */
+  UpdateScheme       m_UpdateScheme;
+  double             m_MaximumMomentum;
+  bool               m_MomentumRestart;
+  double             m_Momentum;
+  double             m_MomentumT;
+  double             m_LastMomentumMetric;
+  SizeValueType      m_NumberOfMomentumRestarts;
+  DisplacementFieldPointer m_PreviousField;
+
+  /** Output of the last iteration accepted by the adaptive time step, and
+   *  the field the update of the current step is added to, if not the
+   *  output. */
+  DisplacementFieldPointer m_LastAcceptedField;
+  DisplacementFieldType *  m_UpdateSource;
+  SizeValueType      m_NumberOfBacktrackingSteps;
+
+  /** Statistics of the active blocks. */
+  double             m_ActiveBlockFraction;
+  double             m_SumOfActiveBlockFractions;
+  SizeValueType      m_NumberOfActiveBlockFractions;
+
   /** Modes to control smoothing of the update and deformation fields */
   bool               m_SmoothDisplacementField;
   bool               m_SmoothUpdateField;
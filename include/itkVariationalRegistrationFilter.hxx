@@ -21,6 +21,8 @@
 
 #include "itkImageRegionConstIterator.h"
 #include "itkImageRegionIterator.h"
+#include <algorithm>
+#include <cmath>
 
 namespace itk
 {
@@ -40,6 +42,33 @@ VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
   this->SetNumberOfIterations( 10 );
 
   m_StopRegistrationFlag = false;
+  m_ComputeMetric = true;
+  m_MetricUpdated = false;
+  m_MetricSamplingStride = 1;
+  m_ForceSamplingFraction = 1.0;
+  m_CurrentForceSamplingFraction = 1.0;
+  m_ForceSamplingSeed = 0;
+  m_UseMaskBlocks = false;
+  m_MaskBlockSize = 16;
+  m_FreezeConvergedBlocks = false;
+  m_UpdateScheme = UPDATE_SCHEME_GRADIENT_DESCENT;
+  m_MaximumMomentum = 0.95;
+  m_MomentumRestart = true;
+  m_Momentum = 0.0;
+  m_MomentumT = 1.0;
+  m_LastMomentumMetric = NumericTraits< double >::max();
+  m_NumberOfMomentumRestarts = 0;
+  m_NumberOfBacktrackingSteps = 0;
+  m_UpdateSource = NULL;
+  m_FreezeThreshold = 0.01;
+  m_FreezeIterations = 5;
+  m_ActiveBlockFraction = 1.0;
+  m_SumOfActiveBlockFractions = 0.0;
+  m_NumberOfActiveBlockFractions = 0;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    m_BlockGridSize[d] = 0;
+    }
   m_SmoothDisplacementField = true;
   m_SmoothUpdateField = false;
 
@@ -228,30 +257,156 @@ VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
 ::CopyInputToOutput()
 {
   typename Superclass::InputImageType::ConstPointer inputPtr = this->GetInput();
+  typename OutputImageType::Pointer output = this->GetOutput();
 
-  if( inputPtr )
+  // Nothing to copy if the filter runs in place.
+  if( inputPtr && inputPtr->GetPixelContainer() == output->GetPixelContainer() )
     {
-    this->Superclass::CopyInputToOutput();
+    return;
     }
-  else
+
+  this->CopyOrZeroFillField( inputPtr, output );
+}
+
+/*
+ * Copy or zero fill a field using multiple threads.
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+void
+VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::CopyOrZeroFillField( const DisplacementFieldType * source,
+    DisplacementFieldType * target )
+{
+  CopyOrZeroFillThreadStruct str;
+  str.Filter = this;
+  str.source = source;
+  str.target = target;
+
+  this->GetMultiThreader()->SetNumberOfThreads( this->GetNumberOfThreads() );
+  this->GetMultiThreader()->SetSingleMethod( this->CopyOrZeroFillCallback, &str );
+  this->GetMultiThreader()->SingleMethodExecute();
+}
+
+/*
+ * Callback function for threaded copying or zero filling of a field.
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+ITK_THREAD_RETURN_TYPE
+VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::CopyOrZeroFillCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct* threadStruct =
+      (MultiThreader::ThreadInfoStruct *) arg;
+  ThreadIdType threadId = threadStruct->ThreadID;
+  ThreadIdType threadCount = threadStruct->NumberOfThreads;
+
+  CopyOrZeroFillThreadStruct* str =
+      (CopyOrZeroFillThreadStruct*) threadStruct->UserData;
+
+  // Calculate region for current thread
+  typename DisplacementFieldType::RegionType splitRegion;
+  ThreadIdType total = str->Filter->SplitRequestedRegion(
+      threadId, threadCount, splitRegion );
+
+  if( threadId >= total )
     {
-    typename Superclass::PixelType zeros;
-    for( unsigned int j = 0; j < ImageDimension; j++ )
+    return ITK_THREAD_RETURN_VALUE;
+    }
+
+  typedef typename DisplacementFieldType::PixelType PixelType;
+  PixelType zeros;
+  for( unsigned int j = 0; j < ImageDimension; j++ )
+    {
+    zeros[j] = 0;
+    }
+
+  DisplacementFieldType * target = str->target;
+  const typename DisplacementFieldType::RegionType & bufferedRegion =
+      target->GetBufferedRegion();
+
+  // The region is contiguous in memory if it covers the whole buffer in all
+  // but the last dimension, which is the usual case for the split along the
+  // slowest dimension. Then the pixels are written as one block.
+  bool contiguous = true;
+  for( unsigned int d = 0; d + 1 < ImageDimension; d++ )
+    {
+    if( splitRegion.GetSize( d ) != bufferedRegion.GetSize( d ) )
       {
-      zeros[j] = 0;
+      contiguous = false;
       }
+    }
+  if( str->source && str->source->GetBufferedRegion() != bufferedRegion )
+    {
+    contiguous = false;
+    }
 
-    typename OutputImageType::Pointer output = this->GetOutput();
-
-    ImageRegionIterator< OutputImageType > out( output, output->GetRequestedRegion() );
+  if( contiguous )
+    {
+    const typename DisplacementFieldType::OffsetValueType offset =
+        target->ComputeOffset( splitRegion.GetIndex() );
+    const SizeValueType numberOfPixels = splitRegion.GetNumberOfPixels();
+    PixelType * targetBuffer = target->GetBufferPointer() + offset;
 
-    out.GoToBegin();
-    while( !out.IsAtEnd() )
+    if( str->source )
+      {
+      const PixelType * sourceBuffer = str->source->GetBufferPointer() + offset;
+      std::copy( sourceBuffer, sourceBuffer + numberOfPixels, targetBuffer );
+      }
+    else
+      {
+      std::fill( targetBuffer, targetBuffer + numberOfPixels, zeros );
+      }
+    }
+  else
+    {
+    ImageRegionIterator< DisplacementFieldType > out( target, splitRegion );
+    if( str->source )
+      {
+      ImageRegionConstIterator< DisplacementFieldType > in( str->source, splitRegion );
+      while( !out.IsAtEnd() )
+        {
+        out.Value() = in.Get();
+        ++out;
+        ++in;
+        }
+      }
+    else
       {
-      out.Value() = zeros;
-      ++out;
+      while( !out.IsAtEnd() )
+        {
+        out.Value() = zeros;
+        ++out;
+        }
       }
     }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/*
+ * Set the number of threads of the filter and its components.
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+void
+VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::SetNumberOfThreads( ThreadIdType numberOfThreads )
+{
+  Superclass::SetNumberOfThreads( numberOfThreads );
+
+  // Use the clamped value of the superclass.
+  const ThreadIdType threads = this->GetNumberOfThreads();
+  if( m_Regularizer )
+    {
+    m_Regularizer->SetNumberOfThreads( threads );
+    }
+
+  RegistrationFunctionType *function =
+      dynamic_cast< RegistrationFunctionType * >
+      ( this->GetDifferenceFunction().GetPointer() );
+  if( function && function->GetMovingImageWarper() )
+    {
+    function->GetMovingImageWarper()->SetNumberOfThreads( threads );
+    }
 }
 
 /**
@@ -324,6 +479,110 @@ VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
 
   // Set StopRegistrationFlag false
   m_StopRegistrationFlag = false;
+
+  // Compute the metric in the first iteration.
+  m_ComputeMetric = true;
+  m_MetricUpdated = false;
+
+  // Start with the initial force sampling fraction.
+  m_CurrentForceSamplingFraction = m_ForceSamplingFraction;
+
+  // Find the blocks containing mask foreground; all blocks are live in
+  // the first iteration.
+  m_ActiveMaskBlocks.clear();
+  m_InactiveMaskBlocks.clear();
+  m_LiveBlocks.clear();
+  m_FrozenBlocks.clear();
+  if( ( m_UseMaskBlocks && this->GetMaskImage() ) || m_FreezeConvergedBlocks )
+    {
+    this->BuildMaskBlocks();
+    }
+  for( SizeValueType b = 0; b < m_ActiveMaskBlocks.size(); b++ )
+    {
+    m_LiveBlocks.push_back( b );
+    }
+  m_BlockUpdateNorms.assign( m_ActiveMaskBlocks.size(), 0.0 );
+  m_BlockQuietIterations.assign( m_ActiveMaskBlocks.size(), 0 );
+
+  m_ActiveBlockFraction = 1.0;
+  m_SumOfActiveBlockFractions = 0.0;
+  m_NumberOfActiveBlockFractions = 0;
+
+  // The first step of the accelerated scheme is a plain step.
+  m_Momentum = 0.0;
+  m_MomentumT = 1.0;
+  m_LastMomentumMetric = NumericTraits< double >::max();
+  m_NumberOfMomentumRestarts = 0;
+  if( m_UpdateScheme == UPDATE_SCHEME_NESTEROV )
+    {
+    if( !m_PreviousField )
+      {
+      m_PreviousField = DisplacementFieldType::New();
+      }
+    if( m_Workspace )
+      {
+      m_Workspace->AttachBuffer( m_PreviousField.GetPointer(), "PreviousField" );
+      }
+    m_PreviousField->CopyInformation( this->GetOutput() );
+    m_PreviousField->SetBufferedRegion( this->GetOutput()->GetBufferedRegion() );
+    m_PreviousField->SetRequestedRegion( this->GetOutput()->GetRequestedRegion() );
+    m_PreviousField->Allocate();
+    this->CopyOrZeroFillField( this->GetOutput(), m_PreviousField );
+    }
+  else
+    {
+    m_PreviousField = NULL;
+    }
+
+  // Start the adaptive time step with the initial step and the initial
+  // output as the last accepted field.
+  RegistrationFunctionType *rfp = this->DownCastDifferenceFunctionType();
+  m_NumberOfBacktrackingSteps = 0;
+  if( rfp->GetAdaptiveTimeStep() )
+    {
+    rfp->ResetTimeStepAdaptation();
+    if( !m_LastAcceptedField )
+      {
+      m_LastAcceptedField = DisplacementFieldType::New();
+      }
+    if( m_Workspace )
+      {
+      m_Workspace->AttachBuffer( m_LastAcceptedField.GetPointer(), "LastAcceptedField" );
+      }
+    m_LastAcceptedField->CopyInformation( this->GetOutput() );
+    m_LastAcceptedField->SetBufferedRegion( this->GetOutput()->GetBufferedRegion() );
+    m_LastAcceptedField->SetRequestedRegion( this->GetOutput()->GetRequestedRegion() );
+    m_LastAcceptedField->Allocate();
+    this->CopyOrZeroFillField( this->GetOutput(), m_LastAcceptedField );
+    }
+  else
+    {
+    m_LastAcceptedField = NULL;
+    }
+
+  // Share the workspace with regularizer and registration function. If it
+  // has been removed, they allocate their buffers themselves again.
+  m_Regularizer->SetWorkspace( m_Workspace );
+  m_Regularizer->SetInstrumentation( m_Instrumentation );
+  this->DownCastDifferenceFunctionType()->SetWorkspace( m_Workspace );
+}
+
+/*
+ * Allocate the update buffer
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+void
+VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::AllocateUpdateBuffer()
+{
+  // Let the update buffer use the workspace memory; Allocate() in the
+  // superclass will then only adjust the size of the container.
+  if( m_Workspace )
+    {
+    m_Workspace->AttachBuffer( this->GetUpdateBuffer(), "UpdateBuffer" );
+    }
+
+  this->Superclass::AllocateUpdateBuffer();
 }
 
 /*
@@ -355,8 +614,643 @@ VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
     rfp->SetMaskImage( maskImage );
     }
 
-  // Call superclass method.
+  rfp->SetComputeMetric( m_ComputeMetric );
+  rfp->SetMetricSamplingStride( m_MetricSamplingStride );
+  m_MetricUpdated = m_ComputeMetric;
+
+  // Draw a new force sample in each iteration.
+  rfp->SetForceSamplingFraction( m_CurrentForceSamplingFraction );
+  rfp->SetForceSamplingSeed( m_ForceSamplingSeed * 2654435761u
+      + static_cast< uint32_t >( this->GetElapsedIterations() ) );
+
+  if( m_Instrumentation )
+    {
+    m_Instrumentation->StartIteration( this->GetNumberOfThreads(), this->GetAllocatedBytes() );
+    }
+
+  // Call superclass method, which warps the moving image.
+  this->StartPhase( InstrumentationType::WarpPhase );
   this->Superclass::InitializeIteration();
+  this->StopPhase( InstrumentationType::WarpPhase );
+}
+
+/*
+ * Compute the update buffer
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+typename VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::TimeStepType
+VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::CalculateChange()
+{
+  this->StartPhase( InstrumentationType::ForcePhase );
+  TimeStepType dt;
+  if( !m_ActiveMaskBlocks.empty() )
+    {
+    dt = this->CalculateChangeInMaskBlocks();
+    }
+  else
+    {
+    dt = this->Superclass::CalculateChange();
+    }
+  this->StopPhase( InstrumentationType::ForcePhase );
+
+  return dt;
+}
+
+/*
+ * Sort the blocks of the output region by mask foreground
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+void
+VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::BuildMaskBlocks()
+{
+  const MaskImageType * mask = m_UseMaskBlocks ? this->GetMaskImage() : NULL;
+  const MaskImagePixelType threshold =
+      this->DownCastDifferenceFunctionType()->GetMaskBackgroundThreshold();
+  const DisplacementFieldRegionType region = this->GetOutput()->GetRequestedRegion();
+
+  // Number of blocks in each dimension
+  SizeValueType numberOfBlocks[ImageDimension];
+  SizeValueType totalNumberOfBlocks = 1;
+  for( unsigned int d = 0; d < ImageDimension; d++ )
+    {
+    numberOfBlocks[d] = ( region.GetSize( d ) + m_MaskBlockSize - 1 ) / m_MaskBlockSize;
+    totalNumberOfBlocks *= numberOfBlocks[d];
+    m_BlockGridSize[d] = numberOfBlocks[d];
+    }
+  m_BlockGridPositions.clear();
+  m_BlockGridToActive.assign( totalNumberOfBlocks, -1 );
+
+  // Blocks are enumerated with the first dimension running fastest, so
+  // that consecutive blocks are close in memory.
+  for( SizeValueType b = 0; b < totalNumberOfBlocks; b++ )
+    {
+    DisplacementFieldRegionType block;
+    SizeValueType rest = b;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      const SizeValueType offset = ( rest % numberOfBlocks[d] ) * m_MaskBlockSize;
+      rest /= numberOfBlocks[d];
+      block.SetIndex( d, region.GetIndex( d ) + static_cast< IndexValueType >( offset ) );
+      block.SetSize( d, vnl_math_min( m_MaskBlockSize, region.GetSize( d ) - offset ) );
+      }
+
+    // A block is active if one of its pixels is mask foreground.
+    bool active = ( mask == NULL );
+    DisplacementFieldRegionType maskBlock = block;
+    if( mask && maskBlock.Crop( mask->GetBufferedRegion() ) )
+      {
+      ImageRegionConstIterator< MaskImageType > it( mask, maskBlock );
+      for( it.GoToBegin(); !active && !it.IsAtEnd(); ++it )
+        {
+        active = it.Get() > threshold;
+        }
+      }
+
+    if( active )
+      {
+      m_BlockGridToActive[b] = m_ActiveMaskBlocks.size();
+      m_BlockGridPositions.push_back( b );
+      m_ActiveMaskBlocks.push_back( block );
+      }
+    else
+      {
+      m_InactiveMaskBlocks.push_back( block );
+      }
+    }
+
+  itkDebugMacro( << m_ActiveMaskBlocks.size() << " of " << totalNumberOfBlocks
+      << " mask blocks are active" );
+}
+
+/*
+ * Compute the update buffer in the live blocks
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+typename VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::TimeStepType
+VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::CalculateChangeInMaskBlocks()
+{
+  const ThreadIdType numberOfThreads = this->GetNumberOfThreads();
+
+  MaskBlockThreadStruct str;
+  str.Filter = this;
+  str.TimeStep = NumericTraits< TimeStepType >::Zero;
+  str.TimeStepList.resize( numberOfThreads, NumericTraits< TimeStepType >::Zero );
+  str.ValidTimeStepList.resize( numberOfThreads, false );
+
+  this->GetMultiThreader()->SetNumberOfThreads( numberOfThreads );
+  this->GetMultiThreader()->SetSingleMethod( this->CalculateChangeInMaskBlocksCallback, &str );
+  this->GetMultiThreader()->SingleMethodExecute();
+
+  // Use the smallest time step of the threads, as the superclass does.
+  bool valid = false;
+  TimeStepType dt = NumericTraits< TimeStepType >::Zero;
+  for( ThreadIdType i = 0; i < numberOfThreads; i++ )
+    {
+    if( str.ValidTimeStepList[i] && ( !valid || str.TimeStepList[i] < dt ) )
+      {
+      dt = str.TimeStepList[i];
+      valid = true;
+      }
+    }
+
+  return dt;
+}
+
+/*
+ * Callback function for the threaded computation of the update buffer in
+ * the mask blocks. Each thread processes a contiguous range of blocks.
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+ITK_THREAD_RETURN_TYPE
+VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::CalculateChangeInMaskBlocksCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct* threadStruct =
+      (MultiThreader::ThreadInfoStruct *) arg;
+  ThreadIdType threadId = threadStruct->ThreadID;
+  ThreadIdType threadCount = threadStruct->NumberOfThreads;
+
+  MaskBlockThreadStruct* str =
+      (MaskBlockThreadStruct*) threadStruct->UserData;
+  Self * filter = str->Filter;
+
+  const SizeValueType numberOfLiveBlocks = filter->m_LiveBlocks.size();
+  const SizeValueType firstLive = numberOfLiveBlocks * threadId / threadCount;
+  const SizeValueType lastLive = numberOfLiveBlocks * ( threadId + 1 ) / threadCount;
+  for( SizeValueType i = firstLive; i < lastLive; i++ )
+    {
+    const SizeValueType b = filter->m_LiveBlocks[i];
+    const TimeStepType dt = filter->ThreadedCalculateChange(
+        filter->m_ActiveMaskBlocks[b], threadId );
+    if( !str->ValidTimeStepList[threadId] || dt < str->TimeStepList[threadId] )
+      {
+      str->TimeStepList[threadId] = dt;
+      str->ValidTimeStepList[threadId] = true;
+      }
+
+    // Record the largest update of the block for the active set.
+    if( filter->m_FreezeConvergedBlocks )
+      {
+      double & norm = filter->m_BlockUpdateNorms[b];
+      ImageRegionConstIterator< UpdateBufferType > it( filter->GetUpdateBuffer(),
+          filter->m_ActiveMaskBlocks[b] );
+      for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+        {
+        norm = vnl_math_max( norm, static_cast< double >( it.Get().GetSquaredNorm() ) );
+        }
+      }
+    }
+
+  // The smoothed update of the last iteration may be left in the inactive
+  // and frozen blocks, which are read by the regularizer.
+  if( filter->GetSmoothUpdateField() )
+    {
+    typedef typename DisplacementFieldType::PixelType PixelType;
+    PixelType zeros;
+    for( unsigned int j = 0; j < ImageDimension; j++ )
+      {
+      zeros[j] = 0;
+      }
+
+    const SizeValueType numberOfInactiveBlocks = filter->m_InactiveMaskBlocks.size();
+    const SizeValueType numberOfZeroBlocks =
+        numberOfInactiveBlocks + filter->m_FrozenBlocks.size();
+    const SizeValueType firstZero = numberOfZeroBlocks * threadId / threadCount;
+    const SizeValueType lastZero = numberOfZeroBlocks * ( threadId + 1 ) / threadCount;
+    for( SizeValueType i = firstZero; i < lastZero; i++ )
+      {
+      const DisplacementFieldRegionType & block = i < numberOfInactiveBlocks
+          ? filter->m_InactiveMaskBlocks[i]
+          : filter->m_ActiveMaskBlocks[filter->m_FrozenBlocks[i - numberOfInactiveBlocks]];
+      ImageRegionIterator< UpdateBufferType > it( filter->GetUpdateBuffer(), block );
+      for( it.GoToBegin(); !it.IsAtEnd(); ++it )
+        {
+        it.Set( zeros );
+        }
+      }
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/*
+ * Extrapolate the output with the Nesterov momentum
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+void
+VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::ApplyMomentum()
+{
+  // Restart if the metric at the extrapolated field increased.
+  if( m_MomentumRestart && m_MetricUpdated )
+    {
+    const double metric = this->GetMetric();
+    if( metric > m_LastMomentumMetric )
+      {
+      m_MomentumT = 1.0;
+      m_NumberOfMomentumRestarts++;
+      }
+    m_LastMomentumMetric = metric;
+    }
+
+  const double nextT = 0.5 * ( 1.0 + std::sqrt( 1.0 + 4.0 * m_MomentumT * m_MomentumT ) );
+  m_Momentum = vnl_math_min( ( m_MomentumT - 1.0 ) / nextT, m_MaximumMomentum );
+  m_MomentumT = nextT;
+
+  this->ExtrapolateOutput( m_PreviousField, 1.0 + m_Momentum, true );
+}
+
+/*
+ * Set the output to reference + factor * (output - reference)
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+void
+VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::ExtrapolateOutput( DisplacementFieldType * reference, double factor, bool storeOutput )
+{
+  ExtrapolateThreadStruct str;
+  str.Filter = this;
+  str.Reference = reference;
+  str.Factor = factor;
+  str.StoreOutput = storeOutput;
+
+  this->GetMultiThreader()->SetNumberOfThreads( this->GetNumberOfThreads() );
+  this->GetMultiThreader()->SetSingleMethod( this->ExtrapolateOutputCallback, &str );
+  this->GetMultiThreader()->SingleMethodExecute();
+
+  // The iterators do not modify the time stamp of the output.
+  this->GetOutput()->Modified();
+}
+
+/*
+ * Callback function for the threaded extrapolation of the output.
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+ITK_THREAD_RETURN_TYPE
+VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::ExtrapolateOutputCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct* threadStruct =
+      (MultiThreader::ThreadInfoStruct *) arg;
+  ThreadIdType threadId = threadStruct->ThreadID;
+  ThreadIdType threadCount = threadStruct->NumberOfThreads;
+
+  ExtrapolateThreadStruct* str =
+      (ExtrapolateThreadStruct*) threadStruct->UserData;
+
+  // Calculate region for current thread
+  typename DisplacementFieldType::RegionType splitRegion;
+  ThreadIdType total = str->Filter->SplitRequestedRegion(
+      threadId, threadCount, splitRegion );
+
+  if( threadId >= total )
+    {
+    return ITK_THREAD_RETURN_VALUE;
+    }
+
+  typedef typename DisplacementFieldType::PixelType PixelType;
+  typedef typename PixelType::ValueType             ValueType;
+  const ValueType factor = static_cast< ValueType >( str->Factor );
+
+  ImageRegionIterator< DisplacementFieldType > o( str->Filter->GetOutput(), splitRegion );
+  ImageRegionIterator< DisplacementFieldType > r( str->Reference, splitRegion );
+  for( o.GoToBegin(), r.GoToBegin(); !o.IsAtEnd(); ++o, ++r )
+    {
+    const PixelType current = o.Get();
+    o.Set( r.Get() + ( current - r.Get() ) * factor );
+    if( str->StoreOutput )
+      {
+      r.Set( current );
+      }
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/*
+ * Update the active set of the blocks
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+void
+VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::UpdateLiveBlocks( const TimeStepType& dt )
+{
+  // Statistics of the finished iteration.
+  SizeValueType livePixels = 0;
+  for( SizeValueType i = 0; i < m_LiveBlocks.size(); i++ )
+    {
+    livePixels += m_ActiveMaskBlocks[m_LiveBlocks[i]].GetNumberOfPixels();
+    }
+  const SizeValueType totalPixels = this->GetOutput()->GetRequestedRegion().GetNumberOfPixels();
+  m_ActiveBlockFraction = totalPixels > 0
+      ? static_cast< double >( livePixels ) / totalPixels : 0.0;
+  m_SumOfActiveBlockFractions += m_ActiveBlockFraction;
+  m_NumberOfActiveBlockFractions++;
+
+  if( !m_FreezeConvergedBlocks )
+    {
+    return;
+    }
+
+  // Count the iterations below the threshold for the processed blocks;
+  // frozen blocks keep their count.
+  const double threshold = vnl_math_sqr( m_FreezeThreshold );
+  const double dtSquared = vnl_math_sqr( static_cast< double >( dt ) );
+  for( SizeValueType i = 0; i < m_LiveBlocks.size(); i++ )
+    {
+    const SizeValueType b = m_LiveBlocks[i];
+    if( m_BlockUpdateNorms[b] * dtSquared < threshold )
+      {
+      m_BlockQuietIterations[b]++;
+      }
+    else
+      {
+      m_BlockQuietIterations[b] = 0;
+      }
+    m_BlockUpdateNorms[b] = 0.0;
+    }
+
+  // A block stays live if it or one of its face neighbors has not
+  // converged.
+  m_LiveBlocks.clear();
+  m_FrozenBlocks.clear();
+  for( SizeValueType b = 0; b < m_ActiveMaskBlocks.size(); b++ )
+    {
+    bool live = m_BlockQuietIterations[b] < m_FreezeIterations;
+
+    const SizeValueType position = m_BlockGridPositions[b];
+    SizeValueType stride = 1;
+    for( unsigned int d = 0; d < ImageDimension && !live; d++ )
+      {
+      const SizeValueType coordinate = ( position / stride ) % m_BlockGridSize[d];
+      if( coordinate > 0 )
+        {
+        const OffsetValueType neighbor = m_BlockGridToActive[position - stride];
+        live = neighbor >= 0 && m_BlockQuietIterations[neighbor] < m_FreezeIterations;
+        }
+      if( !live && coordinate + 1 < m_BlockGridSize[d] )
+        {
+        const OffsetValueType neighbor = m_BlockGridToActive[position + stride];
+        live = neighbor >= 0 && m_BlockQuietIterations[neighbor] < m_FreezeIterations;
+        }
+      stride *= m_BlockGridSize[d];
+      }
+
+    if( live )
+      {
+      m_LiveBlocks.push_back( b );
+      }
+    else
+      {
+      m_FrozenBlocks.push_back( b );
+      }
+    }
+
+  // The field has converged everywhere.
+  if( m_LiveBlocks.empty() )
+    {
+    itkDebugMacro( << "All blocks are frozen, stopping registration" );
+    this->StopRegistration();
+    }
+}
+
+/*
+ * Exchange the buffers of the output and the last accepted field
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+void
+VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::SwapOutputAndLastAcceptedField()
+{
+  typedef typename DisplacementFieldType::PixelContainerPointer PixelContainerPointer;
+  const PixelContainerPointer outputContainer = this->GetOutput()->GetPixelContainer();
+  const PixelContainerPointer acceptedContainer = m_LastAcceptedField->GetPixelContainer();
+
+  // A regularizer which does not run in place shares its output buffer
+  // with the grafted output. It has to follow the output, otherwise it
+  // overwrites the accepted field.
+  if( m_Regularizer
+      && m_Regularizer->GetOutput()->GetPixelContainer() == outputContainer.GetPointer() )
+    {
+    m_Regularizer->GetOutput()->SetPixelContainer( acceptedContainer );
+    }
+
+  this->GetOutput()->SetPixelContainer( acceptedContainer );
+  m_LastAcceptedField->SetPixelContainer( outputContainer );
+}
+
+/*
+ * Add the update buffer to the update source
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+void
+VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::ThreadedApplyUpdate( const TimeStepType& dt, const ThreadRegionType &regionToProcess,
+    ThreadIdType )
+{
+  ImageRegionConstIterator< DisplacementFieldType > s( this->GetUpdateSource(), regionToProcess );
+  ImageRegionIterator< UpdateBufferType > u( this->GetUpdateBuffer(), regionToProcess );
+  ImageRegionIterator< OutputImageType > o( this->GetOutput(), regionToProcess );
+
+  typedef typename OutputImageType::PixelType PixelType;
+
+  for( s.GoToBegin(), u.GoToBegin(), o.GoToBegin(); !o.IsAtEnd(); ++s, ++u, ++o )
+    {
+    o.Set( s.Get() + static_cast< PixelType >( u.Value() * dt ) );
+    }
+}
+
+/*
+ * Add the update buffer to the output in the live blocks
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+void
+VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::ApplyUpdateInMaskBlocks( const TimeStepType& dt )
+{
+  MaskBlockThreadStruct str;
+  str.Filter = this;
+  str.TimeStep = dt;
+
+  this->GetMultiThreader()->SetNumberOfThreads( this->GetNumberOfThreads() );
+  this->GetMultiThreader()->SetSingleMethod( this->ApplyUpdateInMaskBlocksCallback, &str );
+  this->GetMultiThreader()->SingleMethodExecute();
+
+  // The iterators do not modify the time stamp of the output.
+  this->GetOutput()->Modified();
+}
+
+/*
+ * Callback function for the threaded application of the update in the
+ * mask blocks.
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+ITK_THREAD_RETURN_TYPE
+VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::ApplyUpdateInMaskBlocksCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct* threadStruct =
+      (MultiThreader::ThreadInfoStruct *) arg;
+  ThreadIdType threadId = threadStruct->ThreadID;
+  ThreadIdType threadCount = threadStruct->NumberOfThreads;
+
+  MaskBlockThreadStruct* str =
+      (MaskBlockThreadStruct*) threadStruct->UserData;
+  Self * filter = str->Filter;
+
+  // Subclasses define the update in ThreadedApplyUpdate(), e.g. from a
+  // forward and a backward update buffer.
+  const SizeValueType numberOfLiveBlocks = filter->m_LiveBlocks.size();
+  const SizeValueType firstLive = numberOfLiveBlocks * threadId / threadCount;
+  const SizeValueType lastLive = numberOfLiveBlocks * ( threadId + 1 ) / threadCount;
+  for( SizeValueType i = firstLive; i < lastLive; i++ )
+    {
+    filter->ThreadedApplyUpdate( str->TimeStep,
+        filter->m_ActiveMaskBlocks[filter->m_LiveBlocks[i]], threadId );
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/*
+ * Finish the record of the last iteration
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+void
+VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::PostProcessOutput()
+{
+  this->Superclass::PostProcessOutput();
+
+  if( m_Instrumentation )
+    {
+    m_Instrumentation->StopIteration();
+    }
+}
+
+/*
+ * Get the number of bytes allocated for the fields
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+SizeValueType
+VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::GetAllocatedBytes()
+{
+  typedef typename DisplacementFieldType::PixelType PixelType;
+
+  // The output is not counted if it is a view of the workspace.
+  SizeValueType bytes = 0;
+  if( this->GetOutput() && this->GetOutput()->GetPixelContainer()
+      && this->GetOutput()->GetPixelContainer()->GetContainerManageMemory() )
+    {
+    bytes += this->GetOutput()->GetPixelContainer()->Capacity() * sizeof( PixelType );
+    }
+
+  // The update buffer is part of the workspace, if a workspace is set.
+  if( m_Workspace )
+    {
+    bytes += m_Workspace->GetAllocatedBytes();
+    }
+  else if( this->GetUpdateBuffer() && this->GetUpdateBuffer()->GetPixelContainer() )
+    {
+    bytes += this->GetUpdateBuffer()->GetPixelContainer()->Capacity() * sizeof( PixelType );
+    }
+
+  if( m_Regularizer )
+    {
+    bytes += m_Regularizer->GetAllocatedBytes();
+    }
+
+  if( m_PreviousField && m_PreviousField->GetPixelContainer()
+      && m_PreviousField->GetPixelContainer()->GetContainerManageMemory() )
+    {
+    bytes += m_PreviousField->GetPixelContainer()->Capacity() * sizeof( PixelType );
+    }
+
+  if( m_LastAcceptedField && m_LastAcceptedField->GetPixelContainer()
+      && m_LastAcceptedField->GetPixelContainer()->GetContainerManageMemory() )
+    {
+    bytes += m_LastAcceptedField->GetPixelContainer()->Capacity() * sizeof( PixelType );
+    }
+
+  return bytes;
+}
+
+/*
+ * Free the internal buffers
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+void
+VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::ReleaseBuffers()
+{
+  if( this->GetUpdateBuffer() )
+    {
+    this->GetUpdateBuffer()->ReleaseData();
+    }
+
+  m_PreviousField = NULL;
+  m_LastAcceptedField = NULL;
+
+  RegistrationFunctionType *rfp =
+      dynamic_cast< RegistrationFunctionType * >( this->GetDifferenceFunction().GetPointer() );
+  if( rfp && rfp->GetMovingImageWarper() )
+    {
+    rfp->GetMovingImageWarper()->GetOutput()->ReleaseData();
+    }
+
+  if( m_Regularizer )
+    {
+    m_Regularizer->ReleaseBuffers();
+    }
+}
+
+/*
+ * Estimate the number of bytes allocated for a field of the given region
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+SizeValueType
+VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::EstimateAllocatedBytes( const DisplacementFieldRegionType & region ) const
+{
+  const SizeValueType numberOfPixels = region.GetNumberOfPixels();
+  const SizeValueType fieldBytes = numberOfPixels
+      * sizeof( typename DisplacementFieldType::PixelType );
+
+  // Output, update buffer and warped moving image.
+  SizeValueType bytes = 2 * fieldBytes
+      + numberOfPixels * sizeof( typename MovingImageType::PixelType );
+
+  // Output of the last iteration for the accelerated scheme.
+  if( m_UpdateScheme == UPDATE_SCHEME_NESTEROV )
+    {
+    bytes += fieldBytes;
+    }
+
+  // Last accepted output for the adaptive time step.
+  const RegistrationFunctionType *rfp =
+      dynamic_cast< const RegistrationFunctionType * >( this->GetDifferenceFunction().GetPointer() );
+  if( rfp && rfp->GetAdaptiveTimeStep() )
+    {
+    bytes += fieldBytes;
+    }
+
+  // Regularizer buffers and output, unless the regularizer runs in place.
+  if( m_Regularizer && ( m_SmoothDisplacementField || m_SmoothUpdateField ) )
+    {
+    bytes += m_Regularizer->EstimateBufferBytes( region );
+    if( !m_Regularizer->GetInPlace() )
+      {
+      bytes += fieldBytes;
+      }
+    }
+
+  return bytes;
 }
 
 /**
@@ -365,36 +1259,136 @@ VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
 template< class TFixedImage, class TMovingImage, class TDisplacementField >
 void
 VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
-::ApplyUpdate( const TimeStepType& dt )
+::ApplyUpdate( const TimeStepType& givenDt )
 {
+  RegistrationFunctionType *rfp = this->DownCastDifferenceFunctionType();
+
+  // Let the registration function adapt its time step to the metric of the
+  // current output. A rejected output is moved back towards the last
+  // accepted one and no step is taken in this iteration.
+  TimeStepType dt = givenDt;
+  if( m_LastAcceptedField )
+    {
+    const TimeStepType oldTimeStep = rfp->GetTimeStep();
+    if( !rfp->AdaptTimeStep() )
+      {
+      this->StartPhase( InstrumentationType::UpdatePhase );
+      this->ExtrapolateOutput( m_LastAcceptedField,
+          rfp->GetTimeStepShrinkFactor(), false );
+      this->StopPhase( InstrumentationType::UpdatePhase );
+      m_NumberOfBacktrackingSteps++;
+
+      // The blocks count the rejected iteration like any other one, so
+      // that the update norms are reset and the active fraction is
+      // recorded.
+      if( !m_ActiveMaskBlocks.empty() )
+        {
+        this->UpdateLiveBlocks( dt );
+        }
+
+      // The direction of the last step is not trusted any longer, so the
+      // momentum is restarted and the next step is a plain step.
+      if( m_UpdateScheme == UPDATE_SCHEME_NESTEROV && m_PreviousField )
+        {
+        m_Momentum = 0.0;
+        m_MomentumT = 1.0;
+        m_LastMomentumMetric = NumericTraits< double >::max();
+        m_NumberOfMomentumRestarts++;
+        }
+
+      this->SetRMSChange( rfp->GetRMSChange() );
+      return;
+      }
+
+    // Keep the accepted output by exchanging its buffer with the last
+    // accepted field; the step then adds the update to the accepted field.
+    // If only the live mask blocks are updated, the output is needed
+    // outside of the blocks and is copied.
+    if( !m_ActiveMaskBlocks.empty() && !this->GetSmoothUpdateField() )
+      {
+      this->CopyOrZeroFillField( this->GetOutput(), m_LastAcceptedField );
+      }
+    else
+      {
+      this->SwapOutputAndLastAcceptedField();
+      m_UpdateSource = m_LastAcceptedField;
+      }
+
+    if( oldTimeStep != 0 )
+      {
+      dt *= rfp->GetTimeStep() / oldTimeStep;
+      }
+    }
+
+  // Sampled forces are rescaled by the inverse fraction, so that the
+  // expected step equals the dense step. As the regularizers are linear,
+  // scaling the step equals scaling the regularized update; without
+  // regularization the sampled pixels would get spikes and no rescaling
+  // is done.
+  if( rfp->GetForceSamplingFraction() < 1.0
+      && ( this->GetSmoothUpdateField() || this->GetSmoothDisplacementField() ) )
+    {
+    dt /= rfp->GetForceSamplingFraction();
+    }
+
   // If fluid-like registration is performed, smooth the update field.
   if( this->GetSmoothUpdateField() )
     {
+    this->StartPhase( InstrumentationType::RegularizationPhase );
     m_Regularizer->SetInput( this->GetUpdateBuffer() );
     m_Regularizer->GetOutput()->SetRequestedRegion(
         this->GetOutput()->GetRequestedRegion() );
     m_Regularizer->Update();
 
     this->GetUpdateBuffer()->Graft( m_Regularizer->GetOutput() );
+    this->StopPhase( InstrumentationType::RegularizationPhase );
     }
 
-  // Adds update field to output (deformation field).
-  this->Superclass::ApplyUpdate( dt );
+  // Adds update field to output (deformation field). Without smoothing of
+  // the update field, it is zero outside of the active mask blocks.
+  this->StartPhase( InstrumentationType::UpdatePhase );
+  if( !m_ActiveMaskBlocks.empty() && !this->GetSmoothUpdateField() )
+    {
+    this->ApplyUpdateInMaskBlocks( dt );
+    }
+  else
+    {
+    this->Superclass::ApplyUpdate( dt );
+    }
+  m_UpdateSource = NULL;
+  this->StopPhase( InstrumentationType::UpdatePhase );
+
+  // Determine the blocks of the next iteration.
+  if( !m_ActiveMaskBlocks.empty() )
+    {
+    this->UpdateLiveBlocks( dt );
+    }
 
   // If diffusion-like registration is performed, smooth the output
   // (= deformation field).
   if( this->GetSmoothDisplacementField() )
     {
+    this->StartPhase( InstrumentationType::RegularizationPhase );
     m_Regularizer->SetInput( this->GetOutput() );
     m_Regularizer->GetOutput()->SetRequestedRegion(
         this->GetOutput()->GetRequestedRegion() );
     m_Regularizer->Update();
 
     this->GetOutput()->Graft( m_Regularizer->GetOutput() );
+    this->StopPhase( InstrumentationType::RegularizationPhase );
+    }
+
+  // Extrapolate along the last step. The regularized output is the iterate
+  // of the scheme, so the extrapolation follows the regularization and is
+  // not smoothed itself.
+  if( m_UpdateScheme == UPDATE_SCHEME_NESTEROV && m_PreviousField )
+    {
+    this->StartPhase( InstrumentationType::UpdatePhase );
+    this->ApplyMomentum();
+    this->StopPhase( InstrumentationType::UpdatePhase );
     }
 
   // Get metric from registration function.
-  const RegistrationFunctionType *rfp = this->DownCastDifferenceFunctionType();
   this->SetRMSChange( rfp->GetRMSChange() );
 }
 
@@ -410,9 +1404,37 @@ VariationalRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
 
   os << indent << "Regularizer: ";
   os << m_Regularizer.GetPointer() << std::endl;
+  os << indent << "Workspace: ";
+  os << m_Workspace.GetPointer() << std::endl;
+  os << indent << "Instrumentation: ";
+  os << m_Instrumentation.GetPointer() << std::endl;
 
   os << indent << "StopRegistrationFlag: ";
   os << m_StopRegistrationFlag << std::endl;
+  os << indent << "ComputeMetric: ";
+  os << m_ComputeMetric << std::endl;
+  os << indent << "MetricSamplingStride: ";
+  os << m_MetricSamplingStride << std::endl;
+  os << indent << "ForceSamplingFraction: ";
+  os << m_ForceSamplingFraction << std::endl;
+  os << indent << "ForceSamplingSeed: ";
+  os << m_ForceSamplingSeed << std::endl;
+  os << indent << "UseMaskBlocks: ";
+  os << m_UseMaskBlocks << std::endl;
+  os << indent << "MaskBlockSize: ";
+  os << m_MaskBlockSize << std::endl;
+  os << indent << "UpdateScheme: ";
+  os << m_UpdateScheme << std::endl;
+  os << indent << "MaximumMomentum: ";
+  os << m_MaximumMomentum << std::endl;
+  os << indent << "MomentumRestart: ";
+  os << m_MomentumRestart << std::endl;
+  os << indent << "FreezeConvergedBlocks: ";
+  os << m_FreezeConvergedBlocks << std::endl;
+  os << indent << "FreezeThreshold: ";
+  os << m_FreezeThreshold << std::endl;
+  os << indent << "FreezeIterations: ";
+  os << m_FreezeIterations << std::endl;
 
   os << indent << "SmoothDisplacementField: ";
   os << m_SmoothDisplacementField << std::endl;
@@ -21,6 +21,7 @@
 #include "itkFiniteDifferenceFunction.h"
 //#include "itkWarpImageFilter.h"
 #include "itkContinuousBorderWarpImageFilter.h"
+#include "itkVariationalRegistrationWorkspace.h"
 
 namespace itk {
 
@@ -93,6 +94,10 @@ public:
                                                          MovingImageWarperType;
   typedef typename MovingImageWarperType::Pointer        MovingImageWarperPointer;
 
+  /** Workspace type. */
+  typedef VariationalRegistrationWorkspace< DisplacementFieldType >
+                                                         WorkspaceType;
+  typedef typename WorkspaceType::Pointer                WorkspacePointer;
 
   /** Set the Moving image.  */
   virtual void SetMovingImage( const MovingImageType * ptr )
@@ -134,14 +139,92 @@ public:
   virtual const MovingImageWarperType * GetMovingImageWarper(void) const
     { return m_MovingImageWarper; }
 
+  /** Get the moving image warper. */
+  virtual MovingImageWarperType * GetMovingImageWarper(void)
+    { return m_MovingImageWarper; }
+
+  /** Set the workspace used for the warped image. */
+  virtual void SetWorkspace( WorkspaceType * ptr )
+    { m_Workspace = ptr; }
+
+  /** Get the workspace used for the warped image. */
+  virtual WorkspaceType * GetWorkspace(void) const
+    { return m_Workspace; }
+
   /** Set the time step. This time step will be used by ComputeGlobalTimeStep(). */
   virtual void SetTimeStep(  TimeStepType timeStep )
-    { m_TimeStep = timeStep; }
+    { m_TimeStep = timeStep; m_InitialTimeStep = timeStep; }
 
-  /** Get the time step. */
+  /** Get the time step. With adaptive time step, this is the current
+   *  adapted time step. */
   virtual const TimeStepType GetTimeStep(void) const
     { return m_TimeStep; }
 
+  /** Get the time step set with SetTimeStep(). */
+  virtual const TimeStepType GetInitialTimeStep(void) const
+    { return m_InitialTimeStep; }
+
+  /** Set whether the time step is adapted to the metric, see
+   *  AdaptTimeStep(). Default is off. */
+  virtual void SetAdaptiveTimeStep( bool adaptive )
+    { m_AdaptiveTimeStep = adaptive; }
+
+  /** Get whether the time step is adapted. */
+  virtual bool GetAdaptiveTimeStep(void) const
+    { return m_AdaptiveTimeStep; }
+
+  /** Set the factors by which the time step is multiplied if the metric
+   *  decreased (default 1.2) or increased (default 0.5). */
+  virtual void SetTimeStepGrowthFactor( double factor )
+    { m_TimeStepGrowthFactor = vnl_math_max( factor, 1.0 ); }
+  virtual void SetTimeStepShrinkFactor( double factor )
+    { m_TimeStepShrinkFactor = vnl_math_min( vnl_math_max( factor, 0.0 ), 1.0 ); }
+
+  /** Get the factors by which the time step is multiplied. */
+  virtual double GetTimeStepGrowthFactor(void) const
+    { return m_TimeStepGrowthFactor; }
+  virtual double GetTimeStepShrinkFactor(void) const
+    { return m_TimeStepShrinkFactor; }
+
+  /** Set the range of the adapted time step relative to the initial time
+   *  step. Default is [0.01, 10]. */
+  virtual void SetTimeStepRange( double minimumFactor, double maximumFactor )
+    {
+    m_MinimumTimeStepFactor = vnl_math_max( minimumFactor, 0.0 );
+    m_MaximumTimeStepFactor = vnl_math_max( maximumFactor, m_MinimumTimeStepFactor );
+    }
+
+  /** Get the range of the adapted time step relative to the initial time
+   *  step. */
+  virtual double GetMinimumTimeStepFactor(void) const
+    { return m_MinimumTimeStepFactor; }
+  virtual double GetMaximumTimeStepFactor(void) const
+    { return m_MaximumTimeStepFactor; }
+
+  /** Set the maximum step length. If positive, the adapted time step is
+   *  limited so that the time step times the RMS change of the update does
+   *  not exceed it. Default is 0, i.e. no limit. */
+  virtual void SetMaximumStepLength( double length )
+    { m_MaximumStepLength = length; }
+
+  /** Get the maximum step length. */
+  virtual double GetMaximumStepLength(void) const
+    { return m_MaximumStepLength; }
+
+  /** Reset the adapted time step to the initial time step. Called at the
+   *  start of each update of the registration filter. */
+  virtual void ResetTimeStepAdaptation();
+
+  /** Adapt the time step to the metric of the current iteration. If the
+   *  metric did not increase compared to the last accepted iteration, the
+   *  current displacement field is accepted and the time step grows.
+   *  Otherwise the time step shrinks and false is returned; the
+   *  registration filter then backtracks towards the last accepted field.
+   *  Iterations in which the metric is not computed are always accepted
+   *  without changing the time step. Must be called after the update of
+   *  the iteration has been computed. */
+  virtual bool AdaptTimeStep();
+
   /** Set the MaskBackgroundThreshold. All Pixels of the mask image will be
    *  treated as background if the are <= this threshold. */
   virtual void SetMaskBackgroundThreshold(  MaskImagePixelType threshold )
@@ -152,6 +235,55 @@ public:
   virtual MaskImagePixelType GetMaskBackgroundThreshold(void) const
     { return m_MaskBackgroundThreshold; }
 
+  /** Set whether the metric and the RMS change are accumulated in the
+   *  following iterations. If off, the reduction is skipped and GetMetric()
+   *  and GetRMSChange() return the values of the last iteration in which
+   *  they were computed. Default is on. */
+  virtual void SetComputeMetric( bool computeMetric )
+    { m_ComputeMetric = computeMetric; }
+
+  /** Get whether the metric and the RMS change are accumulated. */
+  virtual bool GetComputeMetric(void) const
+    { return m_ComputeMetric; }
+
+  /** Set the metric sampling stride. The metric and the RMS change are
+   *  estimated from every stride-th pixel processed by each thread. Default
+   *  is 1, i.e. all pixels are used. */
+  virtual void SetMetricSamplingStride( SizeValueType stride )
+    { m_MetricSamplingStride = stride > 0 ? stride : 1; }
+
+  /** Get the metric sampling stride. */
+  virtual SizeValueType GetMetricSamplingStride(void) const
+    { return m_MetricSamplingStride; }
+
+  /** Set the fraction of pixels at which the force is computed. The pixels
+   *  are selected by a pseudo-random function of the pixel index and the
+   *  force sampling seed; all other pixels get a zero update. The forces
+   *  and the RMS change are not weighted; VariationalRegistrationFilter
+   *  rescales the step by the inverse fraction after the regularization.
+   *  Only supported by SSD and demons forces, the NCC functions throw an
+   *  exception for fractions below 1. Default is 1, i.e. dense forces. */
+  virtual void SetForceSamplingFraction( double fraction )
+    {
+    m_ForceSamplingFraction = vnl_math_min( vnl_math_max( fraction,
+        NumericTraits< double >::min() ), 1.0 );
+    m_ForceSamplingThreshold = static_cast< uint32_t >( vnl_math_min(
+        m_ForceSamplingFraction * 4294967296.0, 4294967295.0 ) );
+    }
+
+  /** Get the force sampling fraction. */
+  virtual double GetForceSamplingFraction(void) const
+    { return m_ForceSamplingFraction; }
+
+  /** Set the seed of the force sampling. Pixels are sampled identically
+   *  for identical seeds. */
+  virtual void SetForceSamplingSeed( uint32_t seed )
+    { m_ForceSamplingSeed = seed; }
+
+  /** Get the seed of the force sampling. */
+  virtual uint32_t GetForceSamplingSeed(void) const
+    { return m_ForceSamplingSeed; }
+
   /** Set the object's state before each iteration. */
   virtual void InitializeIteration() ITK_OVERRIDE;
 
@@ -201,8 +333,56 @@ protected:
     double          m_SumOfMetricValues;
     SizeValueType   m_NumberOfPixelsProcessed;
     double          m_SumOfSquaredChange;
+    SizeValueType   m_MetricStride;     // Zero if the metric is not computed.
+    SizeValueType   m_MetricCountdown;  // Pixels until the next sample.
     };
 
+  /** Get the stride for the global data of the threads in the current
+   *  iteration, i.e. zero if the metric is not computed. */
+  SizeValueType GetGlobalDataMetricStride() const
+    { return m_ComputeMetric ? m_MetricSamplingStride : 0; }
+
+  /** Returns true if the current pixel contributes to the metric. Called
+   *  by ComputeUpdate() of the subclasses once per pixel. */
+  template< class TGlobalData >
+  static bool SampleMetric( TGlobalData * globalData )
+    {
+    if( !globalData || globalData->m_MetricStride == 0
+        || --globalData->m_MetricCountdown != 0 )
+      {
+      return false;
+      }
+    globalData->m_MetricCountdown = globalData->m_MetricStride;
+    return true;
+    }
+
+  /** Returns true if the force is computed at the index, see
+   *  SetForceSamplingFraction(). */
+  bool IsForceSampled( const typename FixedImageType::IndexType & index ) const
+    {
+    if( m_ForceSamplingFraction >= 1.0 )
+      {
+      return true;
+      }
+    uint32_t hash = m_ForceSamplingSeed;
+    for( unsigned int d = 0; d < ImageDimension; d++ )
+      {
+      hash = MixBits( hash ^ ( static_cast< uint32_t >( index[d] ) + 0x9e3779b9u ) );
+      }
+    return hash < m_ForceSamplingThreshold;
+    }
+
+  /** Finalization step of the 32 bit MurmurHash3. */
+  static uint32_t MixBits( uint32_t h )
+    {
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+    }
+
 private:
   VariationalRegistrationFunction(const Self&); //purposely not implemented
   void operator=(const Self&); //purposely not implemented
@@ -222,12 +402,34 @@ private:
   /** A class to warp the moving image into the domain of the fixed image. */
   MovingImageWarperPointer        m_MovingImageWarper;
 
+  /** Workspace for the warped image. */
+  WorkspacePointer                m_Workspace;
+
   /** The global timestep. */
   TimeStepType                    m_TimeStep;
 
+  /** Parameters and state of the adaptive time step. */
+  TimeStepType                    m_InitialTimeStep;
+  bool                            m_AdaptiveTimeStep;
+  double                          m_TimeStepGrowthFactor;
+  double                          m_TimeStepShrinkFactor;
+  double                          m_MinimumTimeStepFactor;
+  double                          m_MaximumTimeStepFactor;
+  double                          m_MaximumStepLength;
+  double                          m_LastAcceptedMetric;
+
   /** Threshold to define the background in the mask image. */
   MaskImagePixelType              m_MaskBackgroundThreshold;
 
+  /** Flag and pixel stride for the metric computation. */
+  bool                            m_ComputeMetric;
+  SizeValueType                   m_MetricSamplingStride;
+
+  /** Fraction, threshold and seed of the force sampling. */
+  double                          m_ForceSamplingFraction;
+  uint32_t                        m_ForceSamplingThreshold;
+  uint32_t                        m_ForceSamplingSeed;
+
   /** The metric value is the mean square difference in intensity between
    * the fixed image and transforming moving image computed over the
    * the overlapping region between the two images. */
@@ -36,6 +36,14 @@ VariationalRegistrationFunction< TFixedImage, TMovingImage, TDisplacementField >
   m_MaskImage = NULL;
 
   m_TimeStep = 1.0;
+  m_InitialTimeStep = 1.0;
+  m_AdaptiveTimeStep = false;
+  m_TimeStepGrowthFactor = 1.2;
+  m_TimeStepShrinkFactor = 0.5;
+  m_MinimumTimeStepFactor = 0.01;
+  m_MaximumTimeStepFactor = 10.0;
+  m_MaximumStepLength = 0.0;
+  m_LastAcceptedMetric = NumericTraits< double >::max();
 
   m_MaskBackgroundThreshold = NumericTraits< MaskImagePixelType >::Zero;
 
@@ -45,8 +53,13 @@ VariationalRegistrationFunction< TFixedImage, TMovingImage, TDisplacementField >
   m_NumberOfPixelsProcessed = 0L;
   m_RMSChange = NumericTraits< double >::max();
   m_SumOfSquaredChange = 0.0;
+  m_ComputeMetric = true;
+  m_MetricSamplingStride = 1;
+  m_ForceSamplingSeed = 0;
+  this->SetForceSamplingFraction( 1.0 );
 
   m_MovingImageWarper = MovingImageWarperType::New();
+  m_Workspace = NULL;
 }
 
 /**
@@ -70,6 +83,58 @@ VariationalRegistrationFunction< TFixedImage, TMovingImage, TDisplacementField >
   m_SumOfSquaredChange = 0.0;
 }
 
+/**
+ * Reset the adapted time step
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+void
+VariationalRegistrationFunction< TFixedImage, TMovingImage, TDisplacementField >
+::ResetTimeStepAdaptation()
+{
+  m_TimeStep = m_InitialTimeStep;
+  m_LastAcceptedMetric = NumericTraits< double >::max();
+}
+
+/**
+ * Adapt the time step to the metric of the current iteration
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+bool
+VariationalRegistrationFunction< TFixedImage, TMovingImage, TDisplacementField >
+::AdaptTimeStep()
+{
+  if( !m_AdaptiveTimeStep || !m_ComputeMetric )
+    {
+    return true;
+    }
+
+  // Grow the step while the metric decreases, shrink it on increase.
+  const bool accepted = m_Metric <= m_LastAcceptedMetric;
+  if( accepted )
+    {
+    m_LastAcceptedMetric = m_Metric;
+    m_TimeStep *= m_TimeStepGrowthFactor;
+    }
+  else
+    {
+    m_TimeStep *= m_TimeStepShrinkFactor;
+    }
+
+  m_TimeStep = vnl_math_min( vnl_math_max( static_cast< double >( m_TimeStep ),
+      m_MinimumTimeStepFactor * m_InitialTimeStep ),
+      m_MaximumTimeStepFactor * m_InitialTimeStep );
+
+  // Limit the RMS length of the step.
+  if( m_MaximumStepLength > 0.0 && m_RMSChange > 0.0
+      && m_RMSChange < NumericTraits< double >::max() )
+    {
+    m_TimeStep = vnl_math_min( static_cast< double >( m_TimeStep ),
+        m_MaximumStepLength / m_RMSChange );
+    }
+
+  return accepted;
+}
+
 /**
  * Return the warped moving image.
  */
@@ -100,6 +165,7 @@ VariationalRegistrationFunction< TFixedImage, TMovingImage, TDisplacementField >
     m_MovingImageWarper->SetInput( this->GetMovingImage() );
     m_MovingImageWarper->SetOutputParametersFromImage( this->GetFixedImage() );
     m_MovingImageWarper->SetDisplacementField( this->GetDisplacementField() );
+    m_MovingImageWarper->SetWorkspace( m_Workspace );
     m_MovingImageWarper->UpdateLargestPossibleRegion();
     }
   catch( itk::ExceptionObject & excep )
@@ -122,6 +188,8 @@ VariationalRegistrationFunction< TFixedImage, TMovingImage, TDisplacementField >
   global->m_SumOfMetricValues = 0.0;
   global->m_NumberOfPixelsProcessed = 0L;
   global->m_SumOfSquaredChange = 0;
+  global->m_MetricStride = this->GetGlobalDataMetricStride();
+  global->m_MetricCountdown = 1;
 
   return global;
 }
@@ -136,6 +204,13 @@ VariationalRegistrationFunction< TFixedImage, TMovingImage, TDisplacementField >
 {
   GlobalDataStruct * globalData = (GlobalDataStruct *) gd;
 
+  // Nothing to reduce if the metric is not computed in this iteration.
+  if( globalData->m_MetricStride == 0 )
+    {
+    delete globalData;
+    return;
+    }
+
   m_MetricCalculationLock.Lock();
 
   m_SumOfMetricValues += globalData->m_SumOfMetricValues;
@@ -173,11 +248,25 @@ VariationalRegistrationFunction< TFixedImage, TMovingImage, TDisplacementField >
   os << m_DisplacementField.GetPointer() << std::endl;
   os << indent << "MovingImageWarper: ";
   os << m_MovingImageWarper.GetPointer() << std::endl;
+  os << indent << "Workspace: ";
+  os << m_Workspace.GetPointer() << std::endl;
 
   os << indent << "TimeStep: ";
   os << m_TimeStep << std::endl;
+  os << indent << "AdaptiveTimeStep: ";
+  os << m_AdaptiveTimeStep << std::endl;
+  os << indent << "InitialTimeStep: ";
+  os << m_InitialTimeStep << std::endl;
   os << indent << "MaskBackgroundThreshold: ";
   os << static_cast<int>(m_MaskBackgroundThreshold) << std::endl;
+  os << indent << "ComputeMetric: ";
+  os << m_ComputeMetric << std::endl;
+  os << indent << "MetricSamplingStride: ";
+  os << m_MetricSamplingStride << std::endl;
+  os << indent << "ForceSamplingFraction: ";
+  os << m_ForceSamplingFraction << std::endl;
+  os << indent << "ForceSamplingSeed: ";
+  os << m_ForceSamplingSeed << std::endl;
 
   os << indent << "Metric: ";
   os << m_Metric << std::endl;
@@ -70,6 +70,7 @@ public:
   typedef typename Superclass::PixelType                     PixelType;
 
   typedef typename Superclass::ValueType                     ValueType;
+  typedef typename Superclass::RegionType                    RegionType;
 
   /** Types for buffer image. */
   typedef Image< ValueType, ImageDimension >                 BufferImageType;
@@ -105,6 +106,10 @@ public:
    * \sa GaussianOperator. */
   itkGetConstMacro( MaximumKernelWidth, unsigned int );
 
+  /** Get an estimate of the number of bytes of the intermediate fields of
+   *  the separable smoothing for a field with the given region. */
+  virtual SizeValueType EstimateBufferBytes( const RegionType & region ) const ITK_OVERRIDE;
+
 protected:
   VariationalRegistrationGaussianRegularizer();
   ~VariationalRegistrationGaussianRegularizer() {}
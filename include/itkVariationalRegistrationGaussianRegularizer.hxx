@@ -132,6 +132,20 @@ VariationalRegistrationGaussianRegularizer< TDisplacementField >
   this->GraftOutput( smoothers[ImageDimension - 1]->GetOutput() );
 }
 
+/*
+ * Estimate the number of bytes of the intermediate fields
+ */
+template< class TDisplacementField >
+SizeValueType
+VariationalRegistrationGaussianRegularizer< TDisplacementField >
+::EstimateBufferBytes( const RegionType & region ) const
+{
+  // The smoothers release their outputs, so at most the input and the output
+  // of one intermediate smoother exist at the same time.
+  const unsigned int numberOfIntermediateFields = ImageDimension > 2 ? 2 : ImageDimension - 1;
+  return numberOfIntermediateFields * region.GetNumberOfPixels() * sizeof( PixelType );
+}
+
 /*
  * Initialize flags
  */
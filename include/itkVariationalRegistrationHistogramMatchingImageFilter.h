@@ -0,0 +1,216 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkVariationalRegistrationHistogramMatchingImageFilter_h
+#define itkVariationalRegistrationHistogramMatchingImageFilter_h
+
+#include "itkInPlaceImageFilter.h"
+#include "itkArray.h"
+#include <vector>
+
+namespace itk
+{
+
+/** \class itk::VariationalRegistrationHistogramMatchingImageFilter
+ *
+ *  \brief Multi-threaded histogram matching for scalar images, optionally in place.
+ *
+ *  This filter maps the intensities of the input (source) image such that its
+ *  histogram matches the histogram of the reference image. The method is the
+ *  same as in HistogramMatchingImageFilter: the histograms of both images
+ *  with NumberOfHistogramLevels bins are computed, NumberOfMatchPoints
+ *  quantiles are matched and intensities between the quantiles are mapped
+ *  piecewise linearly. If ThresholdAtMeanIntensity is on, only pixels above
+ *  the mean intensity are considered in the histograms.
+ *
+ *  In contrast to HistogramMatchingImageFilter, all passes work directly on
+ *  the image buffers without intermediate images: intensity statistics and
+ *  histograms are computed by each thread for a contiguous part of the
+ *  buffer and merged afterwards. For integer pixel types, the mapping is
+ *  tabulated for all intensities of the source image, and each pixel is
+ *  remapped by a table look-up. If InPlace is on, the input buffer is
+ *  reused for the output.
+ *
+ *  \sa HistogramMatchingImageFilter
+ *
+ *  \ingroup VariationalRegistration
+ *  \ingroup MultiThreaded
+ */
+template< class TImage >
+class VariationalRegistrationHistogramMatchingImageFilter
+  : public InPlaceImageFilter< TImage, TImage >
+{
+public:
+  /** Standard class typedefs */
+  typedef VariationalRegistrationHistogramMatchingImageFilter Self;
+  typedef InPlaceImageFilter< TImage, TImage >                Superclass;
+  typedef SmartPointer< Self >                                Pointer;
+  typedef SmartPointer< const Self >                          ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro(VariationalRegistrationHistogramMatchingImageFilter, InPlaceImageFilter);
+
+  /** Image types. */
+  typedef TImage                                  ImageType;
+  typedef typename ImageType::Pointer             ImagePointer;
+  typedef typename ImageType::ConstPointer        ImageConstPointer;
+  typedef typename ImageType::PixelType           PixelType;
+
+  /** Set the reference image. */
+  void SetReferenceImage( const ImageType * ptr );
+
+  /** Get the reference image. */
+  const ImageType * GetReferenceImage(void) const;
+
+  /** Set/Get the number of histogram bins. Default is 256. */
+  itkSetClampMacro( NumberOfHistogramLevels, SizeValueType, 1,
+      NumericTraits< SizeValueType >::max() );
+  itkGetConstMacro( NumberOfHistogramLevels, SizeValueType );
+
+  /** Set/Get the number of quantiles to be matched. Default is 1. */
+  itkSetMacro( NumberOfMatchPoints, SizeValueType );
+  itkGetConstMacro( NumberOfMatchPoints, SizeValueType );
+
+  /** Set/Get if only pixels above the mean intensity are considered in the
+   *  histograms. Default is on. */
+  itkSetMacro( ThresholdAtMeanIntensity, bool );
+  itkGetConstMacro( ThresholdAtMeanIntensity, bool );
+  itkBooleanMacro( ThresholdAtMeanIntensity );
+
+protected:
+  VariationalRegistrationHistogramMatchingImageFilter();
+  ~VariationalRegistrationHistogramMatchingImageFilter() {}
+
+  /** Print information about the filter. */
+  virtual void PrintSelf(std::ostream& os, Indent indent) const ITK_OVERRIDE;
+
+  /** The whole input and reference images are required. */
+  virtual void GenerateInputRequestedRegion() ITK_OVERRIDE;
+
+  /** The whole output is produced. */
+  virtual void EnlargeOutputRequestedRegion( DataObject *data ) ITK_OVERRIDE;
+
+  /** Match the histograms. */
+  virtual void GenerateData() ITK_OVERRIDE;
+
+  /** Statistics of the intensities of an image. */
+  struct StatisticsType
+    {
+    double Minimum;
+    double Maximum;
+    double Mean;
+    double Threshold;
+    };
+
+  /** Compute minimum, maximum and mean of an image buffer with the
+   *  MultiThreader of the filter. */
+  StatisticsType ComputeStatistics( const ImageType * image );
+
+  /** Compute the histogram of an image buffer between the threshold and
+   *  the maximum of the statistics with the MultiThreader of the filter. */
+  void ComputeHistogram( const ImageType * image, const StatisticsType & statistics,
+      std::vector< SizeValueType > & histogram );
+
+  /** Compute a quantile of a histogram between the threshold and the maximum
+   *  of the statistics, interpolating linearly within the bins. */
+  double ComputeQuantile( const std::vector< SizeValueType > & histogram,
+      const StatisticsType & statistics, double p ) const;
+
+  /** Map an intensity of the source image. */
+  double MapIntensity( double value ) const;
+
+  /** A struct to store parameters for multithreaded function call. */
+  struct StatisticsThreadStruct
+    {
+    Self *             Filter;
+    const PixelType *  buffer;
+    SizeValueType      numberOfPixels;
+    };
+
+  /** A struct to store parameters for multithreaded function call. */
+  struct HistogramThreadStruct
+    {
+    Self *             Filter;
+    const PixelType *  buffer;
+    SizeValueType      numberOfPixels;
+    double             lowerBound;
+    double             upperBound;
+    double             binWidth;
+    };
+
+  /** A struct to store parameters for multithreaded function call. */
+  struct MapIntensitiesThreadStruct
+    {
+    Self *             Filter;
+    const PixelType *  inputBuffer;
+    PixelType *        outputBuffer;
+    SizeValueType      numberOfPixels;
+    };
+
+  /** Callback for the threaded computation of the statistics. */
+  static ITK_THREAD_RETURN_TYPE ComputeStatisticsCallback( void *arg );
+
+  /** Callback for the threaded computation of the histogram. */
+  static ITK_THREAD_RETURN_TYPE ComputeHistogramCallback( void *arg );
+
+  /** Callback for the threaded mapping of the intensities. */
+  static ITK_THREAD_RETURN_TYPE MapIntensitiesCallback( void *arg );
+
+  /** Get the part [begin, end) of a buffer processed by a thread. */
+  static void SplitBuffer( SizeValueType numberOfPixels, ThreadIdType threadId,
+      ThreadIdType threadCount, SizeValueType & begin, SizeValueType & end );
+
+private:
+  VariationalRegistrationHistogramMatchingImageFilter(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  SizeValueType m_NumberOfHistogramLevels;
+  SizeValueType m_NumberOfMatchPoints;
+  bool          m_ThresholdAtMeanIntensity;
+
+  /** Statistics of source and reference image. */
+  StatisticsType m_SourceStatistics;
+  StatisticsType m_ReferenceStatistics;
+
+  /** Quantiles of source (row 0) and reference (row 1), including the
+   *  thresholds and maxima, and the gradients of the mapping between them. */
+  Array2D< double > m_QuantileTable;
+  Array< double >   m_Gradients;
+  double            m_LowerGradient;
+  double            m_UpperGradient;
+
+  /** Partial results of the threads. */
+  std::vector< double >                       m_ThreadMinimum;
+  std::vector< double >                       m_ThreadMaximum;
+  std::vector< double >                       m_ThreadSum;
+  std::vector< std::vector< SizeValueType > > m_ThreadHistograms;
+
+  /** Mapped intensities of the source intensities from the minimum on. Empty
+   *  if no table is used. */
+  std::vector< PixelType > m_LookupTable;
+};
+
+}
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkVariationalRegistrationHistogramMatchingImageFilter.hxx"
+#endif
+
+#endif
@@ -0,0 +1,528 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkVariationalRegistrationHistogramMatchingImageFilter_hxx
+#define itkVariationalRegistrationHistogramMatchingImageFilter_hxx
+#include "itkVariationalRegistrationHistogramMatchingImageFilter.h"
+
+#include <cmath>
+
+namespace itk
+{
+
+/**
+ * Default constructor
+ */
+template< class TImage >
+VariationalRegistrationHistogramMatchingImageFilter< TImage >
+::VariationalRegistrationHistogramMatchingImageFilter()
+{
+  this->SetNumberOfRequiredInputs( 2 );
+
+  m_NumberOfHistogramLevels = 256;
+  m_NumberOfMatchPoints = 1;
+  m_ThresholdAtMeanIntensity = true;
+
+  m_LowerGradient = 0.0;
+  m_UpperGradient = 0.0;
+
+  this->InPlaceOff();
+}
+
+/*
+ * Set the reference image.
+ */
+template< class TImage >
+void
+VariationalRegistrationHistogramMatchingImageFilter< TImage >
+::SetReferenceImage( const ImageType * ptr )
+{
+  this->ProcessObject::SetNthInput( 1, const_cast< ImageType * >( ptr ) );
+}
+
+/*
+ * Get the reference image.
+ */
+template< class TImage >
+const typename VariationalRegistrationHistogramMatchingImageFilter< TImage >
+::ImageType *
+VariationalRegistrationHistogramMatchingImageFilter< TImage >
+::GetReferenceImage() const
+{
+  return dynamic_cast< const ImageType * >
+  ( this->ProcessObject::GetInput( 1 ) );
+}
+
+/*
+ * Request the largest possible regions of the inputs.
+ */
+template< class TImage >
+void
+VariationalRegistrationHistogramMatchingImageFilter< TImage >
+::GenerateInputRequestedRegion()
+{
+  // call the superclass' implementation of this method
+  Superclass::GenerateInputRequestedRegion();
+
+  for( unsigned int i = 0; i < 2; i++ )
+    {
+    ImagePointer inputPtr = const_cast< ImageType * >(
+        dynamic_cast< const ImageType * >( this->ProcessObject::GetInput( i ) ) );
+    if( inputPtr )
+      {
+      inputPtr->SetRequestedRegionToLargestPossibleRegion();
+      }
+    }
+}
+
+/*
+ * The whole output is produced.
+ */
+template< class TImage >
+void
+VariationalRegistrationHistogramMatchingImageFilter< TImage >
+::EnlargeOutputRequestedRegion( DataObject *data )
+{
+  Superclass::EnlargeOutputRequestedRegion( data );
+  data->SetRequestedRegionToLargestPossibleRegion();
+}
+
+/*
+ * Match the histograms.
+ */
+template< class TImage >
+void
+VariationalRegistrationHistogramMatchingImageFilter< TImage >
+::GenerateData()
+{
+  ImageConstPointer sourceImage = this->GetInput();
+  ImageConstPointer referenceImage = this->GetReferenceImage();
+
+  const ThreadIdType numberOfThreads = this->GetNumberOfThreads();
+  m_ThreadMinimum.resize( numberOfThreads );
+  m_ThreadMaximum.resize( numberOfThreads );
+  m_ThreadSum.resize( numberOfThreads );
+  m_ThreadHistograms.resize( numberOfThreads );
+
+  // Statistics and histograms of the inputs are computed before the output
+  // is allocated, as the output may reuse the source buffer.
+  m_SourceStatistics = this->ComputeStatistics( sourceImage );
+  m_ReferenceStatistics = this->ComputeStatistics( referenceImage );
+
+  std::vector< SizeValueType > sourceHistogram;
+  std::vector< SizeValueType > referenceHistogram;
+  this->ComputeHistogram( sourceImage, m_SourceStatistics, sourceHistogram );
+  this->ComputeHistogram( referenceImage, m_ReferenceStatistics, referenceHistogram );
+
+  // Fill the quantile table.
+  const SizeValueType numberOfPoints = m_NumberOfMatchPoints + 2;
+  m_QuantileTable.set_size( 2, numberOfPoints );
+  m_QuantileTable.fill( 0.0 );
+
+  m_QuantileTable[0][0] = m_SourceStatistics.Threshold;
+  m_QuantileTable[1][0] = m_ReferenceStatistics.Threshold;
+  m_QuantileTable[0][numberOfPoints - 1] = m_SourceStatistics.Maximum;
+  m_QuantileTable[1][numberOfPoints - 1] = m_ReferenceStatistics.Maximum;
+
+  const double delta = 1.0 / ( static_cast< double >( m_NumberOfMatchPoints ) + 1.0 );
+  for( SizeValueType j = 1; j < numberOfPoints - 1; j++ )
+    {
+    m_QuantileTable[0][j] = this->ComputeQuantile( sourceHistogram, m_SourceStatistics, j * delta );
+    m_QuantileTable[1][j] = this->ComputeQuantile( referenceHistogram, m_ReferenceStatistics, j * delta );
+    }
+
+  // Fill the gradients of the piecewise linear mapping.
+  m_Gradients.set_size( numberOfPoints - 1 );
+  for( SizeValueType j = 0; j < numberOfPoints - 1; j++ )
+    {
+    const double denominator = m_QuantileTable[0][j + 1] - m_QuantileTable[0][j];
+    m_Gradients[j] = ( denominator != 0.0 ) ?
+        ( m_QuantileTable[1][j + 1] - m_QuantileTable[1][j] ) / denominator : 0.0;
+    }
+
+  double denominator = m_QuantileTable[0][0] - m_SourceStatistics.Minimum;
+  m_LowerGradient = ( denominator != 0.0 ) ?
+      ( m_QuantileTable[1][0] - m_ReferenceStatistics.Minimum ) / denominator : 0.0;
+
+  denominator = m_QuantileTable[0][numberOfPoints - 1] - m_SourceStatistics.Maximum;
+  m_UpperGradient = ( denominator != 0.0 ) ?
+      ( m_QuantileTable[1][numberOfPoints - 1] - m_ReferenceStatistics.Maximum ) / denominator : 0.0;
+
+  // Tabulate the mapping for integer types, if the table is not larger
+  // than the image.
+  const SizeValueType numberOfPixels = sourceImage->GetBufferedRegion().GetNumberOfPixels();
+  const double range = m_SourceStatistics.Maximum - m_SourceStatistics.Minimum;
+
+  m_LookupTable.clear();
+  if( NumericTraits< PixelType >::is_integer && range < numberOfPixels )
+    {
+    const SizeValueType tableSize = static_cast< SizeValueType >( range ) + 1;
+    m_LookupTable.resize( tableSize );
+    for( SizeValueType i = 0; i < tableSize; i++ )
+      {
+      m_LookupTable[i] = static_cast< PixelType >(
+          this->MapIntensity( m_SourceStatistics.Minimum + i ) );
+      }
+    }
+
+  // Allocate the output (reuses the input buffer if InPlace is on) and
+  // map the intensities.
+  const PixelType * inputBuffer = sourceImage->GetBufferPointer();
+
+  this->AllocateOutputs();
+  ImagePointer outputImage = this->GetOutput();
+
+  MapIntensitiesThreadStruct mapStr;
+  mapStr.Filter = this;
+  mapStr.inputBuffer = inputBuffer;
+  mapStr.outputBuffer = outputImage->GetBufferPointer();
+  mapStr.numberOfPixels = numberOfPixels;
+
+  this->GetMultiThreader()->SetNumberOfThreads( numberOfThreads );
+  this->GetMultiThreader()->SetSingleMethod( this->MapIntensitiesCallback, &mapStr );
+  this->GetMultiThreader()->SingleMethodExecute();
+
+  m_LookupTable.clear();
+}
+
+/*
+ * Compute minimum, maximum and mean of an image buffer.
+ */
+template< class TImage >
+typename VariationalRegistrationHistogramMatchingImageFilter< TImage >::StatisticsType
+VariationalRegistrationHistogramMatchingImageFilter< TImage >
+::ComputeStatistics( const ImageType * image )
+{
+  StatisticsThreadStruct statisticsStr;
+  statisticsStr.Filter = this;
+  statisticsStr.buffer = image->GetBufferPointer();
+  statisticsStr.numberOfPixels = image->GetBufferedRegion().GetNumberOfPixels();
+
+  const ThreadIdType numberOfThreads = this->GetNumberOfThreads();
+  for( ThreadIdType i = 0; i < numberOfThreads; i++ )
+    {
+    m_ThreadMinimum[i] = NumericTraits< double >::max();
+    m_ThreadMaximum[i] = NumericTraits< double >::NonpositiveMin();
+    m_ThreadSum[i] = 0.0;
+    }
+
+  this->GetMultiThreader()->SetNumberOfThreads( numberOfThreads );
+  this->GetMultiThreader()->SetSingleMethod( this->ComputeStatisticsCallback, &statisticsStr );
+  this->GetMultiThreader()->SingleMethodExecute();
+
+  // Merge the results of the threads.
+  StatisticsType statistics;
+  statistics.Minimum = m_ThreadMinimum[0];
+  statistics.Maximum = m_ThreadMaximum[0];
+  double sum = 0.0;
+  for( ThreadIdType i = 0; i < numberOfThreads; i++ )
+    {
+    statistics.Minimum = vnl_math_min( statistics.Minimum, m_ThreadMinimum[i] );
+    statistics.Maximum = vnl_math_max( statistics.Maximum, m_ThreadMaximum[i] );
+    sum += m_ThreadSum[i];
+    }
+  statistics.Mean = ( statisticsStr.numberOfPixels > 0 ) ?
+      sum / statisticsStr.numberOfPixels : 0.0;
+  statistics.Threshold = m_ThresholdAtMeanIntensity ? statistics.Mean : statistics.Minimum;
+
+  return statistics;
+}
+
+/*
+ * Compute the histogram of an image buffer.
+ */
+template< class TImage >
+void
+VariationalRegistrationHistogramMatchingImageFilter< TImage >
+::ComputeHistogram( const ImageType * image, const StatisticsType & statistics,
+    std::vector< SizeValueType > & histogram )
+{
+  HistogramThreadStruct histogramStr;
+  histogramStr.Filter = this;
+  histogramStr.buffer = image->GetBufferPointer();
+  histogramStr.numberOfPixels = image->GetBufferedRegion().GetNumberOfPixels();
+  histogramStr.lowerBound = statistics.Threshold;
+  histogramStr.upperBound = statistics.Maximum;
+  histogramStr.binWidth = ( statistics.Maximum - statistics.Threshold ) / m_NumberOfHistogramLevels;
+
+  const ThreadIdType numberOfThreads = this->GetNumberOfThreads();
+  for( ThreadIdType i = 0; i < numberOfThreads; i++ )
+    {
+    m_ThreadHistograms[i].assign( m_NumberOfHistogramLevels, 0 );
+    }
+
+  this->GetMultiThreader()->SetNumberOfThreads( numberOfThreads );
+  this->GetMultiThreader()->SetSingleMethod( this->ComputeHistogramCallback, &histogramStr );
+  this->GetMultiThreader()->SingleMethodExecute();
+
+  // Merge the histograms of the threads.
+  histogram.assign( m_NumberOfHistogramLevels, 0 );
+  for( ThreadIdType i = 0; i < numberOfThreads; i++ )
+    {
+    for( SizeValueType bin = 0; bin < m_NumberOfHistogramLevels; bin++ )
+      {
+      histogram[bin] += m_ThreadHistograms[i][bin];
+      }
+    }
+}
+
+/*
+ * Compute a quantile of a histogram.
+ */
+template< class TImage >
+double
+VariationalRegistrationHistogramMatchingImageFilter< TImage >
+::ComputeQuantile( const std::vector< SizeValueType > & histogram,
+    const StatisticsType & statistics, double p ) const
+{
+  const SizeValueType size = histogram.size();
+  const double binWidth = ( statistics.Maximum - statistics.Threshold ) / size;
+
+  double totalFrequency = 0.0;
+  for( SizeValueType bin = 0; bin < size; bin++ )
+    {
+    totalFrequency += histogram[bin];
+    }
+  if( totalFrequency == 0.0 )
+    {
+    return statistics.Threshold;
+    }
+
+  // Find the bin in which the cumulative frequency exceeds p and
+  // interpolate linearly within the bin.
+  double cumulated = 0.0;
+  for( SizeValueType bin = 0; bin < size; bin++ )
+    {
+    const double previous = cumulated / totalFrequency;
+    cumulated += histogram[bin];
+    const double current = cumulated / totalFrequency;
+    if( current >= p && histogram[bin] > 0 )
+      {
+      const double binMinimum = statistics.Threshold + bin * binWidth;
+      return binMinimum + ( p - previous ) / ( current - previous ) * binWidth;
+      }
+    }
+
+  return statistics.Maximum;
+}
+
+/*
+ * Map an intensity of the source image.
+ */
+template< class TImage >
+double
+VariationalRegistrationHistogramMatchingImageFilter< TImage >
+::MapIntensity( double value ) const
+{
+  const SizeValueType numberOfPoints = m_QuantileTable.cols();
+
+  SizeValueType j = 0;
+  while( j < numberOfPoints && value >= m_QuantileTable[0][j] )
+    {
+    j++;
+    }
+
+  if( j == 0 )
+    {
+    // Linear interpolation between minimum and first point.
+    return m_ReferenceStatistics.Minimum
+        + ( value - m_SourceStatistics.Minimum ) * m_LowerGradient;
+    }
+  else if( j == numberOfPoints )
+    {
+    // Linear interpolation between last point and maximum.
+    return m_ReferenceStatistics.Maximum
+        + ( value - m_SourceStatistics.Maximum ) * m_UpperGradient;
+    }
+
+  // Linear interpolation between point j-1 and point j.
+  return m_QuantileTable[1][j - 1]
+      + ( value - m_QuantileTable[0][j - 1] ) * m_Gradients[j - 1];
+}
+
+/*
+ * Get the part of a buffer processed by a thread.
+ */
+template< class TImage >
+void
+VariationalRegistrationHistogramMatchingImageFilter< TImage >
+::SplitBuffer( SizeValueType numberOfPixels, ThreadIdType threadId,
+    ThreadIdType threadCount, SizeValueType & begin, SizeValueType & end )
+{
+  const SizeValueType chunk = ( numberOfPixels + threadCount - 1 ) / threadCount;
+  begin = vnl_math_min( threadId * chunk, numberOfPixels );
+  end = vnl_math_min( begin + chunk, numberOfPixels );
+}
+
+/*
+ * Callback for the threaded computation of the statistics.
+ */
+template< class TImage >
+ITK_THREAD_RETURN_TYPE
+VariationalRegistrationHistogramMatchingImageFilter< TImage >
+::ComputeStatisticsCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct* threadStruct =
+      (MultiThreader::ThreadInfoStruct *) arg;
+  ThreadIdType threadId = threadStruct->ThreadID;
+  ThreadIdType threadCount = threadStruct->NumberOfThreads;
+
+  StatisticsThreadStruct* str =
+      (StatisticsThreadStruct*) threadStruct->UserData;
+
+  SizeValueType begin, end;
+  SplitBuffer( str->numberOfPixels, threadId, threadCount, begin, end );
+
+  if( begin < end )
+    {
+    PixelType minimum = str->buffer[begin];
+    PixelType maximum = str->buffer[begin];
+    double sum = 0.0;
+    for( SizeValueType i = begin; i < end; i++ )
+      {
+      const PixelType value = str->buffer[i];
+      if( value < minimum )
+        {
+        minimum = value;
+        }
+      if( value > maximum )
+        {
+        maximum = value;
+        }
+      sum += value;
+      }
+
+    str->Filter->m_ThreadMinimum[threadId] = minimum;
+    str->Filter->m_ThreadMaximum[threadId] = maximum;
+    str->Filter->m_ThreadSum[threadId] = sum;
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/*
+ * Callback for the threaded computation of the histogram.
+ */
+template< class TImage >
+ITK_THREAD_RETURN_TYPE
+VariationalRegistrationHistogramMatchingImageFilter< TImage >
+::ComputeHistogramCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct* threadStruct =
+      (MultiThreader::ThreadInfoStruct *) arg;
+  ThreadIdType threadId = threadStruct->ThreadID;
+  ThreadIdType threadCount = threadStruct->NumberOfThreads;
+
+  HistogramThreadStruct* str =
+      (HistogramThreadStruct*) threadStruct->UserData;
+
+  SizeValueType begin, end;
+  SplitBuffer( str->numberOfPixels, threadId, threadCount, begin, end );
+
+  std::vector< SizeValueType > & histogram = str->Filter->m_ThreadHistograms[threadId];
+  const SizeValueType lastBin = histogram.size() - 1;
+
+  for( SizeValueType i = begin; i < end; i++ )
+    {
+    const double value = str->buffer[i];
+    if( value < str->lowerBound || value > str->upperBound )
+      {
+      continue;
+      }
+
+    SizeValueType bin = lastBin;
+    if( str->binWidth > 0.0 )
+      {
+      bin = vnl_math_min( lastBin, static_cast< SizeValueType >(
+          ( value - str->lowerBound ) / str->binWidth ) );
+      }
+    histogram[bin]++;
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/*
+ * Callback for the threaded mapping of the intensities.
+ */
+template< class TImage >
+ITK_THREAD_RETURN_TYPE
+VariationalRegistrationHistogramMatchingImageFilter< TImage >
+::MapIntensitiesCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct* threadStruct =
+      (MultiThreader::ThreadInfoStruct *) arg;
+  ThreadIdType threadId = threadStruct->ThreadID;
+  ThreadIdType threadCount = threadStruct->NumberOfThreads;
+
+  MapIntensitiesThreadStruct* str =
+      (MapIntensitiesThreadStruct*) threadStruct->UserData;
+
+  SizeValueType begin, end;
+  SplitBuffer( str->numberOfPixels, threadId, threadCount, begin, end );
+
+  const Self * filter = str->Filter;
+  if( !filter->m_LookupTable.empty() )
+    {
+    const PixelType * table = &filter->m_LookupTable[0];
+    const double minimum = filter->m_SourceStatistics.Minimum;
+    for( SizeValueType i = begin; i < end; i++ )
+      {
+      str->outputBuffer[i] = table[static_cast< SizeValueType >( str->inputBuffer[i] - minimum )];
+      }
+    }
+  else
+    {
+    for( SizeValueType i = begin; i < end; i++ )
+      {
+      str->outputBuffer[i] = static_cast< PixelType >(
+          filter->MapIntensity( str->inputBuffer[i] ) );
+      }
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/*
+ * Print status information
+ */
+template< class TImage >
+void
+VariationalRegistrationHistogramMatchingImageFilter< TImage >
+::PrintSelf( std::ostream& os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+
+  os << indent << "NumberOfHistogramLevels: ";
+  os << m_NumberOfHistogramLevels << std::endl;
+  os << indent << "NumberOfMatchPoints: ";
+  os << m_NumberOfMatchPoints << std::endl;
+  os << indent << "ThresholdAtMeanIntensity: ";
+  os << m_ThresholdAtMeanIntensity << std::endl;
+  os << indent << "QuantileTable: ";
+  os << m_QuantileTable << std::endl;
+  os << indent << "Gradients: ";
+  os << m_Gradients << std::endl;
+  os << indent << "LowerGradient: ";
+  os << m_LowerGradient << std::endl;
+  os << indent << "UpperGradient: ";
+  os << m_UpperGradient << std::endl;
+}
+
+} // end namespace itk
+
+#endif
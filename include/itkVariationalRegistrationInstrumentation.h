@@ -0,0 +1,335 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkVariationalRegistrationInstrumentation_h
+#define itkVariationalRegistrationInstrumentation_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkRealTimeClock.h"
+#include <vector>
+
+namespace itk
+{
+
+/** \class itk::VariationalRegistrationInstrumentation
+ *
+ *  \brief Records the wall-clock time of the phases of each registration iteration.
+ *
+ *  An instrumentation object is set on a VariationalRegistrationFilter or
+ *  VariationalRegistrationMultiResolutionFilter via SetInstrumentation().
+ *  For each iteration, one record is stored containing the level, the
+ *  iteration number within the level, the time spent in each phase, the
+ *  wall-clock time of the whole iteration, the number of threads and the
+ *  number of bytes allocated for the fields and workspace of the filter.
+ *
+ *  The phases are
+ *    - WarpPhase: warping of the moving image and the other per-iteration
+ *      initialization of the registration function,
+ *    - ForcePhase: computation of the update (force) field,
+ *    - UpdatePhase: adding the update to the output field,
+ *    - RegularizationPhase: smoothing with the regularizer,
+ *    - ExponentiationPhase: computing the displacement from the velocity
+ *      field (diffeomorphic registration only).
+ *  The iteration time additionally contains the observers (e.g. stop
+ *  criterion and logger) invoked on IterationEvent.
+ *
+ *  Additionally, the FFT based regularizers store one transform record
+ *  per regularization with the field size, the (padded) transform size,
+ *  the time for creating the plans and the time of the regularization.
+ *  This allows to compare the times of different transform sizes. The
+ *  instrumentation is passed on to the regularizer by the registration
+ *  filter; transform records are also stored outside of iterations.
+ *
+ *  If no instrumentation is set, the filters only test a null pointer
+ *  per phase, i.e. the instrumentation costs nothing when disabled.
+ *
+ *  \sa VariationalRegistrationFilter
+ *  \sa VariationalRegistrationMultiResolutionFilter
+ *
+ *  \ingroup VariationalRegistration
+ */
+class VariationalRegistrationInstrumentation
+  : public Object
+{
+public:
+  /** Standard class typedefs */
+  typedef VariationalRegistrationInstrumentation  Self;
+  typedef Object                                  Superclass;
+  typedef SmartPointer< Self >                    Pointer;
+  typedef SmartPointer< const Self >              ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro(VariationalRegistrationInstrumentation, Object);
+
+  /** Phases of an iteration. */
+  typedef enum
+    {
+    WarpPhase = 0,
+    ForcePhase,
+    UpdatePhase,
+    RegularizationPhase,
+    ExponentiationPhase,
+    NumberOfPhases
+    } PhaseType;
+
+  /** Record of one iteration. Times are given in seconds. */
+  struct RecordType
+    {
+    unsigned int  Level;
+    unsigned int  Iteration;
+    double        PhaseTime[NumberOfPhases];
+    double        ElapsedTime;
+    SizeValueType AllocatedBytes;
+    ThreadIdType  NumberOfThreads;
+    };
+  typedef std::vector< RecordType >               RecordContainerType;
+
+  /** Record of one regularization with FFT or DCT. Times are given in
+   *  seconds; the plan time is zero if the plans were reused. */
+  struct TransformRecordType
+    {
+    unsigned int                 Level;
+    std::vector< SizeValueType > FieldSize;
+    std::vector< SizeValueType > TransformSize;
+    double                       PlanTime;
+    double                       TransformTime;
+    };
+  typedef std::vector< TransformRecordType >      TransformRecordContainerType;
+
+  /** Set the level of the following iterations. Resets the iteration
+   *  counter and finishes an open iteration. */
+  void SetLevel( unsigned int level )
+    {
+    this->StopIteration();
+    m_Level = level;
+    m_NumberOfLevelIterations = 0;
+    }
+
+  /** Get the level of the following iterations. */
+  itkGetConstMacro( Level, unsigned int );
+
+  /** Start a new record. An open iteration is finished before. */
+  void StartIteration( ThreadIdType numberOfThreads, SizeValueType allocatedBytes )
+    {
+    this->StopIteration();
+
+    RecordType record;
+    record.Level = m_Level;
+    record.Iteration = m_NumberOfLevelIterations++;
+    for( unsigned int i = 0; i < NumberOfPhases; i++ )
+      {
+      record.PhaseTime[i] = 0.0;
+      }
+    record.ElapsedTime = 0.0;
+    record.AllocatedBytes = allocatedBytes;
+    record.NumberOfThreads = numberOfThreads;
+    m_Records.push_back( record );
+
+    m_IterationStartTime = m_Clock->GetTimeInSeconds();
+    m_IterationOpen = true;
+    }
+
+  /** Finish the current iteration. Does nothing if no iteration is open. */
+  void StopIteration()
+    {
+    if( m_IterationOpen )
+      {
+      m_Records.back().ElapsedTime = m_Clock->GetTimeInSeconds() - m_IterationStartTime;
+      m_IterationOpen = false;
+      }
+    }
+
+  /** Start timing a phase of the current iteration. */
+  void StartPhase( PhaseType phase )
+    {
+    m_PhaseStartTime[phase] = m_Clock->GetTimeInSeconds();
+    }
+
+  /** Stop timing a phase and add the time to the current iteration. Phases
+   *  outside of an iteration (e.g. during initialization) are not recorded. */
+  void StopPhase( PhaseType phase )
+    {
+    if( m_IterationOpen )
+      {
+      m_Records.back().PhaseTime[phase] +=
+          m_Clock->GetTimeInSeconds() - m_PhaseStartTime[phase];
+      }
+    }
+
+  /** Add a transform record for the current level. */
+  template< class TSize >
+  void AddTransformRecord( const TSize & fieldSize, const TSize & transformSize,
+    double planTime, double transformTime )
+    {
+    TransformRecordType record;
+    record.Level = m_Level;
+    for( unsigned int i = 0; i < TSize::GetSizeDimension(); i++ )
+      {
+      record.FieldSize.push_back( fieldSize[i] );
+      record.TransformSize.push_back( transformSize[i] );
+      }
+    record.PlanTime = planTime;
+    record.TransformTime = transformTime;
+    m_TransformRecords.push_back( record );
+    }
+
+  /** Remove all records and reset the level. */
+  void Reset()
+    {
+    m_Records.clear();
+    m_TransformRecords.clear();
+    m_IterationOpen = false;
+    m_Level = 0;
+    m_NumberOfLevelIterations = 0;
+    }
+
+  /** Get all records. */
+  const RecordContainerType & GetRecords() const
+    { return m_Records; }
+
+  /** Get the number of records. */
+  SizeValueType GetNumberOfRecords() const
+    { return m_Records.size(); }
+
+  /** Get a record. */
+  const RecordType & GetRecord( SizeValueType i ) const
+    { return m_Records[i]; }
+
+  /** Get all transform records. */
+  const TransformRecordContainerType & GetTransformRecords() const
+    { return m_TransformRecords; }
+
+  /** Get the number of transform records. */
+  SizeValueType GetNumberOfTransformRecords() const
+    { return m_TransformRecords.size(); }
+
+  /** Get a transform record. */
+  const TransformRecordType & GetTransformRecord( SizeValueType i ) const
+    { return m_TransformRecords[i]; }
+
+  /** Get the total time spent in a phase over all levels. */
+  double GetPhaseTime( PhaseType phase ) const
+    {
+    double time = 0.0;
+    for( SizeValueType i = 0; i < m_Records.size(); i++ )
+      {
+      time += m_Records[i].PhaseTime[phase];
+      }
+    return time;
+    }
+
+  /** Get the total time spent in a phase on a level. */
+  double GetPhaseTime( PhaseType phase, unsigned int level ) const
+    {
+    double time = 0.0;
+    for( SizeValueType i = 0; i < m_Records.size(); i++ )
+      {
+      if( m_Records[i].Level == level )
+        {
+        time += m_Records[i].PhaseTime[phase];
+        }
+      }
+    return time;
+    }
+
+  /** Get the total time of all iterations. */
+  double GetElapsedTime() const
+    {
+    double time = 0.0;
+    for( SizeValueType i = 0; i < m_Records.size(); i++ )
+      {
+      time += m_Records[i].ElapsedTime;
+      }
+    return time;
+    }
+
+  /** Get the name of a phase. */
+  static const char * GetPhaseName( PhaseType phase )
+    {
+    switch( phase )
+      {
+      case WarpPhase:
+        return "Warp";
+      case ForcePhase:
+        return "Force";
+      case UpdatePhase:
+        return "Update";
+      case RegularizationPhase:
+        return "Regularization";
+      case ExponentiationPhase:
+        return "Exponentiation";
+      default:
+        return "Unknown";
+      }
+    }
+
+protected:
+  VariationalRegistrationInstrumentation()
+    {
+    m_Clock = RealTimeClock::New();
+    m_Level = 0;
+    m_NumberOfLevelIterations = 0;
+    m_IterationOpen = false;
+    m_IterationStartTime = 0.0;
+    for( unsigned int i = 0; i < NumberOfPhases; i++ )
+      {
+      m_PhaseStartTime[i] = 0.0;
+      }
+    }
+  ~VariationalRegistrationInstrumentation() {}
+
+  /** Print information about the instrumentation. */
+  virtual void PrintSelf(std::ostream& os, Indent indent) const ITK_OVERRIDE
+    {
+    Superclass::PrintSelf( os, indent );
+
+    os << indent << "NumberOfRecords: ";
+    os << m_Records.size() << std::endl;
+    for( unsigned int i = 0; i < NumberOfPhases; i++ )
+      {
+      os << indent << GetPhaseName( static_cast< PhaseType >( i ) ) << "Time: ";
+      os << this->GetPhaseTime( static_cast< PhaseType >( i ) ) << std::endl;
+      }
+    os << indent << "ElapsedTime: ";
+    os << this->GetElapsedTime() << std::endl;
+    os << indent << "NumberOfTransformRecords: ";
+    os << m_TransformRecords.size() << std::endl;
+    }
+
+private:
+  VariationalRegistrationInstrumentation(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  RealTimeClock::Pointer       m_Clock;
+  RecordContainerType          m_Records;
+  TransformRecordContainerType m_TransformRecords;
+
+  unsigned int                 m_Level;
+  unsigned int                 m_NumberOfLevelIterations;
+
+  bool                         m_IterationOpen;
+  double                       m_IterationStartTime;
+  double                       m_PhaseStartTime[NumberOfPhases];
+};
+
+} // end namespace itk
+
+#endif
@@ -0,0 +1,192 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkVariationalRegistrationJobScheduler_h
+#define itkVariationalRegistrationJobScheduler_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkMultiThreader.h"
+#include "itkSimpleMutexLock.h"
+#include "itkConditionVariable.h"
+#include <vector>
+
+namespace itk
+{
+
+/** \class itk::VariationalRegistrationJobScheduler
+ *
+ *  \brief Runs several independent multi-resolution registrations concurrently with a global thread budget.
+ *
+ *  Each job is a VariationalRegistrationMultiResolutionFilter with fixed and
+ *  moving image set, added via AddJob(). Execute() updates all jobs, while
+ *  at most NumberOfThreads threads are in use at any time.
+ *
+ *  The number of threads of a job is derived from the number of pixels of its
+ *  fixed image: one thread per MinimumNumberOfPixelsPerThread pixels, but at
+ *  least one and at most NumberOfThreads. Thus large registrations get many
+ *  threads, while small registrations are packed with one or two threads
+ *  each instead of each of them using all cores. The jobs are started in
+ *  order of decreasing size; whenever a job finishes, the first waiting job
+ *  that fits into the free threads is started.
+ *
+ *  The thread count of a job is set with SetNumberOfThreads() of the
+ *  multi-resolution filter, which passes it on to its pyramids, field
+ *  expanders and mask caster and to the registration filter with its
+ *  regularizer, moving image warper and exponentiators. Jobs must not
+ *  share pipeline objects; input images can be shared via Graft().
+ *
+ *  After Execute(), the wall-clock time, the throughput in jobs (i.e.
+ *  registered pairs) per second and the failed jobs can be queried. A job
+ *  failing with an exception does not stop the other jobs.
+ *
+ *  \sa VariationalRegistrationMultiResolutionFilter
+ *
+ *  \ingroup VariationalRegistration
+ */
+template< class TMultiResolutionFilter >
+class VariationalRegistrationJobScheduler
+  : public Object
+{
+public:
+  /** Standard class typedefs */
+  typedef VariationalRegistrationJobScheduler  Self;
+  typedef Object                               Superclass;
+  typedef SmartPointer< Self >                 Pointer;
+  typedef SmartPointer< const Self >           ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro(VariationalRegistrationJobScheduler, Object);
+
+  /** Multi-resolution filter type of the jobs. */
+  typedef TMultiResolutionFilter                   MRFilterType;
+  typedef typename MRFilterType::Pointer           MRFilterPointer;
+
+  /** Set/Get the total number of threads used by all jobs. */
+  itkSetClampMacro( NumberOfThreads, ThreadIdType, 1, ITK_MAX_THREADS );
+  itkGetConstMacro( NumberOfThreads, ThreadIdType );
+
+  /** Set/Get the number of fixed image pixels per thread of a job. */
+  itkSetClampMacro( MinimumNumberOfPixelsPerThread, SizeValueType,
+      1, NumericTraits< SizeValueType >::max() );
+  itkGetConstMacro( MinimumNumberOfPixelsPerThread, SizeValueType );
+
+  /** Add a job. Returns the job id, i.e. the index of the job. */
+  unsigned int AddJob( MRFilterType * filter );
+
+  /** Get the number of jobs. */
+  unsigned int GetNumberOfJobs() const
+    { return static_cast< unsigned int >( m_Jobs.size() ); }
+
+  /** Get the filter of a job. */
+  MRFilterType * GetJob( unsigned int id ) const
+    { return m_Jobs[id].Filter; }
+
+  /** Get the number of threads assigned to a job. Valid after Execute(). */
+  ThreadIdType GetJobNumberOfThreads( unsigned int id ) const
+    { return m_Jobs[id].NumberOfThreads; }
+
+  /** Returns true, if the update of a job threw an exception. */
+  bool GetJobFailed( unsigned int id ) const
+    { return m_Jobs[id].Failed; }
+
+  /** Get the exception message of a failed job. */
+  const std::string & GetJobErrorMessage( unsigned int id ) const
+    { return m_Jobs[id].ErrorMessage; }
+
+  /** Get the wall-clock time of a job in seconds. */
+  double GetJobElapsedTime( unsigned int id ) const
+    { return m_Jobs[id].ElapsedTime; }
+
+  /** Remove all jobs. */
+  void RemoveAllJobs();
+
+  /** Update all jobs. */
+  void Execute();
+
+  /** Get the number of failed jobs of the last Execute(). */
+  itkGetConstMacro( NumberOfFailedJobs, unsigned int );
+
+  /** Get the wall-clock time of the last Execute() in seconds. */
+  itkGetConstMacro( ElapsedTime, double );
+
+  /** Get the throughput of the last Execute() in jobs per second. */
+  double GetThroughput() const;
+
+protected:
+  VariationalRegistrationJobScheduler();
+  ~VariationalRegistrationJobScheduler() {}
+
+  /** Compute the number of threads of a job. */
+  virtual ThreadIdType ComputeJobNumberOfThreads( const MRFilterType * filter ) const;
+
+  /** Set the number of threads of all filters of a job. */
+  virtual void SetJobNumberOfThreads( MRFilterType * filter, ThreadIdType numberOfThreads );
+
+  /** Start jobs until all are done. Each call runs on one worker thread. */
+  static ITK_THREAD_RETURN_TYPE ExecuteCallback( void *arg );
+
+  /** Print information about the scheduler. */
+  virtual void PrintSelf(std::ostream& os, Indent indent) const ITK_OVERRIDE;
+
+private:
+  VariationalRegistrationJobScheduler(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  /** Data of a job. */
+  struct JobType
+    {
+    MRFilterPointer Filter;
+    ThreadIdType    NumberOfThreads;
+    bool            Started;
+    bool            Failed;
+    std::string     ErrorMessage;
+    double          ElapsedTime;
+    };
+
+  /** Take the first waiting job that fits into the free threads. Blocks
+   *  until a job fits or all jobs are started; returns false in the
+   *  latter case. Must be called with m_Mutex locked. */
+  bool AcquireJob( unsigned int & id );
+
+  std::vector< JobType >      m_Jobs;
+
+  /** Job ids in order of decreasing number of threads. */
+  std::vector< unsigned int > m_Order;
+
+  ThreadIdType                m_NumberOfThreads;
+  SizeValueType               m_MinimumNumberOfPixelsPerThread;
+
+  /** Scheduling state, guarded by m_Mutex. */
+  ThreadIdType                m_NumberOfFreeThreads;
+  SimpleMutexLock             m_Mutex;
+  ConditionVariable::Pointer  m_ThreadsFreed;
+
+  unsigned int                m_NumberOfFailedJobs;
+  double                      m_ElapsedTime;
+};
+
+}
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkVariationalRegistrationJobScheduler.hxx"
+#endif
+
+#endif
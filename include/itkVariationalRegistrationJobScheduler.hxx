@@ -0,0 +1,315 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkVariationalRegistrationJobScheduler_hxx
+#define itkVariationalRegistrationJobScheduler_hxx
+#include "itkVariationalRegistrationJobScheduler.h"
+
+#include "itkRealTimeClock.h"
+#include <algorithm>
+
+namespace itk
+{
+
+/**
+ * Default constructor
+ */
+template< class TMultiResolutionFilter >
+VariationalRegistrationJobScheduler< TMultiResolutionFilter >
+::VariationalRegistrationJobScheduler()
+{
+  m_NumberOfThreads = MultiThreader::GetGlobalDefaultNumberOfThreads();
+  m_MinimumNumberOfPixelsPerThread = 65536;
+  m_NumberOfFreeThreads = 0;
+  m_ThreadsFreed = ConditionVariable::New();
+  m_NumberOfFailedJobs = 0;
+  m_ElapsedTime = 0.0;
+}
+
+/*
+ * Add a job.
+ */
+template< class TMultiResolutionFilter >
+unsigned int
+VariationalRegistrationJobScheduler< TMultiResolutionFilter >
+::AddJob( MRFilterType * filter )
+{
+  if( !filter )
+    {
+    itkExceptionMacro( << "Job filter is null" );
+    }
+
+  JobType job;
+  job.Filter = filter;
+  job.NumberOfThreads = 1;
+  job.Started = false;
+  job.Failed = false;
+  job.ElapsedTime = 0.0;
+  m_Jobs.push_back( job );
+
+  this->Modified();
+  return static_cast< unsigned int >( m_Jobs.size() - 1 );
+}
+
+/*
+ * Remove all jobs.
+ */
+template< class TMultiResolutionFilter >
+void
+VariationalRegistrationJobScheduler< TMultiResolutionFilter >
+::RemoveAllJobs()
+{
+  m_Jobs.clear();
+  m_Order.clear();
+  this->Modified();
+}
+
+/*
+ * Get the throughput in jobs per second.
+ */
+template< class TMultiResolutionFilter >
+double
+VariationalRegistrationJobScheduler< TMultiResolutionFilter >
+::GetThroughput() const
+{
+  if( m_ElapsedTime <= 0.0 )
+    {
+    return 0.0;
+    }
+  return ( m_Jobs.size() - m_NumberOfFailedJobs ) / m_ElapsedTime;
+}
+
+/*
+ * Compute the number of threads of a job from the fixed image size.
+ */
+template< class TMultiResolutionFilter >
+ThreadIdType
+VariationalRegistrationJobScheduler< TMultiResolutionFilter >
+::ComputeJobNumberOfThreads( const MRFilterType * filter ) const
+{
+  if( !filter->GetFixedImage() )
+    {
+    return 1;
+    }
+
+  const SizeValueType numberOfPixels =
+      filter->GetFixedImage()->GetLargestPossibleRegion().GetNumberOfPixels();
+  const SizeValueType numberOfThreads =
+      ( numberOfPixels + m_MinimumNumberOfPixelsPerThread - 1 ) / m_MinimumNumberOfPixelsPerThread;
+
+  if( numberOfThreads < 1 )
+    {
+    return 1;
+    }
+  if( numberOfThreads > m_NumberOfThreads )
+    {
+    return m_NumberOfThreads;
+    }
+  return static_cast< ThreadIdType >( numberOfThreads );
+}
+
+/*
+ * Set the number of threads of all filters of a job.
+ */
+template< class TMultiResolutionFilter >
+void
+VariationalRegistrationJobScheduler< TMultiResolutionFilter >
+::SetJobNumberOfThreads( MRFilterType * filter, ThreadIdType numberOfThreads )
+{
+  // The multi-resolution filter passes the number on to all its internal
+  // filters, including the registration components.
+  filter->SetNumberOfThreads( numberOfThreads );
+}
+
+/*
+ * Update all jobs.
+ */
+template< class TMultiResolutionFilter >
+void
+VariationalRegistrationJobScheduler< TMultiResolutionFilter >
+::Execute()
+{
+  m_NumberOfFailedJobs = 0;
+  m_ElapsedTime = 0.0;
+
+  if( m_Jobs.empty() )
+    {
+    return;
+    }
+
+  // Assign the threads and sort the jobs by decreasing thread count.
+  std::vector< std::pair< ThreadIdType, unsigned int > > order;
+  for( unsigned int id = 0; id < m_Jobs.size(); ++id )
+    {
+    JobType & job = m_Jobs[id];
+    job.NumberOfThreads = this->ComputeJobNumberOfThreads( job.Filter );
+    job.Started = false;
+    job.Failed = false;
+    job.ErrorMessage.clear();
+    job.ElapsedTime = 0.0;
+
+    this->SetJobNumberOfThreads( job.Filter, job.NumberOfThreads );
+    order.push_back( std::make_pair( m_NumberOfThreads - job.NumberOfThreads, id ) );
+    }
+  std::stable_sort( order.begin(), order.end() );
+
+  m_Order.clear();
+  for( unsigned int i = 0; i < order.size(); ++i )
+    {
+    m_Order.push_back( order[i].second );
+    itkDebugMacro( << "Job " << order[i].second << " uses "
+        << m_Jobs[order[i].second].NumberOfThreads << " threads" );
+    }
+
+  m_NumberOfFreeThreads = m_NumberOfThreads;
+
+  // One worker per possibly concurrent job, i.e. at most one per thread.
+  const ThreadIdType numberOfWorkers = static_cast< ThreadIdType >(
+      std::min< SizeValueType >( m_NumberOfThreads, m_Jobs.size() ) );
+
+  RealTimeClock::Pointer clock = RealTimeClock::New();
+  const RealTimeClock::TimeStampType start = clock->GetTimeInSeconds();
+
+  MultiThreader::Pointer threader = MultiThreader::New();
+  threader->SetNumberOfThreads( numberOfWorkers );
+  threader->SetSingleMethod( this->ExecuteCallback, this );
+  threader->SingleMethodExecute();
+
+  m_ElapsedTime = clock->GetTimeInSeconds() - start;
+
+  for( unsigned int id = 0; id < m_Jobs.size(); ++id )
+    {
+    if( m_Jobs[id].Failed )
+      {
+      m_NumberOfFailedJobs++;
+      }
+    }
+
+  itkDebugMacro( << m_Jobs.size() << " jobs finished in " << m_ElapsedTime
+      << " s (" << this->GetThroughput() << " jobs/s)" );
+}
+
+/*
+ * Take the first waiting job that fits into the free threads.
+ */
+template< class TMultiResolutionFilter >
+bool
+VariationalRegistrationJobScheduler< TMultiResolutionFilter >
+::AcquireJob( unsigned int & id )
+{
+  while( true )
+    {
+    bool waiting = false;
+    for( unsigned int i = 0; i < m_Order.size(); ++i )
+      {
+      JobType & job = m_Jobs[m_Order[i]];
+      if( job.Started )
+        {
+        continue;
+        }
+      waiting = true;
+      if( job.NumberOfThreads <= m_NumberOfFreeThreads )
+        {
+        job.Started = true;
+        m_NumberOfFreeThreads -= job.NumberOfThreads;
+        id = m_Order[i];
+        return true;
+        }
+      }
+
+    if( !waiting )
+      {
+      return false;
+      }
+
+    // Wait until a running job returns its threads.
+    m_ThreadsFreed->Wait( &m_Mutex );
+    }
+}
+
+/*
+ * Start jobs until all are done.
+ */
+template< class TMultiResolutionFilter >
+ITK_THREAD_RETURN_TYPE
+VariationalRegistrationJobScheduler< TMultiResolutionFilter >
+::ExecuteCallback( void *arg )
+{
+  Self *scheduler =
+      (Self *) ( ( (MultiThreader::ThreadInfoStruct *) ( arg ) )->UserData );
+
+  RealTimeClock::Pointer clock = RealTimeClock::New();
+
+  while( true )
+    {
+    unsigned int id;
+    scheduler->m_Mutex.Lock();
+    const bool acquired = scheduler->AcquireJob( id );
+    scheduler->m_Mutex.Unlock();
+
+    if( !acquired )
+      {
+      break;
+      }
+
+    JobType & job = scheduler->m_Jobs[id];
+    const RealTimeClock::TimeStampType start = clock->GetTimeInSeconds();
+    try
+      {
+      job.Filter->Update();
+      }
+    catch( ExceptionObject & error )
+      {
+      job.Failed = true;
+      job.ErrorMessage = error.what();
+      }
+    job.ElapsedTime = clock->GetTimeInSeconds() - start;
+
+    scheduler->m_Mutex.Lock();
+    scheduler->m_NumberOfFreeThreads += job.NumberOfThreads;
+    scheduler->m_ThreadsFreed->Broadcast();
+    scheduler->m_Mutex.Unlock();
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/*
+ * Print status information
+ */
+template< class TMultiResolutionFilter >
+void
+VariationalRegistrationJobScheduler< TMultiResolutionFilter >
+::PrintSelf( std::ostream& os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+
+  os << indent << "NumberOfThreads: ";
+  os << m_NumberOfThreads << std::endl;
+  os << indent << "MinimumNumberOfPixelsPerThread: ";
+  os << m_MinimumNumberOfPixelsPerThread << std::endl;
+  os << indent << "NumberOfJobs: ";
+  os << m_Jobs.size() << std::endl;
+  os << indent << "NumberOfFailedJobs: ";
+  os << m_NumberOfFailedJobs << std::endl;
+  os << indent << "ElapsedTime: ";
+  os << m_ElapsedTime << std::endl;
+}
+
+} // end namespace itk
+
+#endif
@@ -79,6 +79,10 @@ protected:
 private:
   VariationalRegistrationLogger(const Self&); //purposely not implemented
   void operator=(const Self&); //purposely not implemented
+
+  /** Mean active block fraction of the current level, negative if the
+   *  registration filter does not freeze converged blocks. */
+  double m_LevelActiveBlockFraction;
 };
 
 } // end namespace itk
@@ -34,6 +34,7 @@ template< class TRegistrationFilter, class TMRFilter >
 VariationalRegistrationLogger< TRegistrationFilter, TMRFilter >
 ::VariationalRegistrationLogger()
 {
+  m_LevelActiveBlockFraction = -1.0;
 }
 
 /**
@@ -68,7 +69,12 @@ VariationalRegistrationLogger< TRegistrationFilter, TMRFilter >
     // MR policy
     if( mrFilter )
       {
-      std::cout << "Finished level " << mrFilter->GetElapsedLevels() << std::endl;
+      std::cout << "Finished level " << mrFilter->GetElapsedLevels();
+      if( m_LevelActiveBlockFraction >= 0.0 )
+        {
+        std::cout << " - Mean active fraction: " << m_LevelActiveBlockFraction;
+        }
+      std::cout << std::endl;
       }
 
     // If caller is registration filter, log metric of last iteration
@@ -78,7 +84,13 @@ VariationalRegistrationLogger< TRegistrationFilter, TMRFilter >
         {
         std::cout << "  " << regFilter->GetElapsedIterations()
             << " - Metric: " << regFilter->GetMetric()
-            << " - RMS-Change: " << regFilter->GetRMSChange() << std::endl;
+            << " - RMS-Change: " << regFilter->GetRMSChange();
+        if( regFilter->GetFreezeConvergedBlocks() )
+          {
+          std::cout << " - Active fraction: " << regFilter->GetActiveBlockFraction();
+          m_LevelActiveBlockFraction = regFilter->GetMeanActiveBlockFraction();
+          }
+        std::cout << std::endl;
         }
     }
 
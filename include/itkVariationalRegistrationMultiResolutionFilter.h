@@ -20,7 +20,9 @@
 
 #include "itkImage.h"
 #include "itkMultiResolutionPyramidImageFilter.h"
+#include "itkCastImageFilter.h"
 #include "itkVectorResampleImageFilter.h"
+#include "itkVariationalRegistrationFieldExpandImageFilter.h"
 #include "itkVariationalRegistrationFilter.h"
 #include "itkArray.h"
 
@@ -57,8 +59,10 @@ namespace itk
  *  corresponding displacement field.
  *
  *  MultiResolutionPyramidImageFilter are used to downsample the fixed
- *  and moving images. A VectorExpandImageFilter is used to upsample
- *  the deformation as we move from a coarse to fine solution.
+ *  and moving images. A VariationalRegistrationFieldExpandImageFilter is used
+ *  to upsample the deformation as we move from a coarse to fine solution, if
+ *  the spacing ratio between the levels is integer. Otherwise, the
+ *  VectorResampleImageFilter set via SetFieldExpander() is used.
  *
  *  This class is templated over the fixed image type, the moving image type,
  *  and the Deformation Field type.
@@ -67,7 +71,7 @@ namespace itk
  *  field image types all have the same number of dimensions.
  *
  *  \sa MultiResolutionPyramidImageFilter
- *  \sa VectorExpandImageFilter
+ *  \sa VariationalRegistrationFieldExpandImageFilter
  *
  *  \ingroup VariationalRegistration
  *
@@ -145,11 +149,32 @@ public:
                                                       MaskImagePyramidType;
   typedef typename MaskImagePyramidType::Pointer      MaskImagePyramidPointer;
 
+  /** The caster of the mask image to the pyramid type. */
+  typedef CastImageFilter< MaskImageType, FloatImageType >
+                                                      MaskImageCasterType;
+  typedef typename MaskImageCasterType::Pointer       MaskImageCasterPointer;
+
   /** The deformation field expander type. */
   typedef VectorResampleImageFilter< DisplacementFieldType, DisplacementFieldType >
                                                       FieldExpanderType;
   typedef typename FieldExpanderType::Pointer         FieldExpanderPointer;
 
+  /** The fused smoothing and upsampling field expander type. */
+  typedef VariationalRegistrationFieldExpandImageFilter< DisplacementFieldType >
+                                                      FusedFieldExpanderType;
+  typedef typename FusedFieldExpanderType::Pointer    FusedFieldExpanderPointer;
+  typedef typename FusedFieldExpanderType::SigmaArrayType
+                                                      SigmaArrayType;
+
+  /** Workspace type for the internal buffers of the registration. */
+  typedef typename RegistrationType::WorkspaceType    WorkspaceType;
+  typedef typename WorkspaceType::Pointer             WorkspacePointer;
+
+  /** Instrumentation type for timing the iterations. */
+  typedef typename RegistrationType::InstrumentationType
+                                                      InstrumentationType;
+  typedef typename InstrumentationType::Pointer       InstrumentationPointer;
+
   /** Array containing the number of iterations. */
   typedef Array< unsigned int >                       NumberOfIterationsType;
 
@@ -225,6 +250,13 @@ public:
   /** Set number of multi-resolution levels. */
   virtual void SetNumberOfLevels( unsigned int num );
 
+  /** Set the number of threads of the filter and of all internal filters:
+   *  the pyramids, the registration filter (which passes it on to its
+   *  regularizer, warper and exponentiators), the field expanders, the mask
+   *  caster and the first touch of the workspace. Components set later keep
+   *  their own number of threads. */
+  virtual void SetNumberOfThreads( ThreadIdType numberOfThreads ) ITK_OVERRIDE;
+
   /** Get number of multi-resolution levels. */
   itkGetConstReferenceMacro( NumberOfLevels, unsigned int );
 
@@ -247,6 +279,113 @@ public:
   /** Get the moving image pyramid. */
   itkGetObjectMacro( FieldExpander, FieldExpanderType );
 
+  /** Set/Get if the fused field expander is used for integer spacing
+   *  ratios between the levels. If off, the FieldExpander is always used,
+   *  after smoothing with a RecursiveGaussianImageFilter if required.
+   *
+   *  The fused expander smooths with a truncated discrete Gaussian instead
+   *  of the recursive filter, so the smoothed initial field and thereby the
+   *  results differ slightly from the default path. Without smoothing, i.e.
+   *  between the levels, both are equal up to rounding errors. If a
+   *  Workspace is set, the fused expander writes the fields of all but the
+   *  last level into two workspace buffers, which the registration filter
+   *  then updates in place, so that no field is allocated per level.
+   *  Default is off; the command line tool enables it with -C 1. */
+  itkSetMacro( UseFusedFieldExpander, bool );
+  itkGetConstMacro( UseFusedFieldExpander, bool );
+  itkBooleanMacro( UseFusedFieldExpander );
+
+  /** Set/Get if the levels of the fixed and mask image pyramids are kept
+   *  after they have been processed. If on, subsequent updates with the same
+   *  fixed and mask image but a different moving image reuse the pyramids
+   *  instead of recomputing them, e.g. when registering several images to
+   *  one reference. Default is off. */
+  itkSetMacro( KeepFixedImagePyramid, bool );
+  itkGetConstMacro( KeepFixedImagePyramid, bool );
+  itkBooleanMacro( KeepFixedImagePyramid );
+
+  /** Set the workspace. The workspace is sized for the finest level and
+   *  handed to the registration filter, so that the internal buffers of all
+   *  levels share the same memory. Set to NULL to let the filters allocate
+   *  their buffers on each level. */
+  itkSetObjectMacro( Workspace, WorkspaceType );
+
+  /** Get the workspace. */
+  itkGetObjectMacro( Workspace, WorkspaceType );
+
+  /** Set the instrumentation. It is handed to the registration filter and
+   *  reset at the beginning of each update, so that it records the phase
+   *  times of all iterations of all levels of the last update. Set to NULL
+   *  (default) to disable timing. */
+  itkSetObjectMacro( Instrumentation, InstrumentationType );
+
+  /** Get the instrumentation. */
+  itkGetObjectMacro( Instrumentation, InstrumentationType );
+
+  /** Enumerate for the policies applied if the estimated peak memory
+   *  exceeds the memory budget. */
+  enum MemoryBudgetPolicy {
+    MEMORY_BUDGET_POLICY_FAIL = 0,
+    MEMORY_BUDGET_POLICY_RELEASE = 1
+  };
+
+  /** Set/Get the memory budget in bytes. Before the pyramids are computed,
+   *  the peak memory of the update is estimated with EstimatePeakMemory().
+   *  If it exceeds the budget, the MemoryBudgetPolicy is applied. Zero
+   *  (default) disables the check. */
+  itkSetMacro( MemoryBudget, SizeValueType );
+  itkGetConstMacro( MemoryBudget, SizeValueType );
+
+  /** Set/Get the policy applied if the estimated peak memory exceeds the
+   *  memory budget:
+   *  - Fail: throw an exception before anything is allocated.
+   *  - Release: run this update without the workspace and free its buffers,
+   *    so that the internal buffers are sized for the current level instead
+   *    of the finest one, free the internal buffers of the registration
+   *    filter after each level (see
+   *    VariationalRegistrationFilter::ReleaseBuffers()) and ignore
+   *    KeepFixedImagePyramid. The peak memory is estimated again for these
+   *    settings, and an exception is thrown if it still exceeds the budget.
+   *  Default is fail. */
+  itkSetEnumMacro( MemoryBudgetPolicy, MemoryBudgetPolicy );
+  itkGetEnumMacro( MemoryBudgetPolicy, MemoryBudgetPolicy );
+
+  /** Throw an exception if the memory budget is exceeded. */
+  virtual void SetMemoryBudgetPolicyToFail()
+    { this->SetMemoryBudgetPolicy( MEMORY_BUDGET_POLICY_FAIL ); }
+
+  /** Release memory early if the memory budget is exceeded. */
+  virtual void SetMemoryBudgetPolicyToRelease()
+    { this->SetMemoryBudgetPolicy( MEMORY_BUDGET_POLICY_RELEASE ); }
+
+  /** Estimate the peak number of bytes held during an update from the sizes
+   *  of the inputs, the pyramid schedules and the registration filter (see
+   *  VariationalRegistrationFilter::EstimateAllocatedBytes()). The estimate
+   *  covers the inputs, the pyramid levels, the fields and buffers of the
+   *  registration on each level and the final expansion of the field; the
+   *  temporary images of the pyramid filters are approximated by two images
+   *  of the real type. The information of the inputs must be up to date,
+   *  e.g. after UpdateOutputInformation(). */
+  virtual SizeValueType EstimatePeakMemory() const;
+
+  /** Get the peak memory estimated at the beginning of the last update. */
+  itkGetConstMacro( EstimatedPeakMemory, SizeValueType );
+
+  /** Get the peak resident set size of the process measured during the
+   *  last update (see VariationalRegistrationWorkspace::GetResidentBytes()).
+   *  It is sampled after the pyramids are computed, after each level and
+   *  after the final expansion, and includes all memory of the process, not
+   *  only that of the registration. Zero if the resident set size cannot be
+   *  measured on this system. */
+  itkGetConstMacro( PeakMemory, SizeValueType );
+
+  /** Get the peak memory of the registration buffers during the last
+   *  update, i.e. the quantity estimated by EstimatePeakMemory(). It is
+   *  sampled together with PeakMemory as the sum of the buffers of the
+   *  inputs, the pyramids, the current fields and the registration filter
+   *  (see VariationalRegistrationFilter::GetAllocatedBytes()). */
+  itkGetConstMacro( PeakBufferMemory, SizeValueType );
+
   /** Stop the registration after the current iteration. */
   virtual void StopRegistration();
 
@@ -283,6 +422,50 @@ protected:
    *  terminate at the current resolution level. */
   virtual bool Halt();
 
+  /** Smooth a field with the given sigma (physical units) and resample it
+   *  to the grid of the reference image. The fused field expander is used
+   *  if enabled and possible; if useWorkspace is true and a workspace is
+   *  set, it then writes into the workspace buffer not used by the previous
+   *  call. The returned field is disconnected from the pipeline. */
+  virtual DisplacementFieldPointer ExpandField( DisplacementFieldType * field,
+      const FixedImageType * reference, const SigmaArrayType & sigma,
+      bool useWorkspace );
+
+  /** Estimate the peak memory of an update. If keepFixedImagePyramid is
+   *  off, the fixed and mask pyramid levels are assumed to be released after
+   *  they have been processed. If useWorkspace is on, the internal buffers
+   *  are sized for the finest level. If releaseBuffers is on, the internal
+   *  buffers of the registration filter are assumed to be freed after each
+   *  level; otherwise, without workspace, the buffers of the previous level
+   *  are held while those of the next level are allocated. */
+  virtual SizeValueType EstimatePeakMemory( bool keepFixedImagePyramid,
+      bool useWorkspace, bool releaseBuffers ) const;
+
+  /** Add the current memory of inputs, pyramids and registration filter
+   *  and the given number of bytes of further fields, update the peak
+   *  buffer memory and sample the resident set size. */
+  void SamplePeakMemory( SizeValueType additionalBytes );
+
+  /** Get the region of a pyramid level of an image with the given region,
+   *  i.e. the size divided by the shrink factors of the level, but at least
+   *  one. */
+  static typename DisplacementFieldType::RegionType GetLevelRegion(
+      const typename DisplacementFieldType::RegionType & region,
+      const typename FixedImagePyramidType::ScheduleType & schedule, unsigned int level );
+
+  /** Get the number of bytes allocated for the buffer of an image. Buffers
+   *  not managed by the image, i.e. views of the workspace, are not counted. */
+  template< class TImage >
+  static SizeValueType GetImageBytes( const TImage * image )
+    {
+    if( !image || !image->GetPixelContainer()
+        || !image->GetPixelContainer()->GetContainerManageMemory() )
+      {
+      return 0;
+      }
+    return image->GetPixelContainer()->Capacity() * sizeof( typename TImage::PixelType );
+    }
+
 private:
   VariationalRegistrationMultiResolutionFilter(const Self&); //purposely not implemented
   void operator=( const Self& ); //purposely not implemented
@@ -291,8 +474,12 @@ private:
   FixedImagePyramidPointer   m_FixedImagePyramid;
   MovingImagePyramidPointer  m_MovingImagePyramid;
   MaskImagePyramidPointer    m_MaskImagePyramid;
+  MaskImageCasterPointer     m_MaskImageCaster;
   FieldExpanderPointer       m_FieldExpander;
+  FusedFieldExpanderPointer  m_FusedFieldExpander;
   DisplacementFieldPointer   m_DisplacementField;
+  WorkspacePointer           m_Workspace;
+  InstrumentationPointer     m_Instrumentation;
 
   unsigned int               m_NumberOfLevels;
   unsigned int               m_ElapsedLevels;
@@ -300,6 +487,22 @@ private:
 
   /** Flag to indicate user stop registration request. */
   bool                       m_StopRegistrationFlag;
+
+  /** Flag to indicate if the fused field expander is used. */
+  bool                       m_UseFusedFieldExpander;
+
+  /** Index of the workspace buffer written by the next field expansion. */
+  unsigned int               m_ExpandedFieldBuffer;
+
+  /** Flag to indicate if the fixed image pyramid is kept between updates. */
+  bool                       m_KeepFixedImagePyramid;
+
+  /** Memory budget, policy and estimated and measured peak memory. */
+  SizeValueType              m_MemoryBudget;
+  MemoryBudgetPolicy         m_MemoryBudgetPolicy;
+  SizeValueType              m_EstimatedPeakMemory;
+  SizeValueType              m_PeakMemory;
+  SizeValueType              m_PeakBufferMemory;
 };
 
 } // end namespace itk
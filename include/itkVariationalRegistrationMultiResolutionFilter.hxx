@@ -27,6 +27,9 @@
 #include "itkImageRegionIterator.h"
 #include "vnl/vnl_math.h"
 
+#include <algorithm>
+#include <vector>
+
 namespace itk
 {
 
@@ -50,8 +53,19 @@ VariationalRegistrationMultiResolutionFilter< TFixedImage, TMovingImage, TDispla
   m_MovingImagePyramid = MovingImagePyramidType::New();
   m_FixedImagePyramid = FixedImagePyramidType::New();
   m_MaskImagePyramid = MaskImagePyramidType::New();
+  m_MaskImageCaster = MaskImageCasterType::New();
 
   m_FieldExpander = FieldExpanderType::New();
+  m_FusedFieldExpander = FusedFieldExpanderType::New();
+  m_UseFusedFieldExpander = false;
+  m_ExpandedFieldBuffer = 0;
+  m_KeepFixedImagePyramid = false;
+  m_MemoryBudget = 0;
+  m_MemoryBudgetPolicy = MEMORY_BUDGET_POLICY_FAIL;
+  m_EstimatedPeakMemory = 0;
+  m_PeakMemory = 0;
+  m_PeakBufferMemory = 0;
+  m_Workspace = WorkspaceType::New();
   m_DisplacementField = NULL;
 
   m_NumberOfLevels = 3;
@@ -195,6 +209,52 @@ VariationalRegistrationMultiResolutionFilter< TFixedImage, TMovingImage, TDispla
     }
 }
 
+/*
+ * Set the number of threads of the filter and all internal filters.
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField, class TRealType >
+void
+VariationalRegistrationMultiResolutionFilter< TFixedImage, TMovingImage, TDisplacementField, TRealType >
+::SetNumberOfThreads( ThreadIdType numberOfThreads )
+{
+  Superclass::SetNumberOfThreads( numberOfThreads );
+
+  // Use the clamped value of the superclass.
+  const ThreadIdType threads = this->GetNumberOfThreads();
+  if( m_FixedImagePyramid )
+    {
+    m_FixedImagePyramid->SetNumberOfThreads( threads );
+    }
+  if( m_MovingImagePyramid )
+    {
+    m_MovingImagePyramid->SetNumberOfThreads( threads );
+    }
+  if( m_MaskImagePyramid )
+    {
+    m_MaskImagePyramid->SetNumberOfThreads( threads );
+    }
+  if( m_RegistrationFilter )
+    {
+    m_RegistrationFilter->SetNumberOfThreads( threads );
+    }
+  if( m_FieldExpander )
+    {
+    m_FieldExpander->SetNumberOfThreads( threads );
+    }
+  if( m_FusedFieldExpander )
+    {
+    m_FusedFieldExpander->SetNumberOfThreads( threads );
+    }
+  if( m_MaskImageCaster )
+    {
+    m_MaskImageCaster->SetNumberOfThreads( threads );
+    }
+  if( m_Workspace )
+    {
+    m_Workspace->SetNumberOfThreads( threads );
+    }
+}
+
 /*
  * Standard PrintSelf method.
  */
@@ -226,6 +286,28 @@ VariationalRegistrationMultiResolutionFilter< TFixedImage, TMovingImage, TDispla
 
   os << indent << "FieldExpander: ";
   os << m_FieldExpander.GetPointer() << std::endl;
+  os << indent << "FusedFieldExpander: ";
+  os << m_FusedFieldExpander.GetPointer() << std::endl;
+  os << indent << "UseFusedFieldExpander: ";
+  os << m_UseFusedFieldExpander << std::endl;
+  os << indent << "KeepFixedImagePyramid: ";
+  os << m_KeepFixedImagePyramid << std::endl;
+
+  os << indent << "MemoryBudget: ";
+  os << m_MemoryBudget << std::endl;
+  os << indent << "MemoryBudgetPolicy: ";
+  os << m_MemoryBudgetPolicy << std::endl;
+  os << indent << "EstimatedPeakMemory: ";
+  os << m_EstimatedPeakMemory << std::endl;
+  os << indent << "PeakMemory: ";
+  os << m_PeakMemory << std::endl;
+  os << indent << "PeakBufferMemory: ";
+  os << m_PeakBufferMemory << std::endl;
+
+  os << indent << "Workspace: ";
+  os << m_Workspace.GetPointer() << std::endl;
+  os << indent << "Instrumentation: ";
+  os << m_Instrumentation.GetPointer() << std::endl;
 
   os << indent << "StopRegistrationFlag: ";
   os << m_StopRegistrationFlag << std::endl;
@@ -280,24 +362,93 @@ VariationalRegistrationMultiResolutionFilter< TFixedImage, TMovingImage, TDispla
   // they are no longer needed after generating the image pyramid.
   this->RestoreInputReleaseDataFlags();
 
+  // Estimate the peak memory and check the memory budget before anything is
+  // allocated. If memory is released early, the workspace is not used and
+  // the fixed and mask pyramids are not kept for this update.
+  bool keepFixedImagePyramid = m_KeepFixedImagePyramid;
+  bool useWorkspace = m_Workspace.IsNotNull();
+  bool releaseEarly = false;
+  m_PeakMemory = 0;
+  m_PeakBufferMemory = 0;
+  m_EstimatedPeakMemory = this->EstimatePeakMemory( keepFixedImagePyramid, useWorkspace, releaseEarly );
+  if( m_MemoryBudget > 0 && m_EstimatedPeakMemory > m_MemoryBudget )
+    {
+    if( m_MemoryBudgetPolicy == MEMORY_BUDGET_POLICY_RELEASE )
+      {
+      keepFixedImagePyramid = false;
+      useWorkspace = false;
+      releaseEarly = true;
+      m_EstimatedPeakMemory = this->EstimatePeakMemory( keepFixedImagePyramid, useWorkspace, releaseEarly );
+      }
+
+    if( m_EstimatedPeakMemory > m_MemoryBudget )
+      {
+      itkExceptionMacro( << "Estimated peak memory of " << m_EstimatedPeakMemory
+          << " bytes exceeds the memory budget of " << m_MemoryBudget << " bytes" );
+      }
+    }
+
+  // The workspace is not used if memory is released early, so its buffers
+  // kept from previous updates are freed before the pyramids are computed.
+  // Images still attached to them allocate their own memory.
+  if( releaseEarly )
+    {
+    m_RegistrationFilter->ReleaseBuffers();
+    if( m_Workspace )
+      {
+      m_Workspace->ReleaseBuffers();
+      }
+    }
+
   // Create the image pyramids.
   m_MovingImagePyramid->SetInput( movingImage );
   m_MovingImagePyramid->UpdateLargestPossibleRegion();
 
+  // The fixed pyramid is only recomputed if the fixed image has changed or
+  // its levels have been released.
   m_FixedImagePyramid->SetInput( fixedImage );
   m_FixedImagePyramid->UpdateLargestPossibleRegion();
 
   if( maskImage )
     {
-    // Cast mask image to real type and calculate pyramid.
-    typedef CastImageFilter< MaskImageType, FloatImageType > MaskImageCasterType;
-    typename MaskImageCasterType::Pointer caster = MaskImageCasterType::New();
-    caster->SetInput( maskImage );
+    // Cast mask image to real type and calculate pyramid. As the caster is
+    // kept, the pyramid is only recomputed if the mask image has changed or
+    // its levels have been released.
+    m_MaskImageCaster->SetInput( maskImage );
 
-    m_MaskImagePyramid->SetInput( caster->GetOutput() );
+    m_MaskImagePyramid->SetInput( m_MaskImageCaster->GetOutput() );
     m_MaskImagePyramid->UpdateLargestPossibleRegion();
+
+    if( !keepFixedImagePyramid )
+      {
+      m_MaskImageCaster->GetOutput()->ReleaseData();
+      }
     }
 
+  this->SamplePeakMemory( 0 );
+
+  // Size the workspace for the finest level that will be computed.
+  if( useWorkspace )
+    {
+    typename WorkspaceType::SizeValueType numberOfPixels = 0;
+    for( unsigned int level = 0; level < m_FixedImagePyramid->GetNumberOfLevels()
+        && level < m_NumberOfLevels; ++level )
+      {
+      numberOfPixels = vnl_math_max( numberOfPixels, static_cast< typename WorkspaceType::SizeValueType >(
+          m_FixedImagePyramid->GetOutput( level )->GetLargestPossibleRegion().GetNumberOfPixels() ) );
+      }
+    m_Workspace->SetNumberOfPixels( numberOfPixels );
+    m_Workspace->SetNumberOfThreads( m_RegistrationFilter->GetNumberOfThreads() );
+    }
+  m_RegistrationFilter->SetWorkspace( useWorkspace ? m_Workspace.GetPointer() : NULL );
+
+  // Share the instrumentation with the registration filter.
+  if( m_Instrumentation )
+    {
+    m_Instrumentation->Reset();
+    }
+  m_RegistrationFilter->SetInstrumentation( m_Instrumentation );
+
   // Initializations
   m_ElapsedLevels = 0;
   m_StopRegistrationFlag = false;
@@ -321,48 +472,25 @@ VariationalRegistrationMultiResolutionFilter< TFixedImage, TMovingImage, TDispla
       const_cast< DisplacementFieldType * >( this->GetInput( 0 ) );
   if( inputPtr  )
     {
-    // First smooth it.
-    tempField = inputPtr;
-
-    typedef RecursiveGaussianImageFilter< DisplacementFieldType,
-        DisplacementFieldType > GaussianFilterType;
-    typename GaussianFilterType::Pointer smoother = GaussianFilterType::New();
-
+    // Smooth and resample it.
+    SigmaArrayType sigma;
     for( unsigned int dim = 0; dim < DisplacementFieldType::ImageDimension; ++dim )
-    {
+      {
       // sigma accounts for the subsampling of the pyramid
-      double sigma = 0.5 * static_cast< float >(
+      sigma[dim] = 0.5 * static_cast< float >(
           m_FixedImagePyramid->GetSchedule()[fixedLevel][dim] );
 
       // but also for a possible discrepancy in the spacing
-      sigma *= fixedImage->GetSpacing()[dim] / inputPtr->GetSpacing()[dim];
-
-      smoother->SetInput( tempField );
-      smoother->SetSigma( sigma );
-      smoother->SetDirection( dim );
-
-      smoother->Update();
+      sigma[dim] *= fixedImage->GetSpacing()[dim] / inputPtr->GetSpacing()[dim];
+      }
 
-      tempField = smoother->GetOutput();
-      tempField->DisconnectPipeline();
+    tempField = this->ExpandField( inputPtr,
+        m_FixedImagePyramid->GetOutput( fixedLevel ), sigma, useWorkspace );
     }
 
-    // Now resample.
-    m_FieldExpander->SetInput( tempField );
-
-    typename FixedImageType::Pointer fi =
-        m_FixedImagePyramid->GetOutput( fixedLevel );
-    m_FieldExpander->SetSize( fi->GetLargestPossibleRegion().GetSize() );
-    m_FieldExpander->SetOutputStartIndex( fi->GetLargestPossibleRegion().GetIndex() );
-    m_FieldExpander->SetOutputOrigin( fi->GetOrigin() );
-    m_FieldExpander->SetOutputSpacing( fi->GetSpacing() );
-    m_FieldExpander->SetOutputDirection( fi->GetDirection() );
-
-    m_FieldExpander->UpdateLargestPossibleRegion();
-    m_FieldExpander->SetInput( NULL );
-    tempField = m_FieldExpander->GetOutput();
-    tempField->DisconnectPipeline();
-    }
+  // No smoothing when expanding the fields between the levels.
+  SigmaArrayType zeroSigma;
+  zeroSigma.Fill( 0.0 );
 
   bool lastShrinkFactorsAllOnes = false;
 
@@ -373,6 +501,17 @@ VariationalRegistrationMultiResolutionFilter< TFixedImage, TMovingImage, TDispla
   while( !this->Halt() )
     {
 
+    // Cache shrink factors for computing the next expand factors.
+    lastShrinkFactorsAllOnes = true;
+    for( unsigned int idim = 0; idim < ImageDimension; idim++ )
+      {
+      if( m_FixedImagePyramid->GetSchedule()[fixedLevel][idim] > 1 )
+        {
+        lastShrinkFactorsAllOnes = false;
+        break;
+        }
+      }
+
     // Set input deformation field.
     if( tempField.IsNull() )
       {
@@ -380,24 +519,14 @@ VariationalRegistrationMultiResolutionFilter< TFixedImage, TMovingImage, TDispla
       }
     else
       {
-      // Resample the field to be the same size as the fixed image
-      // at the current level
-      m_FieldExpander->SetInput( tempField );
-
-      typename FixedImageType::Pointer fi =
-          m_FixedImagePyramid->GetOutput( fixedLevel );
-      m_FieldExpander->SetSize(
-          fi->GetLargestPossibleRegion().GetSize() );
-      m_FieldExpander->SetOutputStartIndex(
-          fi->GetLargestPossibleRegion().GetIndex() );
-      m_FieldExpander->SetOutputOrigin( fi->GetOrigin() );
-      m_FieldExpander->SetOutputSpacing( fi->GetSpacing() );
-      m_FieldExpander->SetOutputDirection( fi->GetDirection() );
-
-      m_FieldExpander->UpdateLargestPossibleRegion();
-      m_FieldExpander->SetInput( NULL );
-      tempField = m_FieldExpander->GetOutput();
-      tempField->DisconnectPipeline();
+      // Resample the field to be the same size as the fixed image at the
+      // current level. The registration filter runs in place on this field,
+      // so it is only written to the workspace if it does not become the
+      // output of this filter.
+      const bool lastLevel = ( m_ElapsedLevels + 1 >= m_NumberOfLevels );
+      tempField = this->ExpandField( tempField,
+          m_FixedImagePyramid->GetOutput( fixedLevel ), zeroSigma,
+          useWorkspace && ( !lastLevel || !lastShrinkFactorsAllOnes ) );
 
       m_RegistrationFilter->SetInput( tempField );
       }
@@ -437,22 +566,16 @@ VariationalRegistrationMultiResolutionFilter< TFixedImage, TMovingImage, TDispla
       m_RegistrationFilter->SetMaskImage( delater->GetOutput() );
       }
 
-    // Cache shrink factors for computing the next expand factors.
-    lastShrinkFactorsAllOnes = true;
-    for( unsigned int idim = 0; idim < ImageDimension; idim++ )
-      {
-      if( m_FixedImagePyramid->GetSchedule()[fixedLevel][idim] > 1 )
-        {
-        lastShrinkFactorsAllOnes = false;
-        break;
-        }
-      }
-
     // Compute new deformation field -> Execute registration on current level.
     itkDebugMacro( << "Starting multi-resolution level " << m_ElapsedLevels + 1 );
 
     // Update registration filter
+    if( m_Instrumentation )
+      {
+      m_Instrumentation->SetLevel( m_ElapsedLevels );
+      }
     m_RegistrationFilter->UpdateLargestPossibleRegion();
+    this->SamplePeakMemory( GetImageBytes( tempField.GetPointer() ) );
 
     // Get results
     displField = m_RegistrationFilter->GetDisplacementField();
@@ -476,14 +599,21 @@ VariationalRegistrationMultiResolutionFilter< TFixedImage, TMovingImage, TDispla
       {
       m_MovingImagePyramid->GetOutput( movingLevel - 1 )->ReleaseData();
       }
-    if( fixedLevel > 0 )
+    if( fixedLevel > 0 && !keepFixedImagePyramid )
       {
       m_FixedImagePyramid->GetOutput( fixedLevel - 1 )->ReleaseData();
       }
-    if( maskImage && maskLevel > 0 )
+    if( maskImage && maskLevel > 0 && !keepFixedImagePyramid )
       {
       m_MaskImagePyramid->GetOutput( maskLevel - 1 )->ReleaseData();
       }
+
+    // The internal buffers are allocated again for the next level, so they
+    // are not held while the field is expanded.
+    if( releaseEarly )
+      {
+      m_RegistrationFilter->ReleaseBuffers();
+      }
     } // while not Halt()
 
   if( !lastShrinkFactorsAllOnes )
@@ -493,30 +623,43 @@ VariationalRegistrationMultiResolutionFilter< TFixedImage, TMovingImage, TDispla
     // to output of this filter
 
     // resample the field to the same size as the fixed image
-    m_FieldExpander->SetInput( tempField );
-    m_FieldExpander->SetSize(
-        fixedImage->GetLargestPossibleRegion().GetSize() );
-    m_FieldExpander->SetOutputStartIndex(
-        fixedImage->GetLargestPossibleRegion().GetIndex() );
-    m_FieldExpander->SetOutputOrigin( fixedImage->GetOrigin() );
-    m_FieldExpander->SetOutputSpacing( fixedImage->GetSpacing() );
-    m_FieldExpander->SetOutputDirection( fixedImage->GetDirection() );
-
-    m_FieldExpander->UpdateLargestPossibleRegion();
-    this->GraftOutput( m_FieldExpander->GetOutput() );
+    DisplacementFieldPointer outputField =
+        this->ExpandField( tempField, fixedImage, zeroSigma, false );
+    this->GraftOutput( outputField );
 
     if( displField != tempField )
       {
-      m_FieldExpander->SetInput( displField );
-      m_FieldExpander->UpdateLargestPossibleRegion();
-      m_DisplacementField = m_FieldExpander->GetOutput();
+      m_DisplacementField = this->ExpandField( displField, fixedImage, zeroSigma, false );
+      }
+    else
+      {
+      m_DisplacementField = outputField;
       }
+
+    this->SamplePeakMemory( GetImageBytes( tempField.GetPointer() )
+        + GetImageBytes( outputField.GetPointer() )
+        + ( m_DisplacementField != outputField ? GetImageBytes( m_DisplacementField.GetPointer() ) : 0 ) );
     }
   else
     {
     // all the last shrink factors are all ones
     // graft the output of registration filter to
-    // to output of this filter
+    // to output of this filter. If the registration was stopped early, the
+    // field may still use workspace memory and is copied.
+    if( !tempField->GetPixelContainer()->GetContainerManageMemory() )
+      {
+      DisplacementFieldPointer outputField = DisplacementFieldType::New();
+      outputField->CopyInformation( tempField );
+      outputField->SetBufferedRegion( tempField->GetBufferedRegion() );
+      outputField->Allocate();
+      std::copy( tempField->GetBufferPointer(), tempField->GetBufferPointer()
+          + tempField->GetBufferedRegion().GetNumberOfPixels(), outputField->GetBufferPointer() );
+      if( displField == tempField )
+        {
+        displField = outputField;
+        }
+      tempField = outputField;
+      }
     this->GraftOutput( tempField );
     m_DisplacementField = displField;
     }
@@ -524,10 +667,340 @@ VariationalRegistrationMultiResolutionFilter< TFixedImage, TMovingImage, TDispla
   // Release memory
   m_FieldExpander->SetInput( NULL );
   m_FieldExpander->GetOutput()->ReleaseData();
+  m_FusedFieldExpander->SetInput( NULL );
+  m_FusedFieldExpander->GetOutput()->ReleaseData();
   m_RegistrationFilter->SetInput( NULL );
   m_RegistrationFilter->GetOutput()->ReleaseData();
 }
 
+/*
+ * Smooth and resample a field to the grid of the reference image.
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField, class TRealType >
+typename VariationalRegistrationMultiResolutionFilter< TFixedImage, TMovingImage, TDisplacementField, TRealType >
+::DisplacementFieldPointer
+VariationalRegistrationMultiResolutionFilter< TFixedImage, TMovingImage, TDisplacementField, TRealType >
+::ExpandField( DisplacementFieldType * field, const FixedImageType * reference,
+    const SigmaArrayType & sigma, bool useWorkspace )
+{
+  DisplacementFieldPointer expandedField;
+
+  if( m_UseFusedFieldExpander && m_FusedFieldExpander
+      && FusedFieldExpanderType::CanExpand( field, reference ) )
+    {
+    // Write into the workspace buffer not holding the input field.
+    if( useWorkspace && m_Workspace )
+      {
+      m_FusedFieldExpander->SetWorkspace( m_Workspace );
+      m_FusedFieldExpander->SetWorkspaceBufferName(
+          m_ExpandedFieldBuffer == 0 ? "ExpandedField0" : "ExpandedField1" );
+      m_ExpandedFieldBuffer = 1 - m_ExpandedFieldBuffer;
+      }
+    else
+      {
+      m_FusedFieldExpander->SetWorkspace( NULL );
+      }
+
+    // Smooth and upsample in a single pass.
+    m_FusedFieldExpander->SetInput( field );
+    m_FusedFieldExpander->SetSigma( sigma );
+    m_FusedFieldExpander->SetOutputParametersFromImage( reference );
+
+    m_FusedFieldExpander->UpdateLargestPossibleRegion();
+    m_FusedFieldExpander->SetInput( NULL );
+    expandedField = m_FusedFieldExpander->GetOutput();
+    expandedField->DisconnectPipeline();
+    return expandedField;
+    }
+
+  // First smooth it.
+  expandedField = field;
+
+  typedef RecursiveGaussianImageFilter< DisplacementFieldType,
+      DisplacementFieldType > GaussianFilterType;
+  typename GaussianFilterType::Pointer smoother = GaussianFilterType::New();
+  smoother->SetNumberOfThreads( this->GetNumberOfThreads() );
+
+  for( unsigned int dim = 0; dim < DisplacementFieldType::ImageDimension; ++dim )
+    {
+    if( sigma[dim] <= 0.0 )
+      {
+      continue;
+      }
+
+    smoother->SetInput( expandedField );
+    smoother->SetSigma( sigma[dim] );
+    smoother->SetDirection( dim );
+
+    smoother->Update();
+
+    expandedField = smoother->GetOutput();
+    expandedField->DisconnectPipeline();
+    }
+
+  // Now resample.
+  m_FieldExpander->SetInput( expandedField );
+  m_FieldExpander->SetSize( reference->GetLargestPossibleRegion().GetSize() );
+  m_FieldExpander->SetOutputStartIndex( reference->GetLargestPossibleRegion().GetIndex() );
+  m_FieldExpander->SetOutputOrigin( reference->GetOrigin() );
+  m_FieldExpander->SetOutputSpacing( reference->GetSpacing() );
+  m_FieldExpander->SetOutputDirection( reference->GetDirection() );
+
+  m_FieldExpander->UpdateLargestPossibleRegion();
+  m_FieldExpander->SetInput( NULL );
+  expandedField = m_FieldExpander->GetOutput();
+  expandedField->DisconnectPipeline();
+
+  return expandedField;
+}
+
+/*
+ * Estimate the peak memory of an update with the current settings.
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField, class TRealType >
+SizeValueType
+VariationalRegistrationMultiResolutionFilter< TFixedImage, TMovingImage, TDisplacementField, TRealType >
+::EstimatePeakMemory() const
+{
+  return this->EstimatePeakMemory( m_KeepFixedImagePyramid, m_Workspace.IsNotNull(), false );
+}
+
+/*
+ * Estimate the peak memory of an update from the sizes of the inputs and
+ * the pyramid schedules.
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField, class TRealType >
+SizeValueType
+VariationalRegistrationMultiResolutionFilter< TFixedImage, TMovingImage, TDisplacementField, TRealType >
+::EstimatePeakMemory( bool keepFixedImagePyramid, bool useWorkspace, bool releaseBuffers ) const
+{
+  typedef typename DisplacementFieldType::RegionType FieldRegionType;
+
+  const FixedImageType * fixedImage = this->GetFixedImage();
+  const MovingImageType * movingImage = this->GetMovingImage();
+  const MaskImageType * maskImage = this->GetMaskImage();
+  const DisplacementFieldType * initialField = this->GetInput( 0 );
+
+  if( !fixedImage || !movingImage || !m_FixedImagePyramid || !m_MovingImagePyramid
+      || !m_RegistrationFilter || m_NumberOfLevels == 0 )
+    {
+    return 0;
+    }
+  if( maskImage && !m_MaskImagePyramid )
+    {
+    maskImage = NULL;
+    }
+
+  const SizeValueType fieldPixelBytes = sizeof( typename DisplacementFieldType::PixelType );
+  const SizeValueType fixedPixelBytes = sizeof( typename FixedImageType::PixelType );
+  const SizeValueType movingPixelBytes = sizeof( typename MovingImageType::PixelType );
+  const SizeValueType realPixelBytes = sizeof( TRealType );
+
+  const FieldRegionType fixedRegion = fixedImage->GetLargestPossibleRegion();
+  const FieldRegionType movingRegion = movingImage->GetLargestPossibleRegion();
+  const SizeValueType numberOfFixedPixels = fixedRegion.GetNumberOfPixels();
+  const SizeValueType numberOfMovingPixels = movingRegion.GetNumberOfPixels();
+
+  // The inputs are held during the whole update.
+  SizeValueType inputBytes = numberOfFixedPixels * fixedPixelBytes
+      + numberOfMovingPixels * movingPixelBytes;
+  if( maskImage )
+    {
+    inputBytes += maskImage->GetLargestPossibleRegion().GetNumberOfPixels()
+        * sizeof( MaskImagePixelType );
+    }
+  if( initialField )
+    {
+    inputBytes += initialField->GetLargestPossibleRegion().GetNumberOfPixels() * fieldPixelBytes;
+    }
+
+  // Pyramid levels.
+  const unsigned int numberOfFixedLevels = m_FixedImagePyramid->GetNumberOfLevels();
+  const unsigned int numberOfMovingLevels = m_MovingImagePyramid->GetNumberOfLevels();
+  const unsigned int numberOfMaskLevels = maskImage ? m_MaskImagePyramid->GetNumberOfLevels() : 0;
+  if( numberOfFixedLevels == 0 || numberOfMovingLevels == 0 )
+    {
+    return 0;
+    }
+
+  std::vector< FieldRegionType > fixedLevelRegions( numberOfFixedLevels );
+  std::vector< SizeValueType > fixedLevelBytes( numberOfFixedLevels );
+  std::vector< SizeValueType > movingLevelBytes( numberOfMovingLevels );
+  std::vector< SizeValueType > maskLevelBytes( numberOfMaskLevels );
+  SizeValueType pyramidBytes = 0;
+  for( unsigned int level = 0; level < numberOfFixedLevels; ++level )
+    {
+    fixedLevelRegions[level] = GetLevelRegion( fixedRegion, m_FixedImagePyramid->GetSchedule(), level );
+    fixedLevelBytes[level] = fixedLevelRegions[level].GetNumberOfPixels() * fixedPixelBytes;
+    pyramidBytes += fixedLevelBytes[level];
+    }
+  for( unsigned int level = 0; level < numberOfMovingLevels; ++level )
+    {
+    movingLevelBytes[level] = GetLevelRegion( movingRegion,
+        m_MovingImagePyramid->GetSchedule(), level ).GetNumberOfPixels() * movingPixelBytes;
+    pyramidBytes += movingLevelBytes[level];
+    }
+  SizeValueType casterBytes = 0;
+  if( maskImage )
+    {
+    const FieldRegionType maskRegion = maskImage->GetLargestPossibleRegion();
+    casterBytes = maskRegion.GetNumberOfPixels() * realPixelBytes;
+    for( unsigned int level = 0; level < numberOfMaskLevels; ++level )
+      {
+      maskLevelBytes[level] = GetLevelRegion( maskRegion,
+          m_MaskImagePyramid->GetSchedule(), level ).GetNumberOfPixels() * realPixelBytes;
+      pyramidBytes += maskLevelBytes[level];
+      }
+    }
+
+  // While the pyramids are computed, all levels, the mask caster output and
+  // about two temporary images of the real type are held.
+  SizeValueType peakBytes = inputBytes + pyramidBytes + casterBytes
+      + 2 * vnl_math_max( numberOfFixedPixels, numberOfMovingPixels ) * realPixelBytes;
+
+  const unsigned int numberOfLevels = vnl_math_min( m_NumberOfLevels, numberOfFixedLevels );
+
+  // With a workspace, the buffers are sized for the largest level.
+  FieldRegionType workspaceRegion = fixedLevelRegions[0];
+  for( unsigned int level = 1; level < numberOfLevels; ++level )
+    {
+    if( fixedLevelRegions[level].GetNumberOfPixels() > workspaceRegion.GetNumberOfPixels() )
+      {
+      workspaceRegion = fixedLevelRegions[level];
+      }
+    }
+
+  // Registration on each level. Pyramid levels below the current level are
+  // released, unless the fixed pyramid is kept.
+  SizeValueType registrationBytes = 0;
+  SizeValueType previousRegistrationBytes = 0;
+  SizeValueType fixedPyramidBytes = 0;
+  for( unsigned int level = 0; level < numberOfLevels; ++level )
+    {
+    SizeValueType levelPyramidBytes = keepFixedImagePyramid ? casterBytes : 0;
+    for( unsigned int i = 0; i < numberOfFixedLevels; ++i )
+      {
+      levelPyramidBytes += ( keepFixedImagePyramid || i >= level ) ? fixedLevelBytes[i] : 0;
+      }
+    for( unsigned int i = 0; i < numberOfMaskLevels; ++i )
+      {
+      levelPyramidBytes += ( keepFixedImagePyramid || i >= level ) ? maskLevelBytes[i] : 0;
+      }
+    fixedPyramidBytes = levelPyramidBytes;
+    for( unsigned int i = level; i < numberOfMovingLevels; ++i )
+      {
+      levelPyramidBytes += movingLevelBytes[i];
+      }
+
+    const SizeValueType numberOfLevelPixels = fixedLevelRegions[level].GetNumberOfPixels();
+    registrationBytes = m_RegistrationFilter->EstimateAllocatedBytes(
+        useWorkspace ? workspaceRegion : fixedLevelRegions[level] );
+
+    // Expanded input field and dilated mask of the level. Without workspace,
+    // the buffers of the previous level are only replaced when those of
+    // this level are allocated, unless they have been released.
+    SizeValueType levelBytes = inputBytes + levelPyramidBytes + registrationBytes;
+    if( !useWorkspace && !releaseBuffers )
+      {
+      levelBytes += previousRegistrationBytes;
+      }
+    previousRegistrationBytes = registrationBytes;
+    if( level > 0 || initialField )
+      {
+      levelBytes += numberOfLevelPixels * fieldPixelBytes;
+      }
+    if( maskImage )
+      {
+      levelBytes += 2 * numberOfLevelPixels * sizeof( MaskImagePixelType );
+      }
+    peakBytes = vnl_math_max( peakBytes, levelBytes );
+    }
+
+  // If the last level is not the full resolution, the output field and the
+  // displacement field are expanded to the size of the fixed image.
+  const unsigned int lastLevel = numberOfLevels - 1;
+  bool lastShrinkFactorsAllOnes = true;
+  for( unsigned int idim = 0; idim < ImageDimension; idim++ )
+    {
+    if( m_FixedImagePyramid->GetSchedule()[lastLevel][idim] > 1 )
+      {
+      lastShrinkFactorsAllOnes = false;
+      }
+    }
+  if( !lastShrinkFactorsAllOnes )
+    {
+    // Released internal buffers leave the output and the displacement field
+    // of the last level, which are counted as two fields of the last level.
+    const SizeValueType numberOfLastLevelPixels = fixedLevelRegions[lastLevel].GetNumberOfPixels();
+    const SizeValueType expansionBytes = inputBytes
+        + ( keepFixedImagePyramid ? fixedPyramidBytes : 0 )
+        + ( releaseBuffers ? numberOfLastLevelPixels * fieldPixelBytes : registrationBytes )
+        + numberOfLastLevelPixels * fieldPixelBytes
+        + 2 * numberOfFixedPixels * fieldPixelBytes;
+    peakBytes = vnl_math_max( peakBytes, expansionBytes );
+    }
+
+  return peakBytes;
+}
+
+/*
+ * Sample the current buffer and resident memory and update the peaks.
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField, class TRealType >
+void
+VariationalRegistrationMultiResolutionFilter< TFixedImage, TMovingImage, TDisplacementField, TRealType >
+::SamplePeakMemory( SizeValueType additionalBytes )
+{
+  SizeValueType bytes = additionalBytes
+      + GetImageBytes( this->GetFixedImage() )
+      + GetImageBytes( this->GetMovingImage() )
+      + GetImageBytes( this->GetMaskImage() )
+      + GetImageBytes( this->GetInput( 0 ) );
+
+  for( unsigned int level = 0; level < m_FixedImagePyramid->GetNumberOfLevels(); ++level )
+    {
+    bytes += GetImageBytes( m_FixedImagePyramid->GetOutput( level ) );
+    }
+  for( unsigned int level = 0; level < m_MovingImagePyramid->GetNumberOfLevels(); ++level )
+    {
+    bytes += GetImageBytes( m_MovingImagePyramid->GetOutput( level ) );
+    }
+  if( m_MaskImagePyramid )
+    {
+    for( unsigned int level = 0; level < m_MaskImagePyramid->GetNumberOfLevels(); ++level )
+      {
+      bytes += GetImageBytes( m_MaskImagePyramid->GetOutput( level ) );
+      }
+    }
+  bytes += GetImageBytes( m_MaskImageCaster->GetOutput() );
+  bytes += m_RegistrationFilter->GetAllocatedBytes();
+
+  m_PeakBufferMemory = vnl_math_max( m_PeakBufferMemory, bytes );
+  m_PeakMemory = vnl_math_max( m_PeakMemory, WorkspaceType::GetResidentBytes() );
+}
+
+/*
+ * Get the region of a pyramid level.
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField, class TRealType >
+typename TDisplacementField::RegionType
+VariationalRegistrationMultiResolutionFilter< TFixedImage, TMovingImage, TDisplacementField, TRealType >
+::GetLevelRegion( const typename DisplacementFieldType::RegionType & region,
+    const typename FixedImagePyramidType::ScheduleType & schedule, unsigned int level )
+{
+  typename DisplacementFieldType::RegionType levelRegion = region;
+  typename DisplacementFieldType::SizeType size = region.GetSize();
+  for( unsigned int dim = 0; dim < ImageDimension; ++dim )
+    {
+    const SizeValueType factor = vnl_math_max( static_cast< SizeValueType >( schedule[level][dim] ),
+        static_cast< SizeValueType >( 1 ) );
+    size[dim] = vnl_math_max( static_cast< SizeValueType >( size[dim] / factor ),
+        static_cast< SizeValueType >( 1 ) );
+    }
+  levelRegion.SetSize( size );
+  return levelRegion;
+}
+
 /*
  * Stop the registration, usually called by an observer.
  */
@@ -0,0 +1,291 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkVariationalRegistrationMultigridRegularizer_h
+#define itkVariationalRegistrationMultigridRegularizer_h
+
+#include "itkVariationalRegistrationRegularizer.h"
+#include "itkMultiThreader.h"
+
+#include <vector>
+
+namespace itk {
+
+/** \class itk::VariationalRegistrationMultigridRegularizer
+ *
+ *  \brief This class performs diffusive or linear elastic regularization of a vector field with a multigrid solver.
+ *
+ *  We compute \f$u^{out}=(Id - A)^{-1}[u^{in}]\f$ with either the diffusive
+ *  operator \f$A[u]=\alpha\Delta u\f$ or the linear elastic operator
+ *  \f$A[u]=\mu\Delta u + (\mu+\lambda)\nabla(\nabla\cdot u)\f$. The weights
+ *  have the same meaning as in VariationalRegistrationDiffusionRegularizer
+ *  and VariationalRegistrationElasticRegularizer, respectively.
+ *
+ *  The operator is discretized with finite differences and Neumann boundary
+ *  conditions. The mixed derivatives are derived from a discrete energy
+ *  with central differences clamped at the boundary, so that the system
+ *  is symmetric positive definite. The system is
+ *  solved with NumberOfCycles geometric multigrid V-cycles starting from
+ *  \f$u^{in}\f$. The grids are cell-centered; each dimension is coarsened by
+ *  a factor of two as long as it has at least 2 * MinimumLevelSize pixels.
+ *  Residuals are restricted by averaging and corrections are prolongated by
+ *  linear interpolation. The smoother is a Gauss-Seidel method with
+ *  red-black ordering for the diffusive operator and with 2^ImageDimension
+ *  colors for the elastic operator, whose mixed derivatives couple diagonal
+ *  neighbours. All colors are processed multi-threaded. The coarsest level
+ *  is solved approximately with NumberOfCoarsestLevelSteps smoothing steps.
+ *
+ *  In contrast to VariationalRegistrationDiffusionRegularizer, the system is
+ *  solved without operator splitting, and in contrast to
+ *  VariationalRegistrationElasticRegularizer, no FFT library is required
+ *  and the boundaries are not periodic. The cost per cycle is linear in the
+ *  number of pixels. The grid hierarchy is kept and only rebuilt if the
+ *  size or spacing of the field changes.
+ *
+ *  \sa VariationalRegistrationFilter
+ *  \sa VariationalRegistrationRegularizer
+ *  \sa VariationalRegistrationDiffusionRegularizer
+ *  \sa VariationalRegistrationElasticRegularizer
+ *
+ *  \ingroup VariationalRegistration
+ *
+ *  \warning The image dimension must be at least 2. For the elastic operator,
+ *  the convergence of the smoother degrades if lambda is much larger than mu.
+ */
+template< class TDisplacementField >
+class VariationalRegistrationMultigridRegularizer
+  : public VariationalRegistrationRegularizer< TDisplacementField >
+{
+public:
+  /** Standard class typedefs */
+  typedef VariationalRegistrationMultigridRegularizer  Self;
+  typedef VariationalRegistrationRegularizer<
+      TDisplacementField >                             Superclass;
+  typedef SmartPointer< Self >                         Pointer;
+  typedef SmartPointer< const Self >                   ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro( VariationalRegistrationMultigridRegularizer, VariationalRegistrationRegularizer);
+
+  /** Dimensionality of input and output data is assumed to be the same. */
+  itkStaticConstMacro(ImageDimension, unsigned int, TDisplacementField::ImageDimension);
+
+  /** Deformation field types, inherited from Superclass. */
+  typedef typename Superclass::DisplacementFieldType         DisplacementFieldType;
+  typedef typename Superclass::DisplacementFieldPointer      DisplacementFieldPointer;
+  typedef typename Superclass::DisplacementFieldConstPointer DisplacementFieldConstPointer;
+  typedef typename Superclass::PixelType                     PixelType;
+  typedef typename Superclass::ValueType                     ValueType;
+  typedef typename Superclass::RegionType                    RegionType;
+  typedef typename DisplacementFieldType::SizeType           SizeType;
+  typedef typename DisplacementFieldType::IndexType          IndexType;
+
+  /** Enumerate for the regularization operators. */
+  enum OperatorType {
+    OPERATOR_DIFFUSION = 0,
+    OPERATOR_ELASTIC = 1
+  };
+
+  /** Set/Get the regularization operator. Default is diffusion. */
+  itkSetEnumMacro( Operator, OperatorType );
+  itkGetEnumMacro( Operator, OperatorType );
+
+  /** Use the diffusive operator with weight alpha. */
+  virtual void SetOperatorToDiffusion()
+    { this->SetOperator( OPERATOR_DIFFUSION ); }
+
+  /** Use the linear elastic operator with weights mu and lambda. */
+  virtual void SetOperatorToElastic()
+    { this->SetOperator( OPERATOR_ELASTIC ); }
+
+  /** Set the regularization weight alpha of the diffusive operator. */
+  itkSetMacro( Alpha, ValueType );
+
+  /** Get the regularization weight alpha of the diffusive operator. */
+  itkGetConstMacro( Alpha, ValueType );
+
+  /** Set the regularization weight mu of the elastic operator. */
+  itkSetMacro( Mu, ValueType );
+
+  /** Get the regularization weight mu of the elastic operator. */
+  itkGetConstMacro( Mu, ValueType );
+
+  /** Set the regularization weight lambda of the elastic operator. */
+  itkSetMacro( Lambda, ValueType );
+
+  /** Get the regularization weight lambda of the elastic operator. */
+  itkGetConstMacro( Lambda, ValueType );
+
+  /** Set/Get the number of V-cycles. Default is 2. */
+  itkSetClampMacro( NumberOfCycles, unsigned int, 1, NumericTraits< unsigned int >::max() );
+  itkGetConstMacro( NumberOfCycles, unsigned int );
+
+  /** Set/Get the number of smoothing steps before and after the coarse grid
+   *  correction. Default is 2. */
+  itkSetClampMacro( NumberOfSmoothingSteps, unsigned int, 1, NumericTraits< unsigned int >::max() );
+  itkGetConstMacro( NumberOfSmoothingSteps, unsigned int );
+
+  /** Set/Get the number of smoothing steps on the coarsest level. Default
+   *  is 50. */
+  itkSetClampMacro( NumberOfCoarsestLevelSteps, unsigned int, 1, NumericTraits< unsigned int >::max() );
+  itkGetConstMacro( NumberOfCoarsestLevelSteps, unsigned int );
+
+  /** Set/Get the minimum size of a dimension on coarse levels. Default is 4. */
+  itkSetClampMacro( MinimumLevelSize, unsigned int, 2, NumericTraits< unsigned int >::max() );
+  itkGetConstMacro( MinimumLevelSize, unsigned int );
+
+  /** Get the number of levels of the current grid hierarchy. */
+  unsigned int GetNumberOfLevels() const
+    { return static_cast< unsigned int >( m_Levels.size() ); }
+
+  /** Get an estimate of the number of bytes of the buffer images needed to
+   *  regularize a field with the given region. */
+  virtual SizeValueType EstimateBufferBytes( const RegionType & region ) const ITK_OVERRIDE;
+
+  /** Get the number of bytes of the buffer images, excluding the buffer
+   *  attached to the workspace. */
+  virtual SizeValueType GetAllocatedBytes() const ITK_OVERRIDE;
+
+  /** Free the buffer images of all levels. */
+  virtual void ReleaseBuffers() ITK_OVERRIDE;
+
+protected:
+  VariationalRegistrationMultigridRegularizer();
+  ~VariationalRegistrationMultigridRegularizer() {}
+
+  /** Print information about the filter. */
+  virtual void PrintSelf(std::ostream& os, Indent indent) const ITK_OVERRIDE;
+
+  /** Execute regularization. This method is multi-threaded but does not
+   * use ThreadedGenerateData(). */
+  virtual void GenerateData() ITK_OVERRIDE;
+
+  /** Method for initialization. The grid hierarchy is built if the size or
+   *  spacing changed and the operator coefficients are computed. */
+  virtual void Initialize() ITK_OVERRIDE;
+
+  /** Data of one level of the grid hierarchy. */
+  struct LevelType
+    {
+    DisplacementFieldPointer Solution;
+    DisplacementFieldPointer RightHandSide;
+    SizeType        Size;
+    OffsetValueType Stride[ImageDimension];
+    unsigned int    Factor[ImageDimension];  // Coarsening factor to the next level.
+    double          Weight[ImageDimension];  // Squared inverse relative grid spacing.
+    double          Coefficient[ImageDimension][ImageDimension];
+    double          MixedCoefficient[ImageDimension][ImageDimension];
+    };
+
+  /** Compute the sizes of the levels for a field of the given size. */
+  virtual void ComputeLevelSizes( const SizeType & size,
+      std::vector< SizeType > & levelSizes ) const;
+
+  /** Allocate the levels and compute the grid weights. */
+  virtual void BuildHierarchy();
+
+  /** Compute the operator coefficients of all levels from the weights. */
+  virtual void ComputeCoefficients();
+
+  /** Perform a V-cycle on the given level and all coarser levels. */
+  virtual void VCycle( unsigned int level );
+
+  /** Perform smoothing steps on a level. */
+  virtual void Smooth( unsigned int level, unsigned int numberOfSteps );
+
+  /** Compute the right hand side f of the discrete system for component c
+   *  at a pixel without the diagonal term, i.e. f_c + sum of the
+   *  off-diagonal terms, and the diagonal. A Gauss-Seidel step sets u_c to
+   *  sum / diagonal; the residual is sum - diagonal * u_c. */
+  inline void ComputeLocalSystem( const LevelType & level, const PixelType * u,
+      const PixelType * f, OffsetValueType offset, const IndexType & index,
+      unsigned int c, double & sum, double & diagonal ) const;
+
+  /** Compute the index of the first pixel of a row (line along dimension 0)
+   *  of a level. */
+  static void ComputeRowIndex( const LevelType & level, OffsetValueType row,
+      IndexType & index );
+
+  /** Split the slowest dimension of a level for multi-threading. Returns
+   *  false if the thread has no work. */
+  bool SplitLevel( const LevelType & level, ThreadIdType threadId,
+      ThreadIdType threadCount, OffsetValueType & begin, OffsetValueType & end ) const;
+
+  /** Execute a callback with the given level and color multi-threaded. */
+  void ExecuteThreaded( ThreadFunctionType callback, unsigned int level, unsigned int color );
+
+  /** A struct to store parameters for multithreaded function call. */
+  struct MultigridThreadStruct
+  {
+    VariationalRegistrationMultigridRegularizer *Filter;
+    unsigned int level;            // The current level.
+    unsigned int color;            // The current color of the smoother.
+  };
+
+  /** Method for multi-threaded copying of the input into the right hand side
+   *  and the output. */
+  static ITK_THREAD_RETURN_TYPE CopyInputCallback( void *arg );
+
+  /** Method for a multi-threaded Gauss-Seidel step on the pixels of one
+   *  color. */
+  static ITK_THREAD_RETURN_TYPE SmoothCallback( void *arg );
+
+  /** Method for multi-threaded restriction of the residual of a level to
+   *  the right hand side of the next coarser level. */
+  static ITK_THREAD_RETURN_TYPE RestrictCallback( void *arg );
+
+  /** Method for multi-threaded prolongation of the solution of the next
+   *  coarser level and correction of the solution of a level. */
+  static ITK_THREAD_RETURN_TYPE ProlongateCallback( void *arg );
+
+private:
+  VariationalRegistrationMultigridRegularizer(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  /** Regularization operator. */
+  OperatorType m_Operator;
+
+  /** Weights of the regularization term. */
+  ValueType m_Alpha;
+  ValueType m_Mu;
+  ValueType m_Lambda;
+
+  /** Solver parameters. */
+  unsigned int m_NumberOfCycles;
+  unsigned int m_NumberOfSmoothingSteps;
+  unsigned int m_NumberOfCoarsestLevelSteps;
+  unsigned int m_MinimumLevelSize;
+
+  /** The size, spacing and minimum level size of the current hierarchy. */
+  SizeType m_Size;
+  typename DisplacementFieldType::SpacingType m_Spacing;
+  unsigned int m_HierarchyMinimumLevelSize;
+
+  /** The grid hierarchy. The solution of the finest level is the output. */
+  std::vector< LevelType > m_Levels;
+};
+
+}
+
+#ifndef ITK_MANUAL_INSTANTIATION
+# include "itkVariationalRegistrationMultigridRegularizer.hxx"
+#endif
+
+#endif
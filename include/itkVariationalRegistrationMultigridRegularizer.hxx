@@ -0,0 +1,855 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkVariationalRegistrationMultigridRegularizer_hxx
+#define itkVariationalRegistrationMultigridRegularizer_hxx
+#include "itkVariationalRegistrationMultigridRegularizer.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace itk
+{
+
+/**
+ * Default constructor
+ */
+template< class TDisplacementField >
+VariationalRegistrationMultigridRegularizer< TDisplacementField >
+::VariationalRegistrationMultigridRegularizer()
+{
+  m_Operator = OPERATOR_DIFFUSION;
+
+  // Initialize regularization weights.
+  m_Alpha = 1.0;
+  m_Mu = 1.0;
+  m_Lambda = 1.0;
+
+  // Initialize solver parameters.
+  m_NumberOfCycles = 2;
+  m_NumberOfSmoothingSteps = 2;
+  m_NumberOfCoarsestLevelSteps = 50;
+  m_MinimumLevelSize = 4;
+
+  for( unsigned int i = 0; i < ImageDimension; ++i )
+    {
+    m_Size[i] = 0;
+    m_Spacing[i] = 1.0;
+    }
+  m_HierarchyMinimumLevelSize = 0;
+}
+
+/**
+ * Generate data by solving the system with V-cycles
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationMultigridRegularizer< TDisplacementField >
+::GenerateData()
+{
+  // Allocate the output image
+  this->AllocateOutputs();
+
+  // Initialize the hierarchy and the coefficients
+  this->Initialize();
+
+  // The input is the right hand side and the initial solution.
+  this->ExecuteThreaded( this->CopyInputCallback, 0, 0 );
+
+  for( unsigned int cycle = 0; cycle < m_NumberOfCycles; ++cycle )
+    {
+    this->VCycle( 0 );
+    }
+
+  // Do not keep a reference to the output.
+  m_Levels[0].Solution = NULL;
+}
+
+/*
+ * Initialize the hierarchy and the coefficients
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationMultigridRegularizer< TDisplacementField >
+::Initialize()
+{
+  this->Superclass::Initialize();
+
+  DisplacementFieldPointer DisplacementField = this->GetOutput();
+
+  SizeType size = DisplacementField->GetBufferedRegion().GetSize();
+  typename DisplacementFieldType::SpacingType spacing = DisplacementField->GetSpacing();
+
+  // Only rebuild the hierarchy if size or spacing have changed since last
+  // Initialize()
+  if( m_Levels.empty() || size != m_Size || spacing != m_Spacing
+      || m_MinimumLevelSize != m_HierarchyMinimumLevelSize )
+    {
+    m_Size = size;
+    m_Spacing = spacing;
+    m_HierarchyMinimumLevelSize = m_MinimumLevelSize;
+
+    this->BuildHierarchy();
+    }
+
+  m_Levels[0].Solution = DisplacementField;
+  this->ComputeCoefficients();
+}
+
+/**
+ * Compute the sizes of the levels
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationMultigridRegularizer< TDisplacementField >
+::ComputeLevelSizes( const SizeType & size, std::vector< SizeType > & levelSizes ) const
+{
+  levelSizes.clear();
+  levelSizes.push_back( size );
+
+  // Halve each dimension that is large enough until none is left.
+  SizeType current = size;
+  while( true )
+    {
+    bool coarsened = false;
+    for( unsigned int d = 0; d < ImageDimension; ++d )
+      {
+      if( current[d] >= 2 * m_MinimumLevelSize )
+        {
+        current[d] = ( current[d] + 1 ) / 2;
+        coarsened = true;
+        }
+      }
+    if( !coarsened )
+      {
+      break;
+      }
+    levelSizes.push_back( current );
+    }
+}
+
+/**
+ * Allocate the levels
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationMultigridRegularizer< TDisplacementField >
+::BuildHierarchy()
+{
+  std::vector< SizeType > levelSizes;
+  this->ComputeLevelSizes( m_Size, levelSizes );
+
+  m_Levels.clear();
+  m_Levels.resize( levelSizes.size() );
+  for( unsigned int l = 0; l < m_Levels.size(); ++l )
+    {
+    LevelType & level = m_Levels[l];
+    level.Size = levelSizes[l];
+    level.Stride[0] = 1;
+    for( unsigned int d = 1; d < ImageDimension; ++d )
+      {
+      level.Stride[d] = level.Stride[d - 1] * level.Size[d - 1];
+      }
+    for( unsigned int d = 0; d < ImageDimension; ++d )
+      {
+      level.Factor[d] = ( l + 1 < levelSizes.size()
+          && levelSizes[l + 1][d] != levelSizes[l][d] ) ? 2 : 1;
+      }
+
+    if( l == 0 )
+      {
+      // The solution of the finest level is the output; only the right
+      // hand side is allocated and shared via the workspace.
+      DisplacementFieldPointer DisplacementField = this->GetOutput();
+      level.RightHandSide = DisplacementFieldType::New();
+      level.RightHandSide->CopyInformation( DisplacementField );
+      level.RightHandSide->SetRequestedRegion( DisplacementField->GetBufferedRegion() );
+      level.RightHandSide->SetBufferedRegion( DisplacementField->GetBufferedRegion() );
+      if( this->GetWorkspace() )
+        {
+        this->GetWorkspace()->AttachBuffer( level.RightHandSide.GetPointer(), "MultigridRightHandSide" );
+        }
+      level.RightHandSide->Allocate();
+      }
+    else
+      {
+      RegionType region;
+      region.SetSize( level.Size );
+
+      level.Solution = DisplacementFieldType::New();
+      level.Solution->SetRegions( region );
+      level.Solution->Allocate();
+
+      level.RightHandSide = DisplacementFieldType::New();
+      level.RightHandSide->SetRegions( region );
+      level.RightHandSide->Allocate();
+      }
+    }
+}
+
+/**
+ * Compute the operator coefficients of all levels
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationMultigridRegularizer< TDisplacementField >
+::ComputeCoefficients()
+{
+  double meanSquaredSpacing = 0.0;
+  for( unsigned int d = 0; d < ImageDimension; ++d )
+    {
+    meanSquaredSpacing += m_Spacing[d] * m_Spacing[d];
+    }
+  meanSquaredSpacing /= ImageDimension;
+
+  for( unsigned int l = 0; l < m_Levels.size(); ++l )
+    {
+    LevelType & level = m_Levels[l];
+
+    // Squared inverse grid spacing relative to the mean squared spacing of
+    // the finest level, as in the diffusive and elastic regularizers.
+    for( unsigned int d = 0; d < ImageDimension; ++d )
+      {
+      if( l == 0 )
+        {
+        level.Weight[d] = this->GetUseImageSpacing() ?
+            meanSquaredSpacing / ( m_Spacing[d] * m_Spacing[d] ) : 1.0;
+        }
+      else
+        {
+        const LevelType & finer = m_Levels[l - 1];
+        level.Weight[d] = finer.Weight[d] / ( finer.Factor[d] * finer.Factor[d] );
+        }
+      }
+
+    // Weights of the second differences of component c in direction d and
+    // of the mixed differences of component d in directions c and d.
+    for( unsigned int c = 0; c < ImageDimension; ++c )
+      {
+      for( unsigned int d = 0; d < ImageDimension; ++d )
+        {
+        if( m_Operator == OPERATOR_ELASTIC )
+          {
+          level.Coefficient[c][d] = ( m_Mu + ( c == d ? m_Mu + m_Lambda : 0.0 ) ) * level.Weight[d];
+          level.MixedCoefficient[c][d] = ( c == d ) ? 0.0 :
+              0.25 * ( m_Mu + m_Lambda ) * std::sqrt( level.Weight[c] * level.Weight[d] );
+          }
+        else
+          {
+          level.Coefficient[c][d] = m_Alpha * level.Weight[d];
+          level.MixedCoefficient[c][d] = 0.0;
+          }
+        }
+      }
+    }
+}
+
+/**
+ * Perform a V-cycle
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationMultigridRegularizer< TDisplacementField >
+::VCycle( unsigned int level )
+{
+  if( level + 1 == m_Levels.size() )
+    {
+    this->Smooth( level, m_NumberOfCoarsestLevelSteps );
+    return;
+    }
+
+  this->Smooth( level, m_NumberOfSmoothingSteps );
+
+  // Coarse grid correction.
+  this->ExecuteThreaded( this->RestrictCallback, level + 1, 0 );
+  this->VCycle( level + 1 );
+  this->ExecuteThreaded( this->ProlongateCallback, level, 0 );
+
+  this->Smooth( level, m_NumberOfSmoothingSteps );
+}
+
+/**
+ * Perform Gauss-Seidel steps
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationMultigridRegularizer< TDisplacementField >
+::Smooth( unsigned int level, unsigned int numberOfSteps )
+{
+  // The mixed derivatives of the elastic operator couple diagonal
+  // neighbours, which have the same color in red-black ordering.
+  const unsigned int numberOfColors =
+      ( m_Operator == OPERATOR_ELASTIC ) ? ( 1u << ImageDimension ) : 2;
+
+  for( unsigned int step = 0; step < numberOfSteps; ++step )
+    {
+    for( unsigned int color = 0; color < numberOfColors; ++color )
+      {
+      this->ExecuteThreaded( this->SmoothCallback, level, color );
+      }
+    }
+}
+
+/**
+ * Compute the local system of a pixel
+ */
+template< class TDisplacementField >
+inline void
+VariationalRegistrationMultigridRegularizer< TDisplacementField >
+::ComputeLocalSystem( const LevelType & level, const PixelType * u,
+    const PixelType * f, OffsetValueType offset, const IndexType & index,
+    unsigned int c, double & sum, double & diagonal ) const
+{
+  sum = f[offset][c];
+  diagonal = 1.0;
+
+  // Second differences with Neumann boundary conditions.
+  const double * coefficient = level.Coefficient[c];
+  for( unsigned int d = 0; d < ImageDimension; ++d )
+    {
+    if( index[d] > 0 )
+      {
+      sum += coefficient[d] * u[offset - level.Stride[d]][c];
+      diagonal += coefficient[d];
+      }
+    if( index[d] + 1 < static_cast< OffsetValueType >( level.Size[d] ) )
+      {
+      sum += coefficient[d] * u[offset + level.Stride[d]][c];
+      diagonal += coefficient[d];
+      }
+    }
+
+  if( m_Operator != OPERATOR_ELASTIC )
+    {
+    return;
+    }
+
+  // Mixed differences of the other components. The operator is derived
+  // from the discrete energy sum_x (D_c u_c)(x) (D_d u_d)(x) of the mixed
+  // terms of (div u)^2, with central differences D_c whose indices are
+  // clamped at the boundary. Its gradient is D_c^T D_d u_d, i.e. the
+  // transposed difference in direction c of the difference of component d
+  // in direction d. The system matrix is thus symmetric, also at the
+  // boundary; in the interior, the stencil is the product of the central
+  // differences.
+  const OffsetValueType cStride = level.Stride[c];
+  const bool cFirst = ( index[c] == 0 );
+  const bool cLast = ( index[c] + 1 == static_cast< OffsetValueType >( level.Size[c] ) );
+  for( unsigned int d = 0; d < ImageDimension; ++d )
+    {
+    if( d == c )
+      {
+      continue;
+      }
+    const OffsetValueType dPlus = ( index[d] + 1 < static_cast< OffsetValueType >( level.Size[d] ) ) ? level.Stride[d] : 0;
+    const OffsetValueType dMinus = ( index[d] > 0 ) ? level.Stride[d] : 0;
+
+    // The clamped difference at the pixel replaces the missing neighbor in
+    // direction c with the opposite sign.
+    const double center = cFirst || cLast ?
+        u[offset + dPlus][d] - u[offset - dMinus][d] : 0.0;
+    const double upper = cLast ? -center :
+        u[offset + cStride + dPlus][d] - u[offset + cStride - dMinus][d];
+    const double lower = cFirst ? -center :
+        u[offset - cStride + dPlus][d] - u[offset - cStride - dMinus][d];
+    sum += level.MixedCoefficient[c][d] * ( upper - lower );
+    }
+}
+
+/**
+ * Compute the index of the first pixel of a row
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationMultigridRegularizer< TDisplacementField >
+::ComputeRowIndex( const LevelType & level, OffsetValueType row, IndexType & index )
+{
+  index[0] = 0;
+  for( unsigned int d = 1; d < ImageDimension; ++d )
+    {
+    const OffsetValueType size = level.Size[d];
+    index[d] = row % size;
+    row /= size;
+    }
+}
+
+/**
+ * Split the slowest dimension of a level
+ */
+template< class TDisplacementField >
+bool
+VariationalRegistrationMultigridRegularizer< TDisplacementField >
+::SplitLevel( const LevelType & level, ThreadIdType threadId,
+    ThreadIdType threadCount, OffsetValueType & begin, OffsetValueType & end ) const
+{
+  const OffsetValueType range = level.Size[ImageDimension - 1];
+  const OffsetValueType valuesPerThread = ( range + threadCount - 1 ) / threadCount;
+
+  begin = threadId * valuesPerThread;
+  end = std::min< OffsetValueType >( begin + valuesPerThread, range );
+  return begin < end;
+}
+
+/**
+ * Execute a callback multi-threaded
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationMultigridRegularizer< TDisplacementField >
+::ExecuteThreaded( ThreadFunctionType callback, unsigned int level, unsigned int color )
+{
+  MultigridThreadStruct str;
+  str.Filter = this;
+  str.level = level;
+  str.color = color;
+
+  this->GetMultiThreader()->SetNumberOfThreads( this->GetNumberOfThreads() );
+  this->GetMultiThreader()->SetSingleMethod( callback, &str );
+  this->GetMultiThreader()->SingleMethodExecute();
+}
+
+/**
+ * Callback function for threaded copying of the input
+ */
+template< class TDisplacementField >
+ITK_THREAD_RETURN_TYPE
+VariationalRegistrationMultigridRegularizer< TDisplacementField >
+::CopyInputCallback( void* arg )
+{
+  // Get MultiThreader struct
+  MultiThreader::ThreadInfoStruct* threadStruct =
+      (MultiThreader::ThreadInfoStruct *) arg;
+  ThreadIdType threadId = threadStruct->ThreadID;
+  ThreadIdType threadCount = threadStruct->NumberOfThreads;
+
+  // Get user struct
+  MultigridThreadStruct* userStruct =
+      (MultigridThreadStruct*) threadStruct->UserData;
+  Self* filter = userStruct->Filter;
+  const LevelType & level = filter->m_Levels[0];
+
+  OffsetValueType begin, end;
+  if( filter->SplitLevel( level, threadId, threadCount, begin, end ) )
+    {
+    const PixelType* in = filter->GetInput()->GetBufferPointer();
+    PixelType* out = filter->GetOutput()->GetBufferPointer();
+    PixelType* f = level.RightHandSide->GetBufferPointer();
+
+    // The output is the input if the filter runs in place.
+    const OffsetValueType stride = level.Stride[ImageDimension - 1];
+    for( OffsetValueType offset = begin * stride; offset < end * stride; ++offset )
+      {
+      f[offset] = in[offset];
+      if( out != in )
+        {
+        out[offset] = in[offset];
+        }
+      }
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/**
+ * Callback function for a threaded Gauss-Seidel step on one color.
+ *
+ * For efficiency reasons, this method operates directly on the image buffers.
+ */
+template< class TDisplacementField >
+ITK_THREAD_RETURN_TYPE
+VariationalRegistrationMultigridRegularizer< TDisplacementField >
+::SmoothCallback( void* arg )
+{
+  // Get MultiThreader struct
+  MultiThreader::ThreadInfoStruct* threadStruct =
+      (MultiThreader::ThreadInfoStruct *) arg;
+  ThreadIdType threadId = threadStruct->ThreadID;
+  ThreadIdType threadCount = threadStruct->NumberOfThreads;
+
+  // Get user struct
+  MultigridThreadStruct* userStruct =
+      (MultigridThreadStruct*) threadStruct->UserData;
+  Self* filter = userStruct->Filter;
+  const LevelType & level = filter->m_Levels[userStruct->level];
+  const unsigned int color = userStruct->color;
+
+  OffsetValueType begin, end;
+  if( filter->SplitLevel( level, threadId, threadCount, begin, end ) )
+    {
+    PixelType* u = level.Solution->GetBufferPointer();
+    const PixelType* f = level.RightHandSide->GetBufferPointer();
+    const bool elastic = ( filter->m_Operator == OPERATOR_ELASTIC );
+
+    const OffsetValueType rowSize = level.Size[0];
+    const OffsetValueType rowsPerSlice = level.Stride[ImageDimension - 1] / rowSize;
+
+    IndexType index;
+    double sum, diagonal;
+    for( OffsetValueType row = begin * rowsPerSlice; row < end * rowsPerSlice; ++row )
+      {
+      ComputeRowIndex( level, row, index );
+
+      // Find the first pixel of the color in the row. With 2^ImageDimension
+      // colors, bit d of the color is the parity of the index in
+      // dimension d; with two colors, the color is the parity of the sum
+      // of the indices.
+      OffsetValueType start = 0;
+      if( elastic )
+        {
+        bool skip = false;
+        for( unsigned int d = 1; d < ImageDimension; ++d )
+          {
+          if( static_cast< unsigned int >( index[d] & 1 ) != ( ( color >> d ) & 1 ) )
+            {
+            skip = true;
+            }
+          }
+        if( skip )
+          {
+          continue;
+          }
+        start = color & 1;
+        }
+      else
+        {
+        OffsetValueType parity = color;
+        for( unsigned int d = 1; d < ImageDimension; ++d )
+          {
+          parity += index[d];
+          }
+        start = parity & 1;
+        }
+
+      for( index[0] = start; index[0] < rowSize; index[0] += 2 )
+        {
+        const OffsetValueType offset = row * rowSize + index[0];
+        for( unsigned int c = 0; c < ImageDimension; ++c )
+          {
+          filter->ComputeLocalSystem( level, u, f, offset, index, c, sum, diagonal );
+          u[offset][c] = static_cast< ValueType >( sum / diagonal );
+          }
+        }
+      }
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/**
+ * Callback function for the threaded restriction of the residual. The
+ * residual is computed on the fly and not stored on the fine level.
+ */
+template< class TDisplacementField >
+ITK_THREAD_RETURN_TYPE
+VariationalRegistrationMultigridRegularizer< TDisplacementField >
+::RestrictCallback( void* arg )
+{
+  // Get MultiThreader struct
+  MultiThreader::ThreadInfoStruct* threadStruct =
+      (MultiThreader::ThreadInfoStruct *) arg;
+  ThreadIdType threadId = threadStruct->ThreadID;
+  ThreadIdType threadCount = threadStruct->NumberOfThreads;
+
+  // Get user struct; the level is the coarse level.
+  MultigridThreadStruct* userStruct =
+      (MultigridThreadStruct*) threadStruct->UserData;
+  Self* filter = userStruct->Filter;
+  const LevelType & coarse = filter->m_Levels[userStruct->level];
+  const LevelType & fine = filter->m_Levels[userStruct->level - 1];
+
+  OffsetValueType begin, end;
+  if( filter->SplitLevel( coarse, threadId, threadCount, begin, end ) )
+    {
+    PixelType* coarseU = coarse.Solution->GetBufferPointer();
+    PixelType* coarseF = coarse.RightHandSide->GetBufferPointer();
+    const PixelType* u = fine.Solution->GetBufferPointer();
+    const PixelType* f = fine.RightHandSide->GetBufferPointer();
+
+    const OffsetValueType rowSize = coarse.Size[0];
+    const OffsetValueType rowsPerSlice = coarse.Stride[ImageDimension - 1] / rowSize;
+
+    IndexType coarseIndex;
+    IndexType fineIndex;
+    double sum, diagonal;
+    double residual[ImageDimension];
+    for( OffsetValueType row = begin * rowsPerSlice; row < end * rowsPerSlice; ++row )
+      {
+      ComputeRowIndex( coarse, row, coarseIndex );
+      for( coarseIndex[0] = 0; coarseIndex[0] < rowSize; ++coarseIndex[0] )
+        {
+        for( unsigned int c = 0; c < ImageDimension; ++c )
+          {
+          residual[c] = 0.0;
+          }
+
+        // Average the residual over the fine pixels of the coarse pixel.
+        unsigned int count = 0;
+        for( unsigned int child = 0; child < ( 1u << ImageDimension ); ++child )
+          {
+          bool valid = true;
+          OffsetValueType fineOffset = 0;
+          for( unsigned int d = 0; d < ImageDimension && valid; ++d )
+            {
+            const unsigned int bit = ( child >> d ) & 1;
+            fineIndex[d] = coarseIndex[d] * fine.Factor[d] + bit;
+            valid = ( bit < fine.Factor[d] )
+                && fineIndex[d] < static_cast< OffsetValueType >( fine.Size[d] );
+            fineOffset += fineIndex[d] * fine.Stride[d];
+            }
+          if( !valid )
+            {
+            continue;
+            }
+
+          for( unsigned int c = 0; c < ImageDimension; ++c )
+            {
+            filter->ComputeLocalSystem( fine, u, f, fineOffset, fineIndex, c, sum, diagonal );
+            residual[c] += sum - diagonal * u[fineOffset][c];
+            }
+          ++count;
+          }
+
+        // The correction starts from zero.
+        const OffsetValueType offset = row * rowSize + coarseIndex[0];
+        for( unsigned int c = 0; c < ImageDimension; ++c )
+          {
+          coarseF[offset][c] = static_cast< ValueType >( residual[c] / count );
+          }
+        coarseU[offset].Fill( NumericTraits< ValueType >::Zero );
+        }
+      }
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/**
+ * Callback function for the threaded prolongation of the correction by
+ * linear interpolation between the cell centers of the coarse level.
+ */
+template< class TDisplacementField >
+ITK_THREAD_RETURN_TYPE
+VariationalRegistrationMultigridRegularizer< TDisplacementField >
+::ProlongateCallback( void* arg )
+{
+  // Get MultiThreader struct
+  MultiThreader::ThreadInfoStruct* threadStruct =
+      (MultiThreader::ThreadInfoStruct *) arg;
+  ThreadIdType threadId = threadStruct->ThreadID;
+  ThreadIdType threadCount = threadStruct->NumberOfThreads;
+
+  // Get user struct; the level is the fine level.
+  MultigridThreadStruct* userStruct =
+      (MultigridThreadStruct*) threadStruct->UserData;
+  Self* filter = userStruct->Filter;
+  const LevelType & fine = filter->m_Levels[userStruct->level];
+  const LevelType & coarse = filter->m_Levels[userStruct->level + 1];
+
+  OffsetValueType begin, end;
+  if( filter->SplitLevel( fine, threadId, threadCount, begin, end ) )
+    {
+    PixelType* u = fine.Solution->GetBufferPointer();
+    const PixelType* coarseU = coarse.Solution->GetBufferPointer();
+
+    const OffsetValueType rowSize = fine.Size[0];
+    const OffsetValueType rowsPerSlice = fine.Stride[ImageDimension - 1] / rowSize;
+
+    // Offsets and weights of the nearest (I) and second nearest (J) coarse
+    // cell center in each dimension.
+    OffsetValueType offsetI[ImageDimension];
+    OffsetValueType offsetJ[ImageDimension];
+    double weightI[ImageDimension];
+    double weightJ[ImageDimension];
+    double correction[ImageDimension];
+
+    IndexType index;
+    for( OffsetValueType row = begin * rowsPerSlice; row < end * rowsPerSlice; ++row )
+      {
+      ComputeRowIndex( fine, row, index );
+      for( index[0] = 0; index[0] < rowSize; ++index[0] )
+        {
+        for( unsigned int d = 0; d < ImageDimension; ++d )
+          {
+          if( d > 0 && index[0] > 0 )
+            {
+            // Constant within the row.
+            break;
+            }
+          const OffsetValueType I = index[d] / fine.Factor[d];
+          OffsetValueType J = ( index[d] & 1 ) ? I + 1 : I - 1;
+          if( fine.Factor[d] == 1 || J < 0 || J >= static_cast< OffsetValueType >( coarse.Size[d] ) )
+            {
+            J = I;
+            weightI[d] = 1.0;
+            weightJ[d] = 0.0;
+            }
+          else
+            {
+            weightI[d] = 0.75;
+            weightJ[d] = 0.25;
+            }
+          offsetI[d] = I * coarse.Stride[d];
+          offsetJ[d] = J * coarse.Stride[d];
+          }
+
+        for( unsigned int c = 0; c < ImageDimension; ++c )
+          {
+          correction[c] = 0.0;
+          }
+        for( unsigned int corner = 0; corner < ( 1u << ImageDimension ); ++corner )
+          {
+          double weight = 1.0;
+          OffsetValueType coarseOffset = 0;
+          for( unsigned int d = 0; d < ImageDimension; ++d )
+            {
+            if( ( corner >> d ) & 1 )
+              {
+              weight *= weightJ[d];
+              coarseOffset += offsetJ[d];
+              }
+            else
+              {
+              weight *= weightI[d];
+              coarseOffset += offsetI[d];
+              }
+            }
+          if( weight == 0.0 )
+            {
+            continue;
+            }
+          for( unsigned int c = 0; c < ImageDimension; ++c )
+            {
+            correction[c] += weight * coarseU[coarseOffset][c];
+            }
+          }
+
+        const OffsetValueType offset = row * rowSize + index[0];
+        for( unsigned int c = 0; c < ImageDimension; ++c )
+          {
+          u[offset][c] += static_cast< ValueType >( correction[c] );
+          }
+        }
+      }
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/**
+ * Estimate the number of bytes of the buffer images
+ */
+template< class TDisplacementField >
+SizeValueType
+VariationalRegistrationMultigridRegularizer< TDisplacementField >
+::EstimateBufferBytes( const RegionType & region ) const
+{
+  std::vector< SizeType > levelSizes;
+  this->ComputeLevelSizes( region.GetSize(), levelSizes );
+
+  // Right hand side of the finest level, solution and right hand side of
+  // the coarser levels.
+  SizeValueType numberOfPixels = region.GetNumberOfPixels();
+  for( unsigned int l = 1; l < levelSizes.size(); ++l )
+    {
+    SizeValueType levelPixels = 1;
+    for( unsigned int d = 0; d < ImageDimension; ++d )
+      {
+      levelPixels *= levelSizes[l][d];
+      }
+    numberOfPixels += 2 * levelPixels;
+    }
+  return numberOfPixels * sizeof( PixelType );
+}
+
+/**
+ * Get the number of bytes of the buffer images
+ */
+template< class TDisplacementField >
+SizeValueType
+VariationalRegistrationMultigridRegularizer< TDisplacementField >
+::GetAllocatedBytes() const
+{
+  SizeValueType numberOfPixels = 0;
+  for( unsigned int l = 0; l < m_Levels.size(); ++l )
+    {
+    const LevelType & level = m_Levels[l];
+    if( l > 0 && level.Solution )
+      {
+      numberOfPixels += level.Solution->GetPixelContainer()->Capacity();
+      }
+
+    // The right hand side of the finest level is accounted for by the
+    // workspace, if it is attached to one.
+    if( level.RightHandSide && ( l > 0 || !this->GetWorkspace() ) )
+      {
+      numberOfPixels += level.RightHandSide->GetPixelContainer()->Capacity();
+      }
+    }
+  return numberOfPixels * sizeof( PixelType );
+}
+
+/**
+ * Free the buffer images
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationMultigridRegularizer< TDisplacementField >
+::ReleaseBuffers()
+{
+  m_Levels.clear();
+
+  // Force reinitialization on the next update.
+  m_Size.Fill( 0 );
+}
+
+/*
+ * Print status information
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationMultigridRegularizer< TDisplacementField >
+::PrintSelf( std::ostream& os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+
+  os << indent << "Operator: ";
+  os << m_Operator << std::endl;
+  os << indent << "Alpha: ";
+  os << m_Alpha << std::endl;
+  os << indent << "Mu: ";
+  os << m_Mu << std::endl;
+  os << indent << "Lambda: ";
+  os << m_Lambda << std::endl;
+  os << indent << "NumberOfCycles: ";
+  os << m_NumberOfCycles << std::endl;
+  os << indent << "NumberOfSmoothingSteps: ";
+  os << m_NumberOfSmoothingSteps << std::endl;
+  os << indent << "NumberOfCoarsestLevelSteps: ";
+  os << m_NumberOfCoarsestLevelSteps << std::endl;
+  os << indent << "MinimumLevelSize: ";
+  os << m_MinimumLevelSize << std::endl;
+  os << indent << "NumberOfLevels: ";
+  os << m_Levels.size() << std::endl;
+  os << indent << "Size: ";
+  os << m_Size << std::endl;
+  os << indent << "Spacing: ";
+  os << m_Spacing << std::endl;
+}
+
+} // end namespace itk
+
+#endif
@@ -82,6 +82,11 @@ VariationalRegistrationNCCFunction< TFixedImage, TMovingImage, TDisplacementFiel
         << "MovingImage, FixedImage and/or Interpolator not set" );
     }
 
+  if( this->GetForceSamplingFraction() < 1.0 )
+    {
+    itkExceptionMacro( << "Force sampling is not supported by NCC forces" );
+    }
+
   // cache fixed image information
   SpacingType fixedImageSpacing = this->GetFixedImage()->GetSpacing();
 
@@ -235,7 +240,7 @@ VariationalRegistrationNCCFunction< TFixedImage, TMovingImage, TDisplacementFiel
 
   // Update the global data (metric etc.)
   GlobalDataStruct *globalData = (GlobalDataStruct *) gd;
-  if( globalData )
+  if( this->SampleMetric( globalData ) )
     {
     globalData->m_NumberOfPixelsProcessed += 1;
     // use 1 - CC to get a decreasing metric value
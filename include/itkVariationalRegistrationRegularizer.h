@@ -20,6 +20,8 @@
 
 #include "itkInPlaceImageFilter.h"
 #include "itkMultiThreader.h"
+#include "itkVariationalRegistrationWorkspace.h"
+#include "itkVariationalRegistrationInstrumentation.h"
 
 namespace itk {
 
@@ -68,9 +70,18 @@ public:
   typedef typename DisplacementFieldType::Pointer      DisplacementFieldPointer;
   typedef typename DisplacementFieldType::ConstPointer DisplacementFieldConstPointer;
   typedef typename DisplacementFieldType::PixelType    PixelType;
+  typedef typename DisplacementFieldType::RegionType   RegionType;
 
   typedef typename NumericTraits<PixelType>::ValueType ValueType;
 
+  /** Workspace type. */
+  typedef VariationalRegistrationWorkspace< DisplacementFieldType > WorkspaceType;
+  typedef typename WorkspaceType::Pointer                           WorkspacePointer;
+
+  /** Instrumentation type. */
+  typedef VariationalRegistrationInstrumentation   InstrumentationType;
+  typedef InstrumentationType::Pointer             InstrumentationPointer;
+
   /** Set whether the image spacing should be considered or not */
   itkSetMacro( UseImageSpacing, bool );
 
@@ -80,6 +91,34 @@ public:
   /** Set whether the image spacing should be considered or not */
   itkBooleanMacro( UseImageSpacing );
 
+  /** Set the workspace used for the internal buffers. If no workspace
+   *  is set, the buffers are allocated by the regularizer. */
+  itkSetObjectMacro( Workspace, WorkspaceType );
+
+  /** Get the workspace used for the internal buffers. */
+  itkGetObjectMacro( Workspace, WorkspaceType );
+
+  /** Set the instrumentation. Regularizers using transforms store the
+   *  transform and plan times per transform size in it. */
+  itkSetObjectMacro( Instrumentation, InstrumentationType );
+
+  /** Get the instrumentation. */
+  itkGetObjectMacro( Instrumentation, InstrumentationType );
+
+  /** Get an estimate of the number of bytes of the internal buffers needed
+   *  to regularize a field with the given region, excluding input and
+   *  output. Buffers attached to the workspace are included. */
+  virtual SizeValueType EstimateBufferBytes( const RegionType & ) const
+    { return 0; }
+
+  /** Get the number of bytes currently allocated for the internal buffers
+   *  outside of the workspace. */
+  virtual SizeValueType GetAllocatedBytes() const
+    { return 0; }
+
+  /** Free the internal buffers. They are allocated again by the next update. */
+  virtual void ReleaseBuffers() {}
+
 protected:
   VariationalRegistrationRegularizer();
   ~VariationalRegistrationRegularizer() {}
@@ -96,6 +135,12 @@ private:
 
   /** A boolean that indicates, if image spacing is considered. */
   bool m_UseImageSpacing;
+
+  /** Workspace for the internal buffers. */
+  WorkspacePointer m_Workspace;
+
+  /** Instrumentation for the transform times. */
+  InstrumentationPointer m_Instrumentation;
 };
 
 }
@@ -48,6 +48,10 @@ VariationalRegistrationRegularizer< TDisplacementField >
 
   os << indent << "UseImageSpacing: ";
   os << m_UseImageSpacing << std::endl;
+  os << indent << "Workspace: ";
+  os << m_Workspace.GetPointer() << std::endl;
+  os << indent << "Instrumentation: ";
+  os << m_Instrumentation.GetPointer() << std::endl;
 }
 
 } // end namespace itk
@@ -97,6 +97,12 @@ VariationalRegistrationSSDFunction< TFixedImage, TMovingImage, TDisplacementFiel
     return m_ZeroUpdateReturn;
     }
 
+  // Check if the force is computed at the index
+  if( !this->IsForceSampled( index ) )
+    {
+    return m_ZeroUpdateReturn;
+    }
+
   const double warpedValue = (double) this->GetWarpedImage()->GetPixel( index );
   const double fixedValue = (double) this->GetFixedImage()->GetPixel( index );
 
@@ -144,7 +150,7 @@ VariationalRegistrationSSDFunction< TFixedImage, TMovingImage, TDisplacementFiel
 
   // Update the global data (metric etc.)
   GlobalDataStruct *globalData = (GlobalDataStruct *) gd;
-  if( globalData )
+  if( this->SampleMetric( globalData ) )
     {
     globalData->m_NumberOfPixelsProcessed += 1;
     globalData->m_SumOfMetricValues += sqr_speedValue;
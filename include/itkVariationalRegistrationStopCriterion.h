@@ -20,6 +20,8 @@
 
 #include "itkCommand.h"
 #include "itkEventObject.h"
+#include "itkArray.h"
+#include "itkRealTimeClock.h"
 
 #include "itkVariationalRegistrationFilter.h"
 #include "itkVariationalRegistrationMultiResolutionFilter.h"
@@ -53,6 +55,21 @@ namespace itk {
  *      only increase count check on second finest level, no check (maximum number
  *      of iterations) on other levels
  *
+ *  Independent of the metric history, a budget for the whole run can be
+ *  set with a budget policy:
+ *    - Time: wall-clock time in seconds, measured from the initialize event
+ *      of the multi-resolution filter (or the first iteration, if the
+ *      criterion observes a registration filter only)
+ *    - Cost: number of processed pixels, i.e. each iteration costs the
+ *      number of pixels of its level
+ *  At the start of each level, the remaining budget is distributed over
+ *  the remaining levels according to the level budget weights, so that
+ *  budget not used by a level is available to the finer levels. A level is
+ *  stopped if the next iteration is projected to exceed its budget.
+ *  Additionally, the gain rate check stops a level if the metric decrease
+ *  per second, estimated from the regression line of the last metric values
+ *  and the measured iteration times, falls below a threshold.
+ *
  *  \sa VariationalRegistrationFilter
  *  \sa VariationalRegistrationMultiResolutionFilter
  *
@@ -91,6 +108,15 @@ public:
   /**  Get iteration modulus. */
   itkGetMacro( IterationModulus, int );
 
+  /** Let the registration filter compute the metric only in the iterations
+   *  in which the criterion is checked, i.e. every IterationModulus
+   *  iterations (see VariationalRegistrationFilter::SetComputeMetric()).
+   *  Increase count and line fitting then only use the metric values of
+   *  these iterations. Budgets are still checked in every iteration. */
+  itkSetMacro( SkipMetricOnUncheckedIterations, bool );
+  itkGetMacro( SkipMetricOnUncheckedIterations, bool );
+  itkBooleanMacro( SkipMetricOnUncheckedIterations );
+
   /** Perform increase count check. */
   itkSetMacro( PerformIncreaseCountCheck, bool );
   itkGetMacro( PerformIncreaseCountCheck, bool );
@@ -102,6 +128,9 @@ public:
   /** Get maximum increase count. */
   itkGetMacro( MaximumIncreaseCount, int );
 
+  /** Get the number of metric increases counted on the current level. */
+  itkGetMacro( CurrentIncreaseCount, int );
+
   /** Perform line fitting check. */
   itkSetMacro( PerformLineFittingCheck, bool );
   itkGetMacro( PerformLineFittingCheck, bool );
@@ -212,6 +241,103 @@ public:
   virtual void SetMultiResolutionPolicyToGraduated()
     { this->SetMultiResolutionPolicy( MULTI_RESOLUTION_POLICY_GRADUATED ); }
 
+  /** Enumerate for the different budget policies. */
+  enum BudgetPolicy {
+    BUDGET_POLICY_NONE = 0,
+    BUDGET_POLICY_TIME = 1,
+    BUDGET_POLICY_COST = 2
+  };
+
+  /** Set the budget policy. Three policies are provided:
+   * - None: No budget (default)
+   * - Time: Budget is the wall-clock time of the run in seconds
+   * - Cost: Budget is the number of pixels processed in the run, i.e. the
+   *   sum of the number of pixels of the levels over all iterations */
+  itkSetEnumMacro( BudgetPolicy, BudgetPolicy );
+
+  /** Get the budget policy. */
+  itkGetEnumMacro( BudgetPolicy, BudgetPolicy );
+
+  /** Do not use a budget. */
+  virtual void SetBudgetPolicyToNone()
+    { this->SetBudgetPolicy( BUDGET_POLICY_NONE ); }
+
+  /** Use a wall-clock time budget in seconds. */
+  virtual void SetBudgetPolicyToTime()
+    { this->SetBudgetPolicy( BUDGET_POLICY_TIME ); }
+
+  /** Use a budget of processed pixels. */
+  virtual void SetBudgetPolicyToCost()
+    { this->SetBudgetPolicy( BUDGET_POLICY_COST ); }
+
+  /** Set the budget of the whole run (seconds or pixels). */
+  itkSetMacro( Budget, double );
+
+  /** Get the budget of the whole run. */
+  itkGetMacro( Budget, double );
+
+  /** Array containing the level budget weights. */
+  typedef Array< double >                             LevelBudgetWeightsType;
+
+  /** Set the weights for distributing the budget over the levels, starting
+   *  with the coarsest level. At the start of each level, the remaining
+   *  budget times the weight of the level divided by the sum of the weights
+   *  of the remaining levels is assigned to the level. If the number of
+   *  weights differs from the number of levels, all levels are weighted
+   *  equally (default). */
+  itkSetMacro( LevelBudgetWeights, LevelBudgetWeightsType );
+
+  /** Get the level budget weights. */
+  itkGetConstReferenceMacro( LevelBudgetWeights, LevelBudgetWeightsType );
+
+  /** Get the budget assigned to the current level. */
+  itkGetMacro( LevelBudget, double );
+
+  /** Get the budget used on the current level. */
+  virtual double GetLevelUsedBudget() const;
+
+  /** Get the budget used in the current run. */
+  virtual double GetUsedBudget() const;
+
+  /** Perform gain rate check. */
+  itkSetMacro( PerformGainRateCheck, bool );
+  itkGetMacro( PerformGainRateCheck, bool );
+  itkBooleanMacro( PerformGainRateCheck );
+
+  /** Set the minimum gain rate, i.e. the relative decrease of the metric
+   *  per second. The decrease per iteration is the negative slope of the
+   *  regression line of the last NumberOfFittingIterations metric values,
+   *  divided by the maximum metric value of the level. */
+  itkSetMacro( MinimumGainRate, double );
+
+  /** Get the minimum gain rate. */
+  itkGetMacro( MinimumGainRate, double );
+
+  /** Get the current gain rate (zero if not enough iterations were
+   *  performed on the current level). */
+  itkGetMacro( GainRate, double );
+
+  /** Get the mean wall-clock time of the last iterations in seconds. */
+  virtual double GetMeanIterationTime() const;
+
+  /** Increase the force sampling density instead of stopping. If the
+   *  registration filter computes sampled forces (see
+   *  VariationalRegistrationFilter::SetForceSamplingFraction()) and the
+   *  criterion is fulfilled, the current force sampling fraction is
+   *  multiplied by ForceSamplingIncreaseFactor and the metric history of
+   *  the level is restarted. The level is stopped when the criterion is
+   *  fulfilled with dense forces or the budget is exhausted. */
+  itkSetMacro( AdaptForceSampling, bool );
+  itkGetMacro( AdaptForceSampling, bool );
+  itkBooleanMacro( AdaptForceSampling );
+
+  /** Set the factor by which the force sampling fraction is increased.
+   *  Default is 2. */
+  itkSetClampMacro( ForceSamplingIncreaseFactor, double, 1.0, NumericTraits< double >::max() );
+
+  /** Get the force sampling increase factor. */
+  itkGetMacro( ForceSamplingIncreaseFactor, double );
+
   virtual void Execute( itk::Object *caller, const itk::EventObject & event ) ITK_OVERRIDE;
 
   virtual void Execute( const itk::Object *caller, const itk::EventObject & event ) ITK_OVERRIDE;
@@ -228,6 +354,25 @@ protected:
   virtual void SetModeForNextLevel(
       const unsigned int nextLevel, const unsigned int numberOfLevels );
 
+  /** Start the run, i.e. reset the used budget. */
+  virtual void StartRun();
+
+  /** Assign the budget of the next level. */
+  virtual void SetBudgetForNextLevel(
+      const unsigned int nextLevel, const unsigned int numberOfLevels );
+
+  /** Set the cost of the current iteration and measure its wall-clock time.
+   *  Must be called before SetNextMetricValue().
+   * \param cost The number of pixels of the current iteration. */
+  virtual void SetNextIterationCost( const double cost );
+
+  /** Check if the next iteration is projected to exceed the budget of the
+   *  level. */
+  virtual bool CheckBudget();
+
+  /** Check if the gain rate is below the minimum gain rate. */
+  virtual bool CheckGainRate();
+
   /** Set the metric value for the current iteration.
    * \param value The metric value of the current iteration. */
   virtual void SetNextMetricValue( const double value );
@@ -235,6 +380,10 @@ protected:
   /** Reset the fitting data. */
   virtual void ResetFittingData();
 
+  /** Discard the metric values of the level, but keep the iteration count
+   *  and times. */
+  virtual void ResetMetricHistory();
+
   /** Perform the checking of the stop criterion.
    * \return Result of the stopping check. */
   virtual bool CheckStopRegistration();
@@ -252,7 +401,9 @@ private:
 
   // General parameter.
   int                   m_IterationModulus;  // Only check every mod iterations.
-  int                   m_ElapsedIterations; // The number of elapsed iterations.
+  int                   m_ElapsedIterations; // The number of metric values on the level.
+  int                   m_LevelIterations;   // The number of iterations on the level.
+  bool                  m_SkipMetricOnUncheckedIterations;
 
   // Member for increase count calculation.
   bool                  m_PerformIncreaseCountCheck; // Perform increase count check?
@@ -278,6 +429,32 @@ private:
   double*               m_DistanceArray;
   double*               m_IterationArray;
   double*               m_DistanceArrayForFitting;
+
+  // Member for the budget.
+  BudgetPolicy          m_BudgetPolicy;
+  double                m_Budget;
+  LevelBudgetWeightsType m_LevelBudgetWeights;
+  double                m_LevelBudget;
+
+  // Member for the gain rate check.
+  bool                  m_PerformGainRateCheck;
+  double                m_MinimumGainRate;
+  double                m_GainRate;
+
+  // Wall-clock times and costs of the run, the level and the iterations.
+  RealTimeClock::Pointer m_Clock;
+  double                m_RunStartTime;      // Negative if not started.
+  bool                  m_RunStartedByMRFilter;
+  double                m_LevelStartTime;
+  double                m_LastIterationTime;
+  double                m_RunCost;
+  double                m_LevelCost;
+  double                m_LastIterationCost;
+  double*               m_IterationTimeArray; // Times of the fitting iterations.
+
+  // Member for the adaptive force sampling.
+  bool                  m_AdaptForceSampling;
+  double                m_ForceSamplingIncreaseFactor;
 };
 
 } // end namespace itk
@@ -37,7 +37,11 @@ VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
 
   // Initialize general parameters.
   m_ElapsedIterations = 0;
+  m_LevelIterations = 0;
   m_IterationModulus = 1;
+  m_SkipMetricOnUncheckedIterations = false;
+  m_AdaptForceSampling = false;
+  m_ForceSamplingIncreaseFactor = 2.0;
 
   // Initialize increase count parameters.
   m_PerformIncreaseCountCheck = false;
@@ -57,6 +61,26 @@ VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
   m_IterationArray = NULL;
   m_DistanceArray = NULL;
   m_DistanceArrayForFitting = NULL;
+  m_IterationTimeArray = NULL;
+
+  // Initialize budget parameters.
+  m_BudgetPolicy = BUDGET_POLICY_NONE;
+  m_Budget = 0.0;
+  m_LevelBudget = 0.0;
+
+  // Initialize gain rate parameters.
+  m_PerformGainRateCheck = false;
+  m_MinimumGainRate = 0.0;
+  m_GainRate = 0.0;
+
+  m_Clock = RealTimeClock::New();
+  m_RunStartTime = -1.0;
+  m_RunStartedByMRFilter = false;
+  m_LevelStartTime = 0.0;
+  m_LastIterationTime = 0.0;
+  m_RunCost = 0.0;
+  m_LevelCost = 0.0;
+  m_LastIterationCost = 0.0;
 
   m_MaxMetricValue = NumericTraits<double>::min();
   m_MinMetricValue = NumericTraits<double>::max();
@@ -77,6 +101,8 @@ VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
     delete[] m_DistanceArray;
   if( m_DistanceArrayForFitting != NULL )
     delete[] m_DistanceArrayForFitting;
+  if( m_IterationTimeArray != NULL )
+    delete[] m_IterationTimeArray;
 }
 
 /**
@@ -121,6 +147,11 @@ VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
 
       //Reset data before new measurement
       this->ResetFittingData();
+
+      // Assign the remaining budget to the next level
+      this->SetBudgetForNextLevel(
+          mrFilter->GetElapsedLevels(),
+          mrFilter->GetNumberOfLevels() );
       }
 
     // If caller is registration filter, log metric of last iteration
@@ -128,14 +159,53 @@ VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
     else
       if( regFilter )
         {
-        // Set next metric value
-        this->SetNextMetricValue( regFilter->GetMetric() );
+        // Without MR filter, each update of the registration filter is a
+        // run with a single level
+        if( !m_RunStartedByMRFilter && regFilter->GetElapsedIterations() <= 1 )
+          {
+          this->StartRun();
+          this->SetBudgetForNextLevel( 0, 1 );
+          }
+
+        // Set cost of the iteration
+        this->SetNextIterationCost( static_cast< double >(
+            regFilter->GetOutput()->GetBufferedRegion().GetNumberOfPixels() ) );
+
+        // Perform check if the metric was computed in this iteration,
+        // otherwise only check the budget, and stop registration if check
+        // was positive
+        bool stop = false;
+        if( regFilter->GetMetricUpdated() )
+          {
+          this->SetNextMetricValue( regFilter->GetMetric() );
+          stop = this->CheckStopRegistration();
+
+          // Continue with denser forces if the budget allows
+          const double fraction = regFilter->GetCurrentForceSamplingFraction();
+          if( stop && m_AdaptForceSampling && fraction < 1.0 && !this->CheckBudget() )
+            {
+            regFilter->SetCurrentForceSamplingFraction( vnl_math_min(
+                fraction * m_ForceSamplingIncreaseFactor, 1.0 ) );
+            this->ResetMetricHistory();
+            stop = false;
+            }
+          }
+        else
+          {
+          stop = this->CheckBudget();
+          }
 
-        // Perform check and stop registration if check was positive
-        if( this->CheckStopRegistration() )
+        if( stop )
           {
           regFilter->StopRegistration();
           }
+
+        // Request the metric only for the next checked iteration
+        if( m_SkipMetricOnUncheckedIterations )
+          {
+          regFilter->SetComputeMetric( m_IterationModulus <= 1
+              || (m_LevelIterations + 2) % m_IterationModulus == 0 );
+          }
         }
     }
 
@@ -149,6 +219,10 @@ VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
 
       if( mrFilter )
         {
+        // Start measuring time and cost of the run
+        m_RunStartedByMRFilter = true;
+        this->StartRun();
+
         // Set the mode for the next level according to MR policy
         this->SetModeForNextLevel(
             mrFilter->GetElapsedLevels(),
@@ -156,6 +230,11 @@ VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
 
         //Reset data before new measurement
         this->ResetFittingData();
+
+        // Assign the budget to the first level
+        this->SetBudgetForNextLevel(
+            mrFilter->GetElapsedLevels(),
+            mrFilter->GetNumberOfLevels() );
         }
       }
 }
@@ -224,6 +303,232 @@ VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
     }
 }
 
+/**
+ * Start the run
+ */
+template< class TRegistrationFilter, class TMRFilter >
+void
+VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
+::StartRun()
+{
+  m_RunStartTime = m_Clock->GetTimeInSeconds();
+  m_LevelStartTime = m_RunStartTime;
+  m_LastIterationTime = m_RunStartTime;
+  m_RunCost = 0.0;
+  m_LevelCost = 0.0;
+  m_LastIterationCost = 0.0;
+}
+
+/**
+ * Distribute the remaining budget over the remaining levels
+ */
+template< class TRegistrationFilter, class TMRFilter >
+void
+VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
+::SetBudgetForNextLevel(
+    const unsigned int nextLevel,
+    const unsigned int numberOfLevels )
+{
+  m_LevelStartTime = m_Clock->GetTimeInSeconds();
+  m_LastIterationTime = m_LevelStartTime;
+  m_LevelCost = 0.0;
+  m_LastIterationCost = 0.0;
+
+  if( nextLevel >= numberOfLevels )
+    {
+    m_LevelBudget = 0.0;
+    return;
+    }
+
+  // Equal weights, if the weights do not match the levels.
+  double levelWeight = 1.0;
+  double remainingWeight = static_cast< double >( numberOfLevels - nextLevel );
+  if( m_LevelBudgetWeights.GetSize() == numberOfLevels )
+    {
+    levelWeight = m_LevelBudgetWeights[nextLevel];
+    remainingWeight = 0.0;
+    for( unsigned int level = nextLevel; level < numberOfLevels; level++ )
+      {
+      remainingWeight += m_LevelBudgetWeights[level];
+      }
+    }
+
+  const double remainingBudget = vnl_math_max( m_Budget - this->GetUsedBudget(), 0.0 );
+  if( remainingWeight > 0.0 )
+    {
+    m_LevelBudget = remainingBudget * levelWeight / remainingWeight;
+    }
+  else
+    {
+    m_LevelBudget = remainingBudget;
+    }
+  itkDebugMacro( << "Budget of level " << nextLevel << ": " << m_LevelBudget );
+}
+
+/**
+ * Set the cost and measure the time of the current iteration
+ */
+template< class TRegistrationFilter, class TMRFilter >
+void
+VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
+::SetNextIterationCost( const double cost )
+{
+  const double time = m_Clock->GetTimeInSeconds();
+
+  unsigned int index = m_LevelIterations % m_NumberOfFittingIterations;
+  m_IterationTimeArray[index] = time - m_LastIterationTime;
+  m_LevelIterations++;
+
+  m_LastIterationTime = time;
+  m_LastIterationCost = cost;
+  m_LevelCost += cost;
+  m_RunCost += cost;
+}
+
+/**
+ * Get the budget used on the current level
+ */
+template< class TRegistrationFilter, class TMRFilter >
+double
+VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
+::GetLevelUsedBudget() const
+{
+  switch( m_BudgetPolicy )
+    {
+  case BUDGET_POLICY_TIME :
+    return m_RunStartTime < 0.0 ? 0.0 : m_Clock->GetTimeInSeconds() - m_LevelStartTime;
+  case BUDGET_POLICY_COST :
+    return m_LevelCost;
+  default :
+    return 0.0;
+    }
+}
+
+/**
+ * Get the budget used in the current run
+ */
+template< class TRegistrationFilter, class TMRFilter >
+double
+VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
+::GetUsedBudget() const
+{
+  switch( m_BudgetPolicy )
+    {
+  case BUDGET_POLICY_TIME :
+    return m_RunStartTime < 0.0 ? 0.0 : m_Clock->GetTimeInSeconds() - m_RunStartTime;
+  case BUDGET_POLICY_COST :
+    return m_RunCost;
+  default :
+    return 0.0;
+    }
+}
+
+/**
+ * Get the mean time of the iterations in the fitting window
+ */
+template< class TRegistrationFilter, class TMRFilter >
+double
+VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
+::GetMeanIterationTime() const
+{
+  const int n = vnl_math_min( m_LevelIterations, m_NumberOfFittingIterations );
+  if( n <= 0 )
+    {
+    return 0.0;
+    }
+
+  double time = 0.0;
+  for( int k = 0; k < n; k++ )
+    {
+    time += m_IterationTimeArray[k];
+    }
+  return time / n;
+}
+
+/**
+ * Check if the next iteration would exceed the budget of the level
+ */
+template< class TRegistrationFilter, class TMRFilter >
+bool
+VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
+::CheckBudget()
+{
+  switch( m_BudgetPolicy )
+    {
+  case BUDGET_POLICY_NONE :
+    return false;
+
+  case BUDGET_POLICY_TIME :
+    // Project the time of the next iteration from the last iterations.
+    return this->GetLevelUsedBudget() + this->GetMeanIterationTime() > m_LevelBudget;
+
+  case BUDGET_POLICY_COST :
+    // The next iteration costs as much as the last one.
+    return m_LevelCost + m_LastIterationCost > m_LevelBudget;
+
+  default :
+    itkExceptionMacro( << "Unknown budget policy!" );
+    break;
+    }
+  return false;
+}
+
+/**
+ * Check if the metric decrease per second is below the threshold
+ */
+template< class TRegistrationFilter, class TMRFilter >
+bool
+VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
+::CheckGainRate()
+{
+  m_GainRate = 0.0;
+
+  // Check if minimal number of iterations for performing line fitting is reached.
+  if( m_ElapsedIterations < m_NumberOfFittingIterations || m_MaxMetricValue <= 0.0 )
+    {
+    return false;
+    }
+
+  const double meanIterationTime = this->GetMeanIterationTime();
+  if( meanIterationTime <= 0.0 )
+    {
+    return false;
+    }
+
+  // Metric decrease per iteration relative to the maximum metric value,
+  // divided by the time per iteration.
+  double m = 0.0;
+  double b = 0.0;
+  this->FitLine( m_IterationArray, m_DistanceArray, m_NumberOfFittingIterations, &m, &b );
+  m_GainRate = -m / ( m_MaxMetricValue * meanIterationTime );
+  itkDebugMacro( << "Gain rate: " << m_GainRate );
+
+  return m_GainRate < m_MinimumGainRate;
+}
+
+/**
+ * Discard the metric values of the level
+ */
+template< class TRegistrationFilter, class TMRFilter >
+void
+VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
+::ResetMetricHistory()
+{
+  m_ElapsedIterations = 0;
+  m_CurrentIncreaseCount = 0;
+
+  m_MaxMetricValue = NumericTraits< double >::max();
+  m_MinMetricValue = NumericTraits< double >::max();
+
+  for( int i = 0; i < m_NumberOfFittingIterations; i++ )
+    {
+    m_IterationArray[i] = NumericTraits< double >::ZeroValue();
+    m_DistanceArray[i] = NumericTraits< double >::NonpositiveMin();
+    m_DistanceArrayForFitting[i] = NumericTraits< double >::NonpositiveMin();
+    }
+  m_GainRate = 0.0;
+}
+
 /**
  * Reset the fitting data
  */
@@ -233,6 +538,7 @@ VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
 ::ResetFittingData()
 {
   m_ElapsedIterations = 0;
+  m_LevelIterations = 0;
   m_CurrentIncreaseCount = 0;
 
   m_MaxMetricValue = NumericTraits< double >::max();
@@ -244,17 +550,22 @@ VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
     delete[] m_DistanceArray;
   if( m_DistanceArrayForFitting != NULL )
     delete[] m_DistanceArrayForFitting;
+  if( m_IterationTimeArray != NULL )
+    delete[] m_IterationTimeArray;
 
   m_IterationArray = new double[m_NumberOfFittingIterations];
   m_DistanceArray = new double[m_NumberOfFittingIterations];
   m_DistanceArrayForFitting = new double[m_NumberOfFittingIterations];
+  m_IterationTimeArray = new double[m_NumberOfFittingIterations];
 
   for( int i = 0; i < m_NumberOfFittingIterations; i++ )
     {
     m_IterationArray[i] = NumericTraits< double >::ZeroValue();
     m_DistanceArray[i] = NumericTraits< double >::NonpositiveMin();
     m_DistanceArrayForFitting[i] = NumericTraits< double >::NonpositiveMin();
+    m_IterationTimeArray[i] = 0.0;
     }
+  m_GainRate = 0.0;
 }
 
 /**
@@ -314,9 +625,12 @@ VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
       }
     }
 
+  // The iteration of the value is the last iteration on the level, if the
+  // iterations are counted by SetNextIterationCost().
   unsigned int index = m_ElapsedIterations % m_NumberOfFittingIterations;
   m_DistanceArray[index] = absValue;
-  m_IterationArray[index] = static_cast< double >( m_ElapsedIterations );
+  m_IterationArray[index] = static_cast< double >(
+      m_LevelIterations > 0 ? m_LevelIterations - 1 : m_ElapsedIterations );
 
   m_ElapsedIterations++;
 }
@@ -329,12 +643,29 @@ bool
 VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
 ::CheckStopRegistration()
 {
+  // The budget is checked in every iteration.
+  if( this->CheckBudget() )
+    {
+    return true;
+    }
+
   // Check modulus if e.g. only every fifth iteration should be checked.
-  if( (m_ElapsedIterations + 1) % m_IterationModulus != 0 )
+  const int iterations = m_LevelIterations > 0 ? m_LevelIterations : m_ElapsedIterations;
+  if( (iterations + 1) % m_IterationModulus != 0 )
     {
     return false;
     }
 
+  //--------------------------------------
+  //
+  // perform checking for GAIN_RATE
+  //
+  //--------------------------------------
+  if( m_PerformGainRateCheck && this->CheckGainRate() )
+    {
+    return true;
+    }
+
   //--------------------------------------
   //
   // perform checking for INCREASE_COUNT
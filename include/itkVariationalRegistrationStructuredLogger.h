@@ -0,0 +1,248 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkVariationalRegistrationStructuredLogger_h
+#define itkVariationalRegistrationStructuredLogger_h
+
+#include "itkCommand.h"
+#include "itkEventObject.h"
+#include "itkAtomicInt.h"
+#include "itkConditionVariable.h"
+#include "itkMultiThreader.h"
+#include "itkSimpleMutexLock.h"
+#include "itkRealTimeClock.h"
+
+#include "itkVariationalRegistrationInstrumentation.h"
+#include "itkVariationalRegistrationStopCriterion.h"
+
+#include <fstream>
+#include <vector>
+
+namespace itk {
+
+/** \class itk::VariationalRegistrationStructuredLogger
+ *  \brief An observer writing machine-readable records of the registration process as JSON lines or CSV.
+ *
+ *  VariationalRegistrationStructuredLogger is used like
+ *  VariationalRegistrationLogger: connect it with AddObserver() to the
+ *  IterationEvent of VariationalRegistrationFilter and to the IterationEvent
+ *  and InitializeEvent of VariationalRegistrationMultiResolutionFilter.
+ *  Instead of printing text, it writes one record per iteration ("iteration")
+ *  and per finished level ("level") with the fields
+ *    - level and iteration,
+ *    - metric value and RMS change,
+ *    - whether the registration was stopped and the increase count of the
+ *      stop criterion set via SetStopCriterion(),
+ *    - the phase times, number of threads and allocated bytes recorded by
+ *      the instrumentation of the registration filter (zero if no
+ *      instrumentation is set),
+ *    - the wall-clock time in seconds since the initialize event.
+ *  The output format is either JSON lines (one JSON object per line) or CSV
+ *  with a header line. The records are written to the file set via
+ *  SetFileName(), or to std::cout if no file name is set.
+ *
+ *  The observer never waits for the output: records are copied into a
+ *  single-producer ring buffer of BufferSize records, from which a
+ *  background thread formats and writes them. The background thread sleeps
+ *  on a condition variable until a record is pushed; the mutex guarding it
+ *  is only held to check for records, never while formatting or writing.
+ *  If the buffer is full, the record is dropped and counted in
+ *  NumberOfDroppedRecords. Flush() waits
+ *  until all records are written and stops the background thread; it is
+ *  called on destruction. The producer side must only be called from one
+ *  thread at a time, i.e. a logger must not be shared between concurrent
+ *  registrations. To see whether the stop criterion stopped the
+ *  registration in an iteration, add the logger after the stop criterion.
+ *
+ *  \sa VariationalRegistrationLogger
+ *  \sa VariationalRegistrationInstrumentation
+ *
+ *  \ingroup VariationalRegistration
+ */
+template< class TRegistrationFilter, class TMRFilter >
+class VariationalRegistrationStructuredLogger
+  : public Command
+{
+public:
+  /** Standard class typedefs. */
+  typedef VariationalRegistrationStructuredLogger     Self;
+  typedef Command                                     Superclass;
+  typedef SmartPointer< Self >                        Pointer;
+  typedef SmartPointer< const Self >                  ConstPointer;
+
+  /** Registration and MR filter types */
+  typedef TRegistrationFilter                         RegistrationFilterType;
+  typedef TMRFilter                                   MRFilterType;
+
+  /** Stop criterion type. */
+  typedef VariationalRegistrationStopCriterion< TRegistrationFilter, TMRFilter >
+                                                      StopCriterionType;
+
+  /** Instrumentation type. */
+  typedef VariationalRegistrationInstrumentation      InstrumentationType;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro(VariationalRegistrationStructuredLogger, Command);
+
+  /** Enumerate for the output formats. */
+  enum OutputFormat {
+    OUTPUT_FORMAT_JSON_LINES = 0,
+    OUTPUT_FORMAT_CSV = 1
+  };
+
+  /** Set/Get the output format. Default is JSON lines. */
+  itkSetEnumMacro( OutputFormat, OutputFormat );
+  itkGetEnumMacro( OutputFormat, OutputFormat );
+
+  /** Write one JSON object per line. */
+  virtual void SetOutputFormatToJSONLines()
+    { this->SetOutputFormat( OUTPUT_FORMAT_JSON_LINES ); }
+
+  /** Write comma-separated values with a header line. */
+  virtual void SetOutputFormatToCSV()
+    { this->SetOutputFormat( OUTPUT_FORMAT_CSV ); }
+
+  /** Set/Get the output file. If empty (default), std::cout is used. The
+   *  file is created on the first record and appended to afterwards. */
+  itkSetStringMacro( FileName );
+  itkGetStringMacro( FileName );
+
+  /** Set/Get the number of records in the ring buffer. Takes effect when
+   *  the background thread is started. Default is 4096. */
+  itkSetClampMacro( BufferSize, SizeValueType, 2, NumericTraits< SizeValueType >::max() );
+  itkGetConstMacro( BufferSize, SizeValueType );
+
+  /** Set the stop criterion whose state is logged. Optional. */
+  itkSetObjectMacro( StopCriterion, StopCriterionType );
+
+  /** Get the stop criterion. */
+  itkGetObjectMacro( StopCriterion, StopCriterionType );
+
+  /** Get the number of records dropped because the buffer was full. */
+  itkGetConstMacro( NumberOfDroppedRecords, SizeValueType );
+
+  /** Write all pending records and stop the background thread. */
+  void Flush();
+
+  /** Log levels or iterations on IterationEvent or InitializeEvent */
+  virtual void Execute( itk::Object *caller, const itk::EventObject & event ) ITK_OVERRIDE
+    {
+      Execute( (const itk::Object *)caller, event);
+    }
+
+  /** Log levels or iterations on IterationEvent or InitializeEvent */
+  virtual void Execute( const itk::Object *caller, const itk::EventObject & event ) ITK_OVERRIDE;
+
+protected:
+  VariationalRegistrationStructuredLogger();
+  ~VariationalRegistrationStructuredLogger();
+
+  /** Print information about the logger. */
+  virtual void PrintSelf(std::ostream& os, Indent indent) const ITK_OVERRIDE;
+
+  /** Types of records. */
+  enum RecordEvent {
+    RECORD_EVENT_ITERATION = 0,
+    RECORD_EVENT_LEVEL = 1
+  };
+
+  /** Data of a record. Plain data only, as records are copied into the
+   *  ring buffer by the registration thread. */
+  struct RecordType
+    {
+    RecordEvent   Event;
+    unsigned int  Level;
+    unsigned int  Iteration;
+    double        Metric;
+    double        RMSChange;
+    bool          Stopped;
+    int           IncreaseCount;
+    double        PhaseTime[InstrumentationType::NumberOfPhases];
+    ThreadIdType  NumberOfThreads;
+    SizeValueType AllocatedBytes;
+    double        Time;
+    };
+
+  /** Copy a record into the ring buffer, or drop it if the buffer is full.
+   *  Starts the background thread on the first record. */
+  void PushRecord( const RecordType & record );
+
+  /** Write the records in the ring buffer to the stream. Called by the
+   *  background thread. */
+  void DrainRecords();
+
+  /** Format a record. */
+  virtual void WriteRecord( std::ostream & os, const RecordType & record ) const;
+
+  /** Write the CSV header. */
+  virtual void WriteHeader( std::ostream & os ) const;
+
+  /** Open the output and start the background thread. */
+  void StartWriter();
+
+  /** Loop of the background thread. */
+  static ITK_THREAD_RETURN_TYPE WriterCallback( void *arg );
+
+private:
+  VariationalRegistrationStructuredLogger(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  OutputFormat                   m_OutputFormat;
+  std::string                    m_FileName;
+  SizeValueType                  m_BufferSize;
+
+  typename StopCriterionType::Pointer m_StopCriterion;
+
+  /** Ring buffer. m_Head is only written by the producer and m_Tail only
+   *  by the background thread; both count records since the start. */
+  std::vector< RecordType >      m_Buffer;
+  AtomicInt< SizeValueType >     m_Head;
+  AtomicInt< SizeValueType >     m_Tail;
+  SizeValueType                  m_NumberOfDroppedRecords;
+
+  /** Background thread. */
+  MultiThreader::Pointer         m_Threader;
+  ThreadIdType                   m_WriterThreadId;
+  bool                           m_WriterRunning;
+  AtomicInt< int >               m_StopWriter;
+
+  /** Wakes the background thread on new records and on Flush(). */
+  SimpleMutexLock                m_WriterMutex;
+  ConditionVariable::Pointer     m_WriterCondition;
+
+  /** Output, only used by the background thread while it is running. */
+  std::ofstream                  m_FileStream;
+  bool                           m_FileOpened;
+  bool                           m_HeaderWritten;
+
+  /** State of the producer. */
+  RealTimeClock::Pointer         m_Clock;
+  double                         m_StartTime;
+  unsigned int                   m_CurrentLevel;
+  RecordType                     m_LastRecord;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkVariationalRegistrationStructuredLogger.hxx"
+#endif
+
+#endif
@@ -0,0 +1,451 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkVariationalRegistrationStructuredLogger_hxx
+#define itkVariationalRegistrationStructuredLogger_hxx
+
+#include "vnl/vnl_math.h"
+#include "itkVariationalRegistrationStructuredLogger.h"
+
+#include "itkVariationalRegistrationFilter.h"
+#include "itkVariationalRegistrationMultiResolutionFilter.h"
+#include "itksys/SystemTools.hxx"
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+
+namespace itk
+{
+
+/**
+ * Default constructor
+ */
+template< class TRegistrationFilter, class TMRFilter >
+VariationalRegistrationStructuredLogger< TRegistrationFilter, TMRFilter >
+::VariationalRegistrationStructuredLogger()
+{
+  m_OutputFormat = OUTPUT_FORMAT_JSON_LINES;
+  m_BufferSize = 4096;
+
+  m_Head = 0;
+  m_Tail = 0;
+  m_NumberOfDroppedRecords = 0;
+
+  m_Threader = MultiThreader::New();
+  m_WriterThreadId = 0;
+  m_WriterRunning = false;
+  m_StopWriter = 0;
+  m_WriterCondition = ConditionVariable::New();
+
+  m_FileOpened = false;
+  m_HeaderWritten = false;
+
+  m_Clock = RealTimeClock::New();
+  m_StartTime = m_Clock->GetTimeInSeconds();
+  m_CurrentLevel = 0;
+
+  m_LastRecord.Event = RECORD_EVENT_ITERATION;
+  m_LastRecord.Level = 0;
+  m_LastRecord.Iteration = 0;
+  m_LastRecord.Metric = 0.0;
+  m_LastRecord.RMSChange = 0.0;
+  m_LastRecord.Stopped = false;
+  m_LastRecord.IncreaseCount = 0;
+  for( unsigned int i = 0; i < InstrumentationType::NumberOfPhases; i++ )
+    {
+    m_LastRecord.PhaseTime[i] = 0.0;
+    }
+  m_LastRecord.NumberOfThreads = 0;
+  m_LastRecord.AllocatedBytes = 0;
+  m_LastRecord.Time = 0.0;
+}
+
+/**
+ * Default destructor
+ */
+template< class TRegistrationFilter, class TMRFilter >
+VariationalRegistrationStructuredLogger< TRegistrationFilter, TMRFilter >
+::~VariationalRegistrationStructuredLogger()
+{
+  this->Flush();
+}
+
+/**
+ * Handle iteration and initialize events
+ */
+template< class TRegistrationFilter, class TMRFilter >
+void
+VariationalRegistrationStructuredLogger< TRegistrationFilter, TMRFilter >
+::Execute( const itk::Object *caller, const itk::EventObject & event )
+{
+  // If event is an iteration event, check if thrown by registration
+  // or multi resolution filter
+  if( itk::IterationEvent().CheckEvent( &event ) )
+    {
+    // Cast caller for subsequent check
+    const RegistrationFilterType* regFilter =
+        dynamic_cast< const RegistrationFilterType* >( caller );
+
+    const MRFilterType* mrFilter =
+        dynamic_cast< const MRFilterType* >( caller );
+
+    // If caller is MR filter, log the finished level with the values of
+    // its last iteration
+    if( mrFilter )
+      {
+      RecordType record = m_LastRecord;
+      record.Event = RECORD_EVENT_LEVEL;
+      record.Level = mrFilter->GetElapsedLevels() - 1;
+      record.Time = m_Clock->GetTimeInSeconds() - m_StartTime;
+      this->PushRecord( record );
+
+      m_CurrentLevel = mrFilter->GetElapsedLevels();
+      }
+
+    // If caller is registration filter, log the last iteration
+    else
+      if( regFilter )
+        {
+        RecordType record;
+        record.Event = RECORD_EVENT_ITERATION;
+        record.Level = m_CurrentLevel;
+        record.Iteration = regFilter->GetElapsedIterations();
+        record.Metric = regFilter->GetMetric();
+        record.RMSChange = regFilter->GetRMSChange();
+        record.Stopped = regFilter->GetStopRegistrationFlag();
+        record.IncreaseCount = m_StopCriterion ? m_StopCriterion->GetCurrentIncreaseCount() : 0;
+
+        // The record of the current iteration is complete up to its
+        // elapsed time when the iteration event is invoked.
+        const InstrumentationType * instrumentation = regFilter->GetInstrumentation();
+        if( instrumentation && instrumentation->GetNumberOfRecords() > 0 )
+          {
+          const typename InstrumentationType::RecordType & timing =
+              instrumentation->GetRecords().back();
+          for( unsigned int i = 0; i < InstrumentationType::NumberOfPhases; i++ )
+            {
+            record.PhaseTime[i] = timing.PhaseTime[i];
+            }
+          record.NumberOfThreads = timing.NumberOfThreads;
+          record.AllocatedBytes = timing.AllocatedBytes;
+          }
+        else
+          {
+          for( unsigned int i = 0; i < InstrumentationType::NumberOfPhases; i++ )
+            {
+            record.PhaseTime[i] = 0.0;
+            }
+          record.NumberOfThreads = regFilter->GetNumberOfThreads();
+          record.AllocatedBytes = 0;
+          }
+
+        record.Time = m_Clock->GetTimeInSeconds() - m_StartTime;
+        this->PushRecord( record );
+
+        m_LastRecord = record;
+        }
+    }
+
+  // If initialize event called by MR filter, restart level and time
+  else
+    if( itk::InitializeEvent().CheckEvent( &event ) )
+      {
+      const MRFilterType* mrFilter =
+          dynamic_cast< const MRFilterType* >( caller );
+
+      if( mrFilter )
+        {
+        m_CurrentLevel = 0;
+        m_StartTime = m_Clock->GetTimeInSeconds();
+        }
+      }
+}
+
+/**
+ * Copy a record into the ring buffer
+ */
+template< class TRegistrationFilter, class TMRFilter >
+void
+VariationalRegistrationStructuredLogger< TRegistrationFilter, TMRFilter >
+::PushRecord( const RecordType & record )
+{
+  if( !m_WriterRunning )
+    {
+    this->StartWriter();
+    }
+
+  const SizeValueType head = m_Head;
+  const SizeValueType tail = m_Tail;
+  if( head - tail >= m_Buffer.size() )
+    {
+    m_NumberOfDroppedRecords++;
+    return;
+    }
+
+  m_Buffer[head % m_Buffer.size()] = record;
+
+  // Publish the record to the background thread and wake it. The thread
+  // checks for records with the mutex held, so the signal is not lost.
+  m_Head = head + 1;
+  m_WriterMutex.Lock();
+  m_WriterCondition->Signal();
+  m_WriterMutex.Unlock();
+}
+
+/**
+ * Write the records in the ring buffer
+ */
+template< class TRegistrationFilter, class TMRFilter >
+void
+VariationalRegistrationStructuredLogger< TRegistrationFilter, TMRFilter >
+::DrainRecords()
+{
+  SizeValueType tail = m_Tail;
+  const SizeValueType head = m_Head;
+  if( tail == head )
+    {
+    return;
+    }
+
+  // Format into a string first, so that the state of the output stream is
+  // not changed and the records are written in one piece.
+  std::ostringstream formatted;
+  formatted << std::setprecision( 10 );
+  while( tail != head )
+    {
+    this->WriteRecord( formatted, m_Buffer[tail % m_Buffer.size()] );
+
+    // Release the slot to the producer.
+    tail++;
+    m_Tail = tail;
+    }
+
+  std::ostream & os = m_FileOpened ? static_cast< std::ostream & >( m_FileStream ) : std::cout;
+  os << formatted.str();
+  os.flush();
+}
+
+/**
+ * Open the output and start the background thread
+ */
+template< class TRegistrationFilter, class TMRFilter >
+void
+VariationalRegistrationStructuredLogger< TRegistrationFilter, TMRFilter >
+::StartWriter()
+{
+  if( !m_FileName.empty() && !m_FileOpened )
+    {
+    // Create the file for the first records and append afterwards.
+    m_FileStream.open( m_FileName.c_str(), m_HeaderWritten ?
+        std::ios::out | std::ios::app : std::ios::out | std::ios::trunc );
+    if( !m_FileStream.is_open() )
+      {
+      itkExceptionMacro( << "Could not open log file " << m_FileName );
+      }
+    m_FileOpened = true;
+    }
+
+  std::ostream & os = m_FileOpened ? static_cast< std::ostream & >( m_FileStream ) : std::cout;
+  if( !m_HeaderWritten )
+    {
+    if( m_OutputFormat == OUTPUT_FORMAT_CSV )
+      {
+      this->WriteHeader( os );
+      }
+    m_HeaderWritten = true;
+    }
+
+  m_Buffer.resize( m_BufferSize );
+  m_Head = 0;
+  m_Tail = 0;
+  m_StopWriter = 0;
+
+  m_WriterThreadId = m_Threader->SpawnThread( this->WriterCallback, this );
+  m_WriterRunning = true;
+}
+
+/**
+ * Write all pending records and stop the background thread
+ */
+template< class TRegistrationFilter, class TMRFilter >
+void
+VariationalRegistrationStructuredLogger< TRegistrationFilter, TMRFilter >
+::Flush()
+{
+  if( !m_WriterRunning )
+    {
+    return;
+    }
+
+  // The background thread drains the buffer once more after it has seen
+  // the stop flag, i.e. all records pushed before are written.
+  m_WriterMutex.Lock();
+  m_StopWriter = 1;
+  m_WriterCondition->Signal();
+  m_WriterMutex.Unlock();
+  m_Threader->TerminateThread( m_WriterThreadId );
+  m_WriterRunning = false;
+
+  if( m_FileOpened )
+    {
+    m_FileStream.close();
+    m_FileOpened = false;
+    }
+}
+
+/**
+ * Loop of the background thread
+ */
+template< class TRegistrationFilter, class TMRFilter >
+ITK_THREAD_RETURN_TYPE
+VariationalRegistrationStructuredLogger< TRegistrationFilter, TMRFilter >
+::WriterCallback( void *arg )
+{
+  Self *logger =
+      (Self *) ( ( (MultiThreader::ThreadInfoStruct *) ( arg ) )->UserData );
+
+  while( true )
+    {
+    // Sleep until records are pushed or the writer is stopped.
+    logger->m_WriterMutex.Lock();
+    while( static_cast< SizeValueType >( logger->m_Head ) == logger->m_Tail
+           && logger->m_StopWriter == 0 )
+      {
+      logger->m_WriterCondition->Wait( &logger->m_WriterMutex );
+      }
+    const bool stop = ( logger->m_StopWriter != 0 );
+    logger->m_WriterMutex.Unlock();
+
+    logger->DrainRecords();
+    if( stop )
+      {
+      break;
+      }
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/**
+ * Write the CSV header
+ */
+template< class TRegistrationFilter, class TMRFilter >
+void
+VariationalRegistrationStructuredLogger< TRegistrationFilter, TMRFilter >
+::WriteHeader( std::ostream & os ) const
+{
+  os << "event,level,iteration,metric,rms_change,stopped,increase_count";
+  for( unsigned int i = 0; i < InstrumentationType::NumberOfPhases; i++ )
+    {
+    std::string name = InstrumentationType::GetPhaseName(
+        static_cast< typename InstrumentationType::PhaseType >( i ) );
+    os << "," << itksys::SystemTools::LowerCase( name ) << "_time";
+    }
+  os << ",threads,allocated_bytes,time" << std::endl;
+}
+
+/**
+ * Format a record
+ */
+template< class TRegistrationFilter, class TMRFilter >
+void
+VariationalRegistrationStructuredLogger< TRegistrationFilter, TMRFilter >
+::WriteRecord( std::ostream & os, const RecordType & record ) const
+{
+  const char * event = ( record.Event == RECORD_EVENT_LEVEL ) ? "level" : "iteration";
+
+  // JSON has no representation of NaN and infinity.
+  const bool validMetric = vnl_math_isfinite( record.Metric );
+  const bool validRMSChange = vnl_math_isfinite( record.RMSChange );
+
+  if( m_OutputFormat == OUTPUT_FORMAT_CSV )
+    {
+    os << event << "," << record.Level << "," << record.Iteration << ","
+        << record.Metric << "," << record.RMSChange << ","
+        << ( record.Stopped ? 1 : 0 ) << "," << record.IncreaseCount;
+    for( unsigned int i = 0; i < InstrumentationType::NumberOfPhases; i++ )
+      {
+      os << "," << record.PhaseTime[i];
+      }
+    os << "," << record.NumberOfThreads << "," << record.AllocatedBytes
+        << "," << record.Time << "\n";
+    }
+  else
+    {
+    os << "{\"event\":\"" << event << "\""
+        << ",\"level\":" << record.Level
+        << ",\"iteration\":" << record.Iteration
+        << ",\"metric\":";
+    if( validMetric )
+      {
+      os << record.Metric;
+      }
+    else
+      {
+      os << "null";
+      }
+    os << ",\"rms_change\":";
+    if( validRMSChange )
+      {
+      os << record.RMSChange;
+      }
+    else
+      {
+      os << "null";
+      }
+    os << ",\"stopped\":" << ( record.Stopped ? "true" : "false" )
+        << ",\"increase_count\":" << record.IncreaseCount
+        << ",\"phase_time\":{";
+    for( unsigned int i = 0; i < InstrumentationType::NumberOfPhases; i++ )
+      {
+      std::string name = InstrumentationType::GetPhaseName(
+          static_cast< typename InstrumentationType::PhaseType >( i ) );
+      os << ( i > 0 ? "," : "" ) << "\"" << itksys::SystemTools::LowerCase( name )
+          << "\":" << record.PhaseTime[i];
+      }
+    os << "},\"threads\":" << record.NumberOfThreads
+        << ",\"allocated_bytes\":" << record.AllocatedBytes
+        << ",\"time\":" << record.Time << "}\n";
+    }
+}
+
+/**
+ * Standard "PrintSelf" method.
+ */
+template< class TRegistrationFilter, class TMRFilter >
+void
+VariationalRegistrationStructuredLogger< TRegistrationFilter, TMRFilter >
+::PrintSelf( std::ostream& os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+
+  os << indent << "OutputFormat: ";
+  os << m_OutputFormat << std::endl;
+  os << indent << "FileName: ";
+  os << m_FileName << std::endl;
+  os << indent << "BufferSize: ";
+  os << m_BufferSize << std::endl;
+  os << indent << "StopCriterion: ";
+  os << m_StopCriterion.GetPointer() << std::endl;
+  os << indent << "NumberOfDroppedRecords: ";
+  os << m_NumberOfDroppedRecords << std::endl;
+}
+
+} // end namespace itk
+
+#endif
@@ -0,0 +1,242 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkVariationalRegistrationWorkspace_h
+#define itkVariationalRegistrationWorkspace_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkMultiThreader.h"
+#include <cstddef>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace itk
+{
+
+/** \class itk::VariationalRegistrationWorkspace
+ *
+ *  \brief Memory for the internal buffers of the registration, reused across resolution levels.
+ *
+ *  The workspace holds one named memory block for each internal buffer of the
+ *  registration. Each block is allocated once with room for NumberOfPixels
+ *  pixels, which is usually set to the number of pixels of the finest
+ *  resolution level.
+ *
+ *  AttachBuffer() sets the pixel container of an image to a view of a block.
+ *  Subsequent calls of Allocate() on this image do not allocate memory as
+ *  long as the buffered region fits into the block. Since the outputs of
+ *  filters are reset at the beginning of each update, filters attach the
+ *  block to their output in AllocateOutputs().
+ *
+ *  The following buffers use the workspace:
+ *  - the update buffer and the backward update buffer of the registration,
+ *  - the warped moving image of the registration function,
+ *  - the buffers of the regularizers,
+ *  - the fields of the Nesterov and adaptive time step schemes,
+ *  - the expanded fields between the levels, if the fused field expander
+ *    of the multi-resolution filter is used. The registration filter then
+ *    updates them in place, i.e. they also hold its output.
+ *
+ *  The fields allocated by the default field expander, the output of the
+ *  coarsest level if no initial field is given, the displacement fields of
+ *  the diffeomorphic filters computed by the exponentiator and the output
+ *  of the multi-resolution filter are not part of the workspace.
+ *
+ *  Each block must only be attached to one image at a time. The memory is
+ *  kept until ReleaseBuffers() is called or the workspace is destroyed; the
+ *  filters using the workspace hold a reference to it. When a block is
+ *  freed or reallocated, the pixel containers attached to it are emptied,
+ *  so that images still holding them allocate their own memory on the next
+ *  Allocate() instead of accessing the freed block.
+ *
+ *  If ParallelFirstTouch is on (default), a new block is zeroed by
+ *  NumberOfThreads threads, each writing one contiguous part. On NUMA systems
+ *  the pages are thereby placed on the memory nodes of the threads which
+ *  later process the same part of the finest level, as the filters split
+ *  their regions along the slowest dimension, i.e. into contiguous parts of
+ *  the buffer, too. This also avoids page faults during the registration.
+ *
+ *  If a BackingDirectory is set, the blocks are not allocated on the heap but
+ *  mapped from unlinked temporary files in this directory (POSIX only). The
+ *  operating system can then page the workspace buffers out to disk if
+ *  memory runs low. Mapped blocks are zero-initialized lazily by the
+ *  operating system and are not first touched.
+ *
+ *  Note that this is not a tiled out-of-core mode. The images, their
+ *  pyramids, the output fields and the buffers listed above as not part of
+ *  the workspace stay on the heap, and each iteration still passes over the
+ *  whole workspace buffers of the current level. The resident memory is
+ *  only reduced by the buffers that are idle during a pass, e.g. those of
+ *  the coarser levels or of the update schemes; if the buffers used in one
+ *  iteration do not fit into memory, the run time is dominated by paging.
+ *
+ *  \sa VariationalRegistrationMultiResolutionFilter
+ *
+ *  \ingroup VariationalRegistration
+ */
+template< class TDisplacementField >
+class VariationalRegistrationWorkspace
+  : public Object
+{
+public:
+  /** Standard class typedefs */
+  typedef VariationalRegistrationWorkspace  Self;
+  typedef Object                            Superclass;
+  typedef SmartPointer< Self >              Pointer;
+  typedef SmartPointer< const Self >        ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro(VariationalRegistrationWorkspace, Object);
+
+  /** Deformation field type. */
+  typedef TDisplacementField                          DisplacementFieldType;
+  typedef typename DisplacementFieldType::SizeValueType SizeValueType;
+
+  /** Set/Get the number of pixels each buffer can hold. */
+  itkSetMacro( NumberOfPixels, SizeValueType );
+  itkGetConstMacro( NumberOfPixels, SizeValueType );
+
+  /** Set/Get whether new buffers are first touched in parallel. */
+  itkSetMacro( ParallelFirstTouch, bool );
+  itkGetConstMacro( ParallelFirstTouch, bool );
+  itkBooleanMacro( ParallelFirstTouch );
+
+  /** Set/Get the directory for file-backed buffers. If empty (default), the
+   *  buffers are allocated on the heap. */
+  itkSetStringMacro( BackingDirectory );
+  itkGetStringMacro( BackingDirectory );
+
+  /** Set/Get the number of threads used for the first touch. */
+  itkSetClampMacro( NumberOfThreads, ThreadIdType, 1, ITK_MAX_THREADS );
+  itkGetConstMacro( NumberOfThreads, ThreadIdType );
+
+  /** Let the pixel container of the image point to the workspace buffer
+   *  with the given name. The buffer is allocated if it does not exist or
+   *  is too small for NumberOfPixels pixels of the image type. Nothing is
+   *  done if NumberOfPixels is zero. */
+  template< class TImage >
+  void AttachBuffer( TImage * image, const std::string & name );
+
+  /** Get the number of bytes allocated by the workspace. */
+  SizeValueType GetAllocatedBytes() const;
+
+  /** Get the number of bytes of the file-backed buffers. These are part of
+   *  GetAllocatedBytes(), but can be paged out by the operating system. */
+  SizeValueType GetMappedBytes() const;
+
+  /** Free all buffers. Images attached to a buffer keep an empty pixel
+   *  container; their contents are lost. */
+  void ReleaseBuffers();
+
+  /** Zero a memory block with the given number of threads, each thread
+   *  writing one contiguous part of the block. The parts are split at the
+   *  page boundaries of the absolute addresses, so no page is written by
+   *  two threads. */
+  static void FirstTouch( void * buffer, SizeValueType numberOfBytes,
+      ThreadIdType numberOfThreads );
+
+  /** Get the page size of the system (sysconf(_SC_PAGESIZE) on POSIX
+   *  systems, 4096 otherwise). */
+  static std::size_t GetPageSize();
+
+  /** Get the current resident set size of the process in bytes, read from
+   *  /proc/self/statm. Returns zero on systems without /proc. */
+  static SizeValueType GetResidentBytes();
+
+protected:
+  VariationalRegistrationWorkspace();
+  ~VariationalRegistrationWorkspace();
+
+  /** Struct to pass the memory block to the first touch threads. */
+  struct FirstTouchStruct
+    {
+    char *        Buffer;
+    SizeValueType NumberOfBytes;
+    };
+
+  /** Zero the part of the memory block associated with the thread. */
+  static ITK_THREAD_RETURN_TYPE FirstTouchCallback( void *arg );
+
+  /** Print information about the workspace. */
+  virtual void PrintSelf(std::ostream& os, Indent indent) const ITK_OVERRIDE;
+
+private:
+  VariationalRegistrationWorkspace(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  /** Pixel container handed out by AttachBuffer() and the function which
+   *  empties it. The function is instantiated for the container type. */
+  struct AttachedContainerType
+    {
+    Object::Pointer Container;
+    void ( *Detach )( Object * );
+    };
+  typedef std::vector< AttachedContainerType >  AttachedContainerListType;
+
+  /** Empty a pixel container of the given type. */
+  template< class TPixelContainer >
+  static void DetachContainer( Object * container )
+    {
+    static_cast< TPixelContainer * >( container )->SetImportPointer( NULL, 0, false );
+    }
+
+  /** Memory blocks are stored as double arrays. Heap blocks are page
+   *  aligned on POSIX systems and mapped blocks always are. They are
+   *  allocated without initialization, so that the first touch can be done
+   *  in parallel. The containers attached to a block are emptied when it is
+   *  freed. */
+  struct BufferType
+    {
+    double *                  Data;
+    SizeValueType             Size;
+    bool                      Mapped;
+    AttachedContainerListType Containers;
+    };
+  typedef std::map< std::string, BufferType >   BufferMapType;
+
+  /** Number of pixels each buffer can hold. */
+  SizeValueType m_NumberOfPixels;
+
+  /** Flag and number of threads for the first touch of new buffers. */
+  bool          m_ParallelFirstTouch;
+  ThreadIdType  m_NumberOfThreads;
+
+  /** Allocate a block on the heap or as file-backed mapping. */
+  void AllocateBuffer( BufferType & buffer, SizeValueType numberOfValues );
+
+  /** Free a block allocated by AllocateBuffer(). */
+  void FreeBuffer( BufferType & buffer );
+
+  /** Directory for file-backed buffers. */
+  std::string   m_BackingDirectory;
+
+  /** Named memory blocks. */
+  BufferMapType m_Buffers;
+};
+
+}
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkVariationalRegistrationWorkspace.hxx"
+#endif
+
+#endif
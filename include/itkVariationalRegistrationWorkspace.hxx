@@ -0,0 +1,415 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkVariationalRegistrationWorkspace_hxx
+#define itkVariationalRegistrationWorkspace_hxx
+#include "itkVariationalRegistrationWorkspace.h"
+
+#include <cstring>
+#include <fstream>
+#if !defined( _WIN32 )
+#include <sys/mman.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <vector>
+#endif
+
+namespace itk
+{
+
+/**
+ * Default constructor
+ */
+template< class TDisplacementField >
+VariationalRegistrationWorkspace< TDisplacementField >
+::VariationalRegistrationWorkspace()
+{
+  m_NumberOfPixels = 0;
+  m_ParallelFirstTouch = true;
+  m_NumberOfThreads = MultiThreader::GetGlobalDefaultNumberOfThreads();
+}
+
+/**
+ * Destructor
+ */
+template< class TDisplacementField >
+VariationalRegistrationWorkspace< TDisplacementField >
+::~VariationalRegistrationWorkspace()
+{
+  this->ReleaseBuffers();
+}
+
+/*
+ * Attach a named buffer to the pixel container of an image.
+ */
+template< class TDisplacementField >
+template< class TImage >
+void
+VariationalRegistrationWorkspace< TDisplacementField >
+::AttachBuffer( TImage * image, const std::string & name )
+{
+  typedef typename TImage::PixelType       PixelType;
+  typedef typename TImage::PixelContainer  PixelContainerType;
+
+  if( !image || m_NumberOfPixels == 0 )
+    {
+    return;
+    }
+
+  const SizeValueType numberOfValues =
+      ( m_NumberOfPixels * sizeof( PixelType ) + sizeof( double ) - 1 ) / sizeof( double );
+
+  typename BufferMapType::iterator it = m_Buffers.find( name );
+  if( it == m_Buffers.end() )
+    {
+    BufferType empty;
+    empty.Data = NULL;
+    empty.Size = 0;
+    empty.Mapped = false;
+    it = m_Buffers.insert( typename BufferMapType::value_type( name, empty ) ).first;
+    }
+
+  BufferType & buffer = it->second;
+  if( buffer.Size < numberOfValues )
+    {
+    itkDebugMacro( << "Allocating workspace buffer " << name << " for "
+        << m_NumberOfPixels << " pixels" );
+    this->FreeBuffer( buffer );
+    this->AllocateBuffer( buffer, numberOfValues );
+
+    if( m_ParallelFirstTouch && !buffer.Mapped )
+      {
+      FirstTouch( buffer.Data, numberOfValues * sizeof( double ), m_NumberOfThreads );
+      }
+    }
+
+  // The container does not manage the memory, i.e. it is not freed by
+  // the image and Allocate() only reallocates if the region is too large.
+  typename PixelContainerType::Pointer container = PixelContainerType::New();
+  container->SetImportPointer( reinterpret_cast< PixelType * >( buffer.Data ),
+      m_NumberOfPixels, false );
+
+  image->SetPixelContainer( container );
+
+  // Remember the container to empty it when the block is freed. Containers
+  // only referenced by the workspace are no longer used by any image.
+  typename AttachedContainerListType::iterator containerIt = buffer.Containers.begin();
+  while( containerIt != buffer.Containers.end() )
+    {
+    if( containerIt->Container->GetReferenceCount() <= 1 )
+      {
+      containerIt = buffer.Containers.erase( containerIt );
+      }
+    else
+      {
+      ++containerIt;
+      }
+    }
+  AttachedContainerType attached;
+  attached.Container = container.GetPointer();
+  attached.Detach = &DetachContainer< PixelContainerType >;
+  buffer.Containers.push_back( attached );
+}
+
+/*
+ * Get the number of allocated bytes.
+ */
+template< class TDisplacementField >
+typename VariationalRegistrationWorkspace< TDisplacementField >::SizeValueType
+VariationalRegistrationWorkspace< TDisplacementField >
+::GetAllocatedBytes() const
+{
+  SizeValueType bytes = 0;
+  for( typename BufferMapType::const_iterator it = m_Buffers.begin();
+      it != m_Buffers.end(); ++it )
+    {
+    bytes += it->second.Size * sizeof( double );
+    }
+  return bytes;
+}
+
+/*
+ * Get the number of bytes of the file-backed buffers.
+ */
+template< class TDisplacementField >
+typename VariationalRegistrationWorkspace< TDisplacementField >::SizeValueType
+VariationalRegistrationWorkspace< TDisplacementField >
+::GetMappedBytes() const
+{
+  SizeValueType bytes = 0;
+  for( typename BufferMapType::const_iterator it = m_Buffers.begin();
+      it != m_Buffers.end(); ++it )
+    {
+    if( it->second.Mapped )
+      {
+      bytes += it->second.Size * sizeof( double );
+      }
+    }
+  return bytes;
+}
+
+/*
+ * Free all buffers.
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationWorkspace< TDisplacementField >
+::ReleaseBuffers()
+{
+  for( typename BufferMapType::iterator it = m_Buffers.begin();
+      it != m_Buffers.end(); ++it )
+    {
+    this->FreeBuffer( it->second );
+    }
+  m_Buffers.clear();
+}
+
+/*
+ * Allocate a block on the heap or as file-backed mapping.
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationWorkspace< TDisplacementField >
+::AllocateBuffer( BufferType & buffer, SizeValueType numberOfValues )
+{
+  buffer.Size = numberOfValues;
+  buffer.Mapped = false;
+
+  if( m_BackingDirectory.empty() )
+    {
+#if !defined( _WIN32 )
+    // Align the block to a page, so that the parts of the first touch
+    // threads start at page boundaries of the block.
+    void * data = NULL;
+    if( posix_memalign( &data, GetPageSize(), numberOfValues * sizeof( double ) ) != 0 )
+      {
+      buffer.Size = 0;
+      itkExceptionMacro( << "Could not allocate workspace buffer of "
+          << numberOfValues * sizeof( double ) << " bytes" );
+      }
+    buffer.Data = static_cast< double * >( data );
+#else
+    buffer.Data = new double[numberOfValues];
+#endif
+    return;
+    }
+
+#if !defined( _WIN32 )
+  const SizeValueType numberOfBytes = numberOfValues * sizeof( double );
+
+  std::string fileName = m_BackingDirectory + "/VariationalRegistrationXXXXXX";
+  std::vector< char > fileNameBuffer( fileName.begin(), fileName.end() );
+  fileNameBuffer.push_back( '\0' );
+
+  int fd = mkstemp( &fileNameBuffer[0] );
+  if( fd < 0 )
+    {
+    buffer.Size = 0;
+    itkExceptionMacro( << "Could not create backing file in " << m_BackingDirectory );
+    }
+
+  // The file is removed immediately and only kept alive by the mapping.
+  unlink( &fileNameBuffer[0] );
+
+  void * data = MAP_FAILED;
+  if( ftruncate( fd, static_cast< off_t >( numberOfBytes ) ) == 0 )
+    {
+    data = mmap( NULL, numberOfBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+    }
+  close( fd );
+
+  if( data == MAP_FAILED )
+    {
+    buffer.Size = 0;
+    itkExceptionMacro( << "Could not map backing file of " << numberOfBytes << " bytes" );
+    }
+
+  buffer.Data = static_cast< double * >( data );
+  buffer.Mapped = true;
+#else
+  itkWarningMacro( << "File-backed buffers are not supported on this platform" );
+  buffer.Data = new double[numberOfValues];
+#endif
+}
+
+/*
+ * Free a block allocated by AllocateBuffer().
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationWorkspace< TDisplacementField >
+::FreeBuffer( BufferType & buffer )
+{
+  // Images still holding a view of the block allocate their own memory on
+  // the next Allocate().
+  for( typename AttachedContainerListType::iterator it = buffer.Containers.begin();
+      it != buffer.Containers.end(); ++it )
+    {
+    it->Detach( it->Container.GetPointer() );
+    }
+  buffer.Containers.clear();
+
+#if !defined( _WIN32 )
+  if( buffer.Mapped )
+    {
+    munmap( buffer.Data, buffer.Size * sizeof( double ) );
+    }
+  else
+    {
+    free( buffer.Data );
+    }
+#else
+  delete[] buffer.Data;
+#endif
+
+  buffer.Data = NULL;
+  buffer.Size = 0;
+  buffer.Mapped = false;
+}
+
+/*
+ * Zero a memory block in parallel.
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationWorkspace< TDisplacementField >
+::FirstTouch( void * buffer, SizeValueType numberOfBytes, ThreadIdType numberOfThreads )
+{
+  if( buffer == NULL || numberOfBytes == 0 )
+    {
+    return;
+    }
+
+  FirstTouchStruct str;
+  str.Buffer = static_cast< char * >( buffer );
+  str.NumberOfBytes = numberOfBytes;
+
+  MultiThreader::Pointer threader = MultiThreader::New();
+  threader->SetNumberOfThreads( numberOfThreads );
+  threader->SetSingleMethod( FirstTouchCallback, &str );
+  threader->SingleMethodExecute();
+}
+
+/*
+ * Zero the part of the memory block associated with the thread.
+ */
+template< class TDisplacementField >
+ITK_THREAD_RETURN_TYPE
+VariationalRegistrationWorkspace< TDisplacementField >
+::FirstTouchCallback( void *arg )
+{
+  const ThreadIdType threadId =
+      ( (MultiThreader::ThreadInfoStruct *) ( arg ) )->ThreadID;
+  const ThreadIdType threadCount =
+      ( (MultiThreader::ThreadInfoStruct *) ( arg ) )->NumberOfThreads;
+
+  FirstTouchStruct *str =
+      (FirstTouchStruct *) ( ( (MultiThreader::ThreadInfoStruct *) ( arg ) )->UserData );
+
+  // Split at the page boundaries of the absolute addresses, so that no page
+  // is shared by two threads, even if the block is not page aligned.
+  const std::size_t pageSize = GetPageSize();
+  const std::size_t blockBegin = reinterpret_cast< std::size_t >( str->Buffer );
+  const std::size_t blockEnd = blockBegin + str->NumberOfBytes;
+  const std::size_t firstPage = blockBegin / pageSize;
+  const std::size_t numberOfPages = ( blockEnd + pageSize - 1 ) / pageSize - firstPage;
+  const std::size_t pagesPerThread =
+      ( numberOfPages + threadCount - 1 ) / threadCount;
+
+  std::size_t begin = ( firstPage + threadId * pagesPerThread ) * pageSize;
+  std::size_t end = begin + pagesPerThread * pageSize;
+  if( begin < blockBegin )
+    {
+    begin = blockBegin;
+    }
+  if( end > blockEnd )
+    {
+    end = blockEnd;
+    }
+
+  if( begin < end )
+    {
+    std::memset( str->Buffer + ( begin - blockBegin ), 0, end - begin );
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+/*
+ * Get the page size of the system.
+ */
+template< class TDisplacementField >
+std::size_t
+VariationalRegistrationWorkspace< TDisplacementField >
+::GetPageSize()
+{
+#if !defined( _WIN32 )
+  const long pageSize = sysconf( _SC_PAGESIZE );
+  if( pageSize > 0 )
+    {
+    return static_cast< std::size_t >( pageSize );
+    }
+#endif
+  return 4096;
+}
+
+/*
+ * Get the current resident set size of the process.
+ */
+template< class TDisplacementField >
+typename VariationalRegistrationWorkspace< TDisplacementField >::SizeValueType
+VariationalRegistrationWorkspace< TDisplacementField >
+::GetResidentBytes()
+{
+  // The second field of statm is the number of resident pages.
+  std::ifstream statm( "/proc/self/statm" );
+  SizeValueType totalPages = 0;
+  SizeValueType residentPages = 0;
+  if( statm >> totalPages >> residentPages )
+    {
+    return residentPages * GetPageSize();
+    }
+  return 0;
+}
+
+/*
+ * Print status information
+ */
+template< class TDisplacementField >
+void
+VariationalRegistrationWorkspace< TDisplacementField >
+::PrintSelf( std::ostream& os, Indent indent ) const
+{
+  Superclass::PrintSelf( os, indent );
+
+  os << indent << "NumberOfPixels: ";
+  os << m_NumberOfPixels << std::endl;
+  os << indent << "ParallelFirstTouch: ";
+  os << m_ParallelFirstTouch << std::endl;
+  os << indent << "BackingDirectory: ";
+  os << m_BackingDirectory << std::endl;
+  os << indent << "NumberOfThreads: ";
+  os << m_NumberOfThreads << std::endl;
+  os << indent << "NumberOfBuffers: ";
+  os << m_Buffers.size() << std::endl;
+  os << indent << "AllocatedBytes: ";
+  os << this->GetAllocatedBytes() << std::endl;
+}
+
+} // end namespace itk
+
+#endif
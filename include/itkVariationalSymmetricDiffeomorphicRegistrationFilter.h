@@ -120,6 +120,8 @@ public:
   /** Deformation field type. */
   typedef TDisplacementField                       DisplacementFieldType;
   typedef typename DisplacementFieldType::Pointer  DisplacementFieldPointer;
+  typedef typename Superclass::DisplacementFieldRegionType
+                                                   DisplacementFieldRegionType;
 
   /** Types inherited from the superclass */
   typedef typename Superclass::OutputImageType     OutputImageType;
@@ -137,6 +139,24 @@ public:
   /** Get output inverse deformation field. */
   itkGetObjectMacro( InverseDisplacementField, DisplacementFieldType );
 
+  /** Set the number of threads of the filter, its components and both
+   *  exponentiators. */
+  virtual void SetNumberOfThreads( ThreadIdType numberOfThreads ) ITK_OVERRIDE;
+
+  /** Get the number of bytes allocated for the fields, including the
+   *  inverse displacement field and the backward update buffer. */
+  virtual SizeValueType GetAllocatedBytes() ITK_OVERRIDE;
+
+  /** Free the internal buffers of the superclass and the backward update
+   *  buffer. */
+  virtual void ReleaseBuffers() ITK_OVERRIDE;
+
+  /** Get an estimate of the number of bytes allocated for a field of the
+   *  given region, including the inverse displacement field and the
+   *  backward update buffer. */
+  virtual SizeValueType EstimateAllocatedBytes(
+      const DisplacementFieldRegionType & region ) const ITK_OVERRIDE;
+
 protected:
   VariationalSymmetricDiffeomorphicRegistrationFilter();
   ~VariationalSymmetricDiffeomorphicRegistrationFilter() {}
@@ -36,6 +36,21 @@ VariationalSymmetricDiffeomorphicRegistrationFilter< TFixedImage, TMovingImage,
   m_InverseExponentiator->ComputeInverseOn();
 }
 
+/*
+ * Set the number of threads of the filter and both exponentiators.
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+void
+VariationalSymmetricDiffeomorphicRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::SetNumberOfThreads( ThreadIdType numberOfThreads )
+{
+  Superclass::SetNumberOfThreads( numberOfThreads );
+  if( m_InverseExponentiator )
+    {
+    m_InverseExponentiator->SetNumberOfThreads( this->GetNumberOfThreads() );
+    }
+}
+
 /*
  * Initialize flags
  */
@@ -83,9 +98,7 @@ VariationalSymmetricDiffeomorphicRegistrationFilter< TFixedImage, TMovingImage,
   else
     {
     // Initialize deformation field with zero vectors.
-    typename TDisplacementField::PixelType zeros;
-    zeros.Fill( 0.0 );
-    m_InverseDisplacementField->FillBuffer( zeros );
+    this->CopyOrZeroFillField( NULL, m_InverseDisplacementField );
     }
 
   // Allocate backward update buffer.
@@ -93,6 +106,10 @@ VariationalSymmetricDiffeomorphicRegistrationFilter< TFixedImage, TMovingImage,
   m_BackwardUpdateBuffer->CopyInformation( this->GetOutput() );
   m_BackwardUpdateBuffer->SetRequestedRegion( this->GetOutput()->GetRequestedRegion() );
   m_BackwardUpdateBuffer->SetBufferedRegion( this->GetOutput()->GetBufferedRegion() );
+  if( this->GetWorkspace() )
+    {
+    this->GetWorkspace()->AttachBuffer( m_BackwardUpdateBuffer.GetPointer(), "BackwardUpdateBuffer" );
+    }
   m_BackwardUpdateBuffer->Allocate();
 
   // Initialize superclass.
@@ -147,7 +164,9 @@ VariationalSymmetricDiffeomorphicRegistrationFilter< TFixedImage, TMovingImage,
   this->GetBackwardUpdateBuffer()->SetPixelContainer( swap );
 
   // Initialize backward iteration.
+  this->StartPhase( VariationalRegistrationInstrumentation::WarpPhase );
   this->InitializeBackwardIteration();
+  this->StopPhase( VariationalRegistrationInstrumentation::WarpPhase );
 
   // Call super class method for backward iteration.
   dt += this->Superclass::CalculateChange();
@@ -172,7 +191,59 @@ VariationalSymmetricDiffeomorphicRegistrationFilter< TFixedImage, TMovingImage,
   this->Superclass::ApplyUpdate( dt );
 
   // Calculate deformation field from velocity field exponential
+  this->StartPhase( VariationalRegistrationInstrumentation::ExponentiationPhase );
   this->CalcInverseDeformationFromVelocityField( this->GetVelocityField() );
+  this->StopPhase( VariationalRegistrationInstrumentation::ExponentiationPhase );
+}
+
+/*
+ * Get the number of bytes allocated for the fields
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+SizeValueType
+VariationalSymmetricDiffeomorphicRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::GetAllocatedBytes()
+{
+  typedef typename DisplacementFieldType::PixelType PixelType;
+
+  SizeValueType bytes = this->Superclass::GetAllocatedBytes();
+  if( m_InverseDisplacementField && m_InverseDisplacementField->GetPixelContainer() )
+    {
+    bytes += m_InverseDisplacementField->GetPixelContainer()->Capacity() * sizeof( PixelType );
+    }
+
+  // The backward update buffer is part of the workspace, if a workspace is set.
+  if( !this->GetWorkspace() && m_BackwardUpdateBuffer
+      && m_BackwardUpdateBuffer->GetPixelContainer() )
+    {
+    bytes += m_BackwardUpdateBuffer->GetPixelContainer()->Capacity() * sizeof( PixelType );
+    }
+  return bytes;
+}
+
+/*
+ * Free the internal buffers
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+void
+VariationalSymmetricDiffeomorphicRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::ReleaseBuffers()
+{
+  this->Superclass::ReleaseBuffers();
+  m_BackwardUpdateBuffer = NULL;
+}
+
+/*
+ * Estimate the number of bytes allocated for a field of the given region
+ */
+template< class TFixedImage, class TMovingImage, class TDisplacementField >
+SizeValueType
+VariationalSymmetricDiffeomorphicRegistrationFilter< TFixedImage, TMovingImage, TDisplacementField >
+::EstimateAllocatedBytes( const DisplacementFieldRegionType & region ) const
+{
+  // Inverse displacement field and backward update buffer.
+  return this->Superclass::EstimateAllocatedBytes( region )
+      + 2 * region.GetNumberOfPixels() * sizeof( typename DisplacementFieldType::PixelType );
 }
 
 template< class TFixedImage, class TMovingImage, class TDisplacementField >
@@ -182,20 +253,23 @@ VariationalSymmetricDiffeomorphicRegistrationFilter< TFixedImage, TMovingImage,
 {
   ImageRegionIterator< UpdateBufferType > f( this->GetUpdateBuffer(), regionToProcess );
   ImageRegionIterator< UpdateBufferType > b( m_BackwardUpdateBuffer, regionToProcess );
+  ImageRegionConstIterator< OutputImageType > s( this->GetUpdateSource(), regionToProcess );
   ImageRegionIterator< OutputImageType > o( this->GetOutput(), regionToProcess );
 
   typedef typename OutputImageType::PixelType PixelType;
 
   f.GoToBegin();
   b.GoToBegin();
+  s.GoToBegin();
   o.GoToBegin();
 
   TimeStepType dtHalf = dt * 0.5;
 
   while( !o.IsAtEnd() )
     {
-    o.Value() += static_cast< PixelType >( (f.Value() - b.Value()) * dtHalf );
+    o.Set( s.Get() + static_cast< PixelType >( (f.Value() - b.Value()) * dtHalf ) );
     ++o;
+    ++s;
     ++f;
     ++b;
     }
@@ -0,0 +1,856 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+/** \file VariationalRegistrationBenchmark.cxx
+ *
+ *  Microbenchmarks for the components of the ITK Variational Registration
+ *  module. The program measures the throughput (voxels per second) of
+ *    - the force computation (ComputeUpdate) of the Demons, SSD, NCC and
+ *      FastNCC functions,
+ *    - the Gaussian, diffusive, elastic and curvature regularizers (the
+ *      latter two only if ITK is built with FFTW) and the multigrid
+ *      regularizer with diffusive and elastic operator,
+ *    - the ContinuousBorderWarpImageFilter,
+ *    - the ExponentialDisplacementFieldImageFilter with and without inverse,
+ *    - a complete registration iteration with a workspace which is first
+ *      touched in parallel or by a single thread,
+ *    - the same iteration pinned to the CPUs of one and of two NUMA nodes
+ *      (Linux only, skipped on systems with a single node) to measure the
+ *      scaling from one to two sockets with serial and parallel first touch,
+ *  on synthetic 2D and 3D images of several sizes and for several numbers of
+ *  threads. Each benchmark is run once for warm-up and then repeatedly; the
+ *  minimum and mean wall-clock time of the repetitions are reported in JSON
+ *  format for regression tracking.
+ *
+ *  The force computation and the registration iteration are timed with a
+ *  VariationalRegistrationInstrumentation, i.e. the force time is the time of
+ *  the threaded ComputeUpdate calls of the registration filter.
+ */
+
+// System includes:
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#if defined(__linux__)
+#include <sched.h>
+#endif
+#define GETOPT_API
+extern "C"
+{
+#include "getopt.h"
+}
+
+#define ExceptionMacro(x) std::cerr << "ERROR: " x << std::endl; return EXIT_FAILURE;
+
+// Project includes:
+#include "itkConfigure.h"
+
+#include "itkVariationalRegistrationFilter.h"
+#include "itkVariationalRegistrationWorkspace.h"
+#include "itkVariationalRegistrationInstrumentation.h"
+
+#include "itkVariationalRegistrationFunction.h"
+#include "itkVariationalRegistrationDemonsFunction.h"
+#include "itkVariationalRegistrationSSDFunction.h"
+#include "itkVariationalRegistrationNCCFunction.h"
+#include "itkVariationalRegistrationFastNCCFunction.h"
+
+#include "itkVariationalRegistrationRegularizer.h"
+#include "itkVariationalRegistrationGaussianRegularizer.h"
+#include "itkVariationalRegistrationDiffusionRegularizer.h"
+#include "itkVariationalRegistrationMultigridRegularizer.h"
+#if defined( ITK_USE_FFTWD ) || defined( ITK_USE_FFTWF )
+#include "itkVariationalRegistrationElasticRegularizer.h"
+#include "itkVariationalRegistrationElasticDCTRegularizer.h"
+#include "itkVariationalRegistrationCurvatureRegularizer.h"
+#endif
+
+#include "itkContinuousBorderWarpImageFilter.h"
+#include "itkExponentialDisplacementFieldImageFilter.h"
+
+// ITK library includes
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkMultiThreader.h"
+#include "itkRealTimeClock.h"
+#include "itkVersion.h"
+
+#include <vnl/vnl_math.h>
+
+using namespace itk;
+
+//////////////////////////////////////////////
+//
+// Options and results
+//
+//////////////////////////////////////////////
+struct BenchmarkOptions
+{
+  std::vector<SizeValueType> sizes2D;
+  std::vector<SizeValueType> sizes3D;
+  std::vector<ThreadIdType>  threads;
+  unsigned int               repetitions;
+  std::string                pattern;
+  bool                       run2D;
+  bool                       run3D;
+};
+
+struct BenchmarkResult
+{
+  std::string   name;
+  unsigned int  dimension;
+  SizeValueType size;
+  ThreadIdType  threads;
+  SizeValueType voxels;
+  unsigned int  repetitions;
+  double        minimumTime;
+  double        meanTime;
+};
+
+typedef std::vector<BenchmarkResult> BenchmarkResultContainer;
+
+//////////////////////////////////////////////
+//
+// Helpers
+//
+//////////////////////////////////////////////
+
+// Name of a benchmark in the form <component>/<dim>D/size:<n>/threads:<t>.
+std::string BenchmarkName( const std::string & component, unsigned int dimension,
+    SizeValueType size, ThreadIdType threads )
+{
+  std::ostringstream name;
+  name << component << "/" << dimension << "D/size:" << size << "/threads:" << threads;
+  return name.str();
+}
+
+// A benchmark is run if no pattern is given or its name contains the pattern.
+bool IsSelected( const BenchmarkOptions & options, const std::string & name )
+{
+  return options.pattern.empty() || name.find( options.pattern ) != std::string::npos;
+}
+
+// Store the result of a benchmark. The first time is the warm-up run and is
+// discarded.
+void AddResult( const std::string & name, unsigned int dimension, SizeValueType size,
+    ThreadIdType threads, SizeValueType voxels, const std::vector<double> & times,
+    BenchmarkResultContainer & results )
+{
+  BenchmarkResult result;
+  result.name = name;
+  result.dimension = dimension;
+  result.size = size;
+  result.threads = threads;
+  result.voxels = voxels;
+  result.repetitions = 0;
+  result.minimumTime = 0.0;
+  result.meanTime = 0.0;
+
+  for( unsigned int i = 1; i < times.size(); i++ )
+    {
+    if( result.repetitions == 0 || times[i] < result.minimumTime )
+      {
+      result.minimumTime = times[i];
+      }
+    result.meanTime += times[i];
+    result.repetitions++;
+    }
+  if( result.repetitions > 0 )
+    {
+    result.meanTime /= result.repetitions;
+    }
+
+  std::cerr << "  " << name << ": " << result.minimumTime << " s" << std::endl;
+  results.push_back( result );
+}
+
+// Run a filter repeatedly and return the wall-clock time of each run.
+std::vector<double> TimeUpdates( ProcessObject * filter, unsigned int repetitions )
+{
+  RealTimeClock::Pointer clock = RealTimeClock::New();
+  std::vector<double> times;
+  for( unsigned int i = 0; i <= repetitions; i++ )
+    {
+    filter->Modified();
+    const RealTimeClock::TimeStampType start = clock->GetTimeInSeconds();
+    filter->Update();
+    times.push_back( clock->GetTimeInSeconds() - start );
+    }
+  return times;
+}
+
+// Fill an image with a sphere and a sinusoidal texture, such that all
+// force terms have non-zero gradients in the whole image.
+template <typename TImage>
+void FillPhantom( TImage * image, double shift )
+{
+  typedef ImageRegionIteratorWithIndex<TImage> IteratorType;
+
+  const typename TImage::SizeType size = image->GetBufferedRegion().GetSize();
+  double radius = 0.3 * size[0];
+  for( IteratorType it( image, image->GetBufferedRegion() ); !it.IsAtEnd(); ++it )
+    {
+    const typename TImage::IndexType index = it.GetIndex();
+    double distance = 0.0;
+    double texture = 1.0;
+    for( unsigned int j = 0; j < TImage::ImageDimension; j++ )
+      {
+      const double x = index[j] - shift;
+      distance += vnl_math_sqr( x - 0.5 * size[j] );
+      texture *= std::cos( 0.2 * x );
+      }
+    double value = 20.0 + 20.0 * texture;
+    if( distance <= radius * radius )
+      {
+      value += 150.0;
+      }
+    it.Set( static_cast<typename TImage::PixelType>( value ) );
+    }
+}
+
+// Fill a displacement field with a smooth sinusoidal deformation.
+template <typename TField>
+void FillField( TField * field, double amplitude )
+{
+  typedef ImageRegionIteratorWithIndex<TField> IteratorType;
+
+  const typename TField::SizeType size = field->GetBufferedRegion().GetSize();
+  for( IteratorType it( field, field->GetBufferedRegion() ); !it.IsAtEnd(); ++it )
+    {
+    const typename TField::IndexType index = it.GetIndex();
+    typename TField::PixelType vector;
+    for( unsigned int j = 0; j < TField::ImageDimension; j++ )
+      {
+      vector[j] = amplitude * std::sin( 2.0 * vnl_math::pi * index[j] / size[j] );
+      }
+    it.Set( vector );
+    }
+}
+
+//////////////////////////////////////////////
+//
+// Benchmarks
+//
+//////////////////////////////////////////////
+
+// Time the force computation of a registration function inside a
+// registration filter without smoothing.
+template <typename TImage, typename TField>
+void BenchmarkForce( const std::string & component,
+    VariationalRegistrationFunction<TImage, TImage, TField> * function,
+    TImage * fixedImage, TImage * movingImage, SizeValueType size, ThreadIdType threads,
+    const BenchmarkOptions & options, BenchmarkResultContainer & results )
+{
+  const std::string name = BenchmarkName( component, TImage::ImageDimension, size, threads );
+  if( !IsSelected( options, name ) )
+    {
+    return;
+    }
+
+  typedef VariationalRegistrationFunction<TImage, TImage, TField> FunctionType;
+  typedef VariationalRegistrationFilter<TImage, TImage, TField>   RegistrationFilterType;
+  typedef VariationalRegistrationInstrumentation                  InstrumentationType;
+
+  typename FunctionType::MovingImageWarperType::Pointer warper =
+      FunctionType::MovingImageWarperType::New();
+  warper->SetNumberOfThreads( threads );
+  function->SetMovingImageWarper( warper );
+  function->SetTimeStep( 1.0 );
+
+  InstrumentationType::Pointer instrumentation = InstrumentationType::New();
+
+  typename RegistrationFilterType::Pointer regFilter = RegistrationFilterType::New();
+  regFilter->SetDifferenceFunction( function );
+  regFilter->SetFixedImage( fixedImage );
+  regFilter->SetMovingImage( movingImage );
+  regFilter->SetNumberOfIterations( options.repetitions + 1 );
+  regFilter->SetNumberOfThreads( threads );
+  regFilter->SmoothDisplacementFieldOff();
+  regFilter->SmoothUpdateFieldOff();
+  regFilter->SetInstrumentation( instrumentation );
+  regFilter->Update();
+
+  std::vector<double> times;
+  for( SizeValueType i = 0; i < instrumentation->GetNumberOfRecords(); i++ )
+    {
+    times.push_back( instrumentation->GetRecord( i ).PhaseTime[InstrumentationType::ForcePhase] );
+    }
+
+  AddResult( name, TImage::ImageDimension, size, threads,
+      fixedImage->GetBufferedRegion().GetNumberOfPixels(), times, results );
+}
+
+// Time a regularizer on a displacement field.
+template <typename TField>
+void BenchmarkRegularizer( const std::string & component,
+    VariationalRegistrationRegularizer<TField> * regularizer,
+    TField * field, SizeValueType size, ThreadIdType threads,
+    const BenchmarkOptions & options, BenchmarkResultContainer & results )
+{
+  const std::string name = BenchmarkName( component, TField::ImageDimension, size, threads );
+  if( !IsSelected( options, name ) )
+    {
+    return;
+    }
+
+  regularizer->InPlaceOff();
+  regularizer->SetNumberOfThreads( threads );
+  regularizer->SetInput( field );
+
+  AddResult( name, TField::ImageDimension, size, threads,
+      field->GetBufferedRegion().GetNumberOfPixels(),
+      TimeUpdates( regularizer, options.repetitions ), results );
+}
+
+// Time a complete registration iteration (Demons forces and diffusive
+// regularization) using a workspace with or without parallel first touch.
+template <typename TImage, typename TField>
+void BenchmarkIteration( const std::string & component, bool parallelFirstTouch,
+    TImage * fixedImage, TImage * movingImage, SizeValueType size, ThreadIdType threads,
+    const BenchmarkOptions & options, BenchmarkResultContainer & results )
+{
+  const std::string name = BenchmarkName(
+      component + ( parallelFirstTouch ? "/FirstTouch:parallel" : "/FirstTouch:serial" ),
+      TImage::ImageDimension, size, threads );
+  if( !IsSelected( options, name ) )
+    {
+    return;
+    }
+
+  typedef VariationalRegistrationDemonsFunction<TImage, TImage, TField> DemonsFunctionType;
+  typedef VariationalRegistrationDiffusionRegularizer<TField>           DiffusionRegularizerType;
+  typedef VariationalRegistrationFilter<TImage, TImage, TField>         RegistrationFilterType;
+  typedef VariationalRegistrationWorkspace<TField>                      WorkspaceType;
+  typedef VariationalRegistrationInstrumentation                        InstrumentationType;
+
+  typename DemonsFunctionType::Pointer function = DemonsFunctionType::New();
+  typename DemonsFunctionType::MovingImageWarperType::Pointer warper =
+      DemonsFunctionType::MovingImageWarperType::New();
+  warper->SetNumberOfThreads( threads );
+  function->SetMovingImageWarper( warper );
+
+  typename DiffusionRegularizerType::Pointer regularizer = DiffusionRegularizerType::New();
+  regularizer->SetAlpha( 0.5 );
+
+  typename WorkspaceType::Pointer workspace = WorkspaceType::New();
+  workspace->SetNumberOfPixels( fixedImage->GetBufferedRegion().GetNumberOfPixels() );
+  workspace->SetParallelFirstTouch( parallelFirstTouch );
+  workspace->SetNumberOfThreads( threads );
+
+  InstrumentationType::Pointer instrumentation = InstrumentationType::New();
+
+  typename RegistrationFilterType::Pointer regFilter = RegistrationFilterType::New();
+  regFilter->SetDifferenceFunction( function );
+  regFilter->SetRegularizer( regularizer );
+  regFilter->SetWorkspace( workspace );
+  regFilter->SetFixedImage( fixedImage );
+  regFilter->SetMovingImage( movingImage );
+  regFilter->SetNumberOfIterations( options.repetitions + 1 );
+  regFilter->SetNumberOfThreads( threads );
+  regFilter->SetInstrumentation( instrumentation );
+  regFilter->Update();
+
+  std::vector<double> times;
+  for( SizeValueType i = 0; i < instrumentation->GetNumberOfRecords(); i++ )
+    {
+    times.push_back( instrumentation->GetRecord( i ).ElapsedTime );
+    }
+
+  AddResult( name, TImage::ImageDimension, size, threads,
+      fixedImage->GetBufferedRegion().GetNumberOfPixels(), times, results );
+}
+
+#if defined(__linux__)
+// Get the CPUs of the NUMA nodes from /sys. Returns one list per node, or an
+// empty vector if the topology is not available.
+std::vector< std::vector<int> > GetNUMANodeCPUs()
+{
+  std::vector< std::vector<int> > nodes;
+  for( unsigned int node = 0; ; node++ )
+    {
+    std::ostringstream filename;
+    filename << "/sys/devices/system/node/node" << node << "/cpulist";
+    std::ifstream file( filename.str().c_str() );
+    if( !file )
+      {
+      break;
+      }
+
+    // The list has the form "0-7,16-23".
+    std::vector<int> cpus;
+    std::string range;
+    while( std::getline( file, range, ',' ) )
+      {
+      int first = 0;
+      int last = 0;
+      const int count = std::sscanf( range.c_str(), "%d-%d", &first, &last );
+      if( count < 1 )
+        {
+        continue;
+        }
+      if( count == 1 )
+        {
+        last = first;
+        }
+      for( int cpu = first; cpu <= last; cpu++ )
+        {
+        cpus.push_back( cpu );
+        }
+      }
+    if( !cpus.empty() )
+      {
+      nodes.push_back( cpus );
+      }
+    }
+  return nodes;
+}
+#endif
+
+// Time a registration iteration pinned to the CPUs of one and of two NUMA
+// nodes, with one thread per CPU, and with serial and parallel first touch
+// of the workspace. Only available on Linux systems with at least two nodes.
+template <typename TImage, typename TField>
+void BenchmarkSocketScaling( TImage * fixedImage, TImage * movingImage, SizeValueType size,
+    const BenchmarkOptions & options, BenchmarkResultContainer & results )
+{
+#if defined(__linux__)
+  const std::vector< std::vector<int> > nodes = GetNUMANodeCPUs();
+  if( nodes.size() < 2 )
+    {
+    std::cerr << "Skipping socket scaling benchmark: "
+              << nodes.size() << " NUMA node(s) found" << std::endl;
+    return;
+    }
+
+  cpu_set_t originalMask;
+  CPU_ZERO( &originalMask );
+  if( sched_getaffinity( 0, sizeof( originalMask ), &originalMask ) != 0 )
+    {
+    std::cerr << "Skipping socket scaling benchmark: cannot get CPU affinity" << std::endl;
+    return;
+    }
+
+  for( unsigned int numberOfNodes = 1; numberOfNodes <= 2; numberOfNodes++ )
+    {
+    cpu_set_t mask;
+    CPU_ZERO( &mask );
+    ThreadIdType threads = 0;
+    for( unsigned int node = 0; node < numberOfNodes; node++ )
+      {
+      for( unsigned int i = 0; i < nodes[node].size(); i++ )
+        {
+        CPU_SET( nodes[node][i], &mask );
+        threads++;
+        }
+      }
+    if( sched_setaffinity( 0, sizeof( mask ), &mask ) != 0 )
+      {
+      std::cerr << "Skipping socket scaling benchmark: cannot set CPU affinity" << std::endl;
+      break;
+      }
+
+    // Threads created by the multi-threader inherit the affinity mask.
+    std::ostringstream component;
+    component << "Iteration/Sockets:" << numberOfNodes;
+    BenchmarkIteration<TImage, TField>( component.str(), false,
+        fixedImage, movingImage, size, threads, options, results );
+    BenchmarkIteration<TImage, TField>( component.str(), true,
+        fixedImage, movingImage, size, threads, options, results );
+    }
+
+  sched_setaffinity( 0, sizeof( originalMask ), &originalMask );
+#else
+  (void)fixedImage;
+  (void)movingImage;
+  (void)size;
+  (void)options;
+  (void)results;
+  std::cerr << "Skipping socket scaling benchmark: not supported on this platform" << std::endl;
+#endif
+}
+
+// Run all benchmarks for one image dimension.
+template <unsigned int VDimension>
+void RunBenchmarks( const std::vector<SizeValueType> & sizes,
+    const BenchmarkOptions & options, BenchmarkResultContainer & results )
+{
+  typedef Image<short, VDimension>                        ImageType;
+  typedef Image<Vector<float, VDimension>, VDimension>    DisplacementFieldType;
+
+  typedef VariationalRegistrationDemonsFunction<
+      ImageType, ImageType, DisplacementFieldType>        DemonsFunctionType;
+  typedef VariationalRegistrationSSDFunction<
+      ImageType, ImageType, DisplacementFieldType>        SSDFunctionType;
+  typedef VariationalRegistrationNCCFunction<
+      ImageType, ImageType, DisplacementFieldType>        NCCFunctionType;
+  typedef VariationalRegistrationFastNCCFunction<
+      ImageType, ImageType, DisplacementFieldType>        FastNCCFunctionType;
+
+  typedef VariationalRegistrationGaussianRegularizer<DisplacementFieldType>  GaussianRegularizerType;
+  typedef VariationalRegistrationDiffusionRegularizer<DisplacementFieldType> DiffusionRegularizerType;
+  typedef VariationalRegistrationMultigridRegularizer<DisplacementFieldType> MultigridRegularizerType;
+#if defined( ITK_USE_FFTWD ) || defined( ITK_USE_FFTWF )
+  typedef VariationalRegistrationElasticRegularizer<DisplacementFieldType>   ElasticRegularizerType;
+  typedef VariationalRegistrationElasticDCTRegularizer<DisplacementFieldType> ElasticDCTRegularizerType;
+  typedef VariationalRegistrationCurvatureRegularizer<DisplacementFieldType> CurvatureRegularizerType;
+#endif
+
+  typedef ContinuousBorderWarpImageFilter<
+      ImageType, ImageType, DisplacementFieldType>        WarperType;
+  typedef ExponentialDisplacementFieldImageFilter<
+      DisplacementFieldType, DisplacementFieldType>       ExponentiatorType;
+
+  for( unsigned int s = 0; s < sizes.size(); s++ )
+    {
+    const SizeValueType size = sizes[s];
+    std::cerr << "Generating " << VDimension << "D images of size " << size << std::endl;
+
+    typename ImageType::RegionType region;
+    typename ImageType::SizeType imageSize;
+    imageSize.Fill( size );
+    region.SetSize( imageSize );
+
+    typename ImageType::Pointer fixedImage = ImageType::New();
+    fixedImage->SetRegions( region );
+    fixedImage->Allocate();
+    FillPhantom<ImageType>( fixedImage, 0.0 );
+
+    typename ImageType::Pointer movingImage = ImageType::New();
+    movingImage->SetRegions( region );
+    movingImage->Allocate();
+    FillPhantom<ImageType>( movingImage, 2.0 );
+
+    typename DisplacementFieldType::Pointer field = DisplacementFieldType::New();
+    field->SetRegions( region );
+    field->Allocate();
+    FillField<DisplacementFieldType>( field, 2.0 );
+
+    typename DisplacementFieldType::Pointer velocityField = DisplacementFieldType::New();
+    velocityField->SetRegions( region );
+    velocityField->Allocate();
+    FillField<DisplacementFieldType>( velocityField, 0.5 );
+
+    const SizeValueType voxels = region.GetNumberOfPixels();
+
+    for( unsigned int t = 0; t < options.threads.size(); t++ )
+      {
+      const ThreadIdType threads = options.threads[t];
+
+      //
+      // Force terms
+      //
+      typename NCCFunctionType::RadiusType radius;
+      radius.Fill( 2 );
+
+      BenchmarkForce<ImageType, DisplacementFieldType>( "Force/Demons",
+          DemonsFunctionType::New(), fixedImage, movingImage, size, threads, options, results );
+      BenchmarkForce<ImageType, DisplacementFieldType>( "Force/SSD",
+          SSDFunctionType::New(), fixedImage, movingImage, size, threads, options, results );
+
+      typename NCCFunctionType::Pointer nccFunction = NCCFunctionType::New();
+      nccFunction->SetRadius( radius );
+      BenchmarkForce<ImageType, DisplacementFieldType>( "Force/NCC",
+          nccFunction, fixedImage, movingImage, size, threads, options, results );
+
+      typename FastNCCFunctionType::Pointer fastNCCFunction = FastNCCFunctionType::New();
+      fastNCCFunction->SetRadius( radius );
+      BenchmarkForce<ImageType, DisplacementFieldType>( "Force/FastNCC",
+          fastNCCFunction, fixedImage, movingImage, size, threads, options, results );
+
+      //
+      // Regularizers
+      //
+      typename GaussianRegularizerType::Pointer gaussRegularizer = GaussianRegularizerType::New();
+      gaussRegularizer->SetStandardDeviations( 1.0 );
+      BenchmarkRegularizer<DisplacementFieldType>( "Regularizer/Gaussian",
+          gaussRegularizer, field, size, threads, options, results );
+
+      typename DiffusionRegularizerType::Pointer diffRegularizer = DiffusionRegularizerType::New();
+      diffRegularizer->SetAlpha( 0.5 );
+      BenchmarkRegularizer<DisplacementFieldType>( "Regularizer/Diffusion",
+          diffRegularizer, field, size, threads, options, results );
+
+      typename MultigridRegularizerType::Pointer multigridRegularizer = MultigridRegularizerType::New();
+      multigridRegularizer->SetAlpha( 0.5 );
+      BenchmarkRegularizer<DisplacementFieldType>( "Regularizer/MultigridDiffusion",
+          multigridRegularizer, field, size, threads, options, results );
+
+      multigridRegularizer = MultigridRegularizerType::New();
+      multigridRegularizer->SetOperatorToElastic();
+      multigridRegularizer->SetMu( 0.5 );
+      multigridRegularizer->SetLambda( 0.5 );
+      BenchmarkRegularizer<DisplacementFieldType>( "Regularizer/MultigridElastic",
+          multigridRegularizer, field, size, threads, options, results );
+
+#if defined( ITK_USE_FFTWD ) || defined( ITK_USE_FFTWF )
+      typename ElasticRegularizerType::Pointer elasticRegularizer = ElasticRegularizerType::New();
+      elasticRegularizer->SetMu( 0.5 );
+      elasticRegularizer->SetLambda( 0.5 );
+      BenchmarkRegularizer<DisplacementFieldType>( "Regularizer/Elastic",
+          elasticRegularizer, field, size, threads, options, results );
+
+      elasticRegularizer = ElasticRegularizerType::New();
+      elasticRegularizer->SetMu( 0.5 );
+      elasticRegularizer->SetLambda( 0.5 );
+      elasticRegularizer->UsePaddedSizeOn();
+      BenchmarkRegularizer<DisplacementFieldType>( "Regularizer/ElasticPadded",
+          elasticRegularizer, field, size, threads, options, results );
+
+      typename ElasticDCTRegularizerType::Pointer elasticDCTRegularizer = ElasticDCTRegularizerType::New();
+      elasticDCTRegularizer->SetMu( 0.5 );
+      elasticDCTRegularizer->SetLambda( 0.5 );
+      BenchmarkRegularizer<DisplacementFieldType>( "Regularizer/ElasticDCT",
+          elasticDCTRegularizer, field, size, threads, options, results );
+
+      typename CurvatureRegularizerType::Pointer curvRegularizer = CurvatureRegularizerType::New();
+      curvRegularizer->SetAlpha( 0.5 );
+      BenchmarkRegularizer<DisplacementFieldType>( "Regularizer/Curvature",
+          curvRegularizer, field, size, threads, options, results );
+#endif
+
+      //
+      // Warper
+      //
+      std::string name = BenchmarkName( "Warper/ContinuousBorder", VDimension, size, threads );
+      if( IsSelected( options, name ) )
+        {
+        typename WarperType::Pointer warper = WarperType::New();
+        warper->SetInput( movingImage );
+        warper->SetOutputParametersFromImage( fixedImage );
+        warper->SetDisplacementField( field );
+        warper->SetNumberOfThreads( threads );
+        AddResult( name, VDimension, size, threads, voxels,
+            TimeUpdates( warper, options.repetitions ), results );
+        }
+
+      //
+      // Exponentiators
+      //
+      for( unsigned int inverse = 0; inverse < 2; inverse++ )
+        {
+        name = BenchmarkName( inverse ? "Exponentiator/Inverse" : "Exponentiator/Forward",
+            VDimension, size, threads );
+        if( IsSelected( options, name ) )
+          {
+          typename ExponentiatorType::Pointer exponentiator = ExponentiatorType::New();
+          exponentiator->SetInput( velocityField );
+          exponentiator->AutomaticNumberOfIterationsOff();
+          exponentiator->SetMaximumNumberOfIterations( 4 );
+          exponentiator->SetComputeInverse( inverse == 1 );
+          exponentiator->SetNumberOfThreads( threads );
+          AddResult( name, VDimension, size, threads, voxels,
+              TimeUpdates( exponentiator, options.repetitions ), results );
+          }
+        }
+
+      //
+      // Registration iteration with serial and parallel first touch
+      //
+      BenchmarkIteration<ImageType, DisplacementFieldType>( "Iteration", false,
+          fixedImage, movingImage, size, threads, options, results );
+      BenchmarkIteration<ImageType, DisplacementFieldType>( "Iteration", true,
+          fixedImage, movingImage, size, threads, options, results );
+      }
+
+    //
+    // Registration iteration pinned to one and two NUMA nodes
+    //
+    BenchmarkSocketScaling<ImageType, DisplacementFieldType>(
+        fixedImage, movingImage, size, options, results );
+    }
+}
+
+// Write the results in the JSON format of Google Benchmark with additional
+// fields for dimension, size, threads and voxels per second.
+void WriteResults( std::ostream & os, const BenchmarkOptions & options,
+    const BenchmarkResultContainer & results )
+{
+  os.precision( 10 );
+  os << "{" << std::endl;
+  os << "  \"context\": {" << std::endl;
+  os << "    \"itk_version\": \"" << Version::GetITKVersion() << "\"," << std::endl;
+  os << "    \"num_cpus\": " << MultiThreader::GetGlobalDefaultNumberOfThreads() << "," << std::endl;
+  os << "    \"repetitions\": " << options.repetitions << std::endl;
+  os << "  }," << std::endl;
+  os << "  \"benchmarks\": [" << std::endl;
+  for( unsigned int i = 0; i < results.size(); i++ )
+    {
+    const BenchmarkResult & result = results[i];
+    double voxelsPerSecond = 0.0;
+    if( result.minimumTime > 0.0 )
+      {
+      voxelsPerSecond = result.voxels / result.minimumTime;
+      }
+    os << "    {";
+    os << "\"name\": \"" << result.name << "\", ";
+    os << "\"dimension\": " << result.dimension << ", ";
+    os << "\"size\": " << result.size << ", ";
+    os << "\"threads\": " << result.threads << ", ";
+    os << "\"voxels\": " << result.voxels << ", ";
+    os << "\"repetitions\": " << result.repetitions << ", ";
+    os << "\"real_time\": " << result.minimumTime << ", ";
+    os << "\"real_time_mean\": " << result.meanTime << ", ";
+    os << "\"time_unit\": \"s\", ";
+    os << "\"voxels_per_second\": " << voxelsPerSecond;
+    os << "}" << ( i + 1 < results.size() ? "," : "" ) << std::endl;
+    }
+  os << "  ]" << std::endl;
+  os << "}" << std::endl;
+}
+
+void PrintHelp()
+{
+  std::cout << "Usage:" << std::endl;
+  std::cout << "  VariationalRegistrationBenchmark [options]" << std::endl;
+  std::cout << std::endl;
+  std::cout << "  Options:" << std::endl;
+  std::cout << "    -o <file>                JSON output file (default: standard output)." << std::endl;
+  std::cout << "    -d 2|3                   Run only 2D or 3D benchmarks (default: both)." << std::endl;
+  std::cout << "    -s <size>                Edge length of 2D images; may be repeated (default: 256, 1024)." << std::endl;
+  std::cout << "    -S <size>                Edge length of 3D images; may be repeated (default: 64, 128)." << std::endl;
+  std::cout << "    -t <threads>             Number of threads; may be repeated (default: 1 and all cores)." << std::endl;
+  std::cout << "    -r <repetitions>         Number of timed repetitions after a warm-up run (default: 5)." << std::endl;
+  std::cout << "    -b <pattern>             Run only benchmarks whose name contains the pattern." << std::endl;
+  std::cout << "    -?                       Print this help." << std::endl;
+  std::cout << std::endl;
+}
+
+int main( int argc, char *argv[] )
+{
+  BenchmarkOptions options;
+  options.repetitions = 5;
+  options.run2D = true;
+  options.run3D = true;
+
+  std::string outputFilename;
+  int c;
+  int intVal = 0;
+
+  while( (c = getopt( argc, argv, "o:d:s:S:t:r:b:?" )) != -1 )
+  {
+    switch( c )
+    {
+    case 'o':
+      outputFilename = optarg;
+      break;
+    case 'd':
+      intVal = atoi( optarg );
+      if( intVal != 2 && intVal != 3 )
+      {
+        ExceptionMacro( "Dimension must be 2 or 3!" );
+      }
+      options.run2D = ( intVal == 2 );
+      options.run3D = ( intVal == 3 );
+      break;
+    case 's':
+    case 'S':
+      intVal = atoi( optarg );
+      if( intVal < 8 )
+      {
+        ExceptionMacro( "Image size must be at least 8!" );
+      }
+      if( c == 's' )
+      {
+        options.sizes2D.push_back( intVal );
+      }
+      else
+      {
+        options.sizes3D.push_back( intVal );
+      }
+      break;
+    case 't':
+      intVal = atoi( optarg );
+      if( intVal < 1 )
+      {
+        ExceptionMacro( "Number of threads must be at least 1!" );
+      }
+      options.threads.push_back( intVal );
+      break;
+    case 'r':
+      intVal = atoi( optarg );
+      if( intVal < 1 )
+      {
+        ExceptionMacro( "Number of repetitions must be at least 1!" );
+      }
+      options.repetitions = intVal;
+      break;
+    case 'b':
+      options.pattern = optarg;
+      break;
+    case '?':
+      PrintHelp();
+      return EXIT_SUCCESS;
+    }
+  }
+
+  if( options.sizes2D.empty() )
+    {
+    options.sizes2D.push_back( 256 );
+    options.sizes2D.push_back( 1024 );
+    }
+  if( options.sizes3D.empty() )
+    {
+    options.sizes3D.push_back( 64 );
+    options.sizes3D.push_back( 128 );
+    }
+  if( options.threads.empty() )
+    {
+    options.threads.push_back( 1 );
+    if( MultiThreader::GetGlobalDefaultNumberOfThreads() > 1 )
+      {
+      options.threads.push_back( MultiThreader::GetGlobalDefaultNumberOfThreads() );
+      }
+    }
+
+  BenchmarkResultContainer results;
+  try
+    {
+    if( options.run2D )
+      {
+      RunBenchmarks<2>( options.sizes2D, options, results );
+      }
+    if( options.run3D )
+      {
+      RunBenchmarks<3>( options.sizes3D, options, results );
+      }
+    }
+  catch( itk::ExceptionObject & error )
+    {
+    ExceptionMacro( "Error during benchmark: " << error );
+    }
+
+  if( outputFilename.empty() )
+    {
+    WriteResults( std::cout, options, results );
+    }
+  else
+    {
+    std::ofstream file( outputFilename.c_str() );
+    if( !file )
+      {
+      ExceptionMacro( "Could not open output file " << outputFilename );
+      }
+    WriteResults( file, options, results );
+    }
+
+  return EXIT_SUCCESS;
+}
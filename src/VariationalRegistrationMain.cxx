@@ -43,7 +43,11 @@
 
 // System includes:
 #include <iostream>
+#include <fstream>
+#include <sstream>
 #include <string>
+#include <vector>
+#include <deque>
 #define GETOPT_API
 extern "C"
 {
@@ -55,10 +59,13 @@ extern "C"
 // Project includes:
 #include "itkConfigure.h"
 #include "itkVariationalRegistrationIncludeRequiredIOFactories.h"
+#include "itkVariationalRegistrationMappedImageReader.h"
+#include "itkVariationalRegistrationHistogramMatchingImageFilter.h"
 
 #include "itkExponentialDisplacementFieldImageFilter.h"
 
 #include "itkVariationalRegistrationMultiResolutionFilter.h"
+#include "itkVariationalRegistrationJobScheduler.h"
 #include "itkVariationalRegistrationFilter.h"
 #include "itkVariationalDiffeomorphicRegistrationFilter.h"
 #include "itkVariationalSymmetricDiffeomorphicRegistrationFilter.h"
@@ -72,23 +79,1074 @@ extern "C"
 #include "itkVariationalRegistrationRegularizer.h"
 #include "itkVariationalRegistrationGaussianRegularizer.h"
 #include "itkVariationalRegistrationDiffusionRegularizer.h"
+#include "itkVariationalRegistrationMultigridRegularizer.h"
 #if defined( ITK_USE_FFTWD ) || defined( ITK_USE_FFTWF )
 #include "itkVariationalRegistrationElasticRegularizer.h"
+#include "itkVariationalRegistrationElasticDCTRegularizer.h"
 #include "itkVariationalRegistrationCurvatureRegularizer.h"
 #endif
 
 #include "itkVariationalRegistrationStopCriterion.h"
 #include "itkVariationalRegistrationLogger.h"
+#include "itkVariationalRegistrationStructuredLogger.h"
 
 // ITK library includes
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
-#include "itkHistogramMatchingImageFilter.h"
+#include "itkSimpleMutexLock.h"
+#include "itkConditionVariable.h"
+#include "itkImageDuplicator.h"
+#include "itkRealTimeClock.h"
 
 #include <vnl/vnl_math.h>
 
 using namespace itk;
 
+//////////////////////////////////////////////
+//
+// Image and filter types
+//
+//////////////////////////////////////////////
+typedef Image<Vector<float, DIMENSION>, DIMENSION> DisplacementFieldType;
+typedef DisplacementFieldType::Pointer             DisplacementFieldPointerType;
+typedef ImageFileWriter<DisplacementFieldType>     DisplacementFieldWriterType;
+
+typedef Image<short, DIMENSION>                    ImageType;
+typedef ImageType::Pointer                         ImagePointerType;
+typedef ImageFileWriter<ImageType>                 ImageWriterType;
+
+typedef VariationalRegistrationFunction<ImageType,ImageType,DisplacementFieldType>::MaskImageType
+                                                   MaskType;
+typedef MaskType::Pointer                          MaskPointerType;
+
+typedef VariationalRegistrationFunction<
+    ImageType,ImageType,DisplacementFieldType>   FunctionType;
+typedef VariationalRegistrationDemonsFunction<
+    ImageType, ImageType, DisplacementFieldType> DemonsFunctionType;
+typedef VariationalRegistrationSSDFunction<
+    ImageType, ImageType, DisplacementFieldType> SSDFunctionType;
+typedef VariationalRegistrationFastNCCFunction<
+    ImageType, ImageType, DisplacementFieldType> NCCFunctionType;
+
+typedef VariationalRegistrationRegularizer<DisplacementFieldType>          RegularizerType;
+typedef VariationalRegistrationGaussianRegularizer<DisplacementFieldType>  GaussianRegularizerType;
+typedef VariationalRegistrationDiffusionRegularizer<DisplacementFieldType> DiffusionRegularizerType;
+typedef VariationalRegistrationMultigridRegularizer<DisplacementFieldType> MultigridRegularizerType;
+#if defined( ITK_USE_FFTWD ) || defined( ITK_USE_FFTWF )
+typedef VariationalRegistrationElasticRegularizer<DisplacementFieldType>   ElasticRegularizerType;
+typedef VariationalRegistrationElasticDCTRegularizer<DisplacementFieldType> ElasticDCTRegularizerType;
+typedef VariationalRegistrationCurvatureRegularizer<DisplacementFieldType> CurvatureRegularizerType;
+#endif
+
+typedef VariationalRegistrationFilter<
+    ImageType,ImageType,DisplacementFieldType> RegistrationFilterType;
+typedef VariationalDiffeomorphicRegistrationFilter<
+    ImageType,ImageType,DisplacementFieldType> DiffeomorphicRegistrationFilterType;
+typedef VariationalSymmetricDiffeomorphicRegistrationFilter<
+    ImageType,ImageType,DisplacementFieldType> SymmetricDiffeomorphicRegistrationFilterType;
+
+typedef VariationalRegistrationMultiResolutionFilter<ImageType,ImageType,DisplacementFieldType> MRRegistrationFilterType;
+
+typedef VariationalRegistrationStopCriterion<
+    RegistrationFilterType,MRRegistrationFilterType> StopCriterionType;
+typedef VariationalRegistrationLogger<
+    RegistrationFilterType,MRRegistrationFilterType> LoggerType;
+typedef VariationalRegistrationStructuredLogger<
+    RegistrationFilterType,MRRegistrationFilterType> StructuredLoggerType;
+
+// Parameters of the registration given on the command line.
+struct RegistrationParameters
+{
+  // Registration parameters
+  int numberOfIterations;
+  int numberOfLevels;
+  bool useFusedFieldExpander;
+  int numberOfExponentiatorIterations;
+  double timestep;
+  bool adaptiveTimeStep;
+  int searchSpace;
+  bool useImageSpacing;
+
+  // Regularizer parameters
+  int regularizerType;
+  float regulAlpha;
+  float regulVar;
+  float regulMu;
+  float regulLambda;
+  int fftPadding;
+
+  int nccRadius;
+
+  // Force parameters
+  int forceType;
+  int forceDomain;
+  double forceSamplingFraction; // Fraction of pixels with forces, 1 for dense
+
+  // Stop criterion parameters
+  int stopCriterionPolicy;
+  float stopCriterionSlope;
+  double timeBudget;      // Wall-clock budget in seconds, 0 for none
+  double minimumGainRate; // Relative metric decrease per second, 0 for none
+  int metricSamplingStride; // Compute the metric from every n-th pixel
+  int maskBlockSize;        // Edge length of the mask blocks, 0 for none
+  double freezeThreshold;   // Displacement change of converged blocks, 0 for none
+  int updateScheme;         // 0: gradient descent, 1: Nesterov
+
+  // Preproc and general parameters
+  bool useHistogramMatching;
+  bool useDebugMode;
+  bool bWrite3DDisplacementField;
+
+  // Structured log file (JSON lines or CSV), empty for none
+  std::string logFilename;
+
+  // Memory budget in bytes, 0 for none
+  SizeValueType memoryBudget;
+
+  // Policy if the memory budget is exceeded: 0 fail, 1 release
+  int memoryBudgetPolicy;
+
+  // Directory for file-backed workspace buffers, empty for heap buffers
+  std::string workspaceDirectory;
+};
+
+// Parameters for the multi-threaded conversion of a 2D into a 3D field.
+// Both fields have the same memory layout, i.e. pixel i of the 2D field
+// becomes pixel i of the 3D field.
+struct ConvertFieldTo3DThreadStruct
+{
+  const Vector<float, DIMENSION> *source;  // Buffer of the input field.
+  Vector<float, 3> *target;                // Buffer of the output field.
+  SizeValueType numberOfPixels;
+};
+
+ITK_THREAD_RETURN_TYPE ConvertFieldTo3DCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct* threadStruct =
+      (MultiThreader::ThreadInfoStruct *) arg;
+  ThreadIdType threadId = threadStruct->ThreadID;
+  ThreadIdType threadCount = threadStruct->NumberOfThreads;
+
+  ConvertFieldTo3DThreadStruct* str =
+      (ConvertFieldTo3DThreadStruct*) threadStruct->UserData;
+
+  const SizeValueType chunk = ( str->numberOfPixels + threadCount - 1 ) / threadCount;
+  const SizeValueType begin = threadId * chunk;
+  const SizeValueType end = vnl_math_min( begin + chunk, str->numberOfPixels );
+
+  for( SizeValueType i = begin; i < end; ++i )
+    {
+    str->target[i][0] = str->source[i][0];
+    str->target[i][1] = str->source[i][1];
+    str->target[i][2] = 0.0;
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+//////////////////////////////////////////////
+//
+// Setup of the registration
+//
+//////////////////////////////////////////////
+// Create the multi-resolution registration with registration function,
+// regularizer, stop criterion and (optionally) logger as selected by the
+// parameters. All filters use the given number of threads. Elastic and
+// curvature regularization require FFTW, which has to be checked before.
+MRRegistrationFilterType::Pointer CreateRegistration(
+    const RegistrationParameters & param, ThreadIdType numberOfThreads, bool useLogger )
+{
+  //
+  // Setup registration function
+  //
+  FunctionType::Pointer function;
+  switch( param.forceType )
+  {
+  case 0:
+  {
+    DemonsFunctionType::Pointer demonsFunction = DemonsFunctionType::New();
+    switch( param.forceDomain )
+    {
+    case 0:
+      demonsFunction->SetGradientTypeToWarpedMovingImage();
+      break;
+    case 1:
+      demonsFunction->SetGradientTypeToFixedImage();
+      break;
+    case 2:
+      demonsFunction->SetGradientTypeToSymmetric();
+      break;
+    }
+
+    function = demonsFunction;
+  }
+  break;
+  case 1:
+  {
+    SSDFunctionType::Pointer ssdFunction = SSDFunctionType::New();
+    switch( param.forceDomain )
+    {
+    case 0:
+      ssdFunction->SetGradientTypeToWarpedMovingImage();
+      break;
+    case 1:
+      ssdFunction->SetGradientTypeToFixedImage();
+      break;
+    case 2:
+      ssdFunction->SetGradientTypeToSymmetric();
+      break;
+    }
+
+  function = ssdFunction;
+  }
+  break;
+  case 2:
+  {
+    NCCFunctionType::Pointer nccFunction = NCCFunctionType::New();
+    NCCFunctionType::RadiusType r;
+    for( unsigned int dim = 0; dim < NCCFunctionType::ImageDimension; dim++ )
+      {
+      r[dim] = param.nccRadius;
+      }
+    nccFunction->SetRadius( r );
+
+    switch( param.forceDomain )
+    {
+    case 0:
+      nccFunction->SetGradientTypeToWarpedMovingImage();
+      break;
+    case 1:
+      nccFunction->SetGradientTypeToFixedImage();
+      break;
+    case 2:
+      nccFunction->SetGradientTypeToSymmetric();
+      break;
+    }
+    function = nccFunction;
+  }
+  break;
+  }
+
+  typedef FunctionType::MovingImageWarperType MovingImageWarperType;
+  MovingImageWarperType::Pointer warper = MovingImageWarperType::New();
+  warper->SetNumberOfThreads( numberOfThreads );
+
+  function->SetMovingImageWarper( warper );
+  function->SetTimeStep( param.timestep );
+  function->SetAdaptiveTimeStep( param.adaptiveTimeStep );
+
+  //
+  // Setup regularizer
+  //
+  RegularizerType::Pointer regularizer;
+  switch( param.regularizerType )
+  {
+  case 0:
+    {
+    GaussianRegularizerType::Pointer gaussRegularizer = GaussianRegularizerType::New();
+    gaussRegularizer->SetStandardDeviations( vcl_sqrt( param.regulVar ) );
+    regularizer = gaussRegularizer;
+    }
+    break;
+  case 1:
+    {
+    DiffusionRegularizerType::Pointer diffRegularizer = DiffusionRegularizerType::New();
+    diffRegularizer->SetAlpha( param.regulAlpha );
+    regularizer = diffRegularizer;
+    }
+    break;
+  case 4:
+    {
+    MultigridRegularizerType::Pointer multigridRegularizer = MultigridRegularizerType::New();
+    multigridRegularizer->SetOperatorToDiffusion();
+    multigridRegularizer->SetAlpha( param.regulAlpha );
+    regularizer = multigridRegularizer;
+    }
+    break;
+  case 5:
+    {
+    MultigridRegularizerType::Pointer multigridRegularizer = MultigridRegularizerType::New();
+    multigridRegularizer->SetOperatorToElastic();
+    multigridRegularizer->SetMu( param.regulMu );
+    multigridRegularizer->SetLambda( param.regulLambda );
+    regularizer = multigridRegularizer;
+    }
+    break;
+#if defined( ITK_USE_FFTWD ) || defined( ITK_USE_FFTWF )
+  case 2:
+    {
+    ElasticRegularizerType::Pointer elasticRegularizer = ElasticRegularizerType::New();
+    elasticRegularizer->SetMu( param.regulMu );
+    elasticRegularizer->SetLambda( param.regulLambda );
+    if( param.fftPadding > 0 )
+      {
+      elasticRegularizer->UsePaddedSizeOn();
+      elasticRegularizer->SetBoundaryExtension(
+          static_cast<ElasticRegularizerType::BoundaryExtensionType>( param.fftPadding - 1 ) );
+      }
+    regularizer = elasticRegularizer;
+    }
+    break;
+  case 3:
+    {
+    CurvatureRegularizerType::Pointer curvatureRegularizer = CurvatureRegularizerType::New();
+    curvatureRegularizer->SetAlpha( param.regulAlpha );
+    if( param.fftPadding > 0 )
+      {
+      curvatureRegularizer->UsePaddedSizeOn();
+      curvatureRegularizer->SetBoundaryExtension(
+          static_cast<CurvatureRegularizerType::BoundaryExtensionType>( param.fftPadding - 1 ) );
+      }
+    regularizer = curvatureRegularizer;
+    }
+    break;
+  case 6:
+    {
+    ElasticDCTRegularizerType::Pointer elasticRegularizer = ElasticDCTRegularizerType::New();
+    elasticRegularizer->SetMu( param.regulMu );
+    elasticRegularizer->SetLambda( param.regulLambda );
+    if( param.fftPadding > 0 )
+      {
+      elasticRegularizer->UsePaddedSizeOn();
+      elasticRegularizer->SetBoundaryExtension(
+          static_cast<ElasticDCTRegularizerType::BoundaryExtensionType>( param.fftPadding - 1 ) );
+      }
+    regularizer = elasticRegularizer;
+    }
+    break;
+#endif
+  default:
+    return NULL;
+  }
+  regularizer->InPlaceOff();
+  regularizer->SetUseImageSpacing( param.useImageSpacing );
+  regularizer->SetNumberOfThreads( numberOfThreads );
+
+  //
+  // Setup registration filter
+  //
+  RegistrationFilterType::Pointer regFilter;
+  switch( param.searchSpace )
+  {
+  case 0:
+    {
+    regFilter = RegistrationFilterType::New();
+    break;
+    }
+  case 1:
+    {
+    DiffeomorphicRegistrationFilterType::Pointer diffeoRegFilter =
+        DiffeomorphicRegistrationFilterType::New();
+    diffeoRegFilter->SetNumberOfExponentiatorIterations( param.numberOfExponentiatorIterations );
+    regFilter = diffeoRegFilter;
+    break;
+    }
+  case 2:
+    {
+    SymmetricDiffeomorphicRegistrationFilterType::Pointer symmDiffeoRegFilter =
+        SymmetricDiffeomorphicRegistrationFilterType::New();
+    symmDiffeoRegFilter->SetNumberOfExponentiatorIterations( param.numberOfExponentiatorIterations );
+    regFilter = symmDiffeoRegFilter;
+    break;
+    }
+  }
+  regFilter->SetRegularizer( regularizer );
+  regFilter->SetDifferenceFunction( function );
+  regFilter->SetNumberOfThreads( numberOfThreads );
+  regFilter->SetMetricSamplingStride( param.metricSamplingStride );
+  regFilter->SetForceSamplingFraction( param.forceSamplingFraction );
+  if( param.maskBlockSize > 0 )
+    {
+    regFilter->UseMaskBlocksOn();
+    regFilter->SetMaskBlockSize( param.maskBlockSize );
+    }
+  if( param.updateScheme == 1 )
+    {
+    regFilter->SetUpdateSchemeToNesterov();
+    }
+  if( param.freezeThreshold > 0.0 )
+    {
+    regFilter->FreezeConvergedBlocksOn();
+    regFilter->SetFreezeThreshold( param.freezeThreshold );
+    }
+
+  //
+  // Setup multi-resolution filter
+  //
+  Array< unsigned int > its(param.numberOfLevels);
+  its[param.numberOfLevels - 1] = param.numberOfIterations;
+  for( int level = param.numberOfLevels - 2; level >= 0; --level )
+    {
+    its[level] = its[level + 1];
+    }
+
+  MRRegistrationFilterType::Pointer mrRegFilter = MRRegistrationFilterType::New();
+  mrRegFilter->SetRegistrationFilter( regFilter );
+  mrRegFilter->SetNumberOfLevels( param.numberOfLevels );
+  mrRegFilter->SetUseFusedFieldExpander( param.useFusedFieldExpander );
+  mrRegFilter->SetNumberOfIterations( its );
+  mrRegFilter->SetNumberOfThreads( numberOfThreads );
+  mrRegFilter->SetMemoryBudget( param.memoryBudget );
+  if( param.memoryBudgetPolicy == 1 )
+    {
+    mrRegFilter->SetMemoryBudgetPolicyToRelease();
+    }
+  else
+    {
+    mrRegFilter->SetMemoryBudgetPolicyToFail();
+    }
+  mrRegFilter->GetWorkspace()->SetBackingDirectory( param.workspaceDirectory );
+
+  //
+  // Setup stop criterion
+  //
+  StopCriterionType::Pointer stopCriterion = StopCriterionType::New();
+  stopCriterion->SetRegressionLineSlopeThreshold( param.stopCriterionSlope );
+  stopCriterion->PerformLineFittingMaxDistanceCheckOn();
+  if( param.timeBudget > 0.0 )
+    {
+    stopCriterion->SetBudgetPolicyToTime();
+    stopCriterion->SetBudget( param.timeBudget );
+    }
+  if( param.minimumGainRate > 0.0 )
+    {
+    stopCriterion->PerformGainRateCheckOn();
+    stopCriterion->SetMinimumGainRate( param.minimumGainRate );
+    }
+  if( param.forceSamplingFraction < 1.0 )
+    {
+    stopCriterion->AdaptForceSamplingOn();
+    }
+
+  switch( param.stopCriterionPolicy )
+  {
+    case 1:
+      stopCriterion->SetMultiResolutionPolicyToSimpleGraduated();
+      break;
+    case 2:
+      stopCriterion->SetMultiResolutionPolicyToGraduated();
+      break;
+    default:
+      stopCriterion->SetMultiResolutionPolicyToDefault();
+      break;
+  }
+
+  regFilter->AddObserver( itk::IterationEvent(), stopCriterion );
+  mrRegFilter->AddObserver( itk::IterationEvent(), stopCriterion );
+  mrRegFilter->AddObserver( itk::InitializeEvent(), stopCriterion );
+
+  //
+  // Setup logger
+  //
+  LoggerType::Pointer logger = LoggerType::New();
+  if( useLogger )
+    {
+    regFilter->AddObserver( itk::IterationEvent(), logger );
+    mrRegFilter->AddObserver( itk::IterationEvent(), logger );
+    }
+
+  // The structured logger is added after the stop criterion to see its
+  // decision. Its records include the phase times of the instrumentation.
+  if( useLogger && !param.logFilename.empty() )
+    {
+    StructuredLoggerType::Pointer structuredLogger = StructuredLoggerType::New();
+    structuredLogger->SetFileName( param.logFilename );
+    if( itksys::SystemTools::GetFilenameLastExtension( param.logFilename ) == ".csv" )
+      {
+      structuredLogger->SetOutputFormatToCSV();
+      }
+    else
+      {
+      structuredLogger->SetOutputFormatToJSONLines();
+      }
+    structuredLogger->SetStopCriterion( stopCriterion );
+
+    mrRegFilter->SetInstrumentation( VariationalRegistrationInstrumentation::New() );
+
+    regFilter->AddObserver( itk::IterationEvent(), structuredLogger );
+    mrRegFilter->AddObserver( itk::IterationEvent(), structuredLogger );
+    mrRegFilter->AddObserver( itk::InitializeEvent(), structuredLogger );
+    }
+
+  if( param.useDebugMode )
+    {
+    regularizer->DebugOn();
+    regFilter->DebugOn();
+    mrRegFilter->DebugOn();
+    stopCriterion->DebugOn();
+    logger->DebugOn();
+    }
+
+  return mrRegFilter;
+}
+
+// Match the histogram of the moving image to the fixed image. The moving
+// image buffer is reused for the result, i.e. the moving image must not be
+// used afterwards.
+ImagePointerType MatchHistogram( const ImageType * movingImage, const ImageType * fixedImage,
+    ThreadIdType numberOfThreads )
+{
+  typedef VariationalRegistrationHistogramMatchingImageFilter<ImageType> MatchingFilterType;
+  MatchingFilterType::Pointer matcher;
+
+  matcher = MatchingFilterType::New();
+
+  matcher->SetInput( movingImage );
+  matcher->SetReferenceImage( fixedImage );
+  matcher->SetNumberOfHistogramLevels( 1024 );
+  matcher->SetNumberOfMatchPoints( 7 );
+  matcher->ThresholdAtMeanIntensityOn();
+  matcher->SetNumberOfThreads( numberOfThreads );
+  matcher->InPlaceOn();
+  matcher->Update();
+
+  ImagePointerType matchedImage = matcher->GetOutput();
+  matchedImage->DisconnectPipeline();
+  return matchedImage;
+}
+
+// Copy a field into a new image.
+DisplacementFieldPointerType DuplicateField( const DisplacementFieldType * field )
+{
+  typedef ImageDuplicator<DisplacementFieldType> DuplicatorType;
+  DuplicatorType::Pointer duplicator = DuplicatorType::New();
+  duplicator->SetInputImage( field );
+  duplicator->Update();
+  return duplicator->GetModifiableOutput();
+}
+
+// Write the results of a registration. Filenames and the velocity field may
+// be NULL. Throws an exception if writing fails.
+void WriteResults( const RegistrationParameters & param,
+    DisplacementFieldType * outputDisplacementField, DisplacementFieldType * outputVelocityField,
+    const ImageType * movingImage, const ImageType * fixedImage,
+    const char * outputDisplacementFilename, const char * outputVelocityFilename,
+    const char * warpedImageFilename, ThreadIdType numberOfThreads )
+{
+
+  if( outputDisplacementFilename != NULL && outputDisplacementField != NULL )
+    {
+    if( DIMENSION == 2 && param.bWrite3DDisplacementField )
+    {
+      std::cout << "Converting deformation field to 3D..." << std::endl;
+      typedef Image<Vector<float, 3> , 3>               OutDisplacementFieldType;
+      typedef OutDisplacementFieldType::Pointer         OutDisplacementFieldPointerType;
+      typedef ImageFileWriter<OutDisplacementFieldType> OutDisplacementFieldWriterType;
+
+      OutDisplacementFieldPointerType writeField = OutDisplacementFieldType::New();
+
+      DisplacementFieldType::SizeType oldSize = outputDisplacementField->GetLargestPossibleRegion().GetSize();
+      OutDisplacementFieldType::SizeType newSize;
+
+      newSize[0] = oldSize[0];
+      newSize[1] = oldSize[1];
+      newSize[2] = 1;
+
+      writeField->SetRegions( newSize );
+
+      DisplacementFieldType::SpacingType oldSpacing = outputDisplacementField->GetSpacing();
+      OutDisplacementFieldType::SpacingType newSpacing;
+
+      newSpacing[0] = oldSpacing[0];
+      newSpacing[1] = oldSpacing[1];
+      newSpacing[2] = 1;
+
+      writeField->SetSpacing( newSpacing );
+
+      writeField->Allocate();
+
+      ConvertFieldTo3DThreadStruct convertStr;
+      convertStr.source = outputDisplacementField->GetBufferPointer();
+      convertStr.target = writeField->GetBufferPointer();
+      convertStr.numberOfPixels =
+          outputDisplacementField->GetBufferedRegion().GetNumberOfPixels();
+
+      MultiThreader::Pointer threader = MultiThreader::New();
+      threader->SetNumberOfThreads( numberOfThreads );
+      threader->SetSingleMethod( ConvertFieldTo3DCallback, &convertStr );
+      threader->SingleMethodExecute();
+
+      std::cout << "Saving deformation field..." << std::endl;
+      OutDisplacementFieldWriterType::Pointer DisplacementFieldWriter;
+      DisplacementFieldWriter = OutDisplacementFieldWriterType::New();
+
+      DisplacementFieldWriter->SetInput( writeField );
+      DisplacementFieldWriter->SetFileName( outputDisplacementFilename );
+      DisplacementFieldWriter->Update();
+      }
+    else
+      {
+      std::cout << "Saving deformation field..." << std::endl;
+      DisplacementFieldWriterType::Pointer DisplacementFieldWriter;
+      DisplacementFieldWriter = DisplacementFieldWriterType::New();
+
+      DisplacementFieldWriter->SetInput( outputDisplacementField );
+      DisplacementFieldWriter->SetFileName( outputDisplacementFilename );
+      DisplacementFieldWriter->Update();
+
+      if( outputVelocityFilename != NULL && outputVelocityField != NULL )
+      {
+        std::cout << "Saving velocity field..." << std::endl;
+        DisplacementFieldWriterType::Pointer velocityFieldWriter;
+        velocityFieldWriter = DisplacementFieldWriterType::New();
+
+        velocityFieldWriter->SetInput( outputVelocityField );
+        velocityFieldWriter->SetFileName( outputVelocityFilename );
+        velocityFieldWriter->Update();
+      }
+      }
+    }
+
+  if( warpedImageFilename != NULL )
+    {
+
+    typedef FunctionType::MovingImageWarperType MovingImageWarperType;
+    MovingImageWarperType::Pointer warper = MovingImageWarperType::New();
+
+    warper->SetInput( movingImage );
+    warper->SetOutputParametersFromImage( fixedImage );
+    warper->SetDisplacementField( outputDisplacementField );
+    warper->SetNumberOfThreads( numberOfThreads );
+    warper->UpdateLargestPossibleRegion();
+
+    ImageWriterType::Pointer imageWriter;
+    imageWriter = ImageWriterType::New();
+
+    imageWriter->SetInput( warper->GetOutput() );
+    imageWriter->SetFileName( warpedImageFilename );
+    imageWriter->Update();
+    }
+}
+
+//////////////////////////////////////////////
+//
+// Batch mode
+//
+//////////////////////////////////////////////
+// One case of a batch: the moving image and the output filenames. Empty
+// output filenames are not written.
+struct BatchCase
+{
+  std::string movingImageFilename;
+  std::string displacementFilename;
+  std::string warpedImageFilename;
+};
+
+// Read a batch manifest. Each line contains the moving image filename, the
+// output displacement field filename and optionally the warped image
+// filename, separated by whitespace. A '-' skips an output. Empty lines and
+// lines starting with '#' are ignored.
+bool ReadBatchManifest( const char * filename, std::vector<BatchCase> & cases )
+{
+  std::ifstream manifest( filename );
+  if( !manifest )
+    {
+    return false;
+    }
+
+  std::string line;
+  while( std::getline( manifest, line ) )
+    {
+    std::istringstream lineStream( line );
+    BatchCase batchCase;
+    if( !( lineStream >> batchCase.movingImageFilename )
+        || batchCase.movingImageFilename[0] == '#' )
+      {
+      continue;
+      }
+    lineStream >> batchCase.displacementFilename >> batchCase.warpedImageFilename;
+
+    if( batchCase.displacementFilename == "-" )
+      {
+      batchCase.displacementFilename.clear();
+      }
+    if( batchCase.warpedImageFilename == "-" )
+      {
+      batchCase.warpedImageFilename.clear();
+      }
+    if( batchCase.displacementFilename.empty() && batchCase.warpedImageFilename.empty() )
+      {
+      std::cerr << "ERROR: No output given for " << batchCase.movingImageFilename << std::endl;
+      return false;
+      }
+    cases.push_back( batchCase );
+    }
+
+  return true;
+}
+
+// A case passed between the stages of the batch pipeline.
+struct BatchItem
+{
+  SizeValueType caseId;
+  ImagePointerType movingImage;
+  MRRegistrationFilterType::MovingImagePyramidPointer movingImagePyramid;
+  DisplacementFieldPointerType displacementField;
+  DisplacementFieldPointerType velocityField;
+};
+
+// Shared data of the threads processing a batch. The batch is processed in
+// a pipeline of three stages connected by bounded queues:
+//   - thread 0 loads and preprocesses the cases (reading, histogram matching
+//     and moving image pyramid) ahead of the registrations,
+//   - thread 1 writes the results of finished cases,
+//   - all other threads set up their own registration and register the
+//     loaded cases. Registration, workspace, FFT plans and the fixed and mask
+//     image pyramids are kept between the cases of a thread.
+// Each queue holds at most queueLength cases, which bounds the memory.
+struct BatchThreadStruct
+{
+  const RegistrationParameters *param;
+  const ImageType *fixedImage;
+  const MaskType *maskImage;                  // May be NULL.
+  const DisplacementFieldType *initialField;  // May be NULL.
+  const std::vector<BatchCase> *cases;
+  ThreadIdType threadsPerJob;                 // Threads of each registration.
+  SizeValueType queueLength;
+
+  // Pipeline state, guarded by mutex. stateChanged is signaled whenever
+  // a queue or counter changes.
+  SimpleMutexLock *mutex;
+  ConditionVariable *stateChanged;
+  std::deque<BatchItem> loadedQueue;
+  std::deque<BatchItem> resultQueue;
+  SizeValueType numberOfLoadedCases;          // Cases taken by the loader.
+  ThreadIdType numberOfActiveJobs;            // Registration threads not finished.
+  SizeValueType numberOfFailures;
+};
+
+// Stage 1: load and preprocess the cases in order.
+void BatchLoad( BatchThreadStruct *str )
+{
+  // The loader uses its own view of the fixed image as histogram reference.
+  ImagePointerType fixedImage = ImageType::New();
+  fixedImage->Graft( str->fixedImage );
+
+  for( SizeValueType caseId = 0; caseId < str->cases->size(); ++caseId )
+    {
+    const BatchCase & batchCase = ( *str->cases )[caseId];
+
+    BatchItem item;
+    item.caseId = caseId;
+    try
+      {
+      item.movingImage = VariationalRegistrationReadImage<ImageType>(
+          batchCase.movingImageFilename.c_str() );
+
+      if( str->param->useHistogramMatching )
+        {
+        item.movingImage = MatchHistogram( item.movingImage, fixedImage, str->threadsPerJob );
+        }
+
+      // Build the moving pyramid; it is handed to the registration, which
+      // only recomputes it if the image has changed.
+      item.movingImagePyramid = MRRegistrationFilterType::MovingImagePyramidType::New();
+      item.movingImagePyramid->SetNumberOfLevels( str->param->numberOfLevels );
+      item.movingImagePyramid->SetNumberOfThreads( str->threadsPerJob );
+      item.movingImagePyramid->SetInput( item.movingImage );
+      item.movingImagePyramid->UpdateLargestPossibleRegion();
+      }
+    catch( itk::ExceptionObject & error )
+      {
+      str->mutex->Lock();
+      std::cerr << "ERROR: Could not load " << batchCase.movingImageFilename
+          << ": " << error << std::endl;
+      str->numberOfFailures++;
+      str->numberOfLoadedCases++;
+      str->stateChanged->Broadcast();
+      str->mutex->Unlock();
+      continue;
+      }
+
+    str->mutex->Lock();
+    while( str->loadedQueue.size() >= str->queueLength )
+      {
+      str->stateChanged->Wait( str->mutex );
+      }
+    std::cout << "Case " << caseId + 1 << "/" << str->cases->size()
+        << ": Loaded " << batchCase.movingImageFilename << std::endl;
+    str->loadedQueue.push_back( item );
+    str->numberOfLoadedCases++;
+    str->stateChanged->Broadcast();
+    str->mutex->Unlock();
+    }
+}
+
+// Stage 2: register loaded cases until all cases are loaded and taken.
+void BatchRegister( BatchThreadStruct *str )
+{
+  // Each thread uses its own image objects sharing the pixel data of the
+  // inputs, so that the pipelines of the threads do not interfere.
+  ImagePointerType fixedImage = ImageType::New();
+  fixedImage->Graft( str->fixedImage );
+
+  MaskPointerType maskImage;
+  if( str->maskImage != NULL )
+    {
+    maskImage = MaskType::New();
+    maskImage->Graft( str->maskImage );
+    }
+
+  DisplacementFieldPointerType initialField;
+  if( str->initialField != NULL )
+    {
+    initialField = DisplacementFieldType::New();
+    initialField->Graft( str->initialField );
+    }
+
+  MRRegistrationFilterType::Pointer mrRegFilter =
+      CreateRegistration( *str->param, str->threadsPerJob, false );
+  mrRegFilter->SetFixedImage( fixedImage );
+  mrRegFilter->SetMaskImage( maskImage );
+  mrRegFilter->SetInitialField( initialField );
+  mrRegFilter->KeepFixedImagePyramidOn();
+
+  while( true )
+    {
+    str->mutex->Lock();
+    while( str->loadedQueue.empty() && str->numberOfLoadedCases < str->cases->size() )
+      {
+      str->stateChanged->Wait( str->mutex );
+      }
+    if( str->loadedQueue.empty() )
+      {
+      str->mutex->Unlock();
+      break;
+      }
+    BatchItem item = str->loadedQueue.front();
+    str->loadedQueue.pop_front();
+    str->stateChanged->Broadcast();
+    str->mutex->Unlock();
+
+    const BatchCase & batchCase = ( *str->cases )[item.caseId];
+    bool failed = false;
+    try
+      {
+      mrRegFilter->SetMovingImagePyramid( item.movingImagePyramid );
+      mrRegFilter->SetMovingImage( item.movingImage );
+      mrRegFilter->Update();
+
+      // The outputs are copied, as the registration reuses its buffers for
+      // the next case.
+      item.displacementField = DuplicateField( mrRegFilter->GetDisplacementField() );
+      if( str->param->searchSpace == 1 || str->param->searchSpace == 2 )
+        {
+        item.velocityField = DuplicateField( mrRegFilter->GetOutput() );
+        }
+      }
+    catch( itk::ExceptionObject & error )
+      {
+      str->mutex->Lock();
+      std::cerr << "ERROR: Registration of " << batchCase.movingImageFilename
+          << " failed: " << error << std::endl;
+      str->numberOfFailures++;
+      str->mutex->Unlock();
+      failed = true;
+      }
+    item.movingImagePyramid = NULL;
+
+    if( !failed )
+      {
+      str->mutex->Lock();
+      while( str->resultQueue.size() >= str->queueLength )
+        {
+        str->stateChanged->Wait( str->mutex );
+        }
+      std::cout << "Case " << item.caseId + 1 << "/" << str->cases->size()
+          << ": Registered " << batchCase.movingImageFilename << std::endl;
+      str->resultQueue.push_back( item );
+      str->stateChanged->Broadcast();
+      str->mutex->Unlock();
+      }
+    }
+
+  str->mutex->Lock();
+  str->numberOfActiveJobs--;
+  str->stateChanged->Broadcast();
+  str->mutex->Unlock();
+}
+
+// Stage 3: write results until all registrations are finished.
+void BatchWrite( BatchThreadStruct *str )
+{
+  while( true )
+    {
+    str->mutex->Lock();
+    while( str->resultQueue.empty() && str->numberOfActiveJobs > 0 )
+      {
+      str->stateChanged->Wait( str->mutex );
+      }
+    if( str->resultQueue.empty() )
+      {
+      str->mutex->Unlock();
+      break;
+      }
+    BatchItem item = str->resultQueue.front();
+    str->resultQueue.pop_front();
+    str->stateChanged->Broadcast();
+    str->mutex->Unlock();
+
+    const BatchCase & batchCase = ( *str->cases )[item.caseId];
+    try
+      {
+      WriteResults( *str->param, item.displacementField, item.velocityField,
+          item.movingImage, str->fixedImage,
+          batchCase.displacementFilename.empty() ? NULL : batchCase.displacementFilename.c_str(),
+          NULL,
+          batchCase.warpedImageFilename.empty() ? NULL : batchCase.warpedImageFilename.c_str(),
+          str->threadsPerJob );
+      }
+    catch( itk::ExceptionObject & error )
+      {
+      str->mutex->Lock();
+      std::cerr << "ERROR: Could not write results of " << batchCase.movingImageFilename
+          << ": " << error << std::endl;
+      str->numberOfFailures++;
+      str->mutex->Unlock();
+      }
+    }
+}
+
+ITK_THREAD_RETURN_TYPE BatchCallback( void *arg )
+{
+  MultiThreader::ThreadInfoStruct* threadStruct =
+      (MultiThreader::ThreadInfoStruct *) arg;
+  ThreadIdType threadId = threadStruct->ThreadID;
+
+  BatchThreadStruct* str =
+      (BatchThreadStruct*) threadStruct->UserData;
+
+  switch( threadId )
+    {
+    case 0:
+      BatchLoad( str );
+      break;
+    case 1:
+      BatchWrite( str );
+      break;
+    default:
+      BatchRegister( str );
+      break;
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+// Run a batch with the job scheduler: all moving images are loaded, one
+// registration is set up per case and the scheduler assigns the threads
+// according to the image size. Suited for many small images, as all cases
+// are held in memory.
+int RunScheduledBatch( const RegistrationParameters & param, const ImageType * fixedImage,
+    const MaskType * maskImage, const DisplacementFieldType * initialField,
+    const std::vector<BatchCase> & cases, ThreadIdType numberOfThreads )
+{
+  typedef VariationalRegistrationJobScheduler<MRRegistrationFilterType> SchedulerType;
+  SchedulerType::Pointer scheduler = SchedulerType::New();
+  scheduler->SetNumberOfThreads( numberOfThreads );
+  scheduler->SetDebug( param.useDebugMode );
+
+  // A case that cannot be loaded is recorded as failure and skipped, as in
+  // the pipelined batch; jobCases maps the jobs to their cases.
+  std::vector<ImagePointerType> movingImages;
+  std::vector<ImagePointerType> fixedImages;
+  std::vector<unsigned int> jobCases;
+  unsigned int numberOfFailures = 0;
+  for( unsigned int i = 0; i < cases.size(); ++i )
+    {
+    std::cout << "Case " << i + 1 << "/" << cases.size()
+        << ": Loading " << cases[i].movingImageFilename << " ... " << std::endl;
+    ImagePointerType movingImage;
+    try
+      {
+      movingImage = VariationalRegistrationReadImage<ImageType>(
+          cases[i].movingImageFilename.c_str() );
+      if( param.useHistogramMatching )
+        {
+        movingImage = MatchHistogram( movingImage, fixedImage, numberOfThreads );
+        }
+      }
+    catch( itk::ExceptionObject & error )
+      {
+      std::cerr << "ERROR: Could not load " << cases[i].movingImageFilename
+          << ": " << error << std::endl;
+      numberOfFailures++;
+      continue;
+      }
+    movingImages.push_back( movingImage );
+    jobCases.push_back( i );
+
+    // Each job uses its own image objects sharing the pixel data of the inputs.
+    fixedImages.push_back( ImageType::New() );
+    fixedImages.back()->Graft( fixedImage );
+
+    // The scheduler sets the number of threads of the job and all its
+    // internal filters before the job is started.
+    MRRegistrationFilterType::Pointer mrRegFilter = CreateRegistration( param, 1, false );
+    mrRegFilter->SetFixedImage( fixedImages.back() );
+    mrRegFilter->SetMovingImage( movingImages.back() );
+    if( maskImage != NULL )
+      {
+      MaskPointerType maskView = MaskType::New();
+      maskView->Graft( maskImage );
+      mrRegFilter->SetMaskImage( maskView );
+      }
+    if( initialField != NULL )
+      {
+      DisplacementFieldPointerType initialFieldView = DisplacementFieldType::New();
+      initialFieldView->Graft( initialField );
+      mrRegFilter->SetInitialField( initialFieldView );
+      }
+    scheduler->AddJob( mrRegFilter );
+    }
+
+  std::cout << "==========================================" << std::endl;
+  std::cout << "Starting scheduled batch registration of " << jobCases.size()
+      << " cases using " << numberOfThreads << " thread(s)..." << std::endl;
+
+  scheduler->Execute();
+
+  for( unsigned int job = 0; job < jobCases.size(); ++job )
+    {
+    const BatchCase & batchCase = cases[jobCases[job]];
+    if( scheduler->GetJobFailed( job ) )
+      {
+      std::cerr << "ERROR: Registration of " << batchCase.movingImageFilename
+          << " failed: " << scheduler->GetJobErrorMessage( job ) << std::endl;
+      numberOfFailures++;
+      continue;
+      }
+
+    std::cout << "Case " << jobCases[job] + 1 << "/" << cases.size() << ": Registered with "
+        << scheduler->GetJobNumberOfThreads( job ) << " thread(s) in "
+        << scheduler->GetJobElapsedTime( job ) << " s, writing results ... " << std::endl;
+    try
+      {
+      MRRegistrationFilterType * mrRegFilter = scheduler->GetJob( job );
+      WriteResults( param, mrRegFilter->GetDisplacementField(),
+          ( param.searchSpace == 1 || param.searchSpace == 2 ) ? mrRegFilter->GetOutput() : NULL,
+          movingImages[job], fixedImage,
+          batchCase.displacementFilename.empty() ? NULL : batchCase.displacementFilename.c_str(),
+          NULL,
+          batchCase.warpedImageFilename.empty() ? NULL : batchCase.warpedImageFilename.c_str(),
+          numberOfThreads );
+      }
+    catch( itk::ExceptionObject & error )
+      {
+      std::cerr << "ERROR: Could not write results of " << batchCase.movingImageFilename
+          << ": " << error << std::endl;
+      numberOfFailures++;
+      }
+    }
+
+  std::cout << "Batch registration finished, "
+      << cases.size() - numberOfFailures << " of " << cases.size()
+      << " cases succeeded." << std::endl;
+  std::cout << "Registration time: " << scheduler->GetElapsedTime() << " s ("
+      << scheduler->GetThroughput() << " pairs/s)." << std::endl;
+
+  return numberOfFailures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
 void PrintHelp()
 {
   std::cout << std::endl;
@@ -109,24 +1167,45 @@ void PrintHelp()
   std::cout << std::endl;
   std::cout << "SYNOPSIS:" << std::endl;
   std::cout << "  itkVariationalRegistration -F <fixed image> -M <moving image> -D <output displacement field> [<args>]" << std::endl;
+  std::cout << "  itkVariationalRegistration -F <fixed image> -B <manifest> [-j <jobs>] [<args>]" << std::endl;
   std::cout << std::endl;
   std::cout << "OPTIONS:" << std::endl;
   std::cout << "  Input:" << std::endl;
   std::cout << "    -F <fixed image>         Filename of the fixed image." << std::endl;
   std::cout << "    -M <moving image>        Filename of the moving image." << std::endl;
   std::cout << "    -S <segmentation mask>   Filename of the mask image for the registration." << std::endl;
+  std::cout << "    -K <block size>          Only process blocks of this edge length containing mask foreground" << std::endl;
+  std::cout << "                               (default 0: process all pixels)." << std::endl;
   std::cout << "    -I <initial field>       Filename of the initial deformation field." << std::endl;
   std::cout << std::endl;
   std::cout << "  Output:" << std::endl;
   std::cout << "    -O <output def. field>   Filename of the output displacement field." << std::endl;
   std::cout << "    -V <output velo. field>  Filename of the output velocity field (only for diffeomorphic registration)." << std::endl;
   std::cout << "    -W <warped image>        Filename of the output warped image." << std::endl;
-  std::cout << "    -L <log file>            Filename of the log file of the registration (NYI)." << std::endl;
+  std::cout << "    -L <log file>            Filename of a structured log with one record per iteration and level" << std::endl;
+  std::cout << "                               (CSV if the extension is .csv, JSON lines otherwise)." << std::endl;
+  std::cout << std::endl;
+  std::cout << "  Batch mode:" << std::endl;
+  std::cout << "    -B <manifest>            Register all moving images listed in the manifest to the fixed image." << std::endl;
+  std::cout << "                               Each line contains: <moving image> <output def. field> [<warped image>]" << std::endl;
+  std::cout << "                               ('-' skips an output, lines starting with '#' are ignored)." << std::endl;
+  std::cout << "    -j <jobs>                Number of registrations running concurrently (default 1)." << std::endl;
+  std::cout << "                               0: Run all cases concurrently and assign the threads according" << std::endl;
+  std::cout << "                                  to the image size (for many small images)." << std::endl;
+  std::cout << "    -N <threads>             Total number of threads, split evenly between the jobs." << std::endl;
+  std::cout << "    -P <cases>               Number of cases loaded ahead and waiting to be written (default 1)." << std::endl;
+  std::cout << "                               Loading and writing overlap with the registrations." << std::endl;
   std::cout << std::endl;
   std::cout << "  Parameters for registration filter:" << std::endl;
   std::cout << "    -i <iterations>          Number of iterations." << std::endl;
   std::cout << "    -l <levels>              Number of multi-resolution levels." << std::endl;
+  std::cout << "    -C 0|1                   Smooth and resample the fields between the levels in one fused pass." << std::endl;
+  std::cout << "                               0: false, use RecursiveGaussian and VectorResample (default)" << std::endl;
+  std::cout << "                               1: true (faster, smooths with a truncated Gaussian kernel)" << std::endl;
   std::cout << "    -t <tau>                 Registration time step." << std::endl;
+  std::cout << "    -G 0|1                   Adapt the time step to the metric." << std::endl;
+  std::cout << "                               0: false (default)" << std::endl;
+  std::cout << "                               1: true (grow on decrease, shrink and backtrack on increase)" << std::endl;
   std::cout << "    -s 0|1|2                 Select search space." << std::endl;
   std::cout << "                               0: Standard (default)." << std::endl;
   std::cout << "                               1: Diffeomorphic." << std::endl;
@@ -136,17 +1215,30 @@ void PrintHelp()
   std::cout << "                               1: true (default)" << std::endl;
   std::cout << "    -e <exp iterations>      Number of iterations for exponentiator in case of" << std::endl;
   std::cout << "                               diffeomorphic registration (search space 1 or 2)." << std::endl;
+  std::cout << "    -A 0|1                   Select update scheme." << std::endl;
+  std::cout << "                               0: Gradient descent (default)." << std::endl;
+  std::cout << "                               1: Nesterov momentum with restart on metric increase." << std::endl;
+  std::cout << "    -E <threshold>           Skip forces in blocks whose displacement change stayed below the" << std::endl;
+  std::cout << "                               threshold for 5 iterations (default 0: off)." << std::endl;
   std::cout << std::endl;
   std::cout << "  Parameters for regularizer:" << std::endl;
-  std::cout << "    -r 0|1|2|3               Select regularizer." << std::endl;
+  std::cout << "    -r 0|1|2|3|4|5|6         Select regularizer." << std::endl;
   std::cout << "                               0: Gaussian smoother." << std::endl;
   std::cout << "                               1: Diffusive regularizer (default)." << std::endl;
   std::cout << "                               2: Elastic regularizer." << std::endl;
   std::cout << "                               3: Curvature regularizer." << std::endl;
+  std::cout << "                               4: Diffusive regularizer with multigrid solver." << std::endl;
+  std::cout << "                               5: Elastic regularizer with multigrid solver." << std::endl;
+  std::cout << "                               6: Elastic regularizer with DCT (sliding boundaries)." << std::endl;
   std::cout << "    -a <alpha>               Alpha for the regularization (only diffusive or curvature)." << std::endl;
   std::cout << "    -v <variance>            Variance for the regularization (only gaussian)." << std::endl;
   std::cout << "    -m <mu>                  Mu for the regularization (only elastic)." << std::endl;
   std::cout << "    -b <lambda>              Lambda for the regularization (only elasic)." << std::endl;
+  std::cout << "    -X 0|1|2|3               Pad the field to a fast FFT size (only elastic or curvature)." << std::endl;
+  std::cout << "                               0: No padding (default)." << std::endl;
+  std::cout << "                               1: Pad with zeros." << std::endl;
+  std::cout << "                               2: Pad by replicating the border." << std::endl;
+  std::cout << "                               3: Pad by mirroring at the border." << std::endl;
   std::cout << std::endl;
   std::cout << "  Parameters for registration function:" << std::endl;
   std::cout << "    -f 0|1|2                 Select force term." << std::endl;
@@ -159,6 +1251,9 @@ void PrintHelp()
   std::cout << "                               0: Warped image forces (default)." << std::endl;
   std::cout << "                               1: Fixed image forces." << std::endl;
   std::cout << "                               2: Symmetric forces." << std::endl;
+  std::cout << "    -z <fraction>            Compute SSD or demons forces only at a random fraction of the pixels;" << std::endl;
+  std::cout << "                               the fraction is increased when the stop criterion is fulfilled" << std::endl;
+  std::cout << "                               (default 1: all pixels)." << std::endl;
   std::cout << std::endl;
   std::cout << "  Parameters for stop criterion:" << std::endl;
   std::cout << "    -p 0|1|2                 Select stop criterion policy for multi-resolution." << std::endl;
@@ -166,12 +1261,25 @@ void PrintHelp()
   std::cout << "                               1: Use simple graduated policy (default)." << std::endl;
   std::cout << "                               2: Use graduated policy." << std::endl;
   std::cout << "    -g <grad slope>          Set fitted line slope for stop criterion (default 0.005)." << std::endl;
+  std::cout << "    -k <seconds>             Wall-clock budget of the registration, distributed over the levels" << std::endl;
+  std::cout << "                               (default 0: none)." << std::endl;
+  std::cout << "    -c <gain rate>           Stop a level if the relative metric decrease per second falls below" << std::endl;
+  std::cout << "                               this rate (default 0: none)." << std::endl;
+  std::cout << "    -y <stride>              Compute the metric only from every n-th pixel (default 1)." << std::endl;
   std::cout << std::endl;
   std::cout << "  Preprocessing and general parameters:" << std::endl;
   std::cout << "    -h 0|1                   Perform histogram matching." << std::endl;
   std::cout << "                               0: false (default)" << std::endl;
   std::cout << "                               1: true" << std::endl;
   std::cout << "    -x                       Print debug information during execution." << std::endl;
+  std::cout << "    -Y <MB>                  Memory budget in megabytes. If the estimated peak memory exceeds it," << std::endl;
+  std::cout << "                               the policy -U is applied (default 0: none)." << std::endl;
+  std::cout << "    -U <policy>              Policy if the memory budget is exceeded." << std::endl;
+  std::cout << "                               0: fail before anything is allocated (default)" << std::endl;
+  std::cout << "                               1: release memory early, fail if still exceeded" << std::endl;
+  std::cout << "    -Z <directory>           Map the internal registration buffers from temporary files in this" << std::endl;
+  std::cout << "                               directory instead of allocating them on the heap. The images and" << std::endl;
+  std::cout << "                               output fields are still held in memory (default: heap)." << std::endl;
   std::cout << "    -3                       Write 2D displacements as 3D displacements (with zero z-component)." << std::endl;
   std::cout << "    -?                       Print this help." << std::endl;
   std::cout << std::endl;
@@ -214,12 +1322,16 @@ int main( int argc, char *argv[] )
   char* warpedImageFilename = NULL;
   char* initialFieldFilename = NULL;
   char* logFilename = NULL;
+  char* workspaceDirectory = NULL;
+  char* batchFilename = NULL;
 
   // Registration parameters
   int numberOfIterations = 400;
   int numberOfLevels = 3;
+  bool useFusedFieldExpander = false;
   int numberOfExponentiatorIterations = 4;
   double timestep = 1.0;
+  bool adaptiveTimeStep = false;
   int searchSpace = 0;            // Standard
   bool useImageSpacing = true;
 
@@ -229,24 +1341,39 @@ int main( int argc, char *argv[] )
   float regulVar = 0.5;
   float regulMu = 0.5;
   float regulLambda = 0.5;
+  int fftPadding = 0;             // No padding
 
   int nccRadius = 2;
 
   // Force parameters
   int forceType = 0;              // Demon
   int forceDomain = 0;            // Warped moving
+  double forceSamplingFraction = 1.0;
 
   // Stop criterion parameters
   int stopCriterionPolicy = 1; // Simple graduated is default
   float stopCriterionSlope = 0.005;
+  double timeBudget = 0.0;
+  double minimumGainRate = 0.0;
+  int metricSamplingStride = 1;
+  int maskBlockSize = 0;
+  double freezeThreshold = 0.0;
+  int updateScheme = 0;
 
   // Preproc and general parameters
   bool useHistogramMatching = false;
   bool useDebugMode = false;
   bool bWrite3DDisplacementField = false;
+  double memoryBudget = 0.0;
+  int memoryBudgetPolicy = 0;     // Fail
+
+  // Batch mode and threading parameters
+  int numberOfJobs = 1;
+  int queueLength = 1;
+  int numberOfThreads = MultiThreader::GetGlobalDefaultNumberOfThreads();
 
   // Reading parameters
-  while( (c = getopt( argc, argv, "F:R:M:T:S:I:D:O:V:W:L:i:n:l:t:s:u:e:r:a:v:m:b:f:d:p:g:h:q:x?3" )) != -1 )
+  while( (c = getopt( argc, argv, "F:R:M:T:S:I:D:O:V:W:L:B:j:N:P:i:n:l:t:s:u:e:r:a:v:m:b:f:d:p:g:h:q:k:c:y:z:K:E:A:G:X:xY:U:Z:C:?3" )) != -1 )
   {
     switch ( c )
     {
@@ -264,6 +1391,26 @@ int main( int argc, char *argv[] )
       maskImageFilename = optarg;
       std::cout << "  Mask image filename:             " << maskImageFilename << std::endl;
       break;
+    case 'K':
+      maskBlockSize = vnl_math_max( atoi( optarg ), 0 );
+      std::cout << "  Mask block size:                 " << maskBlockSize << std::endl;
+      break;
+    case 'A':
+      updateScheme = atoi( optarg );
+      if( updateScheme == 1 )
+        {
+        std::cout << "  Update scheme:                   Nesterov" << std::endl;
+        }
+      else
+        {
+        updateScheme = 0;
+        std::cout << "  Update scheme:                   Gradient descent" << std::endl;
+        }
+      break;
+    case 'E':
+      freezeThreshold = atof( optarg );
+      std::cout << "  Freeze threshold:                " << freezeThreshold << std::endl;
+      break;
     case 'I':
       initialFieldFilename = optarg;
       std::cout << "  Initial displ. field filename:   " << initialFieldFilename << std::endl;
@@ -285,6 +1432,22 @@ int main( int argc, char *argv[] )
       logFilename = optarg;
       std::cout << "  Log filename:                    " << logFilename << std::endl;
       break;
+    case 'B':
+      batchFilename = optarg;
+      std::cout << "  Batch manifest filename:         " << batchFilename << std::endl;
+      break;
+    case 'j':
+      numberOfJobs = atoi( optarg );
+      std::cout << "  No. of concurrent jobs:          " << numberOfJobs << std::endl;
+      break;
+    case 'P':
+      queueLength = atoi( optarg );
+      std::cout << "  Length of batch queues:          " << queueLength << std::endl;
+      break;
+    case 'N':
+      numberOfThreads = atoi( optarg );
+      std::cout << "  No. of threads:                  " << numberOfThreads << std::endl;
+      break;
     case 'e':
       numberOfExponentiatorIterations = atoi( optarg );
       std::cout << "  No. of exp. iterations:          " << numberOfExponentiatorIterations << std::endl;
@@ -298,10 +1461,18 @@ int main( int argc, char *argv[] )
       numberOfLevels = atoi( optarg );
       std::cout << "  No. of multi-resolution levels:  " << numberOfLevels << std::endl;
       break;
+    case 'C':
+      useFusedFieldExpander = ( atoi( optarg ) != 0 );
+      std::cout << "  Fused field expansion:           " << useFusedFieldExpander << std::endl;
+      break;
     case 't':
       timestep = atof( optarg );
       std::cout << "  Registration time step:          " << timestep << std::endl;
       break;
+    case 'G':
+      adaptiveTimeStep = ( atoi( optarg ) != 0 );
+      std::cout << "  Adaptive time step:              " << adaptiveTimeStep << std::endl;
+      break;
     case 's':
       searchSpace = atoi( optarg );
       if( searchSpace == 0 )
@@ -352,6 +1523,18 @@ int main( int argc, char *argv[] )
       {
         std::cout << "  Regularizer:                     Curvature" << std::endl;
       }
+      else if( regularizerType == 4 )
+      {
+        std::cout << "  Regularizer:                     Diffusive (multigrid)" << std::endl;
+      }
+      else if( regularizerType == 5 )
+      {
+        std::cout << "  Regularizer:                     Elastic (multigrid)" << std::endl;
+      }
+      else if( regularizerType == 6 )
+      {
+        std::cout << "  Regularizer:                     Elastic (DCT)" << std::endl;
+      }
       else
       {
         ExceptionMacro( "Regularizer space unknown!" );
@@ -374,6 +1557,15 @@ int main( int argc, char *argv[] )
       regulLambda = atof( optarg );
       std::cout << "  Regularization lambda:           " << regulLambda << std::endl;
       break;
+    case 'X':
+      fftPadding = atoi( optarg );
+      if( fftPadding < 0 || fftPadding > 3 )
+      {
+        ExceptionMacro( "FFT padding unknown!" );
+        return EXIT_FAILURE;
+      }
+      std::cout << "  FFT padding:                     " << fftPadding << std::endl;
+      break;
     case 'f':
       forceType = atoi( optarg );
       if( forceType == 0 )
@@ -434,6 +1626,22 @@ int main( int argc, char *argv[] )
       stopCriterionSlope = atof( optarg );
       std::cout << "  StopCrit. Grad. Threshold:       " << stopCriterionSlope << std::endl;
       break;
+    case 'k':
+      timeBudget = atof( optarg );
+      std::cout << "  StopCrit. Time Budget [s]:       " << timeBudget << std::endl;
+      break;
+    case 'c':
+      minimumGainRate = atof( optarg );
+      std::cout << "  StopCrit. Min. Gain Rate:        " << minimumGainRate << std::endl;
+      break;
+    case 'z':
+      forceSamplingFraction = vnl_math_min( vnl_math_max( atof( optarg ), 0.001 ), 1.0 );
+      std::cout << "  Force sampling fraction:         " << forceSamplingFraction << std::endl;
+      break;
+    case 'y':
+      metricSamplingStride = vnl_math_max( atoi( optarg ), 1 );
+      std::cout << "  Metric sampling stride:          " << metricSamplingStride << std::endl;
+      break;
     case 'h':
       intVal = atoi( optarg );
       if( intVal == 0 )
@@ -455,6 +1663,18 @@ int main( int argc, char *argv[] )
       std::cout << "  Use debug mode:                  true" << std::endl;
       useDebugMode = true;
       break;
+    case 'Y':
+      memoryBudget = atof( optarg );
+      std::cout << "  Memory budget [MB]:              " << memoryBudget << std::endl;
+      break;
+    case 'U':
+      memoryBudgetPolicy = atoi( optarg );
+      std::cout << "  Memory budget policy:            " << memoryBudgetPolicy << std::endl;
+      break;
+    case 'Z':
+      workspaceDirectory = optarg;
+      std::cout << "  Workspace directory:             " << workspaceDirectory << std::endl;
+      break;
     case '3':
 #ifdef USE_2D_IMPL
         std::cout << "  Write 3D displacement field:     true" << std::endl;
@@ -472,407 +1692,265 @@ int main( int argc, char *argv[] )
     }
   }
   std::cout << "==========================================" << std::endl;
-  std::cout << "INITIALIZING data and filter..." << std::endl;
-  //////////////////////////////////////////////
-  //
-  // check valid arguments.
-  //
-  //////////////////////////////////////////////
-  if( fixedImageFilename == NULL || movingImageFilename == NULL )
-    {
-    ExceptionMacro( << "No input fixed and/or moving image given!" );
-    }
-  if( outputDisplacementFilename == NULL && warpedImageFilename == NULL )
-    {
-    ExceptionMacro( << "No output (deformation field or warped image) given!" );
-    }
-
-  //////////////////////////////////////////////
-  //
-  // image variable
-  //
-  //////////////////////////////////////////////
-  typedef Image<Vector<float, DIMENSION>, DIMENSION> DisplacementFieldType;
-  typedef DisplacementFieldType::Pointer             DisplacementFieldPointerType;
-  typedef ImageFileReader<DisplacementFieldType>     DisplacementFieldReaderType;
-  typedef ImageFileWriter<DisplacementFieldType>     DisplacementFieldWriterType;
-
-  typedef Image<short, DIMENSION>                    ImageType;
-  typedef ImageType::Pointer                         ImagePointerType;
-  typedef ImageFileReader<ImageType>                 ImageReaderType;
-  typedef ImageFileWriter<ImageType>                 ImageWriterType;
-
-  typedef VariationalRegistrationFunction<ImageType,ImageType,DisplacementFieldType>::MaskImageType
-                                                     MaskType;
-  typedef MaskType::Pointer                          MaskPointerType;
-  typedef ImageFileReader<MaskType>                  MaskReaderType;
-
-  ImagePointerType fixedImage;
-  ImagePointerType movingImage;
-  MaskPointerType maskImage;
-  DisplacementFieldPointerType initialField;
-
-  ImagePointerType warpedOutputImage;
-  DisplacementFieldPointerType outputDisplacementField;
-  DisplacementFieldPointerType outputVelocityField;
-
-  //////////////////////////////////////////////
-  //
-  // Load input images
-  //
-  //////////////////////////////////////////////
-  std::cout << "Loading fixed image ... " << std::endl;
-  ImageReaderType::Pointer fixedImageReader;
-  fixedImageReader = ImageReaderType::New();
-
-  fixedImageReader->SetFileName( fixedImageFilename );
-  fixedImageReader->Update();
-  fixedImage = fixedImageReader->GetOutput();
-
-  std::cout << "Loading moving image ... " << std::endl;
-  ImageReaderType::Pointer movingImageReader;
-  movingImageReader = ImageReaderType::New();
-
-  movingImageReader->SetFileName( movingImageFilename );
-  movingImageReader->Update();
-
-  movingImage = movingImageReader->GetOutput();
-
-  if( fixedImage.IsNull() || movingImage.IsNull() )
-    {
-    ExceptionMacro( << "Fixed or moving image data is null" );
-    }
-
-  if( maskImageFilename != NULL )
-    {
-    std::cout << "Loading mask image ... " << std::endl;
-    MaskReaderType::Pointer maskReader;
-    maskReader = MaskReaderType::New();
-
-    maskReader->SetFileName( maskImageFilename );
-    maskReader->Update();
-
-    maskImage = maskReader->GetOutput();
-
-    if( maskImage.IsNull() )
-      {
-      ExceptionMacro( << "Mask image data is null" );
-      }
-    }
-  if( initialFieldFilename != NULL )
-    {
-    std::cout << "Loading initial field..."  << std::endl;
-    DisplacementFieldReaderType::Pointer DisplacementFieldReader;
-    DisplacementFieldReader = DisplacementFieldReaderType::New();
-
-    DisplacementFieldReader->SetFileName( initialFieldFilename );
-    DisplacementFieldReader->Update();
-
-    initialField = DisplacementFieldReader->GetOutput();
-    if( initialField.IsNull() )
-      {
-      ExceptionMacro( << "Initial deformation field is null" );
-      }
-    }
-
-  //////////////////////////////////////////////
-  //
-  // Preprocess input images
-  //
-  //////////////////////////////////////////////
-
-  //
-  // Histogram matching
-  //
-  if( useHistogramMatching )
-    {
-    std::cout << "Performing histogram matching of moving image..." << std::endl;
-    typedef HistogramMatchingImageFilter<ImageType, ImageType> MatchingFilterType;
-    MatchingFilterType::Pointer matcher;
-
-    matcher = MatchingFilterType::New();
-
-    matcher->SetInput( movingImage );
-    matcher->SetReferenceImage( fixedImage );
-    matcher->SetNumberOfHistogramLevels( 1024 );
-    matcher->SetNumberOfMatchPoints( 7 );
-    matcher->ThresholdAtMeanIntensityOn();
-
-    try
-      {
-      matcher->Update();
-      }
-    catch( itk::ExceptionObject&  )
-      {
-      ExceptionMacro( << "Could not match input images!" );
-      }
-
-    movingImage = matcher->GetOutput();
-    }
-
-  //////////////////////////////////////////////
-  //
-  // Initialize registration filter
-  //
-  //////////////////////////////////////////////
-
-  //
-  // Setup registration function
-  //
-
-  typedef VariationalRegistrationFunction<
-      ImageType,ImageType,DisplacementFieldType>   FunctionType;
-  typedef VariationalRegistrationDemonsFunction<
-      ImageType, ImageType, DisplacementFieldType> DemonsFunctionType;
-  typedef VariationalRegistrationSSDFunction<
-      ImageType, ImageType, DisplacementFieldType> SSDFunctionType;
-  typedef VariationalRegistrationFastNCCFunction<
-      ImageType, ImageType, DisplacementFieldType> NCCFunctionType;
-
-  FunctionType::Pointer function;
-  switch( forceType )
-  {
-  case 0:
-  {
-    DemonsFunctionType::Pointer demonsFunction = DemonsFunctionType::New();
-    switch( forceDomain )
-    {
-    case 0:
-      demonsFunction->SetGradientTypeToWarpedMovingImage();
-      break;
-    case 1:
-      demonsFunction->SetGradientTypeToFixedImage();
-      break;
-    case 2:
-      demonsFunction->SetGradientTypeToSymmetric();
-      break;
-    }
-
-    function = demonsFunction;
-  }
-  break;
-  case 1:
-  {
-    SSDFunctionType::Pointer ssdFunction = SSDFunctionType::New();
-    switch( forceDomain )
-    {
-    case 0:
-      ssdFunction->SetGradientTypeToWarpedMovingImage();
-      break;
-    case 1:
-      ssdFunction->SetGradientTypeToFixedImage();
-      break;
-    case 2:
-      ssdFunction->SetGradientTypeToSymmetric();
-      break;
-    }
-
-  function = ssdFunction;
-  }
-  break;
-  case 2:
-  {
-    NCCFunctionType::Pointer nccFunction = NCCFunctionType::New();
-    NCCFunctionType::RadiusType r;
-    for( unsigned int dim = 0; dim < NCCFunctionType::ImageDimension; dim++ )
-      {
-      r[dim] = nccRadius;
-      }
-    nccFunction->SetRadius( r );
-
-    switch( forceDomain )
-    {
-    case 0:
-      nccFunction->SetGradientTypeToWarpedMovingImage();
-      break;
-    case 1:
-      nccFunction->SetGradientTypeToFixedImage();
-      break;
-    case 2:
-      nccFunction->SetGradientTypeToSymmetric();
-      break;
-    }
-    function = nccFunction;
-  }
-  break;
-  }
-  //function->SetMovingImageWarper( warper );
-  function->SetTimeStep( timestep );
-
-
+  std::cout << "INITIALIZING data and filter..." << std::endl;
+  //////////////////////////////////////////////
   //
-  // Setup regularizer
+  // check valid arguments.
   //
-  typedef VariationalRegistrationRegularizer<DisplacementFieldType>          RegularizerType;
-  typedef VariationalRegistrationGaussianRegularizer<DisplacementFieldType>  GaussianRegularizerType;
-  typedef VariationalRegistrationDiffusionRegularizer<DisplacementFieldType> DiffusionRegularizerType;
-#if defined( ITK_USE_FFTWD ) || defined( ITK_USE_FFTWF )
-  typedef VariationalRegistrationElasticRegularizer<DisplacementFieldType>   ElasticRegularizerType;
-  typedef VariationalRegistrationCurvatureRegularizer<DisplacementFieldType> CurvatureRegularizerType;
-#endif
-
-  RegularizerType::Pointer regularizer;
-  switch( regularizerType )
-  {
-  case 0:
+  //////////////////////////////////////////////
+  if( fixedImageFilename == NULL || ( movingImageFilename == NULL && batchFilename == NULL ) )
     {
-    GaussianRegularizerType::Pointer gaussRegularizer = GaussianRegularizerType::New();
-    gaussRegularizer->SetStandardDeviations( vcl_sqrt( regulVar ) );
-    regularizer = gaussRegularizer;
+    ExceptionMacro( << "No input fixed and/or moving image given!" );
     }
-    break;
-  case 1:
+  if( batchFilename == NULL && outputDisplacementFilename == NULL && warpedImageFilename == NULL )
     {
-    DiffusionRegularizerType::Pointer diffRegularizer = DiffusionRegularizerType::New();
-    diffRegularizer->SetAlpha( regulAlpha );
-    regularizer = diffRegularizer;
+    ExceptionMacro( << "No output (deformation field or warped image) given!" );
     }
-    break;
-  case 2:
+  if( numberOfLevels < 1 || numberOfJobs < 0 || numberOfThreads < 1 || queueLength < 1 )
     {
-#if defined( ITK_USE_FFTWD ) || defined( ITK_USE_FFTWF )
-    ElasticRegularizerType::Pointer elasticRegularizer = ElasticRegularizerType::New();
-    elasticRegularizer->SetMu( regulMu );
-    elasticRegularizer->SetLambda( regulLambda );
-    regularizer = elasticRegularizer;
-#else
-    ExceptionMacro( << "ITK has to be built with ITK_USE_FFTWD set ON for elastic regularisation!" );
-#endif
+    ExceptionMacro( << "Number of levels, jobs, threads and queue length must be positive!" );
     }
-    break;
-  case 3:
+  if( forceType == 2 && forceSamplingFraction < 1.0 )
+    {
+    ExceptionMacro( << "Force sampling is only supported by demon and SSD forces!" );
+    }
+#if !defined( ITK_USE_FFTWD ) && !defined( ITK_USE_FFTWF )
+  if( regularizerType == 2 || regularizerType == 3 || regularizerType == 6 )
     {
-#if defined( ITK_USE_FFTWD ) || defined( ITK_USE_FFTWF )
-    CurvatureRegularizerType::Pointer curvatureRegularizer = CurvatureRegularizerType::New();
-    curvatureRegularizer->SetAlpha( regulAlpha );
-    regularizer = curvatureRegularizer;
-#else
     ExceptionMacro( << "ITK has to be built with ITK_USE_FFTWD set ON for elastic regularisation!" );
+    }
 #endif
+
+  RegistrationParameters param;
+  param.numberOfIterations = numberOfIterations;
+  param.numberOfLevels = numberOfLevels;
+  param.useFusedFieldExpander = useFusedFieldExpander;
+  param.numberOfExponentiatorIterations = numberOfExponentiatorIterations;
+  param.timestep = timestep;
+  param.adaptiveTimeStep = adaptiveTimeStep;
+  param.searchSpace = searchSpace;
+  param.useImageSpacing = useImageSpacing;
+  param.regularizerType = regularizerType;
+  param.regulAlpha = regulAlpha;
+  param.regulVar = regulVar;
+  param.regulMu = regulMu;
+  param.regulLambda = regulLambda;
+  param.fftPadding = fftPadding;
+  param.nccRadius = nccRadius;
+  param.forceType = forceType;
+  param.forceDomain = forceDomain;
+  param.stopCriterionPolicy = stopCriterionPolicy;
+  param.stopCriterionSlope = stopCriterionSlope;
+  param.timeBudget = timeBudget;
+  param.minimumGainRate = minimumGainRate;
+  param.metricSamplingStride = metricSamplingStride;
+  param.forceSamplingFraction = forceSamplingFraction;
+  param.maskBlockSize = maskBlockSize;
+  param.freezeThreshold = freezeThreshold;
+  param.updateScheme = updateScheme;
+  param.useHistogramMatching = useHistogramMatching;
+  param.useDebugMode = useDebugMode;
+  param.bWrite3DDisplacementField = bWrite3DDisplacementField;
+  param.memoryBudget = static_cast<SizeValueType>( vnl_math_max( memoryBudget, 0.0 ) * 1024.0 * 1024.0 );
+  param.memoryBudgetPolicy = memoryBudgetPolicy;
+  if( logFilename != NULL )
+    {
+    param.logFilename = logFilename;
+    }
+  if( workspaceDirectory != NULL )
+    {
+    param.workspaceDirectory = workspaceDirectory;
     }
-    break;
-  }
-  regularizer->InPlaceOff();
-  regularizer->SetUseImageSpacing( useImageSpacing );
 
+  //////////////////////////////////////////////
   //
-  // Setup registration filter
+  // image variable
   //
-  typedef VariationalRegistrationFilter<
-      ImageType,ImageType,DisplacementFieldType> RegistrationFilterType;
-  typedef VariationalDiffeomorphicRegistrationFilter<
-      ImageType,ImageType,DisplacementFieldType> DiffeomorphicRegistrationFilterType;
-  typedef VariationalSymmetricDiffeomorphicRegistrationFilter<
-      ImageType,ImageType,DisplacementFieldType> SymmetricDiffeomorphicRegistrationFilterType;
+  //////////////////////////////////////////////
+  ImagePointerType fixedImage;
+  ImagePointerType movingImage;
+  MaskPointerType maskImage;
+  DisplacementFieldPointerType initialField;
 
-  RegistrationFilterType::Pointer regFilter;
-  switch( searchSpace )
-  {
-  case 0:
+  //////////////////////////////////////////////
+  //
+  // Load input images
+  //
+  //////////////////////////////////////////////
+  // Uncompressed MetaImages are mapped into memory instead of being copied.
+  try
     {
-    regFilter = RegistrationFilterType::New();
-    break;
+    std::cout << "Loading fixed image ... " << std::endl;
+    fixedImage = VariationalRegistrationReadImage<ImageType>( fixedImageFilename );
+
+    if( movingImageFilename != NULL && batchFilename == NULL )
+      {
+      std::cout << "Loading moving image ... " << std::endl;
+      movingImage = VariationalRegistrationReadImage<ImageType>( movingImageFilename );
+      }
+
+    if( maskImageFilename != NULL )
+      {
+      std::cout << "Loading mask image ... " << std::endl;
+      maskImage = VariationalRegistrationReadImage<MaskType>( maskImageFilename );
+      }
+
+    if( initialFieldFilename != NULL )
+      {
+      std::cout << "Loading initial field..."  << std::endl;
+      initialField = VariationalRegistrationReadImage<DisplacementFieldType>( initialFieldFilename );
+      }
     }
-  case 1:
+  catch( itk::ExceptionObject & error )
     {
-    DiffeomorphicRegistrationFilterType::Pointer diffeoRegFilter =
-        DiffeomorphicRegistrationFilterType::New();
-    diffeoRegFilter->SetNumberOfExponentiatorIterations( numberOfExponentiatorIterations );
-    regFilter = diffeoRegFilter;
-    break;
+    ExceptionMacro( << "Could not load input data: " << error );
     }
-  case 2:
+
+  if( fixedImage.IsNull() || ( movingImage.IsNull() && batchFilename == NULL ) )
     {
-    SymmetricDiffeomorphicRegistrationFilterType::Pointer symmDiffeoRegFilter =
-        SymmetricDiffeomorphicRegistrationFilterType::New();
-    symmDiffeoRegFilter->SetNumberOfExponentiatorIterations( numberOfExponentiatorIterations );
-    regFilter = symmDiffeoRegFilter;
-    break;
+    ExceptionMacro( << "Fixed or moving image data is null" );
+    }
+  if( maskImageFilename != NULL && maskImage.IsNull() )
+    {
+    ExceptionMacro( << "Mask image data is null" );
+    }
+  if( initialFieldFilename != NULL && initialField.IsNull() )
+    {
+    ExceptionMacro( << "Initial deformation field is null" );
     }
-  }
-  regFilter->SetRegularizer( regularizer );
-  regFilter->SetDifferenceFunction( function );
 
+  //////////////////////////////////////////////
   //
-  // Setup multi-resolution filter
+  // Batch mode
   //
-  Array< unsigned int > its(numberOfLevels);
-  its[numberOfLevels - 1] = numberOfIterations;
-  for( int level = numberOfLevels - 2; level >= 0; --level )
+  //////////////////////////////////////////////
+  if( batchFilename != NULL )
     {
-    its[level] = its[level + 1];
-    }
+    std::vector<BatchCase> cases;
+    if( !ReadBatchManifest( batchFilename, cases ) )
+      {
+      ExceptionMacro( << "Could not read batch manifest " << batchFilename );
+      }
+    if( cases.empty() )
+      {
+      ExceptionMacro( << "Batch manifest " << batchFilename << " contains no cases" );
+      }
+    if( logFilename != NULL )
+      {
+      std::cout << "  Log file is not written in batch mode." << std::endl;
+      }
 
-  typedef VariationalRegistrationMultiResolutionFilter<ImageType,ImageType,DisplacementFieldType> MRRegistrationFilterType;
+    if( numberOfJobs == 0 )
+      {
+      const int result = RunScheduledBatch( param, fixedImage, maskImage, initialField,
+          cases, numberOfThreads );
+      std::cout << "VariationalRegistration (" << DIMENSION << "D) FINISHED!" << std::endl;
+      std::cout << "==========================================\n\n" << std::endl;
+      return result;
+      }
 
-  MRRegistrationFilterType::Pointer mrRegFilter = MRRegistrationFilterType::New();
-  mrRegFilter->SetRegistrationFilter( regFilter );
-  mrRegFilter->SetMovingImage( movingImage );
-  mrRegFilter->SetFixedImage( fixedImage );
-  mrRegFilter->SetMaskImage( maskImage );
-  mrRegFilter->SetNumberOfLevels( numberOfLevels );
-  mrRegFilter->SetNumberOfIterations( its );
-  mrRegFilter->SetInitialField( initialField );
+    // Split the threads evenly between the concurrent registrations.
+    const ThreadIdType numberOfConcurrentJobs =
+        vnl_math_min( static_cast<SizeValueType>( numberOfJobs ),
+                      static_cast<SizeValueType>( cases.size() ) );
+
+    SimpleMutexLock mutex;
+    ConditionVariable::Pointer stateChanged = ConditionVariable::New();
+
+    BatchThreadStruct batchStr;
+    batchStr.param = &param;
+    batchStr.fixedImage = fixedImage;
+    batchStr.maskImage = maskImage;
+    batchStr.initialField = initialField;
+    batchStr.cases = &cases;
+    batchStr.threadsPerJob = vnl_math_max( 1, numberOfThreads / (int) numberOfConcurrentJobs );
+    batchStr.queueLength = queueLength;
+    batchStr.mutex = &mutex;
+    batchStr.stateChanged = stateChanged;
+    batchStr.numberOfLoadedCases = 0;
+    batchStr.numberOfFailures = 0;
+
+    std::cout << "==========================================" << std::endl;
+    std::cout << "Starting batch registration of " << cases.size() << " cases with "
+        << numberOfConcurrentJobs << " concurrent job(s) using "
+        << batchStr.threadsPerJob << " thread(s) each..." << std::endl;
+
+    RealTimeClock::Pointer clock = RealTimeClock::New();
+    const RealTimeClock::TimeStampType start = clock->GetTimeInSeconds();
+
+    MultiThreader::Pointer threader = MultiThreader::New();
+    // One loader, one writer and the registration threads.
+    threader->SetNumberOfThreads( numberOfConcurrentJobs + 2 );
+    batchStr.numberOfActiveJobs = threader->GetNumberOfThreads() - 2;
+    threader->SetSingleMethod( BatchCallback, &batchStr );
+    threader->SingleMethodExecute();
+
+    const double elapsedTime = clock->GetTimeInSeconds() - start;
+    const SizeValueType numberOfSuccesses = cases.size() - batchStr.numberOfFailures;
+
+    std::cout << "Batch registration finished, "
+        << numberOfSuccesses << " of " << cases.size()
+        << " cases succeeded." << std::endl;
+    std::cout << "Total time: " << elapsedTime << " s ("
+        << ( elapsedTime > 0.0 ? numberOfSuccesses / elapsedTime : 0.0 ) << " pairs/s)." << std::endl;
+    std::cout << "VariationalRegistration (" << DIMENSION << "D) FINISHED!" << std::endl;
+    std::cout << "==========================================\n\n" << std::endl;
+
+    return batchStr.numberOfFailures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
 
+  //////////////////////////////////////////////
   //
-  // Setup stop criterion
+  // Preprocess input images
   //
-  typedef VariationalRegistrationStopCriterion<
-      RegistrationFilterType,MRRegistrationFilterType> StopCriterionType;
-  StopCriterionType::Pointer stopCriterion = StopCriterionType::New();
-  stopCriterion->SetRegressionLineSlopeThreshold( stopCriterionSlope );
-  stopCriterion->PerformLineFittingMaxDistanceCheckOn();
-
-  switch( stopCriterionPolicy )
-  {
-    case 1:
-      stopCriterion->SetMultiResolutionPolicyToSimpleGraduated();
-      break;
-    case 2:
-      stopCriterion->SetMultiResolutionPolicyToGraduated();
-      break;
-    default:
-      stopCriterion->SetMultiResolutionPolicyToDefault();
-      break;
-  }
-
-  regFilter->AddObserver( itk::IterationEvent(), stopCriterion );
-  mrRegFilter->AddObserver( itk::IterationEvent(), stopCriterion );
-  mrRegFilter->AddObserver( itk::InitializeEvent(), stopCriterion );
+  //////////////////////////////////////////////
 
   //
-  // Setup logger
+  // Histogram matching
   //
-  typedef VariationalRegistrationLogger<
-      RegistrationFilterType,MRRegistrationFilterType> LoggerType;
-  LoggerType::Pointer logger = LoggerType::New();
-
-  regFilter->AddObserver( itk::IterationEvent(), logger );
-  mrRegFilter->AddObserver( itk::IterationEvent(), logger );
-
-  if( useDebugMode )
+  if( useHistogramMatching )
     {
-    regularizer->DebugOn();
-    regFilter->DebugOn();
-    mrRegFilter->DebugOn();
-    stopCriterion->DebugOn();
-    logger->DebugOn();
+    std::cout << "Performing histogram matching of moving image..." << std::endl;
+    try
+      {
+      movingImage = MatchHistogram( movingImage, fixedImage, numberOfThreads );
+      }
+    catch( itk::ExceptionObject&  )
+      {
+      ExceptionMacro( << "Could not match input images!" );
+      }
     }
 
+  //////////////////////////////////////////////
+  //
+  // Initialize registration filter
+  //
+  //////////////////////////////////////////////
+  MRRegistrationFilterType::Pointer mrRegFilter =
+      CreateRegistration( param, numberOfThreads, true );
+  mrRegFilter->SetMovingImage( movingImage );
+  mrRegFilter->SetFixedImage( fixedImage );
+  mrRegFilter->SetMaskImage( maskImage );
+  mrRegFilter->SetInitialField( initialField );
+
   //
   // Execute registration
   //
   std::cout << "Starting registration..." << std::endl;
 
-  mrRegFilter->Update();
+  try
+    {
+    mrRegFilter->Update();
+    }
+  catch( itk::ExceptionObject & error )
+    {
+    ExceptionMacro( << "Registration failed: " << error );
+    }
 
   std::cout << "Registration execution finished." << std::endl;
-
-  outputDisplacementField = mrRegFilter->GetDisplacementField();
-  if( searchSpace == 1 || searchSpace == 2 )
-  {
-    outputVelocityField = mrRegFilter->GetOutput();
-  }
+  std::cout << "Estimated peak memory: " << mrRegFilter->GetEstimatedPeakMemory() / ( 1024.0 * 1024.0 )
+      << " MB, measured peak buffer memory: " << mrRegFilter->GetPeakBufferMemory() / ( 1024.0 * 1024.0 )
+      << " MB, peak resident set size: " << mrRegFilter->GetPeakMemory() / ( 1024.0 * 1024.0 ) << " MB" << std::endl;
 
   //////////////////////////////////////////////
   //
@@ -882,109 +1960,16 @@ int main( int argc, char *argv[] )
   std::cout << "==========================================" << std::endl;
   std::cout << "WRITING output data..." << std::endl;
 
-  if( outputDisplacementFilename != NULL && outputDisplacementField.IsNotNull() )
-    {
-    if( DIMENSION == 2 && bWrite3DDisplacementField )
+  try
     {
-      std::cout << "Converting deformation field to 3D..." << std::endl;
-      typedef Image<Vector<float, 3> , 3>               OutDisplacementFieldType;
-      typedef OutDisplacementFieldType::Pointer         OutDisplacementFieldPointerType;
-      typedef ImageFileWriter<OutDisplacementFieldType> OutDisplacementFieldWriterType;
-
-      OutDisplacementFieldPointerType writeField = OutDisplacementFieldType::New();
-
-      DisplacementFieldType::SizeType oldSize = outputDisplacementField->GetLargestPossibleRegion().GetSize();
-      OutDisplacementFieldType::SizeType newSize;
-
-      newSize[0] = oldSize[0];
-      newSize[1] = oldSize[1];
-      newSize[2] = 1;
-
-      writeField->SetRegions( newSize );
-
-      DisplacementFieldType::SpacingType oldSpacing = outputDisplacementField->GetSpacing();
-      OutDisplacementFieldType::SpacingType newSpacing;
-
-      newSpacing[0] = oldSpacing[0];
-      newSpacing[1] = oldSpacing[1];
-      newSpacing[2] = 1;
-
-      writeField->SetSpacing( newSpacing );
-
-      writeField->Allocate();
-
-      ImageRegionIterator<DisplacementFieldType> defIterator(
-          outputDisplacementField, outputDisplacementField->GetRequestedRegion() );
-
-      while( ! defIterator.IsAtEnd() )
-      {
-        DisplacementFieldType::IndexType oldIndex = defIterator.GetIndex();
-        OutDisplacementFieldType::IndexType newIndex;
-
-        newIndex[0] = oldIndex[0];
-        newIndex[1] = oldIndex[1];
-        newIndex[2] = 0;
-
-        DisplacementFieldType::PixelType oldValue = defIterator.Value();
-        OutDisplacementFieldType::PixelType newValue;
-
-        newValue[0] = oldValue[0];
-        newValue[1] = oldValue[1];
-        newValue[2] = 0.0;
-
-        writeField->SetPixel( newIndex, newValue );
-
-        ++defIterator;
-      }
-
-      std::cout << "Saving deformation field..." << std::endl;
-      OutDisplacementFieldWriterType::Pointer DisplacementFieldWriter;
-      DisplacementFieldWriter = OutDisplacementFieldWriterType::New();
-
-      DisplacementFieldWriter->SetInput( writeField );
-      DisplacementFieldWriter->SetFileName( outputDisplacementFilename );
-      DisplacementFieldWriter->Update();
-      }
-    else
-      {
-      std::cout << "Saving deformation field..." << std::endl;
-      DisplacementFieldWriterType::Pointer DisplacementFieldWriter;
-      DisplacementFieldWriter = DisplacementFieldWriterType::New();
-
-      DisplacementFieldWriter->SetInput( outputDisplacementField );
-      DisplacementFieldWriter->SetFileName( outputDisplacementFilename );
-      DisplacementFieldWriter->Update();
-
-      if( outputVelocityFilename != NULL && outputVelocityField.IsNotNull() )
-      {
-        std::cout << "Saving velocity field..." << std::endl;
-        DisplacementFieldWriterType::Pointer velocityFieldWriter;
-        velocityFieldWriter = DisplacementFieldWriterType::New();
-
-        velocityFieldWriter->SetInput( outputVelocityField );
-        velocityFieldWriter->SetFileName( outputVelocityFilename );
-        velocityFieldWriter->Update();
-      }
-      }
+    WriteResults( param, mrRegFilter->GetDisplacementField(),
+        ( searchSpace == 1 || searchSpace == 2 ) ? mrRegFilter->GetOutput() : NULL,
+        movingImage, fixedImage, outputDisplacementFilename,
+        outputVelocityFilename, warpedImageFilename, numberOfThreads );
     }
-
-  if( warpedImageFilename != NULL )
+  catch( itk::ExceptionObject & error )
     {
-
-    typedef FunctionType::MovingImageWarperType MovingImageWarperType;
-    MovingImageWarperType::Pointer warper = MovingImageWarperType::New();
-
-    warper->SetInput( movingImage );
-    warper->SetOutputParametersFromImage( fixedImage );
-    warper->SetDisplacementField( outputDisplacementField );
-    warper->UpdateLargestPossibleRegion();
-
-    ImageWriterType::Pointer imageWriter;
-    imageWriter = ImageWriterType::New();
-
-    imageWriter->SetInput( warper->GetOutput() );
-    imageWriter->SetFileName( warpedImageFilename );
-    imageWriter->Update();
+    ExceptionMacro( << "Could not write results: " << error );
     }
 
   std::cout << "VariationalRegistration (" << DIMENSION << "D) FINISHED!" << std::endl;
@@ -0,0 +1,307 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef itkVariationalRegistrationMappedImageReader_h
+#define itkVariationalRegistrationMappedImageReader_h
+
+#include "itkImage.h"
+#include "itkImportImageContainer.h"
+#include "itkImageFileReader.h"
+#include "itkMetaImageIO.h"
+#include "itkByteSwapper.h"
+#include "itksys/SystemTools.hxx"
+#include <fstream>
+#include <string>
+#include <typeinfo>
+#if !defined( _WIN32 )
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace itk
+{
+
+/** \class itk::VariationalRegistrationMappedImportImageContainer
+ *
+ *  \brief Pixel container viewing a memory-mapped image file.
+ *
+ *  The container does not manage the pixel memory itself, but unmaps the
+ *  file mapping set by SetMapping() on destruction. The mapping is private,
+ *  i.e. writing to the pixels never modifies the file.
+ *
+ *  \sa VariationalRegistrationReadImage
+ *
+ *  \ingroup VariationalRegistration
+ */
+template< class TElement >
+class VariationalRegistrationMappedImportImageContainer
+  : public ImportImageContainer< SizeValueType, TElement >
+{
+public:
+  /** Standard class typedefs */
+  typedef VariationalRegistrationMappedImportImageContainer   Self;
+  typedef ImportImageContainer< SizeValueType, TElement >     Superclass;
+  typedef SmartPointer< Self >                                Pointer;
+  typedef SmartPointer< const Self >                          ConstPointer;
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Run-time type information (and related methods) */
+  itkTypeMacro(VariationalRegistrationMappedImportImageContainer, ImportImageContainer);
+
+  /** Set the mapping that is released with the container. */
+  void SetMapping( void * address, SizeValueType length )
+    {
+    m_MappingAddress = address;
+    m_MappingLength = length;
+    }
+
+protected:
+  VariationalRegistrationMappedImportImageContainer()
+    {
+    m_MappingAddress = NULL;
+    m_MappingLength = 0;
+    }
+
+  ~VariationalRegistrationMappedImportImageContainer()
+    {
+#if !defined( _WIN32 )
+    if( m_MappingAddress != NULL )
+      {
+      munmap( m_MappingAddress, m_MappingLength );
+      }
+#endif
+    }
+
+private:
+  VariationalRegistrationMappedImportImageContainer(const Self&); //purposely not implemented
+  void operator=(const Self&); //purposely not implemented
+
+  void *        m_MappingAddress;
+  SizeValueType m_MappingLength;
+};
+
+} // end namespace itk
+
+/** Get the offset of the pixel data in a MetaImage file with local data,
+ *  i.e. the position after the ElementDataFile line, which is the last line
+ *  of the header. Returns false if the line is not found. */
+inline bool
+VariationalRegistrationGetMetaImageLocalDataOffset( const char * filename,
+  itk::SizeValueType & offset )
+{
+  std::ifstream file( filename, std::ios::in | std::ios::binary );
+  std::string line;
+  while( std::getline( file, line ) )
+    {
+    const std::string::size_type begin = line.find_first_not_of( " \t" );
+    if( begin != std::string::npos && line.compare( begin, 15, "ElementDataFile" ) == 0 )
+      {
+      const std::streampos position = file.tellg();
+      if( position < 0 )
+        {
+        return false;
+        }
+      offset = static_cast< itk::SizeValueType >( position );
+      return true;
+      }
+    }
+  return false;
+}
+
+/** Read an uncompressed MetaImage (mha/mhd + raw) without copying the pixel
+ *  data by mapping the file into memory. The position of the pixel data is
+ *  determined like in MetaIO: after HeaderSize bytes if it is positive, at
+ *  the end of the file if it is -1, and otherwise at the beginning of the
+ *  data file or after the header for local data. Returns a null pointer if
+ *  the file cannot be mapped into an image of type TImage, i.e. if it is no
+ *  MetaImage, if it is compressed or split into several files, or if the
+ *  dimension, pixel type or byte order do not match.
+ *
+ *  Only reading of MetaImages is supported. Other formats like NRRD are
+ *  read with an ImageFileReader, and the outputs are always written with
+ *  an ImageFileWriter. */
+template< class TImage >
+typename TImage::Pointer
+VariationalRegistrationReadMappedImage( const char * filename )
+{
+  typedef typename TImage::PixelType                          PixelType;
+  typedef typename itk::NumericTraits< PixelType >::ValueType ComponentType;
+  typedef itk::VariationalRegistrationMappedImportImageContainer< PixelType >
+                                                              ContainerType;
+
+  typename TImage::Pointer image;
+
+#if !defined( _WIN32 )
+  itk::MetaImageIO::Pointer io = itk::MetaImageIO::New();
+  if( !io->CanReadFile( filename ) )
+    {
+    return image;
+    }
+  io->SetFileName( filename );
+  io->ReadImageInformation();
+
+  const unsigned int numberOfComponents = sizeof( PixelType ) / sizeof( ComponentType );
+  const bool systemIsBigEndian = itk::ByteSwapper< ComponentType >::SystemIsBigEndian();
+  const itk::ImageIOBase::ByteOrder systemByteOrder =
+      systemIsBigEndian ? itk::ImageIOBase::BigEndian : itk::ImageIOBase::LittleEndian;
+
+  if( io->GetNumberOfDimensions() != TImage::ImageDimension
+      || io->GetComponentTypeInfo() != typeid( ComponentType )
+      || io->GetNumberOfComponents() != numberOfComponents
+      || ( sizeof( ComponentType ) > 1 && io->GetByteOrder() != systemByteOrder )
+      || io->GetMetaImagePointer()->CompressedData() )
+    {
+    return image;
+    }
+
+  // Locate the pixel data; lists and file patterns are not supported.
+  std::string dataFilename = io->GetMetaImagePointer()->ElementDataFileName();
+  const int headerSize = io->GetMetaImagePointer()->HeaderSize();
+  const bool isLocal = ( dataFilename == "LOCAL" || dataFilename == "Local" );
+  if( isLocal )
+    {
+    dataFilename = filename;
+    }
+  else if( dataFilename == "LIST" || dataFilename.find( '%' ) != std::string::npos )
+    {
+    return image;
+    }
+  else if( !itksys::SystemTools::FileIsFullPath( dataFilename.c_str() ) )
+    {
+    dataFilename = itksys::SystemTools::GetFilenamePath( filename ) + "/" + dataFilename;
+    }
+
+  typename TImage::RegionType region;
+  typename TImage::SpacingType spacing;
+  typename TImage::PointType origin;
+  typename TImage::DirectionType direction;
+  for( unsigned int i = 0; i < TImage::ImageDimension; i++ )
+    {
+    region.SetIndex( i, 0 );
+    region.SetSize( i, io->GetDimensions( i ) );
+    spacing[i] = io->GetSpacing( i );
+    origin[i] = io->GetOrigin( i );
+    for( unsigned int j = 0; j < TImage::ImageDimension; j++ )
+      {
+      direction[j][i] = io->GetDirection( i )[j];
+      }
+    }
+
+  const itk::SizeValueType numberOfPixels = region.GetNumberOfPixels();
+  const itk::SizeValueType numberOfBytes = numberOfPixels * sizeof( PixelType );
+
+  int fd = open( dataFilename.c_str(), O_RDONLY );
+  if( fd < 0 )
+    {
+    return image;
+    }
+
+  struct stat fileStatus;
+  if( fstat( fd, &fileStatus ) != 0
+      || static_cast< itk::SizeValueType >( fileStatus.st_size ) < numberOfBytes
+      || numberOfBytes == 0 )
+    {
+    close( fd );
+    return image;
+    }
+
+  const itk::SizeValueType fileSize = fileStatus.st_size;
+  itk::SizeValueType dataOffset = 0;
+  if( headerSize > 0 )
+    {
+    dataOffset = static_cast< itk::SizeValueType >( headerSize );
+    }
+  else if( headerSize == -1 )
+    {
+    dataOffset = fileSize - numberOfBytes;
+    }
+  else if( isLocal
+      && !VariationalRegistrationGetMetaImageLocalDataOffset( filename, dataOffset ) )
+    {
+    close( fd );
+    return image;
+    }
+
+  // Trailing bytes after the pixel data are allowed, missing bytes are not.
+  if( dataOffset > fileSize - numberOfBytes
+      || dataOffset % sizeof( ComponentType ) != 0 )
+    {
+    close( fd );
+    return image;
+    }
+
+  // Private mapping: pages are copied on write, the file stays unchanged.
+  void * address = mmap( NULL, fileSize, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0 );
+  close( fd );
+  if( address == MAP_FAILED )
+    {
+    return image;
+    }
+
+  typename ContainerType::Pointer container = ContainerType::New();
+  container->SetImportPointer(
+      reinterpret_cast< PixelType * >( static_cast< char * >( address ) + dataOffset ),
+      numberOfPixels, false );
+  container->SetMapping( address, fileSize );
+
+  image = TImage::New();
+  image->SetRegions( region );
+  image->SetSpacing( spacing );
+  image->SetOrigin( origin );
+  image->SetDirection( direction );
+  image->SetPixelContainer( container );
+#endif
+
+  return image;
+}
+
+/** Read an image by mapping the file into memory if possible (see
+ *  VariationalRegistrationReadMappedImage()), or with an ImageFileReader
+ *  otherwise. */
+template< class TImage >
+typename TImage::Pointer
+VariationalRegistrationReadImage( const char * filename, bool useMapping = true )
+{
+  typename TImage::Pointer image;
+  if( useMapping )
+    {
+    image = VariationalRegistrationReadMappedImage< TImage >( filename );
+    if( image.IsNotNull() )
+      {
+      std::cout << "  Mapped " << filename << " into memory." << std::endl;
+      return image;
+      }
+    }
+
+  typedef itk::ImageFileReader< TImage > ReaderType;
+  typename ReaderType::Pointer reader = ReaderType::New();
+  reader->SetFileName( filename );
+  reader->Update();
+
+  image = reader->GetOutput();
+  if( image.IsNotNull() )
+    {
+    image->DisconnectPipeline();
+    }
+  return image;
+}
+
+#endif
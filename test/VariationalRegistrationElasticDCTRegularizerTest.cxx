@@ -0,0 +1,180 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#include "itkVariationalRegistrationElasticDCTRegularizer.h"
+#include "itkVariationalRegistrationElasticRegularizer.h"
+
+#include "itkImageRegionIteratorWithIndex.h"
+#include "vnl/vnl_math.h"
+
+#include <cmath>
+
+#if defined( ITK_USE_FFTWD ) || defined( ITK_USE_FFTWF )
+
+namespace{
+typedef itk::Vector<float,2>            VectorType;
+typedef itk::Image<VectorType,2>        FieldType;
+
+typedef itk::VariationalRegistrationElasticDCTRegularizer<FieldType> DCTRegularizerType;
+typedef itk::VariationalRegistrationElasticRegularizer<FieldType>    FFTRegularizerType;
+
+// Create a field of 61x45 pixels, an odd size, with Gaussian blobs around
+// (cx, cy) in both components.
+FieldType::Pointer
+CreateField( double cx, double cy )
+{
+  FieldType::SizeType size;
+  size[0] = 61;
+  size[1] = 45;
+  FieldType::RegionType region;
+  region.SetSize( size );
+
+  FieldType::Pointer field = FieldType::New();
+  field->SetRegions( region );
+  field->Allocate();
+
+  itk::ImageRegionIteratorWithIndex<FieldType> it( field, region );
+  for( ; !it.IsAtEnd(); ++it )
+    {
+    const double x = it.GetIndex()[0];
+    const double y = it.GetIndex()[1];
+    VectorType value;
+    value[0] = 2.0 * std::exp( -( vnl_math_sqr( x - cx ) + vnl_math_sqr( y - cy ) ) / 20.0 );
+    value[1] = std::exp( -( vnl_math_sqr( x - cx - 2.0 ) + vnl_math_sqr( y - cy + 1.0 ) ) / 12.0 );
+    it.Set( value );
+    }
+  return field;
+}
+
+// Maximum norm of the vectors of a field within the given range of x.
+double
+MaxNorm( const FieldType * field, long fromX, long toX )
+{
+  double maxNorm = 0.0;
+  itk::ImageRegionConstIteratorWithIndex<FieldType> it( field, field->GetBufferedRegion() );
+  for( ; !it.IsAtEnd(); ++it )
+    {
+    if( it.GetIndex()[0] >= fromX && it.GetIndex()[0] < toX )
+      {
+      maxNorm = vnl_math_max( maxNorm, static_cast<double>( it.Get().GetNorm() ) );
+      }
+    }
+  return maxNorm;
+}
+}
+
+int VariationalRegistrationElasticDCTRegularizerTest(int, char* [] )
+{
+  const double mu = 0.5;
+  const double lambda = 1.0;
+
+  DCTRegularizerType::Pointer dctRegularizer = DCTRegularizerType::New();
+  dctRegularizer->InPlaceOff();
+  dctRegularizer->SetMu( mu );
+  dctRegularizer->SetLambda( lambda );
+
+  FFTRegularizerType::Pointer fftRegularizer = FFTRegularizerType::New();
+  fftRegularizer->InPlaceOff();
+  fftRegularizer->SetMu( mu );
+  fftRegularizer->SetLambda( lambda );
+
+  //--------------------------------------------------------
+  std::cout << "Compare with ElasticRegularizer" << std::endl;
+
+  // Both regularizers use the same discretization and differ only in the
+  // boundary conditions. The influence of the border decays within a few
+  // pixels for these weights, so the results agree to float precision at
+  // more than 16 pixels from the border.
+  const long margin = 16;
+  FieldType::Pointer field = CreateField( 30.0, 22.0 );
+
+  dctRegularizer->SetInput( field );
+  dctRegularizer->Update();
+  fftRegularizer->SetInput( field );
+  fftRegularizer->Update();
+
+  const FieldType::SizeType size = field->GetBufferedRegion().GetSize();
+  double maxDiff = 0.0;
+  double maxChange = 0.0;
+  itk::ImageRegionConstIteratorWithIndex<FieldType> it( field, field->GetBufferedRegion() );
+  for( ; !it.IsAtEnd(); ++it )
+    {
+    const FieldType::IndexType index = it.GetIndex();
+    const VectorType value = dctRegularizer->GetOutput()->GetPixel( index );
+    const VectorType change = value - it.Get();
+    maxChange = vnl_math_max( maxChange, static_cast<double>( change.GetNorm() ) );
+
+    if( index[0] >= margin && index[0] + margin < static_cast<long>( size[0] )
+        && index[1] >= margin && index[1] + margin < static_cast<long>( size[1] ) )
+      {
+      const VectorType diff = value - fftRegularizer->GetOutput()->GetPixel( index );
+      maxDiff = vnl_math_max( maxDiff, static_cast<double>( diff.GetNorm() ) );
+      }
+    }
+
+  std::cout << "Maximum difference in the interior: " << maxDiff
+            << ", maximum change: " << maxChange << std::endl;
+
+  if( maxChange == 0.0 || maxDiff > 1e-4 * maxChange )
+    {
+    std::cout << "Test failed - result differs from ElasticRegularizer in the interior." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test wrap-around at the borders" << std::endl;
+
+  // Blobs close to the left border. With periodic boundaries, the FFT
+  // result spreads them across to the right border; with the boundary
+  // conditions of the DCT, the right border stays zero.
+  field = CreateField( 5.0, 22.0 );
+
+  dctRegularizer->SetInput( field );
+  dctRegularizer->Update();
+  fftRegularizer->SetInput( field );
+  fftRegularizer->Update();
+
+  const long rightBorder = static_cast<long>( size[0] ) - 3;
+  const double dctMax = MaxNorm( dctRegularizer->GetOutput(), 0, size[0] );
+  const double dctRight = MaxNorm( dctRegularizer->GetOutput(), rightBorder, size[0] );
+  const double fftRight = MaxNorm( fftRegularizer->GetOutput(), rightBorder, size[0] );
+
+  std::cout << "Maximum at the right border: " << dctRight << " (DCT), "
+            << fftRight << " (FFT), maximum: " << dctMax << std::endl;
+
+  // Check that the setup shows the wrap-around of the FFT at all.
+  if( fftRight < 0.01 * dctMax )
+    {
+    std::cout << "Test failed - no wrap-around of ElasticRegularizer." << std::endl;
+    return EXIT_FAILURE;
+    }
+  if( dctRight > 1e-4 * dctMax )
+    {
+    std::cout << "Test failed - wrap-around at the right border." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // -----------------------------------------------------------
+  std::cout << "Test printing informations." << std::endl;
+  dctRegularizer->Print( std::cout );
+
+  std::cout << "Test passed" << std::endl;
+  return EXIT_SUCCESS;
+}
+
+#endif
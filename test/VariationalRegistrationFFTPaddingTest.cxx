@@ -0,0 +1,305 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#include "itkVariationalRegistrationFFTPadding.h"
+#include "itkVariationalRegistrationInstrumentation.h"
+#include "itkVariationalRegistrationElasticRegularizer.h"
+
+#include "itkImage.h"
+#include "itkImageRegionIteratorWithIndex.h"
+
+#include <vector>
+
+namespace{
+typedef itk::Vector<float,2>            VectorType;
+typedef itk::Image<VectorType,2>        FieldType;
+
+typedef itk::VariationalRegistrationFFTPadding<FieldType>  PaddingType;
+typedef itk::VariationalRegistrationInstrumentation        InstrumentationType;
+
+// Create a field with the given buffered region. The components are
+// 10x + y + 100c, which are exact in float.
+FieldType::Pointer
+CreateField( const FieldType::RegionType & region )
+{
+  FieldType::Pointer field = FieldType::New();
+  field->SetRegions( region );
+  field->Allocate();
+
+  itk::ImageRegionIteratorWithIndex<FieldType> it( field, region );
+  for( ; !it.IsAtEnd(); ++it )
+    {
+    VectorType value;
+    for( unsigned int c = 0; c < 2; c++ )
+      {
+      value[c] = 10.0 * it.GetIndex()[0] + it.GetIndex()[1] + 100.0 * c;
+      }
+    it.Set( value );
+    }
+  return field;
+}
+
+// Get the position in the region that fills position j of the padded
+// buffer of a region with n pixels; -1 means zero.
+long
+GetSourcePosition( long j, long n, PaddingType::BoundaryExtensionType extension )
+{
+  if( j < n )
+    {
+    return j;
+    }
+  switch( extension )
+    {
+    case PaddingType::BOUNDARY_REPLICATE:
+      return n - 1;
+    case PaddingType::BOUNDARY_MIRROR:
+      return 2 * n - 1 - j;
+    default:
+      return -1;
+    }
+}
+
+// Copy one component of the region into a padded buffer, check the
+// padding and copy it back into a zero field. The region has to be
+// identical, the rest of the field has to stay zero.
+bool
+TestRoundTrip( const FieldType * field, const FieldType::RegionType & region,
+    const PaddingType::SizeType & paddedSize, PaddingType::BoundaryExtensionType extension )
+{
+  for( unsigned int c = 0; c < 2; c++ )
+    {
+    std::vector<double> buffer( paddedSize[0] * paddedSize[1] );
+    PaddingType::CopyComponentToBuffer( field, region, c, paddedSize, extension, &buffer[0] );
+
+    for( long j1 = 0; j1 < static_cast<long>( paddedSize[1] ); j1++ )
+      {
+      for( long j0 = 0; j0 < static_cast<long>( paddedSize[0] ); j0++ )
+        {
+        const long s0 = GetSourcePosition( j0, region.GetSize()[0], extension );
+        const long s1 = GetSourcePosition( j1, region.GetSize()[1], extension );
+        double expected = 0.0;
+        if( s0 >= 0 && s1 >= 0 )
+          {
+          FieldType::IndexType index;
+          index[0] = region.GetIndex()[0] + s0;
+          index[1] = region.GetIndex()[1] + s1;
+          expected = field->GetPixel( index )[c];
+          }
+        if( buffer[j0 + j1 * paddedSize[0]] != expected )
+          {
+          std::cout << "Wrong buffer value " << buffer[j0 + j1 * paddedSize[0]]
+                    << " at (" << j0 << ", " << j1 << ") instead of " << expected << std::endl;
+          return false;
+          }
+        }
+      }
+
+    FieldType::Pointer result = FieldType::New();
+    result->SetRegions( field->GetBufferedRegion() );
+    result->Allocate();
+    result->FillBuffer( VectorType( 0.0f ) );
+    PaddingType::CopyBufferToComponent( &buffer[0], paddedSize, 1.0, c, result.GetPointer(), region );
+
+    itk::ImageRegionConstIteratorWithIndex<FieldType> it( field, field->GetBufferedRegion() );
+    for( ; !it.IsAtEnd(); ++it )
+      {
+      const float expected = region.IsInside( it.GetIndex() ) ? it.Get()[c] : 0.0f;
+      if( result->GetPixel( it.GetIndex() )[c] != expected )
+        {
+        std::cout << "Wrong value " << result->GetPixel( it.GetIndex() )[c]
+                  << " at " << it.GetIndex() << " instead of " << expected << std::endl;
+        return false;
+        }
+      }
+    }
+  return true;
+}
+}
+
+int VariationalRegistrationFFTPaddingTest(int, char* [] )
+{
+  //--------------------------------------------------------
+  std::cout << "Test ComputeFastSize" << std::endl;
+
+  const itk::SizeValueType sizes[8][2] = {
+    { 0, 0 }, { 1, 1 }, { 11, 12 }, { 13, 14 }, { 128, 128 }, { 131, 135 }, { 257, 270 }, { 343, 343 } };
+  for( unsigned int i = 0; i < 8; i++ )
+    {
+    const itk::SizeValueType size = PaddingType::ComputeFastSize( sizes[i][0] );
+    std::cout << sizes[i][0] << " -> " << size << std::endl;
+    if( size != sizes[i][1] )
+      {
+      std::cout << "Test failed - fast size of " << sizes[i][0] << " is not "
+                << sizes[i][1] << "." << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  PaddingType::SizeType fieldSize;
+  fieldSize[0] = 131;
+  fieldSize[1] = 64;
+  PaddingType::SizeType paddedSize = PaddingType::ComputePaddedSize( fieldSize, true );
+  if( paddedSize[0] != 135 || paddedSize[1] != 64
+      || PaddingType::ComputePaddedSize( fieldSize, false ) != fieldSize )
+    {
+    std::cout << "Test failed - wrong padded size " << paddedSize << "." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test round trip with boundary extensions" << std::endl;
+
+  // The buffered region does not start at zero, and a region inside of the
+  // field is padded as well. Mirroring requires the padding to be at most
+  // the size of the region.
+  FieldType::RegionType bufferedRegion;
+  bufferedRegion.SetIndex( 0, 2 );
+  bufferedRegion.SetIndex( 1, -1 );
+  bufferedRegion.SetSize( 0, 7 );
+  bufferedRegion.SetSize( 1, 5 );
+  FieldType::Pointer field = CreateField( bufferedRegion );
+
+  FieldType::RegionType innerRegion;
+  innerRegion.SetIndex( 0, 3 );
+  innerRegion.SetIndex( 1, 0 );
+  innerRegion.SetSize( 0, 4 );
+  innerRegion.SetSize( 1, 3 );
+
+  paddedSize[0] = 10;
+  paddedSize[1] = 8;
+  PaddingType::SizeType innerPaddedSize;
+  innerPaddedSize[0] = 7;
+  innerPaddedSize[1] = 5;
+
+  const PaddingType::BoundaryExtensionType extensions[3] = {
+    PaddingType::BOUNDARY_ZERO, PaddingType::BOUNDARY_REPLICATE, PaddingType::BOUNDARY_MIRROR };
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    if( !TestRoundTrip( field, bufferedRegion, paddedSize, extensions[i] )
+        || !TestRoundTrip( field, innerRegion, innerPaddedSize, extensions[i] ) )
+      {
+      std::cout << "Test failed - round trip with boundary extension " << extensions[i] << "." << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  // Without padding, the buffer is a plain copy of the region.
+  if( !TestRoundTrip( field, bufferedRegion, bufferedRegion.GetSize(), PaddingType::BOUNDARY_MIRROR ) )
+    {
+    std::cout << "Test failed - round trip without padding." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+#if defined( ITK_USE_FFTWD ) || defined( ITK_USE_FFTWF )
+  typedef itk::VariationalRegistrationElasticRegularizer<FieldType> ElasticRegularizerType;
+
+  //--------------------------------------------------------
+  std::cout << "Test regularization without padding" << std::endl;
+
+  // For a size without large prime factors, padding does not change the
+  // transform size, so the plans are reused and the result has to be
+  // bit-identical.
+  FieldType::RegionType region;
+  region.SetSize( 0, 32 );
+  region.SetSize( 1, 24 );
+  field = CreateField( region );
+
+  InstrumentationType::Pointer instrumentation = InstrumentationType::New();
+
+  ElasticRegularizerType::Pointer regularizer = ElasticRegularizerType::New();
+  regularizer->InPlaceOff();
+  regularizer->SetInstrumentation( instrumentation );
+  regularizer->SetInput( field );
+  regularizer->Update();
+
+  const itk::SizeValueType numberOfPixels = region.GetNumberOfPixels();
+  const VectorType * output = regularizer->GetOutput()->GetBufferPointer();
+  const std::vector<VectorType> unpaddedOutput( output, output + numberOfPixels );
+
+  regularizer->UsePaddedSizeOn();
+  regularizer->Update();
+
+  output = regularizer->GetOutput()->GetBufferPointer();
+  for( itk::SizeValueType n = 0; n < numberOfPixels; n++ )
+    {
+    if( output[n] != unpaddedOutput[n] )
+      {
+      std::cout << "Test failed - result differs with padding of a fast size." << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test transform records" << std::endl;
+
+  // A field of 13x11 pixels is transformed with 13x11 pixels without
+  // padding and with 14x12 pixels with padding. The plans are created on
+  // the first update of a transform size and reused afterwards.
+  region.SetSize( 0, 13 );
+  region.SetSize( 1, 11 );
+  field = CreateField( region );
+
+  regularizer->UsePaddedSizeOff();
+  regularizer->SetInput( field );
+  regularizer->Update();
+  regularizer->UsePaddedSizeOn();
+  regularizer->Update();
+  field->Modified();
+  regularizer->Update();
+
+  const unsigned int numberOfRecords = 5;
+  if( instrumentation->GetNumberOfTransformRecords() != numberOfRecords )
+    {
+    std::cout << "Test failed - " << instrumentation->GetNumberOfTransformRecords()
+              << " instead of " << numberOfRecords << " transform records." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  const itk::SizeValueType fieldSizes[numberOfRecords][2] = {
+    { 32, 24 }, { 32, 24 }, { 13, 11 }, { 13, 11 }, { 13, 11 } };
+  const itk::SizeValueType transformSizes[numberOfRecords][2] = {
+    { 32, 24 }, { 32, 24 }, { 13, 11 }, { 14, 12 }, { 14, 12 } };
+  const bool planned[numberOfRecords] = { true, false, true, true, false };
+  for( unsigned int i = 0; i < numberOfRecords; i++ )
+    {
+    const InstrumentationType::TransformRecordType & record = instrumentation->GetTransformRecord( i );
+    std::cout << "Field size [" << record.FieldSize[0] << ", " << record.FieldSize[1]
+              << "], transform size [" << record.TransformSize[0] << ", " << record.TransformSize[1]
+              << "], plan time " << record.PlanTime << " s, transform time "
+              << record.TransformTime << " s" << std::endl;
+    if( record.FieldSize.size() != 2 || record.TransformSize.size() != 2
+        || record.FieldSize[0] != fieldSizes[i][0]
+        || record.FieldSize[1] != fieldSizes[i][1]
+        || record.TransformSize[0] != transformSizes[i][0]
+        || record.TransformSize[1] != transformSizes[i][1]
+        || ( !planned[i] && record.PlanTime != 0.0 )
+        || record.PlanTime < 0.0 || record.TransformTime < 0.0 )
+      {
+      std::cout << "Test failed - wrong transform record " << i << "." << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  // -----------------------------------------------------------
+  std::cout << "Test printing informations." << std::endl;
+  regularizer->Print( std::cout );
+#endif
+
+  std::cout << "Test passed" << std::endl;
+  return EXIT_SUCCESS;
+}
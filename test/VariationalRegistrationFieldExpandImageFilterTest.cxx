@@ -0,0 +1,228 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#include "itkVariationalRegistrationFieldExpandImageFilter.h"
+#include "itkVariationalRegistrationWorkspace.h"
+
+#include "itkRecursiveGaussianImageFilter.h"
+#include "itkVectorResampleImageFilter.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "vnl/vnl_math.h"
+
+#include <cmath>
+
+namespace{
+typedef itk::Vector<float,2>            VectorType;
+typedef itk::Image<VectorType,2>        FieldType;
+
+// Expand the field with the Gaussian and VectorResampleImageFilter path
+// used by the multi-resolution filter if the fused expander is off.
+FieldType::Pointer
+ExpandWithResampler( FieldType * field, const FieldType * reference, double sigma )
+{
+  FieldType::Pointer smoothedField = field;
+
+  typedef itk::RecursiveGaussianImageFilter<FieldType,FieldType> GaussianFilterType;
+  GaussianFilterType::Pointer smoother = GaussianFilterType::New();
+  for( unsigned int dim = 0; dim < 2 && sigma > 0.0; ++dim )
+    {
+    smoother->SetInput( smoothedField );
+    smoother->SetSigma( sigma );
+    smoother->SetDirection( dim );
+    smoother->Update();
+    smoothedField = smoother->GetOutput();
+    smoothedField->DisconnectPipeline();
+    }
+
+  typedef itk::VectorResampleImageFilter<FieldType,FieldType> ResamplerType;
+  ResamplerType::Pointer resampler = ResamplerType::New();
+  resampler->SetInput( smoothedField );
+  resampler->SetSize( reference->GetLargestPossibleRegion().GetSize() );
+  resampler->SetOutputStartIndex( reference->GetLargestPossibleRegion().GetIndex() );
+  resampler->SetOutputOrigin( reference->GetOrigin() );
+  resampler->SetOutputSpacing( reference->GetSpacing() );
+  resampler->SetOutputDirection( reference->GetDirection() );
+  resampler->Update();
+
+  return resampler->GetOutput();
+}
+
+// Maximum difference of two fields in the region shrunk by the margin.
+double
+MaximumDifference( const FieldType * a, const FieldType * b, unsigned int margin )
+{
+  FieldType::RegionType region = a->GetLargestPossibleRegion();
+  region.ShrinkByRadius( margin );
+
+  double maxDiff = 0.0;
+  itk::ImageRegionConstIteratorWithIndex<FieldType> aIt( a, region );
+  for( ; !aIt.IsAtEnd(); ++aIt )
+    {
+    const VectorType diff = aIt.Get() - b->GetPixel( aIt.GetIndex() );
+    maxDiff = vnl_math_max( maxDiff, static_cast<double>( diff.GetNorm() ) );
+    }
+  return maxDiff;
+}
+}
+
+int VariationalRegistrationFieldExpandImageFilterTest(int, char* [] )
+{
+  //--------------------------------------------------------
+  std::cout << "Generate coarse field and reference grid" << std::endl;
+
+  // Coarse field of 32x32 pixels with spacing 2, fine grid of 64x64 pixels
+  // with spacing 1, as between two levels of the pyramid.
+  FieldType::SizeType coarseSize;
+  coarseSize.Fill( 32 );
+  FieldType::RegionType coarseRegion;
+  coarseRegion.SetSize( coarseSize );
+
+  FieldType::SpacingType coarseSpacing;
+  coarseSpacing.Fill( 2.0 );
+  FieldType::PointType coarseOrigin;
+  coarseOrigin.Fill( 0.5 );
+
+  FieldType::Pointer field = FieldType::New();
+  field->SetRegions( coarseRegion );
+  field->SetSpacing( coarseSpacing );
+  field->SetOrigin( coarseOrigin );
+  field->Allocate();
+
+  // Smooth field with one period over the field in each direction.
+  const double pi = vnl_math::pi;
+  itk::ImageRegionIteratorWithIndex<FieldType> it( field, coarseRegion );
+  for( ; !it.IsAtEnd(); ++it )
+    {
+    const FieldType::IndexType index = it.GetIndex();
+    VectorType value;
+    value[0] = std::sin( 2.0 * pi * index[0] / 32.0 );
+    value[1] = std::cos( 2.0 * pi * index[1] / 32.0 ) * 0.5;
+    it.Set( value );
+    }
+
+  FieldType::SizeType fineSize;
+  fineSize.Fill( 64 );
+  FieldType::RegionType fineRegion;
+  fineRegion.SetSize( fineSize );
+
+  FieldType::SpacingType fineSpacing;
+  fineSpacing.Fill( 1.0 );
+  FieldType::PointType fineOrigin;
+  fineOrigin.Fill( 0.0 );
+
+  FieldType::Pointer reference = FieldType::New();
+  reference->SetRegions( fineRegion );
+  reference->SetSpacing( fineSpacing );
+  reference->SetOrigin( fineOrigin );
+
+  typedef itk::VariationalRegistrationFieldExpandImageFilter<FieldType> ExpanderType;
+  if( !ExpanderType::CanExpand( field, reference ) )
+    {
+    std::cout << "Test failed - CanExpand() returned false." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Compare resampling without smoothing" << std::endl;
+
+  ExpanderType::Pointer expander = ExpanderType::New();
+  expander->SetInput( field );
+  expander->SetOutputParametersFromImage( reference );
+  expander->Update();
+
+  FieldType::Pointer expectedField = ExpandWithResampler( field, reference, 0.0 );
+  double maxDiff = MaximumDifference( expander->GetOutput(), expectedField, 0 );
+  std::cout << "Maximum difference: " << maxDiff << std::endl;
+
+  // Both interpolate linearly, so only rounding errors are expected.
+  if( maxDiff > 1e-4 )
+    {
+    std::cout << "Test failed - resampling differs from VectorResampleImageFilter." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Compare resampling with smoothing" << std::endl;
+
+  // Sigma of two coarse pixels. The truncated discrete Gaussian and the
+  // recursive Gaussian only agree approximately, and the boundary handling
+  // differs, so pixels within three sigma of the border are excluded.
+  const double sigma = 4.0;
+  ExpanderType::SigmaArrayType sigmaArray;
+  sigmaArray.Fill( sigma );
+  expander->SetSigma( sigmaArray );
+  expander->Update();
+
+  expectedField = ExpandWithResampler( field, reference, sigma );
+  maxDiff = MaximumDifference( expander->GetOutput(), expectedField, 12 );
+  std::cout << "Maximum difference: " << maxDiff << std::endl;
+
+  if( maxDiff > 0.01 )
+    {
+    std::cout << "Test failed - smoothing differs from RecursiveGaussianImageFilter." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  FieldType::Pointer smoothedField = expander->GetOutput();
+  smoothedField->DisconnectPipeline();
+
+  //--------------------------------------------------------
+  std::cout << "Test output in workspace buffer" << std::endl;
+
+  typedef itk::VariationalRegistrationWorkspace<FieldType> WorkspaceType;
+  WorkspaceType::Pointer workspace = WorkspaceType::New();
+  workspace->SetNumberOfPixels( fineRegion.GetNumberOfPixels() );
+
+  expander->SetWorkspace( workspace );
+  expander->SetWorkspaceBufferName( "ExpandedField0" );
+  expander->Update();
+
+  FieldType::Pointer workspaceField = expander->GetOutput();
+  if( workspaceField->GetPixelContainer()->GetContainerManageMemory()
+      || workspace->GetAllocatedBytes() < fineRegion.GetNumberOfPixels() * sizeof( VectorType ) )
+    {
+    std::cout << "Test failed - output not written to the workspace." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  maxDiff = MaximumDifference( workspaceField, smoothedField, 0 );
+  if( maxDiff != 0.0 )
+    {
+    std::cout << "Test failed - output in workspace differs by " << maxDiff << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // A second update with the same buffer must not allocate memory.
+  const VectorType * buffer = workspaceField->GetBufferPointer();
+  const WorkspaceType::SizeValueType allocatedBytes = workspace->GetAllocatedBytes();
+  expander->Modified();
+  expander->Update();
+  if( expander->GetOutput()->GetBufferPointer() != buffer
+      || workspace->GetAllocatedBytes() != allocatedBytes )
+    {
+    std::cout << "Test failed - workspace buffer was not reused." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // -----------------------------------------------------------
+  std::cout << "Test printing informations." << std::endl;
+  expander->Print( std::cout );
+
+  std::cout << "Test passed" << std::endl;
+  return EXIT_SUCCESS;
+}
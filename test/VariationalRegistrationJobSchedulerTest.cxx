@@ -0,0 +1,296 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#include "itkVariationalRegistrationJobScheduler.h"
+#include "itkVariationalRegistrationMultiResolutionFilter.h"
+#include "itkVariationalSymmetricDiffeomorphicRegistrationFilter.h"
+#include "itkVariationalRegistrationDemonsFunction.h"
+#include "itkVariationalRegistrationDiffusionRegularizer.h"
+
+#include "itkCommand.h"
+#include "itkSimpleMutexLock.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "vnl/vnl_math.h"
+
+#include <vector>
+
+namespace{
+typedef unsigned char                          PixelType;
+typedef itk::Image<PixelType,2>                ImageType;
+typedef itk::Vector<float,2>                   VectorType;
+typedef itk::Image<VectorType,2>               FieldType;
+
+typedef itk::VariationalRegistrationDemonsFunction<
+    ImageType, ImageType, FieldType>                           FunctionType;
+typedef itk::VariationalRegistrationDiffusionRegularizer<FieldType> RegularizerType;
+typedef itk::VariationalRegistrationFilter<
+    ImageType, ImageType, FieldType>                           RegistrationFilterType;
+typedef itk::VariationalRegistrationMultiResolutionFilter<
+    ImageType, ImageType, FieldType>                           MRRegistrationFilterType;
+typedef itk::VariationalRegistrationJobScheduler<
+    MRRegistrationFilterType>                                  SchedulerType;
+
+// Symmetric diffeomorphic filter giving access to its exponentiator.
+class ExposedSymmetricDiffeomorphicFilter
+  : public itk::VariationalSymmetricDiffeomorphicRegistrationFilter<ImageType, ImageType, FieldType>
+{
+public:
+  typedef ExposedSymmetricDiffeomorphicFilter   Self;
+  typedef itk::VariationalSymmetricDiffeomorphicRegistrationFilter<
+      ImageType, ImageType, FieldType>          Superclass;
+  typedef itk::SmartPointer< Self >             Pointer;
+
+  itkNewMacro(Self);
+
+  itk::ThreadIdType GetExponentiatorNumberOfThreads()
+    { return this->GetExponentiator()->GetNumberOfThreads(); }
+
+protected:
+  ExposedSymmetricDiffeomorphicFilter() {}
+};
+
+// Tracks the number of threads of the running jobs.
+class ThreadCounter : public itk::Command
+{
+public:
+  typedef ThreadCounter                 Self;
+  typedef itk::Command                  Superclass;
+  typedef itk::SmartPointer< Self >     Pointer;
+
+  itkNewMacro(Self);
+
+  void Execute( itk::Object * caller, const itk::EventObject & event )
+    {
+    const itk::ProcessObject * filter = dynamic_cast< const itk::ProcessObject * >( caller );
+    if( !filter )
+      {
+      return;
+      }
+
+    m_Mutex.Lock();
+    if( itk::StartEvent().CheckEvent( &event ) )
+      {
+      m_ActiveThreads += filter->GetNumberOfThreads();
+      m_ActiveJobs++;
+      m_MaximumActiveThreads = vnl_math_max( m_MaximumActiveThreads, m_ActiveThreads );
+      m_MaximumActiveJobs = vnl_math_max( m_MaximumActiveJobs, m_ActiveJobs );
+      }
+    else if( itk::EndEvent().CheckEvent( &event ) )
+      {
+      m_ActiveThreads -= filter->GetNumberOfThreads();
+      m_ActiveJobs--;
+      }
+    m_Mutex.Unlock();
+    }
+
+  void Execute( const itk::Object * caller, const itk::EventObject & event )
+    { this->Execute( const_cast< itk::Object * >( caller ), event ); }
+
+  unsigned int m_ActiveThreads;
+  unsigned int m_ActiveJobs;
+  unsigned int m_MaximumActiveThreads;
+  unsigned int m_MaximumActiveJobs;
+
+protected:
+  ThreadCounter()
+    {
+    m_ActiveThreads = 0;
+    m_ActiveJobs = 0;
+    m_MaximumActiveThreads = 0;
+    m_MaximumActiveJobs = 0;
+    }
+
+private:
+  itk::SimpleMutexLock m_Mutex;
+};
+
+// Create an image of the given size with a circle.
+ImageType::Pointer
+CreateImage( unsigned int size, double radius )
+{
+  ImageType::SizeType imageSize;
+  imageSize.Fill( size );
+  ImageType::RegionType region;
+  region.SetSize( imageSize );
+
+  ImageType::Pointer image = ImageType::New();
+  image->SetRegions( region );
+  image->Allocate();
+
+  itk::ImageRegionIteratorWithIndex<ImageType> it( image, region );
+  for( ; !it.IsAtEnd(); ++it )
+    {
+    const ImageType::IndexType index = it.GetIndex();
+    const double distance = vnl_math_sqr( index[0] - size / 2.0 )
+        + vnl_math_sqr( index[1] - size / 2.0 );
+    it.Set( distance <= vnl_math_sqr( radius ) ? 250 : 15 );
+    }
+  return image;
+}
+
+// Check that all components of a job use the given number of threads.
+bool
+CheckJobThreads( MRRegistrationFilterType * mrRegFilter, itk::ThreadIdType threads )
+{
+  RegistrationFilterType * regFilter = mrRegFilter->GetRegistrationFilter();
+  FunctionType * function =
+      dynamic_cast< FunctionType * >( regFilter->GetDifferenceFunction().GetPointer() );
+
+  bool passed = mrRegFilter->GetNumberOfThreads() == threads
+      && mrRegFilter->GetFixedImagePyramid()->GetNumberOfThreads() == threads
+      && mrRegFilter->GetMovingImagePyramid()->GetNumberOfThreads() == threads
+      && mrRegFilter->GetMaskImagePyramid()->GetNumberOfThreads() == threads
+      && mrRegFilter->GetFieldExpander()->GetNumberOfThreads() == threads
+      && mrRegFilter->GetWorkspace()->GetNumberOfThreads() == threads
+      && regFilter->GetNumberOfThreads() == threads
+      && regFilter->GetRegularizer()->GetNumberOfThreads() == threads
+      && function != NULL
+      && function->GetMovingImageWarper()->GetNumberOfThreads() == threads;
+
+  ExposedSymmetricDiffeomorphicFilter * diffeoFilter =
+      dynamic_cast< ExposedSymmetricDiffeomorphicFilter * >( regFilter );
+  if( diffeoFilter )
+    {
+    passed = passed && diffeoFilter->GetExponentiatorNumberOfThreads() == threads;
+    }
+  return passed;
+}
+}
+
+int VariationalRegistrationJobSchedulerTest(int, char* [] )
+{
+  //--------------------------------------------------------
+  std::cout << "Set up jobs of different sizes" << std::endl;
+
+  // With 4096 pixels per thread and a budget of 4 threads, the jobs get
+  // 4, 1, 2 and 1 threads.
+  const unsigned int sizes[4] = { 128, 64, 90, 64 };
+  const itk::ThreadIdType expectedThreads[4] = { 4, 1, 2, 1 };
+  const itk::ThreadIdType numberOfThreads = 4;
+
+  SchedulerType::Pointer scheduler = SchedulerType::New();
+  scheduler->SetNumberOfThreads( numberOfThreads );
+  scheduler->SetMinimumNumberOfPixelsPerThread( 4096 );
+
+  ThreadCounter::Pointer counter = ThreadCounter::New();
+
+  itk::Array<unsigned int> iterations( 2 );
+  iterations.Fill( 20 );
+
+  for( unsigned int i = 0; i < 4; i++ )
+    {
+    RegularizerType::Pointer regularizer = RegularizerType::New();
+    regularizer->SetAlpha( 0.5 );
+
+    // The second job uses a diffeomorphic filter to check the exponentiator.
+    RegistrationFilterType::Pointer regFilter;
+    if( i == 1 )
+      {
+      regFilter = ExposedSymmetricDiffeomorphicFilter::New().GetPointer();
+      }
+    else
+      {
+      regFilter = RegistrationFilterType::New();
+      }
+    regFilter->SetDifferenceFunction( FunctionType::New() );
+    regFilter->SetRegularizer( regularizer );
+
+    // All components start with a single thread.
+    MRRegistrationFilterType::Pointer mrRegFilter = MRRegistrationFilterType::New();
+    mrRegFilter->SetRegistrationFilter( regFilter );
+    mrRegFilter->SetNumberOfThreads( 1 );
+    mrRegFilter->SetFixedImage( CreateImage( sizes[i], sizes[i] / 4.0 ) );
+    mrRegFilter->SetMovingImage( CreateImage( sizes[i], sizes[i] / 4.0 - 2.0 ) );
+    mrRegFilter->SetNumberOfLevels( 2 );
+    mrRegFilter->SetNumberOfIterations( iterations );
+    mrRegFilter->AddObserver( itk::StartEvent(), counter );
+    mrRegFilter->AddObserver( itk::EndEvent(), counter );
+
+    if( !CheckJobThreads( mrRegFilter, 1 ) )
+      {
+      std::cout << "Test failed - SetNumberOfThreads() not passed on to all components." << std::endl;
+      return EXIT_FAILURE;
+      }
+
+    scheduler->AddJob( mrRegFilter );
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Execute jobs" << std::endl;
+
+  scheduler->Execute();
+
+  if( scheduler->GetNumberOfFailedJobs() != 0 )
+    {
+    for( unsigned int i = 0; i < scheduler->GetNumberOfJobs(); i++ )
+      {
+      std::cout << scheduler->GetJobErrorMessage( i ) << std::endl;
+      }
+    std::cout << "Test failed - jobs failed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Check thread assignment" << std::endl;
+
+  for( unsigned int i = 0; i < scheduler->GetNumberOfJobs(); i++ )
+    {
+    std::cout << "Job " << i << ": " << scheduler->GetJobNumberOfThreads( i )
+              << " thread(s), " << scheduler->GetJobElapsedTime( i ) << " s" << std::endl;
+    if( scheduler->GetJobNumberOfThreads( i ) != expectedThreads[i] )
+      {
+      std::cout << "Test failed - job " << i << " got "
+                << scheduler->GetJobNumberOfThreads( i ) << " instead of "
+                << expectedThreads[i] << " threads." << std::endl;
+      return EXIT_FAILURE;
+      }
+    if( !CheckJobThreads( scheduler->GetJob( i ), expectedThreads[i] ) )
+      {
+      std::cout << "Test failed - thread budget of job " << i
+                << " not passed on to all components." << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Check packing" << std::endl;
+
+  std::cout << "Maximum active threads: " << counter->m_MaximumActiveThreads
+            << ", maximum active jobs: " << counter->m_MaximumActiveJobs << std::endl;
+
+  // The budget is never exceeded, and the three small jobs fit into the
+  // budget together, so at least two of them run concurrently.
+  if( counter->m_MaximumActiveThreads > numberOfThreads
+      || counter->m_ActiveThreads != 0 )
+    {
+    std::cout << "Test failed - thread budget exceeded." << std::endl;
+    return EXIT_FAILURE;
+    }
+  if( counter->m_MaximumActiveJobs < 2 )
+    {
+    std::cout << "Test failed - small jobs were not packed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // -----------------------------------------------------------
+  std::cout << "Test printing informations." << std::endl;
+  scheduler->Print( std::cout );
+
+  std::cout << "Test passed" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,320 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#include "itkVariationalRegistrationFilter.h"
+#include "itkVariationalRegistrationDemonsFunction.h"
+#include "itkVariationalRegistrationDiffusionRegularizer.h"
+
+#include "itkCommand.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "vnl/vnl_math.h"
+
+#include <cmath>
+#include <vector>
+
+namespace{
+typedef unsigned char                          PixelType;
+typedef itk::Image<PixelType,2>                ImageType;
+typedef itk::Vector<float,2>                   VectorType;
+typedef itk::Image<VectorType,2>               FieldType;
+
+typedef itk::VariationalRegistrationDemonsFunction<
+    ImageType, ImageType, FieldType>                           FunctionType;
+typedef itk::VariationalRegistrationDiffusionRegularizer<FieldType> RegularizerType;
+typedef itk::VariationalRegistrationFilter<
+    ImageType, ImageType, FieldType>                           RegistrationFilterType;
+typedef RegistrationFilterType::MaskImageType                  MaskType;
+
+// Records the active block fraction of each iteration.
+class FractionRecorder : public itk::Command
+{
+public:
+  typedef FractionRecorder              Self;
+  typedef itk::Command                  Superclass;
+  typedef itk::SmartPointer< Self >     Pointer;
+
+  itkNewMacro(Self);
+
+  void Execute( itk::Object * caller, const itk::EventObject & event )
+    { this->Execute( const_cast< const itk::Object * >( caller ), event ); }
+
+  void Execute( const itk::Object * caller, const itk::EventObject & )
+    {
+    const RegistrationFilterType * filter = dynamic_cast< const RegistrationFilterType * >( caller );
+    if( filter )
+      {
+      m_Fractions.push_back( filter->GetActiveBlockFraction() );
+      }
+    }
+
+  std::vector< double > m_Fractions;
+
+protected:
+  FractionRecorder() {}
+};
+
+// Create an image of 64x64 pixels with a Gaussian blob.
+ImageType::Pointer
+CreateImage( double sigma )
+{
+  ImageType::SizeType size;
+  size.Fill( 64 );
+  ImageType::RegionType region;
+  region.SetSize( size );
+
+  ImageType::Pointer image = ImageType::New();
+  image->SetRegions( region );
+  image->Allocate();
+
+  itk::ImageRegionIteratorWithIndex<ImageType> it( image, region );
+  for( ; !it.IsAtEnd(); ++it )
+    {
+    const ImageType::IndexType index = it.GetIndex();
+    const double distance = vnl_math_sqr( index[0] - 32.0 ) + vnl_math_sqr( index[1] - 32.0 );
+    it.Set( static_cast< PixelType >( 100.0 + 100.0 * std::exp( -distance / ( 2.0 * sigma * sigma ) ) ) );
+    }
+  return image;
+}
+
+// Create an image of 64x64 pixels with a bright disc of the given radius
+// in the first block of 16x16 pixels.
+ImageType::Pointer
+CreateDiscImage( double radius )
+{
+  ImageType::SizeType size;
+  size.Fill( 64 );
+  ImageType::RegionType region;
+  region.SetSize( size );
+
+  ImageType::Pointer image = ImageType::New();
+  image->SetRegions( region );
+  image->Allocate();
+
+  itk::ImageRegionIteratorWithIndex<ImageType> it( image, region );
+  for( ; !it.IsAtEnd(); ++it )
+    {
+    const ImageType::IndexType index = it.GetIndex();
+    const double distance = vnl_math_sqr( index[0] - 7.0 ) + vnl_math_sqr( index[1] - 7.0 );
+    it.Set( distance <= radius * radius ? 200 : 100 );
+    }
+  return image;
+}
+
+// Create a mask of 64x64 pixels whose foreground is the square from 20 to
+// 43 around the center of the blobs.
+MaskType::Pointer
+CreateMask()
+{
+  MaskType::SizeType size;
+  size.Fill( 64 );
+  MaskType::RegionType region;
+  region.SetSize( size );
+
+  MaskType::Pointer mask = MaskType::New();
+  mask->SetRegions( region );
+  mask->Allocate();
+
+  itk::ImageRegionIteratorWithIndex<MaskType> it( mask, region );
+  for( ; !it.IsAtEnd(); ++it )
+    {
+    const MaskType::IndexType index = it.GetIndex();
+    const bool inside = index[0] >= 20 && index[0] <= 43 && index[1] >= 20 && index[1] <= 43;
+    it.Set( inside ? 1 : 0 );
+    }
+  return mask;
+}
+
+// Create a masked registration of the blobs with 10 iterations, either
+// diffusion-like (smoothing the field) or fluid-like (smoothing the update).
+RegistrationFilterType::Pointer
+CreateRegistration( const MaskType * mask, bool fluid )
+{
+  RegularizerType::Pointer regularizer = RegularizerType::New();
+  regularizer->SetAlpha( 0.5 );
+
+  RegistrationFilterType::Pointer regFilter = RegistrationFilterType::New();
+  regFilter->SetDifferenceFunction( FunctionType::New() );
+  regFilter->SetRegularizer( regularizer );
+  regFilter->SetFixedImage( CreateImage( 10.0 ) );
+  regFilter->SetMovingImage( CreateImage( 12.0 ) );
+  regFilter->SetMaskImage( mask );
+  regFilter->SetNumberOfIterations( 10 );
+  if( fluid )
+    {
+    regFilter->SmoothDisplacementFieldOff();
+    regFilter->SmoothUpdateFieldOn();
+    }
+  return regFilter;
+}
+
+// Returns true if the values are equal up to the rounding errors of the
+// reduction, whose order depends on the thread scheduling.
+bool
+IsClose( double value1, double value2 )
+{
+  return vnl_math_abs( value1 - value2 ) <= 1e-10 * vnl_math_max( vnl_math_abs( value1 ), 1.0 );
+}
+
+// Returns true if both fields are identical.
+bool
+CompareFields( const FieldType * field1, const FieldType * field2 )
+{
+  const itk::SizeValueType numberOfPixels = field1->GetBufferedRegion().GetNumberOfPixels();
+  if( field2->GetBufferedRegion().GetNumberOfPixels() != numberOfPixels )
+    {
+    return false;
+    }
+  for( itk::SizeValueType i = 0; i < numberOfPixels; i++ )
+    {
+    if( field1->GetBufferPointer()[i] != field2->GetBufferPointer()[i] )
+      {
+      return false;
+      }
+    }
+  return true;
+}
+}
+
+int VariationalRegistrationMaskBlockTest(int, char* [] )
+{
+  //--------------------------------------------------------
+  std::cout << "Test mask blocks" << std::endl;
+
+  // The forces are zero outside of the mask, so restricting the force
+  // computation and the update to the blocks containing mask foreground
+  // must not change the result, neither for diffusion-like nor for
+  // fluid-like registration. Blocks of 8x8 pixels split the image into
+  // 64 blocks, of which the square touches 16 without covering them.
+  MaskType::Pointer mask = CreateMask();
+  const char * names[2] = { "diffusion", "fluid" };
+  for( unsigned int i = 0; i < 2; i++ )
+    {
+    const bool fluid = ( i == 1 );
+    RegistrationFilterType::Pointer maskFilter = CreateRegistration( mask, fluid );
+    maskFilter->Update();
+
+    RegistrationFilterType::Pointer blockFilter = CreateRegistration( mask, fluid );
+    blockFilter->UseMaskBlocksOn();
+    blockFilter->SetMaskBlockSize( 8 );
+    blockFilter->Update();
+
+    std::cout << names[i] << ": " << blockFilter->GetNumberOfActiveMaskBlocks() << " of "
+              << blockFilter->GetNumberOfMaskBlocks() << " blocks active, active fraction "
+              << blockFilter->GetActiveBlockFraction() << ", metric " << blockFilter->GetMetric()
+              << " (without blocks: " << maskFilter->GetMetric() << ")" << std::endl;
+
+    if( maskFilter->GetNumberOfMaskBlocks() != 0
+        || maskFilter->GetActiveBlockFraction() != 1.0 )
+      {
+      std::cout << "Test failed - blocks used without UseMaskBlocks." << std::endl;
+      return EXIT_FAILURE;
+      }
+    if( blockFilter->GetNumberOfMaskBlocks() != 64
+        || blockFilter->GetNumberOfActiveMaskBlocks() != 16
+        || blockFilter->GetActiveBlockFraction() != 0.25
+        || blockFilter->GetMeanActiveBlockFraction() != 0.25 )
+      {
+      std::cout << "Test failed - wrong active blocks." << std::endl;
+      return EXIT_FAILURE;
+      }
+    if( blockFilter->GetElapsedIterations() != maskFilter->GetElapsedIterations()
+        || !IsClose( blockFilter->GetMetric(), maskFilter->GetMetric() )
+        || !IsClose( blockFilter->GetRMSChange(), maskFilter->GetRMSChange() ) )
+      {
+      std::cout << "Test failed - metric of the " << names[i] << " registration changed by the blocks." << std::endl;
+      return EXIT_FAILURE;
+      }
+    if( !CompareFields( blockFilter->GetOutput(), maskFilter->GetOutput() ) )
+      {
+      std::cout << "Test failed - field of the " << names[i] << " registration changed by the blocks." << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test freezing of converged blocks" << std::endl;
+
+  // For identical images all forces are zero, so every block is quiet in
+  // every iteration. After FreezeIterations iterations all blocks are
+  // frozen and the registration is stopped.
+  FractionRecorder::Pointer frozenRecorder = FractionRecorder::New();
+  RegistrationFilterType::Pointer frozenFilter = CreateRegistration( NULL, false );
+  frozenFilter->SetMovingImage( CreateImage( 10.0 ) );
+  frozenFilter->SetNumberOfIterations( 20 );
+  frozenFilter->FreezeConvergedBlocksOn();
+  frozenFilter->SetFreezeIterations( 3 );
+  frozenFilter->AddObserver( itk::IterationEvent(), frozenRecorder );
+  frozenFilter->Update();
+
+  std::cout << frozenFilter->GetElapsedIterations() << " iterations, "
+            << frozenFilter->GetNumberOfMaskBlocks() << " blocks" << std::endl;
+  if( frozenFilter->GetNumberOfMaskBlocks() != 16
+      || frozenFilter->GetNumberOfActiveMaskBlocks() != 16 )
+    {
+    std::cout << "Test failed - freezing does not use blocks of the whole image." << std::endl;
+    return EXIT_FAILURE;
+    }
+  if( frozenFilter->GetElapsedIterations() != 3 || !frozenFilter->GetStopRegistrationFlag()
+      || frozenRecorder->m_Fractions != std::vector< double >( 3, 1.0 ) )
+    {
+    std::cout << "Test failed - registration not stopped after all blocks froze." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test live face neighbors" << std::endl;
+
+  // The discs differ in the first block of the 4x4 block grid only, and
+  // without regularization the forces and the field change are zero
+  // elsewhere. The first block moves in the first iteration, so after
+  // three iterations it is still live. Its two face neighbors stay live as
+  // well, while the diagonal neighbor and all other blocks freeze, i.e.
+  // 3 of 16 blocks are processed in the fourth iteration.
+  FractionRecorder::Pointer discRecorder = FractionRecorder::New();
+  RegistrationFilterType::Pointer discFilter = CreateRegistration( NULL, false );
+  discFilter->SetFixedImage( CreateDiscImage( 4.0 ) );
+  discFilter->SetMovingImage( CreateDiscImage( 5.0 ) );
+  discFilter->SmoothDisplacementFieldOff();
+  discFilter->SetNumberOfIterations( 4 );
+  discFilter->FreezeConvergedBlocksOn();
+  discFilter->SetFreezeThreshold( 1e-6 );
+  discFilter->SetFreezeIterations( 3 );
+  discFilter->AddObserver( itk::IterationEvent(), discRecorder );
+  discFilter->Update();
+
+  for( unsigned int i = 0; i < discRecorder->m_Fractions.size(); i++ )
+    {
+    std::cout << "Iteration " << i << ": active fraction " << discRecorder->m_Fractions[i] << std::endl;
+    }
+  const double expectedFractions[4] = { 1.0, 1.0, 1.0, 0.1875 };
+  if( discRecorder->m_Fractions != std::vector< double >( expectedFractions, expectedFractions + 4 )
+      || discFilter->GetStopRegistrationFlag() )
+    {
+    std::cout << "Test failed - wrong live blocks." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // -----------------------------------------------------------
+  std::cout << "Test printing informations." << std::endl;
+  RegistrationFilterType::Pointer regFilter = CreateRegistration( mask, false );
+  regFilter->UseMaskBlocksOn();
+  regFilter->Print( std::cout );
+
+  std::cout << "Test passed" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,334 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#include "itkVariationalRegistrationMultigridRegularizer.h"
+#include "itkVariationalRegistrationDiffusionRegularizer.h"
+#include "itkVariationalRegistrationElasticRegularizer.h"
+
+#include "itkImageRegionIteratorWithIndex.h"
+#include "vnl/vnl_math.h"
+
+#include <cmath>
+
+namespace{
+typedef itk::Vector<float,2>            VectorType;
+typedef itk::Image<VectorType,2>        FieldType;
+
+typedef itk::VariationalRegistrationMultigridRegularizer<FieldType> MultigridRegularizerType;
+typedef itk::VariationalRegistrationDiffusionRegularizer<FieldType> DiffusionRegularizerType;
+typedef itk::VariationalRegistrationElasticRegularizer<FieldType>   ElasticRegularizerType;
+
+// Create a field of 33x24 pixels, an odd size to test the coarsening. If
+// noise is set, uniform noise is added to the smooth field.
+FieldType::Pointer
+CreateField( bool noise )
+{
+  FieldType::SizeType size;
+  size[0] = 33;
+  size[1] = 24;
+  FieldType::RegionType region;
+  region.SetSize( size );
+
+  FieldType::Pointer field = FieldType::New();
+  field->SetRegions( region );
+  field->Allocate();
+
+  // Linear congruential generator for reproducible noise.
+  unsigned long seed = 1234;
+
+  itk::ImageRegionIteratorWithIndex<FieldType> it( field, region );
+  for( ; !it.IsAtEnd(); ++it )
+    {
+    const double x = it.GetIndex()[0];
+    const double y = it.GetIndex()[1];
+    VectorType value;
+    value[0] = 2.0 * std::exp( -( vnl_math_sqr( x - 16.0 ) + vnl_math_sqr( y - 12.0 ) ) / 50.0 );
+    value[1] = std::exp( -( vnl_math_sqr( x - 12.0 ) + vnl_math_sqr( y - 15.0 ) ) / 30.0 );
+    if( noise )
+      {
+      for( unsigned int c = 0; c < 2; c++ )
+        {
+        seed = ( 1103515245UL * seed + 12345UL ) % 2147483648UL;
+        value[c] += seed / 2147483648.0 - 0.5;
+        }
+      }
+    it.Set( value );
+    }
+  return field;
+}
+
+// RMS of the difference of two fields.
+double
+ComputeDifferenceNorm( const FieldType * field1, const FieldType * field2 )
+{
+  double sumOfSquares = 0.0;
+  itk::ImageRegionConstIteratorWithIndex<FieldType> it( field1, field1->GetBufferedRegion() );
+  for( ; !it.IsAtEnd(); ++it )
+    {
+    sumOfSquares += ( it.Get() - field2->GetPixel( it.GetIndex() ) ).GetSquaredNorm();
+    }
+  return std::sqrt( sumOfSquares / ( 2 * field1->GetBufferedRegion().GetNumberOfPixels() ) );
+}
+
+// Check that each of the first two V-cycles reduces the error by at least
+// a factor of 10. The solution is approximated with 20 cycles, which reach
+// the precision of float.
+bool
+TestConvergence( MultigridRegularizerType * regularizer )
+{
+  FieldType::Pointer field = CreateField( true );
+  regularizer->SetInput( field );
+  regularizer->SetNumberOfCycles( 20 );
+  regularizer->Update();
+
+  FieldType::Pointer solution = FieldType::New();
+  solution->SetRegions( field->GetBufferedRegion() );
+  solution->Allocate();
+  itk::ImageRegionConstIteratorWithIndex<FieldType> it( regularizer->GetOutput(),
+      field->GetBufferedRegion() );
+  for( ; !it.IsAtEnd(); ++it )
+    {
+    solution->SetPixel( it.GetIndex(), it.Get() );
+    }
+
+  // The input is the initial solution.
+  double lastError = ComputeDifferenceNorm( field, solution );
+  std::cout << "Initial error: " << lastError << std::endl;
+
+  for( unsigned int cycles = 1; cycles <= 2; cycles++ )
+    {
+    regularizer->SetNumberOfCycles( cycles );
+    regularizer->Update();
+
+    const double error = ComputeDifferenceNorm( regularizer->GetOutput(), solution );
+    std::cout << "Error after " << cycles << " cycle(s): " << error << std::endl;
+    if( error > 0.1 * lastError )
+      {
+      return false;
+      }
+    lastError = error;
+    }
+  return true;
+}
+
+// Create a field of the given size, which is one at the given pixel for
+// component c and zero elsewhere.
+FieldType::Pointer
+CreateImpulse( const FieldType::SizeType & size, long x, long y, unsigned int c )
+{
+  FieldType::RegionType region;
+  region.SetSize( size );
+
+  FieldType::Pointer field = FieldType::New();
+  field->SetRegions( region );
+  field->Allocate();
+  field->FillBuffer( VectorType( 0.0f ) );
+
+  FieldType::IndexType index;
+  index[0] = x;
+  index[1] = y;
+  VectorType value( 0.0f );
+  value[c] = 1.0f;
+  field->SetPixel( index, value );
+  return field;
+}
+
+// Solve the system for an impulse and get the component d of the solution
+// at the given pixel, i.e. an entry of the inverse system matrix.
+double
+GetInverseEntry( MultigridRegularizerType * regularizer, const FieldType::SizeType & size,
+    long x1, long y1, unsigned int c, long x2, long y2, unsigned int d )
+{
+  regularizer->SetInput( CreateImpulse( size, x1, y1, c ) );
+  regularizer->Update();
+
+  FieldType::IndexType index;
+  index[0] = x2;
+  index[1] = y2;
+  return regularizer->GetOutput()->GetPixel( index )[d];
+}
+}
+
+int VariationalRegistrationMultigridRegularizerTest(int, char* [] )
+{
+  //--------------------------------------------------------
+  std::cout << "Test convergence of the diffusive operator" << std::endl;
+
+  MultigridRegularizerType::Pointer regularizer = MultigridRegularizerType::New();
+  regularizer->InPlaceOff();
+  regularizer->SetOperatorToDiffusion();
+  regularizer->SetAlpha( 1.0 );
+
+  if( !TestConvergence( regularizer ) )
+    {
+    std::cout << "Test failed - error of the diffusive operator did not drop." << std::endl;
+    return EXIT_FAILURE;
+    }
+  std::cout << "Number of levels: " << regularizer->GetNumberOfLevels() << std::endl;
+
+  //--------------------------------------------------------
+  std::cout << "Test convergence of the elastic operator" << std::endl;
+
+  regularizer->SetOperatorToElastic();
+  regularizer->SetMu( 0.5 );
+  regularizer->SetLambda( 1.0 );
+
+  if( !TestConvergence( regularizer ) )
+    {
+    std::cout << "Test failed - error of the elastic operator did not drop." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test symmetry of the elastic operator" << std::endl;
+
+  // The system matrix is symmetric, so its inverse is symmetric as well.
+  // The mixed derivatives couple the components of diagonal neighbors,
+  // which is checked at the corners and edges of the field.
+  FieldType::SizeType impulseSize;
+  impulseSize[0] = 9;
+  impulseSize[1] = 8;
+  regularizer->SetNumberOfCycles( 20 );
+
+  const long pairs[4][4] = { { 0, 1, 1, 0 }, { 0, 0, 1, 1 }, { 8, 3, 7, 4 }, { 8, 7, 7, 6 } };
+  for( unsigned int i = 0; i < 4; i++ )
+    {
+    const double entry = GetInverseEntry( regularizer, impulseSize,
+        pairs[i][0], pairs[i][1], 0, pairs[i][2], pairs[i][3], 1 );
+    const double transposedEntry = GetInverseEntry( regularizer, impulseSize,
+        pairs[i][2], pairs[i][3], 1, pairs[i][0], pairs[i][1], 0 );
+    std::cout << "Entry (" << pairs[i][0] << ", " << pairs[i][1] << ") - (" << pairs[i][2]
+              << ", " << pairs[i][3] << "): " << entry << ", transposed: " << transposedEntry << std::endl;
+    if( vnl_math_abs( entry ) < 1e-4 || vnl_math_abs( entry - transposedEntry ) > 1e-6 )
+      {
+      std::cout << "Test failed - inverse of the elastic operator is not symmetric." << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+#if defined( ITK_USE_FFTWD ) || defined( ITK_USE_FFTWF )
+  //--------------------------------------------------------
+  std::cout << "Compare with ElasticRegularizer" << std::endl;
+
+  // ElasticRegularizer uses the same stencil in the interior, but with
+  // periodic boundary conditions. For a field which decays to zero long
+  // before the boundary, the results agree in the interior up to the
+  // precision of float.
+  FieldType::SizeType elasticSize;
+  elasticSize.Fill( 64 );
+  FieldType::RegionType elasticRegion;
+  elasticRegion.SetSize( elasticSize );
+
+  FieldType::Pointer elasticField = FieldType::New();
+  elasticField->SetRegions( elasticRegion );
+  elasticField->Allocate();
+  itk::ImageRegionIteratorWithIndex<FieldType> elasticIt( elasticField, elasticRegion );
+  for( ; !elasticIt.IsAtEnd(); ++elasticIt )
+    {
+    const double x = elasticIt.GetIndex()[0];
+    const double y = elasticIt.GetIndex()[1];
+    VectorType value;
+    value[0] = 2.0 * std::exp( -( vnl_math_sqr( x - 33.0 ) + vnl_math_sqr( y - 30.0 ) ) / 32.0 );
+    value[1] = std::exp( -( vnl_math_sqr( x - 30.0 ) + vnl_math_sqr( y - 34.0 ) ) / 24.0 );
+    elasticIt.Set( value );
+    }
+
+  regularizer->SetInput( elasticField );
+  regularizer->Update();
+
+  ElasticRegularizerType::Pointer elasticRegularizer = ElasticRegularizerType::New();
+  elasticRegularizer->InPlaceOff();
+  elasticRegularizer->SetMu( 0.5 );
+  elasticRegularizer->SetLambda( 1.0 );
+  elasticRegularizer->SetInput( elasticField );
+  elasticRegularizer->Update();
+
+  double maxElasticDiff = 0.0;
+  double maxElasticChange = 0.0;
+  for( elasticIt.GoToBegin(); !elasticIt.IsAtEnd(); ++elasticIt )
+    {
+    const FieldType::IndexType index = elasticIt.GetIndex();
+    if( index[0] < 16 || index[0] >= 48 || index[1] < 16 || index[1] >= 48 )
+      {
+      continue;
+      }
+    const VectorType value = regularizer->GetOutput()->GetPixel( index );
+    const VectorType diff = value - elasticRegularizer->GetOutput()->GetPixel( index );
+    const VectorType change = value - elasticIt.Get();
+    maxElasticDiff = vnl_math_max( maxElasticDiff, static_cast<double>( diff.GetNorm() ) );
+    maxElasticChange = vnl_math_max( maxElasticChange, static_cast<double>( change.GetNorm() ) );
+    }
+
+  std::cout << "Maximum difference: " << maxElasticDiff
+            << ", maximum change: " << maxElasticChange << std::endl;
+
+  if( maxElasticChange == 0.0 || maxElasticDiff > 1e-4 * maxElasticChange )
+    {
+    std::cout << "Test failed - result differs from ElasticRegularizer in the interior." << std::endl;
+    return EXIT_FAILURE;
+    }
+#endif
+
+  //--------------------------------------------------------
+  std::cout << "Compare with DiffusionRegularizer" << std::endl;
+
+  // DiffusionRegularizer solves the same system with additive operator
+  // splitting, whose splitting error grows with alpha. For a smooth field
+  // and alpha = 1, the results differ by less than 10% of the change by
+  // the regularization.
+  FieldType::Pointer field = CreateField( false );
+
+  regularizer->SetOperatorToDiffusion();
+  regularizer->SetNumberOfCycles( 4 );
+  regularizer->SetInput( field );
+  regularizer->Update();
+
+  DiffusionRegularizerType::Pointer diffusionRegularizer = DiffusionRegularizerType::New();
+  diffusionRegularizer->InPlaceOff();
+  diffusionRegularizer->SetAlpha( 1.0 );
+  diffusionRegularizer->SetInput( field );
+  diffusionRegularizer->Update();
+
+  double maxDiff = 0.0;
+  double maxChange = 0.0;
+  itk::ImageRegionConstIteratorWithIndex<FieldType> it( field, field->GetBufferedRegion() );
+  for( ; !it.IsAtEnd(); ++it )
+    {
+    const VectorType value = regularizer->GetOutput()->GetPixel( it.GetIndex() );
+    const VectorType diff = value - diffusionRegularizer->GetOutput()->GetPixel( it.GetIndex() );
+    const VectorType change = value - it.Get();
+    maxDiff = vnl_math_max( maxDiff, static_cast<double>( diff.GetNorm() ) );
+    maxChange = vnl_math_max( maxChange, static_cast<double>( change.GetNorm() ) );
+    }
+
+  std::cout << "Maximum difference: " << maxDiff
+            << ", maximum change: " << maxChange << std::endl;
+
+  if( maxChange == 0.0 || maxDiff > 0.1 * maxChange )
+    {
+    std::cout << "Test failed - result differs from DiffusionRegularizer." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // -----------------------------------------------------------
+  std::cout << "Test printing informations." << std::endl;
+  regularizer->Print( std::cout );
+
+  std::cout << "Test passed" << std::endl;
+  return EXIT_SUCCESS;
+}
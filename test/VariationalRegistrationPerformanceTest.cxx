@@ -0,0 +1,388 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+/*
+ *  End-to-end performance regression test. The test has two modes:
+ *
+ *    phantom <size> <fixed image> <moving image>
+ *      Generate a deterministic 3D phantom of size^3 voxels and a copy
+ *      deformed by a known smooth displacement field.
+ *
+ *    run <name> <baseline> <results> <time tol> <rss tol> <iteration tol>
+ *        <metric tol> <log file> <executable> [arguments...]
+ *      Run the registration executable with the given arguments, which must
+ *      write a CSV log (-L) to <log file>. The wall-clock time, peak resident
+ *      set size, number of iterations and final metric value are appended to
+ *      <results> and compared to the entry <name> of <baseline>. The
+ *      tolerances are relative; time and memory may only exceed the baseline
+ *      by the tolerance, iterations and metric may deviate in both
+ *      directions. Time and memory depend on the machine and are not
+ *      checked if their baseline field is "-"; iterations and metric are
+ *      not checked either if their field is "-", so that the entry only
+ *      requires a successful run. If the baseline has no entry
+ *      <name>, the test returns NotRunExitCode, which CTest reports as not
+ *      run, and the results line can be copied into the baseline.
+ */
+
+#include "itkImage.h"
+#include "itkImageFileWriter.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itkWarpImageFilter.h"
+#include "itkLinearInterpolateImageFunction.h"
+#include "itkRealTimeClock.h"
+
+#include "itksys/Process.h"
+#include "itksys/SystemTools.hxx"
+
+#include <vnl/vnl_math.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cmath>
+
+#if !defined( _WIN32 )
+#include <sys/resource.h>
+#endif
+
+namespace{
+
+// Exit code of tests without baseline entry, see SKIP_RETURN_CODE in
+// test/CMakeLists.txt.
+const int NotRunExitCode = 77;
+
+struct PerformanceResult
+{
+  double        time;
+  double        peakRSS;
+  double        iterations;
+  double        metric;
+};
+
+// Split a CSV line into fields.
+std::vector<std::string> SplitLine( const std::string & line )
+{
+  std::vector<std::string> fields;
+  std::istringstream stream( line );
+  std::string field;
+  while( std::getline( stream, field, ',' ) )
+    {
+    fields.push_back( field );
+    }
+  return fields;
+}
+
+// Generate a phantom with a sphere, an ellipsoid and a smooth texture and a
+// copy deformed by a sinusoidal displacement field.
+int GeneratePhantoms( unsigned int size, const char * fixedFilename, const char * movingFilename )
+{
+  const unsigned int Dimension = 3;
+  typedef itk::Image<short, Dimension>                       ImageType;
+  typedef itk::Image<itk::Vector<float, Dimension>, Dimension> FieldType;
+
+  ImageType::RegionType region;
+  ImageType::SizeType imageSize;
+  imageSize.Fill( size );
+  region.SetSize( imageSize );
+
+  ImageType::Pointer fixed = ImageType::New();
+  fixed->SetRegions( region );
+  fixed->Allocate();
+
+  FieldType::Pointer field = FieldType::New();
+  field->SetRegions( region );
+  field->Allocate();
+
+  const double center = 0.5 * size;
+  const double radius = 0.3 * size;
+  const double amplitude = 0.03 * size;
+
+  typedef itk::ImageRegionIteratorWithIndex<ImageType> IteratorType;
+  typedef itk::ImageRegionIteratorWithIndex<FieldType> FieldIteratorType;
+  FieldIteratorType fieldIt( field, region );
+  for( IteratorType it( fixed, region ); !it.IsAtEnd(); ++it, ++fieldIt )
+    {
+    const ImageType::IndexType index = it.GetIndex();
+
+    double sphere = 0.0;
+    double ellipsoid = 0.0;
+    double texture = 1.0;
+    FieldType::PixelType displacement;
+    for( unsigned int j = 0; j < Dimension; j++ )
+      {
+      const double x = ( index[j] - center ) / radius;
+      sphere += x * x;
+      ellipsoid += vnl_math_sqr( ( index[j] - center - 0.1 * size ) / ( 0.1 * size * ( j + 1 ) ) );
+      texture *= std::cos( 8.0 * vnl_math::pi * index[j] / size );
+      displacement[j] = amplitude * std::sin( 2.0 * vnl_math::pi * index[( j + 1 ) % Dimension] / size );
+      }
+
+    double value = 50.0 + 10.0 * texture;
+    if( sphere <= 1.0 )
+      {
+      value += 100.0;
+      }
+    if( ellipsoid <= 1.0 )
+      {
+      value += 80.0;
+      }
+    it.Set( static_cast<short>( value ) );
+    fieldIt.Set( displacement );
+    }
+
+  typedef itk::WarpImageFilter<ImageType, ImageType, FieldType> WarperType;
+  WarperType::Pointer warper = WarperType::New();
+  warper->SetInput( fixed );
+  warper->SetDisplacementField( field );
+  warper->SetOutputParametersFromImage( fixed );
+  warper->SetInterpolator( itk::LinearInterpolateImageFunction<ImageType, double>::New() );
+  warper->SetEdgePaddingValue( 50 );
+
+  typedef itk::ImageFileWriter<ImageType> WriterType;
+  WriterType::Pointer writer = WriterType::New();
+  try
+    {
+    writer->SetInput( fixed );
+    writer->SetFileName( fixedFilename );
+    writer->Update();
+
+    writer->SetInput( warper->GetOutput() );
+    writer->SetFileName( movingFilename );
+    writer->Update();
+    }
+  catch( itk::ExceptionObject & error )
+    {
+    std::cerr << "Could not write phantoms: " << error << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  return EXIT_SUCCESS;
+}
+
+// Read the number of iterations and the final metric from a CSV log of the
+// structured logger.
+bool ReadLog( const char * filename, PerformanceResult & result )
+{
+  std::ifstream file( filename );
+  std::string line;
+  if( !std::getline( file, line ) )
+    {
+    return false;
+    }
+
+  const std::vector<std::string> header = SplitLine( line );
+  unsigned int eventColumn = header.size();
+  unsigned int metricColumn = header.size();
+  for( unsigned int i = 0; i < header.size(); i++ )
+    {
+    if( header[i] == "event" )
+      {
+      eventColumn = i;
+      }
+    else if( header[i] == "metric" )
+      {
+      metricColumn = i;
+      }
+    }
+  if( eventColumn == header.size() || metricColumn == header.size() )
+    {
+    return false;
+    }
+
+  result.iterations = 0;
+  result.metric = 0.0;
+  while( std::getline( file, line ) )
+    {
+    const std::vector<std::string> fields = SplitLine( line );
+    if( fields.size() == header.size() && fields[eventColumn] == "iteration" )
+      {
+      result.iterations++;
+      result.metric = atof( fields[metricColumn].c_str() );
+      }
+    }
+  return result.iterations > 0;
+}
+
+// Read an optional baseline value; "-" or an empty field is returned as
+// -1, i.e. not checked.
+double ReadOptionalValue( const std::string & field )
+{
+  if( field.empty() || field == "-" )
+    {
+    return -1.0;
+    }
+  return atof( field.c_str() );
+}
+
+// Find the entry of a test in the baseline. Lines starting with '#' are
+// comments.
+bool ReadBaseline( const char * filename, const std::string & name, PerformanceResult & result )
+{
+  std::ifstream file( filename );
+  std::string line;
+  while( std::getline( file, line ) )
+    {
+    const std::vector<std::string> fields = SplitLine( line );
+    if( line.empty() || line[0] == '#' || fields.size() < 5 || fields[0] != name )
+      {
+      continue;
+      }
+    result.time = ReadOptionalValue( fields[1] );
+    result.peakRSS = ReadOptionalValue( fields[2] );
+    result.iterations = ReadOptionalValue( fields[3] );
+    result.metric = ReadOptionalValue( fields[4] );
+    return true;
+    }
+  return false;
+}
+
+// Compare a value to the baseline. If onlyUpper is set, values below the
+// baseline always pass.
+bool CheckValue( const char * label, double value, double baseline, double tolerance, bool onlyUpper )
+{
+  const double deviation = value - baseline;
+  const double allowed = tolerance * vnl_math_abs( baseline );
+  const bool passed = onlyUpper ? deviation <= allowed : vnl_math_abs( deviation ) <= allowed;
+
+  std::cout << "  " << label << ": " << value << " (baseline " << baseline
+      << ", tolerance " << 100.0 * tolerance << "%) " << ( passed ? "ok" : "FAILED" ) << std::endl;
+  return passed;
+}
+
+int RunRegistration( int argc, char * argv[] )
+{
+  const std::string name = argv[2];
+  const char * baselineFilename = argv[3];
+  const char * resultsFilename = argv[4];
+  const double timeTolerance = atof( argv[5] );
+  const double rssTolerance = atof( argv[6] );
+  const double iterationTolerance = atof( argv[7] );
+  const double metricTolerance = atof( argv[8] );
+  const char * logFilename = argv[9];
+
+  itksys::SystemTools::RemoveFile( logFilename );
+
+  std::vector<const char *> command;
+  for( int i = 10; i < argc; i++ )
+    {
+    command.push_back( argv[i] );
+    }
+  command.push_back( NULL );
+
+  itk::RealTimeClock::Pointer clock = itk::RealTimeClock::New();
+  const itk::RealTimeClock::TimeStampType start = clock->GetTimeInSeconds();
+
+  itksysProcess * process = itksysProcess_New();
+  itksysProcess_SetCommand( process, &command[0] );
+  itksysProcess_SetPipeShared( process, itksysProcess_Pipe_STDOUT, 1 );
+  itksysProcess_SetPipeShared( process, itksysProcess_Pipe_STDERR, 1 );
+  itksysProcess_Execute( process );
+  itksysProcess_WaitForExit( process, NULL );
+
+  PerformanceResult result;
+  result.time = clock->GetTimeInSeconds() - start;
+
+  const int state = itksysProcess_GetState( process );
+  const int exitValue = itksysProcess_GetExitValue( process );
+  itksysProcess_Delete( process );
+
+  if( state != itksysProcess_State_Exited || exitValue != EXIT_SUCCESS )
+    {
+    std::cerr << "Registration of " << name << " failed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // The registration is the only child of this process, so the maximum
+  // resident set size of the children is its peak memory.
+  result.peakRSS = 0.0;
+#if !defined( _WIN32 )
+  struct rusage usage;
+  if( getrusage( RUSAGE_CHILDREN, &usage ) == 0 )
+    {
+#if defined( __APPLE__ )
+    result.peakRSS = usage.ru_maxrss / 1024.0;
+#else
+    result.peakRSS = usage.ru_maxrss;
+#endif
+    }
+#endif
+
+  if( !ReadLog( logFilename, result ) )
+    {
+    std::cerr << "Could not read the registration log " << logFilename << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  std::ofstream results( resultsFilename, std::ios::out | std::ios::app );
+  results.precision( 10 );
+  results << name << "," << result.time << "," << result.peakRSS << ","
+      << result.iterations << "," << result.metric << std::endl;
+
+  std::cout << name << std::endl;
+
+  PerformanceResult baseline;
+  if( !ReadBaseline( baselineFilename, name, baseline ) )
+    {
+    std::cout << "  No baseline entry, results written to " << resultsFilename << std::endl;
+    std::cout << "  time: " << result.time << " s, peak RSS: " << result.peakRSS
+        << " kB, iterations: " << result.iterations << ", metric: " << result.metric << std::endl;
+    std::cout << "  Not run: nothing to compare with." << std::endl;
+    return NotRunExitCode;
+    }
+
+  bool passed = true;
+  if( baseline.time >= 0.0 )
+    {
+    passed &= CheckValue( "time [s]", result.time, baseline.time, timeTolerance, true );
+    }
+  if( result.peakRSS > 0.0 && baseline.peakRSS >= 0.0 )
+    {
+    passed &= CheckValue( "peak RSS [kB]", result.peakRSS, baseline.peakRSS, rssTolerance, true );
+    }
+  if( baseline.iterations >= 0.0 )
+    {
+    passed &= CheckValue( "iterations", result.iterations, baseline.iterations, iterationTolerance, false );
+    }
+  if( baseline.metric >= 0.0 )
+    {
+    passed &= CheckValue( "metric", result.metric, baseline.metric, metricTolerance, false );
+    }
+
+  return passed ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+}
+
+int VariationalRegistrationPerformanceTest( int argc, char * argv[] )
+{
+  if( argc >= 5 && std::string( argv[1] ) == "phantom" )
+    {
+    return GeneratePhantoms( atoi( argv[2] ), argv[3], argv[4] );
+    }
+  if( argc >= 11 && std::string( argv[1] ) == "run" )
+    {
+    return RunRegistration( argc, argv );
+    }
+
+  std::cerr << "Usage: " << argv[0] << " phantom <size> <fixed image> <moving image>" << std::endl;
+  std::cerr << "       " << argv[0] << " run <name> <baseline> <results> <time tol> <rss tol>"
+      << " <iteration tol> <metric tol> <log file> <executable> [arguments...]" << std::endl;
+  return EXIT_FAILURE;
+}
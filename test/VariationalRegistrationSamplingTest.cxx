@@ -0,0 +1,451 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#include "itkVariationalRegistrationFilter.h"
+#include "itkVariationalRegistrationDemonsFunction.h"
+#include "itkVariationalRegistrationNCCFunction.h"
+#include "itkVariationalRegistrationDiffusionRegularizer.h"
+
+#include "itkCommand.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "vnl/vnl_math.h"
+
+#include <cmath>
+#include <vector>
+
+namespace{
+typedef unsigned char                          PixelType;
+typedef itk::Image<PixelType,2>                ImageType;
+typedef itk::Vector<float,2>                   VectorType;
+typedef itk::Image<VectorType,2>               FieldType;
+
+typedef itk::VariationalRegistrationDemonsFunction<
+    ImageType, ImageType, FieldType>                           FunctionType;
+typedef itk::VariationalRegistrationNCCFunction<
+    ImageType, ImageType, FieldType>                           NCCFunctionType;
+typedef itk::VariationalRegistrationDiffusionRegularizer<FieldType> RegularizerType;
+typedef itk::VariationalRegistrationFilter<
+    ImageType, ImageType, FieldType>                           RegistrationFilterType;
+
+// Demons function which exposes the force sampling.
+class SamplingTestFunction : public FunctionType
+{
+public:
+  typedef SamplingTestFunction          Self;
+  typedef FunctionType                  Superclass;
+  typedef itk::SmartPointer< Self >     Pointer;
+
+  itkNewMacro(Self);
+
+  bool IsSampled( const ImageType::IndexType & index ) const
+    { return this->IsForceSampled( index ); }
+
+protected:
+  SamplingTestFunction() {}
+};
+
+// Records metric, RMS change and metric flag of each iteration and
+// switches the metric off after the given iteration.
+class MetricRecorder : public itk::Command
+{
+public:
+  typedef MetricRecorder                Self;
+  typedef itk::Command                  Superclass;
+  typedef itk::SmartPointer< Self >     Pointer;
+
+  itkNewMacro(Self);
+
+  void Execute( itk::Object * caller, const itk::EventObject & )
+    {
+    RegistrationFilterType * filter = dynamic_cast< RegistrationFilterType * >( caller );
+    if( !filter )
+      {
+      return;
+      }
+    m_Metrics.push_back( filter->GetMetric() );
+    m_RMSChanges.push_back( filter->GetRMSChange() );
+    m_MetricUpdated.push_back( filter->GetMetricUpdated() );
+    if( filter->GetElapsedIterations() == m_LastMetricIteration )
+      {
+      filter->ComputeMetricOff();
+      }
+    }
+
+  void Execute( const itk::Object * caller, const itk::EventObject & event )
+    { this->Execute( const_cast< itk::Object * >( caller ), event ); }
+
+  std::vector< double > m_Metrics;
+  std::vector< double > m_RMSChanges;
+  std::vector< bool >   m_MetricUpdated;
+  itk::SizeValueType    m_LastMetricIteration;
+
+protected:
+  MetricRecorder()
+    { m_LastMetricIteration = 0; }
+};
+
+// Create an image of 64x64 pixels with a Gaussian blob, so that the
+// intensity difference of two blobs is spread over the image.
+ImageType::Pointer
+CreateImage( double sigma )
+{
+  ImageType::SizeType size;
+  size.Fill( 64 );
+  ImageType::RegionType region;
+  region.SetSize( size );
+
+  ImageType::Pointer image = ImageType::New();
+  image->SetRegions( region );
+  image->Allocate();
+
+  itk::ImageRegionIteratorWithIndex<ImageType> it( image, region );
+  for( ; !it.IsAtEnd(); ++it )
+    {
+    const ImageType::IndexType index = it.GetIndex();
+    const double distance = vnl_math_sqr( index[0] - 32.0 ) + vnl_math_sqr( index[1] - 32.0 );
+    it.Set( static_cast< PixelType >( 100.0 + 100.0 * std::exp( -distance / ( 2.0 * sigma * sigma ) ) ) );
+    }
+  return image;
+}
+
+// Create a registration of the blobs with 10 iterations.
+RegistrationFilterType::Pointer
+CreateRegistration( MetricRecorder * recorder )
+{
+  RegularizerType::Pointer regularizer = RegularizerType::New();
+  regularizer->SetAlpha( 0.5 );
+
+  RegistrationFilterType::Pointer regFilter = RegistrationFilterType::New();
+  regFilter->SetDifferenceFunction( FunctionType::New() );
+  regFilter->SetRegularizer( regularizer );
+  regFilter->SetFixedImage( CreateImage( 10.0 ) );
+  regFilter->SetMovingImage( CreateImage( 12.0 ) );
+  regFilter->SetNumberOfIterations( 10 );
+  regFilter->AddObserver( itk::IterationEvent(), recorder );
+  return regFilter;
+}
+
+// Returns true if the values are equal up to the rounding errors of the
+// reduction, whose order depends on the thread scheduling.
+bool
+IsClose( double value1, double value2 )
+{
+  return vnl_math_abs( value1 - value2 ) <= 1e-10 * vnl_math_max( vnl_math_abs( value1 ), 1.0 );
+}
+
+// Returns true if both sequences of values are close.
+bool
+AreClose( const std::vector< double > & values1, const std::vector< double > & values2 )
+{
+  if( values1.size() != values2.size() )
+    {
+    return false;
+    }
+  for( unsigned int i = 0; i < values1.size(); i++ )
+    {
+    if( !IsClose( values1[i], values2[i] ) )
+      {
+      return false;
+      }
+    }
+  return true;
+}
+
+// Count the sampled pixels of a region of 256x256 pixels.
+itk::SizeValueType
+CountSampledPixels( const SamplingTestFunction * function, std::vector< bool > & sampled )
+{
+  sampled.assign( 256 * 256, false );
+  itk::SizeValueType count = 0;
+  ImageType::IndexType index;
+  for( index[1] = 0; index[1] < 256; index[1]++ )
+    {
+    for( index[0] = 0; index[0] < 256; index[0]++ )
+      {
+      if( function->IsSampled( index ) )
+        {
+        sampled[index[0] + 256 * index[1]] = true;
+        count++;
+        }
+      }
+    }
+  return count;
+}
+
+// Returns true if both fields are identical.
+bool
+CompareFields( const FieldType * field1, const FieldType * field2 )
+{
+  const itk::SizeValueType numberOfPixels = field1->GetBufferedRegion().GetNumberOfPixels();
+  if( field2->GetBufferedRegion().GetNumberOfPixels() != numberOfPixels )
+    {
+    return false;
+    }
+  for( itk::SizeValueType i = 0; i < numberOfPixels; i++ )
+    {
+    if( field1->GetBufferPointer()[i] != field2->GetBufferPointer()[i] )
+      {
+      return false;
+      }
+    }
+  return true;
+}
+}
+
+int VariationalRegistrationSamplingTest(int, char* [] )
+{
+  //--------------------------------------------------------
+  std::cout << "Test metric sampling stride" << std::endl;
+
+  MetricRecorder::Pointer denseRecorder = MetricRecorder::New();
+  RegistrationFilterType::Pointer denseFilter = CreateRegistration( denseRecorder );
+  denseFilter->Update();
+
+  // A stride of 1 uses every pixel, exactly like the default.
+  MetricRecorder::Pointer strideOneRecorder = MetricRecorder::New();
+  RegistrationFilterType::Pointer strideOneFilter = CreateRegistration( strideOneRecorder );
+  strideOneFilter->SetMetricSamplingStride( 1 );
+  strideOneFilter->Update();
+
+  // A larger stride estimates the metric from a subsample, but does not
+  // change the forces.
+  MetricRecorder::Pointer strideRecorder = MetricRecorder::New();
+  RegistrationFilterType::Pointer strideFilter = CreateRegistration( strideRecorder );
+  strideFilter->SetMetricSamplingStride( 7 );
+  strideFilter->Update();
+
+  for( unsigned int i = 0; i < denseRecorder->m_Metrics.size(); i++ )
+    {
+    std::cout << "Iteration " << i << ": metric " << denseRecorder->m_Metrics[i]
+              << " (stride 7: " << strideRecorder->m_Metrics[i]
+              << "), RMS change " << denseRecorder->m_RMSChanges[i]
+              << " (stride 7: " << strideRecorder->m_RMSChanges[i] << ")" << std::endl;
+    }
+
+  if( !AreClose( strideOneRecorder->m_Metrics, denseRecorder->m_Metrics )
+      || !AreClose( strideOneRecorder->m_RMSChanges, denseRecorder->m_RMSChanges )
+      || !CompareFields( strideOneFilter->GetOutput(), denseFilter->GetOutput() ) )
+    {
+    std::cout << "Test failed - stride 1 differs from dense metric computation." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // The intensity difference of the first iteration is smooth, so every
+  // seventh pixel estimates its mean within a few percent.
+  if( vnl_math_abs( strideRecorder->m_Metrics[0] - denseRecorder->m_Metrics[0] )
+        > 0.05 * denseRecorder->m_Metrics[0]
+      || !CompareFields( strideFilter->GetOutput(), denseFilter->GetOutput() ) )
+    {
+    std::cout << "Test failed - metric of stride 7 not within 5% or field changed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test metric switched off" << std::endl;
+
+  // The metric is computed in the first three iterations only; afterwards
+  // metric and RMS change keep the values of iteration 3, while the field
+  // evolves as in the dense run.
+  MetricRecorder::Pointer staleRecorder = MetricRecorder::New();
+  staleRecorder->m_LastMetricIteration = 3;
+  RegistrationFilterType::Pointer staleFilter = CreateRegistration( staleRecorder );
+  staleFilter->Update();
+
+  if( staleRecorder->m_Metrics.size() != 10 )
+    {
+    std::cout << "Test failed - " << staleRecorder->m_Metrics.size() << " instead of 10 iterations." << std::endl;
+    return EXIT_FAILURE;
+    }
+  for( unsigned int i = 0; i < staleRecorder->m_Metrics.size(); i++ )
+    {
+    const bool updated = ( i < 3 );
+    const unsigned int expected = updated ? i : 2;
+    if( staleRecorder->m_MetricUpdated[i] != updated
+        || !IsClose( staleRecorder->m_Metrics[i], denseRecorder->m_Metrics[expected] )
+        || !IsClose( staleRecorder->m_RMSChanges[i], denseRecorder->m_RMSChanges[expected] ) )
+      {
+      std::cout << "Test failed - wrong metric in iteration " << i << "." << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+  if( !CompareFields( staleFilter->GetOutput(), denseFilter->GetOutput() ) )
+    {
+    std::cout << "Test failed - field changed without metric." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // The metric is switched on again at the start of the next update.
+  staleFilter->Modified();
+  staleFilter->Update();
+  if( staleRecorder->m_MetricUpdated.size() != 20 || !staleRecorder->m_MetricUpdated[10]
+      || !IsClose( staleRecorder->m_Metrics[10], denseRecorder->m_Metrics[0] ) )
+    {
+    std::cout << "Test failed - metric not computed in the next update." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test force sampling fraction" << std::endl;
+
+  // The standard deviation of the achieved fraction is at most 0.002 for
+  // 65536 pixels, so it has to be within 0.01 of the requested fraction.
+  SamplingTestFunction::Pointer samplingFunction = SamplingTestFunction::New();
+  const double fractions[3] = { 0.1, 0.25, 0.5 };
+  std::vector< bool > sampled;
+  std::vector< bool > sampledAgain;
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    samplingFunction->SetForceSamplingFraction( fractions[i] );
+    samplingFunction->SetForceSamplingSeed( 17 );
+    const double fraction = CountSampledPixels( samplingFunction, sampled ) / 65536.0;
+    std::cout << "Fraction " << fractions[i] << ": " << fraction << " achieved" << std::endl;
+    if( vnl_math_abs( fraction - fractions[i] ) > 0.01 )
+      {
+      std::cout << "Test failed - achieved fraction " << fraction << " instead of "
+                << fractions[i] << "." << std::endl;
+      return EXIT_FAILURE;
+      }
+
+    // Identical seeds select identical pixels, other seeds other pixels.
+    CountSampledPixels( samplingFunction, sampledAgain );
+    if( sampledAgain != sampled )
+      {
+      std::cout << "Test failed - sampling not deterministic for a fixed seed." << std::endl;
+      return EXIT_FAILURE;
+      }
+    samplingFunction->SetForceSamplingSeed( 18 );
+    CountSampledPixels( samplingFunction, sampledAgain );
+    if( sampledAgain == sampled )
+      {
+      std::cout << "Test failed - sampling does not depend on the seed." << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  // A fraction of 1 samples all pixels.
+  samplingFunction->SetForceSamplingFraction( 1.0 );
+  if( CountSampledPixels( samplingFunction, sampled ) != 65536 )
+    {
+    std::cout << "Test failed - dense forces not computed at all pixels." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test sampled forces in the filter" << std::endl;
+
+  // Without regularization, a single iteration adds the forces of the
+  // sampled pixels to the zero field. They have to equal the dense forces,
+  // i.e. they are not weighted, and all other pixels have to be zero.
+  MetricRecorder::Pointer unusedRecorder = MetricRecorder::New();
+  RegistrationFilterType::Pointer denseStepFilter = CreateRegistration( unusedRecorder );
+  denseStepFilter->SetNumberOfIterations( 1 );
+  denseStepFilter->SmoothDisplacementFieldOff();
+  denseStepFilter->Update();
+
+  RegistrationFilterType::Pointer sampledFilters[3];
+  const uint32_t seeds[3] = { 5, 5, 6 };
+  for( unsigned int i = 0; i < 3; i++ )
+    {
+    sampledFilters[i] = CreateRegistration( unusedRecorder );
+    sampledFilters[i]->SetNumberOfIterations( 1 );
+    sampledFilters[i]->SmoothDisplacementFieldOff();
+    sampledFilters[i]->SetForceSamplingFraction( 0.25 );
+    sampledFilters[i]->SetForceSamplingSeed( seeds[i] );
+    sampledFilters[i]->Update();
+    }
+
+  if( !CompareFields( sampledFilters[0]->GetOutput(), sampledFilters[1]->GetOutput() )
+      || CompareFields( sampledFilters[0]->GetOutput(), sampledFilters[2]->GetOutput() ) )
+    {
+    std::cout << "Test failed - sampled field not determined by the seed." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  const VectorType zero( 0.0f );
+  const VectorType * dense = denseStepFilter->GetOutput()->GetBufferPointer();
+  const VectorType * sparse = sampledFilters[0]->GetOutput()->GetBufferPointer();
+  itk::SizeValueType numberOfForces = 0;
+  itk::SizeValueType numberOfSampledForces = 0;
+  for( itk::SizeValueType i = 0; i < 64 * 64; i++ )
+    {
+    if( sparse[i] != zero && sparse[i] != dense[i] )
+      {
+      std::cout << "Test failed - sampled force " << sparse[i] << " instead of "
+                << dense[i] << "." << std::endl;
+      return EXIT_FAILURE;
+      }
+    if( dense[i] != zero )
+      {
+      numberOfForces++;
+      if( sparse[i] != zero )
+        {
+        numberOfSampledForces++;
+        }
+      }
+    }
+
+  const double forceFraction = static_cast< double >( numberOfSampledForces ) / numberOfForces;
+  std::cout << numberOfSampledForces << " of " << numberOfForces << " forces sampled" << std::endl;
+  if( numberOfForces < 1000 || vnl_math_abs( forceFraction - 0.25 ) > 0.05 )
+    {
+    std::cout << "Test failed - sampled " << forceFraction << " instead of 0.25 of the forces." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // The RMS change is computed from the unweighted forces of the sampled
+  // pixels and estimates the dense RMS change.
+  std::cout << "RMS change: " << sampledFilters[0]->GetRMSChange()
+            << " (dense: " << denseStepFilter->GetRMSChange() << ")" << std::endl;
+  if( vnl_math_abs( sampledFilters[0]->GetRMSChange() - denseStepFilter->GetRMSChange() )
+      > 0.15 * denseStepFilter->GetRMSChange() )
+    {
+    std::cout << "Test failed - RMS change of the sampled forces not within 15%." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test force sampling with NCC forces" << std::endl;
+
+  RegistrationFilterType::Pointer nccFilter = CreateRegistration( unusedRecorder );
+  nccFilter->SetDifferenceFunction( NCCFunctionType::New() );
+  nccFilter->SetForceSamplingFraction( 0.5 );
+  bool caught = false;
+  try
+    {
+    nccFilter->Update();
+    }
+  catch( itk::ExceptionObject & err )
+    {
+    std::cout << "Caught expected error." << std::endl;
+    std::cout << err << std::endl;
+    caught = true;
+    }
+  if( !caught )
+    {
+    std::cout << "Test failed - NCC forces accepted a force sampling fraction." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // -----------------------------------------------------------
+  std::cout << "Test printing informations." << std::endl;
+  strideFilter->Print( std::cout );
+  sampledFilters[0]->Print( std::cout );
+
+  std::cout << "Test passed" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,305 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#include "itkVariationalRegistrationFilter.h"
+#include "itkVariationalRegistrationMultiResolutionFilter.h"
+#include "itkVariationalRegistrationDemonsFunction.h"
+#include "itkVariationalRegistrationDiffusionRegularizer.h"
+#include "itkVariationalRegistrationStopCriterion.h"
+
+#include "itkCommand.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "itksys/SystemTools.hxx"
+#include "vnl/vnl_math.h"
+
+#include <vector>
+
+namespace{
+typedef unsigned char                          PixelType;
+typedef itk::Image<PixelType,2>                ImageType;
+typedef itk::Vector<float,2>                   VectorType;
+typedef itk::Image<VectorType,2>               FieldType;
+
+typedef itk::VariationalRegistrationDemonsFunction<
+    ImageType, ImageType, FieldType>                           FunctionType;
+typedef itk::VariationalRegistrationDiffusionRegularizer<FieldType> RegularizerType;
+typedef itk::VariationalRegistrationFilter<
+    ImageType, ImageType, FieldType>                           RegistrationFilterType;
+typedef itk::VariationalRegistrationMultiResolutionFilter<
+    ImageType, ImageType, FieldType>                           MRRegistrationFilterType;
+typedef itk::VariationalRegistrationStopCriterion<
+    RegistrationFilterType, MRRegistrationFilterType>          StopCriterionType;
+
+// Registration filter which returns a scripted metric per iteration.
+class TestRegistrationFilter : public RegistrationFilterType
+{
+public:
+  typedef TestRegistrationFilter        Self;
+  typedef RegistrationFilterType        Superclass;
+  typedef itk::SmartPointer< Self >     Pointer;
+
+  itkNewMacro(Self);
+
+  virtual double GetMetric() const ITK_OVERRIDE
+    {
+    if( this->GetElapsedIterations() < m_ScriptedMetrics.size() )
+      {
+      return m_ScriptedMetrics[this->GetElapsedIterations()];
+      }
+    return Superclass::GetMetric();
+    }
+
+  std::vector< double > m_ScriptedMetrics;
+
+protected:
+  TestRegistrationFilter() {}
+};
+
+// Records the number of iterations of each level and optionally delays
+// each iteration.
+class IterationRecorder : public itk::Command
+{
+public:
+  typedef IterationRecorder             Self;
+  typedef itk::Command                  Superclass;
+  typedef itk::SmartPointer< Self >     Pointer;
+
+  itkNewMacro(Self);
+
+  void Execute( itk::Object * caller, const itk::EventObject & )
+    {
+    const RegistrationFilterType * filter = dynamic_cast< RegistrationFilterType * >( caller );
+    if( !filter )
+      {
+      return;
+      }
+    if( filter->GetElapsedIterations() <= 1 )
+      {
+      m_LevelIterations.push_back( 0 );
+      }
+    m_LevelIterations.back() = filter->GetElapsedIterations();
+
+    if( m_Delay > 0.0 )
+      {
+      itksys::SystemTools::Delay( static_cast< unsigned int >( 1000.0 * m_Delay ) );
+      }
+    }
+
+  void Execute( const itk::Object * caller, const itk::EventObject & event )
+    { this->Execute( const_cast< itk::Object * >( caller ), event ); }
+
+  std::vector< itk::SizeValueType > m_LevelIterations;
+  double                            m_Delay;
+
+protected:
+  IterationRecorder()
+    { m_Delay = 0.0; }
+};
+
+// Create an image of 64x64 pixels with a circle.
+ImageType::Pointer
+CreateImage( double radius )
+{
+  ImageType::SizeType size;
+  size.Fill( 64 );
+  ImageType::RegionType region;
+  region.SetSize( size );
+
+  ImageType::Pointer image = ImageType::New();
+  image->SetRegions( region );
+  image->Allocate();
+
+  itk::ImageRegionIteratorWithIndex<ImageType> it( image, region );
+  for( ; !it.IsAtEnd(); ++it )
+    {
+    const ImageType::IndexType index = it.GetIndex();
+    const double distance = vnl_math_sqr( index[0] - 32.0 ) + vnl_math_sqr( index[1] - 32.0 );
+    it.Set( distance <= vnl_math_sqr( radius ) ? 250 : 15 );
+    }
+  return image;
+}
+
+// Create a registration of the circles with the scripted metric, observed
+// by the stop criterion and the recorder.
+TestRegistrationFilter::Pointer
+CreateRegistration( StopCriterionType * stopCriterion, IterationRecorder * recorder,
+    const std::vector< double > & metrics )
+{
+  RegularizerType::Pointer regularizer = RegularizerType::New();
+  regularizer->SetAlpha( 0.5 );
+
+  TestRegistrationFilter::Pointer regFilter = TestRegistrationFilter::New();
+  regFilter->SetDifferenceFunction( FunctionType::New() );
+  regFilter->SetRegularizer( regularizer );
+  regFilter->SetFixedImage( CreateImage( 16.0 ) );
+  regFilter->SetMovingImage( CreateImage( 14.0 ) );
+  regFilter->SetNumberOfIterations( 100 );
+  regFilter->m_ScriptedMetrics = metrics;
+
+  regFilter->AddObserver( itk::IterationEvent(), recorder );
+  regFilter->AddObserver( itk::IterationEvent(), stopCriterion );
+  return regFilter;
+}
+}
+
+int VariationalRegistrationStopCriterionTest(int, char* [] )
+{
+  const std::vector< double > noMetrics;
+
+  //--------------------------------------------------------
+  std::cout << "Test cost budget" << std::endl;
+
+  // Each iteration costs the 4096 pixels of the field. With a budget of
+  // 10.5 iterations, the eleventh iteration would exceed the budget, so the
+  // registration stops after ten iterations.
+  StopCriterionType::Pointer costCriterion = StopCriterionType::New();
+  costCriterion->SetBudgetPolicyToCost();
+  costCriterion->SetBudget( 10.5 * 4096 );
+
+  IterationRecorder::Pointer costRecorder = IterationRecorder::New();
+  TestRegistrationFilter::Pointer regFilter =
+      CreateRegistration( costCriterion, costRecorder, noMetrics );
+  regFilter->Update();
+
+  std::cout << "Iterations: " << regFilter->GetElapsedIterations()
+            << ", used budget: " << costCriterion->GetUsedBudget() << std::endl;
+  if( regFilter->GetElapsedIterations() != 10 || costCriterion->GetUsedBudget() != 10 * 4096 )
+    {
+    std::cout << "Test failed - cost budget did not stop the registration after 10 iterations." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test distribution of the cost budget over the levels" << std::endl;
+
+  // The levels have 32x32 and 64x64 pixels and are weighted 1:4. The first
+  // level gets a fifth of the budget, i.e. 5.1 iterations, and stops after
+  // five iterations. The finest level gets the rest, 20992 pixels or 5.1
+  // iterations, and stops after five iterations as well.
+  StopCriterionType::Pointer levelCriterion = StopCriterionType::New();
+  levelCriterion->SetBudgetPolicyToCost();
+  levelCriterion->SetBudget( 25600 + 512 );
+  StopCriterionType::LevelBudgetWeightsType weights( 2 );
+  weights[0] = 1.0;
+  weights[1] = 4.0;
+  levelCriterion->SetLevelBudgetWeights( weights );
+
+  IterationRecorder::Pointer levelRecorder = IterationRecorder::New();
+  TestRegistrationFilter::Pointer levelFilter =
+      CreateRegistration( levelCriterion, levelRecorder, noMetrics );
+
+  unsigned int its[2] = { 100, 100 };
+  MRRegistrationFilterType::Pointer mrRegFilter = MRRegistrationFilterType::New();
+  mrRegFilter->SetRegistrationFilter( levelFilter );
+  mrRegFilter->SetFixedImage( CreateImage( 16.0 ) );
+  mrRegFilter->SetMovingImage( CreateImage( 14.0 ) );
+  mrRegFilter->SetNumberOfLevels( 2 );
+  mrRegFilter->SetNumberOfIterations( its );
+  mrRegFilter->AddObserver( itk::IterationEvent(), levelCriterion );
+  mrRegFilter->AddObserver( itk::InitializeEvent(), levelCriterion );
+  mrRegFilter->Update();
+
+  for( unsigned int level = 0; level < levelRecorder->m_LevelIterations.size(); level++ )
+    {
+    std::cout << "Level " << level << ": " << levelRecorder->m_LevelIterations[level]
+              << " iterations" << std::endl;
+    }
+  if( levelRecorder->m_LevelIterations.size() != 2
+      || levelRecorder->m_LevelIterations[0] != 5
+      || levelRecorder->m_LevelIterations[1] != 5
+      || levelCriterion->GetUsedBudget() != 5 * 1024 + 5 * 4096 )
+    {
+    std::cout << "Test failed - level budgets not 5 iterations each." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test time budget" << std::endl;
+
+  // Each iteration takes at least 20 ms, so a budget of 0.2 s stops the
+  // registration after at most ten iterations, however fast the machine.
+  StopCriterionType::Pointer timeCriterion = StopCriterionType::New();
+  timeCriterion->SetBudgetPolicyToTime();
+  timeCriterion->SetBudget( 0.2 );
+
+  IterationRecorder::Pointer timeRecorder = IterationRecorder::New();
+  timeRecorder->m_Delay = 0.02;
+  TestRegistrationFilter::Pointer timeFilter =
+      CreateRegistration( timeCriterion, timeRecorder, noMetrics );
+  timeFilter->Update();
+
+  std::cout << "Iterations: " << timeFilter->GetElapsedIterations()
+            << ", mean iteration time: " << timeCriterion->GetMeanIterationTime() << " s" << std::endl;
+  if( timeFilter->GetElapsedIterations() < 1 || timeFilter->GetElapsedIterations() > 10 )
+    {
+    std::cout << "Test failed - time budget did not stop the registration." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test gain rate check" << std::endl;
+
+  // The metric decreases by 1 per iteration from 100 to 70 and stays
+  // constant afterwards. The first window of ten constant values ends
+  // with iteration 39, where the gain rate drops to zero. The regression
+  // slope of the windows before is at least 0.00049 of the maximum per
+  // iteration, which is above the minimum gain rate unless an iteration
+  // takes more than 4 s.
+  std::vector< double > metrics;
+  for( unsigned int i = 0; i <= 100; i++ )
+    {
+    metrics.push_back( 100.0 - vnl_math_min( i, 30u ) );
+    }
+
+  StopCriterionType::Pointer gainCriterion = StopCriterionType::New();
+  gainCriterion->SetNumberOfFittingIterations( 10 );
+  gainCriterion->PerformGainRateCheckOn();
+  gainCriterion->SetMinimumGainRate( 0.0001 );
+
+  IterationRecorder::Pointer gainRecorder = IterationRecorder::New();
+  TestRegistrationFilter::Pointer gainFilter =
+      CreateRegistration( gainCriterion, gainRecorder, metrics );
+  gainFilter->Update();
+
+  std::cout << "Iterations: " << gainFilter->GetElapsedIterations()
+            << ", gain rate: " << gainCriterion->GetGainRate() << " 1/s" << std::endl;
+  if( gainFilter->GetElapsedIterations() != 39 || gainCriterion->GetGainRate() != 0.0 )
+    {
+    std::cout << "Test failed - gain rate check did not stop after 39 iterations." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // Without gain rate check, all iterations are performed.
+  gainCriterion->PerformGainRateCheckOff();
+  gainFilter->Modified();
+  gainFilter->Update();
+
+  if( gainFilter->GetElapsedIterations() != 100 )
+    {
+    std::cout << "Test failed - registration stopped without gain rate check." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // -----------------------------------------------------------
+  std::cout << "Test printing informations." << std::endl;
+  costCriterion->Print( std::cout );
+  gainCriterion->Print( std::cout );
+
+  std::cout << "Test passed" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,286 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#include "itkVariationalRegistrationStructuredLogger.h"
+#include "itkVariationalRegistrationFilter.h"
+#include "itkVariationalRegistrationMultiResolutionFilter.h"
+
+#include "itksys/SystemTools.hxx"
+
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace{
+typedef unsigned char                          PixelType;
+typedef itk::Image<PixelType,2>                ImageType;
+typedef itk::Vector<float,2>                   VectorType;
+typedef itk::Image<VectorType,2>               FieldType;
+
+typedef itk::VariationalRegistrationFilter<
+    ImageType, ImageType, FieldType>                           RegistrationFilterType;
+typedef itk::VariationalRegistrationMultiResolutionFilter<
+    ImageType, ImageType, FieldType>                           MRRegistrationFilterType;
+typedef itk::VariationalRegistrationStructuredLogger<
+    RegistrationFilterType, MRRegistrationFilterType>          LoggerType;
+
+// Logger which pushes records directly, counts the written records and
+// can hold the background thread in the first written record.
+class TestLogger : public LoggerType
+{
+public:
+  typedef TestLogger                    Self;
+  typedef LoggerType                    Superclass;
+  typedef itk::SmartPointer< Self >     Pointer;
+
+  itkNewMacro(Self);
+
+  void Push( bool level, unsigned int iteration, double metric )
+    {
+    RecordType record;
+    record.Event = level ? Superclass::RECORD_EVENT_LEVEL : Superclass::RECORD_EVENT_ITERATION;
+    record.Level = 1;
+    record.Iteration = iteration;
+    record.Metric = metric;
+    record.RMSChange = 0.25;
+    record.Stopped = level;
+    record.IncreaseCount = 2;
+    for( unsigned int i = 0; i < InstrumentationType::NumberOfPhases; i++ )
+      {
+      record.PhaseTime[i] = 0.5;
+      }
+    record.NumberOfThreads = 4;
+    record.AllocatedBytes = 1024;
+    record.Time = 3.0;
+    this->PushRecord( record );
+    }
+
+  // Wait until the given number of records is written, at most 10 s.
+  bool WaitForRecords( int numberOfRecords )
+    {
+    for( unsigned int i = 0; i < 10000 && m_WrittenRecords < numberOfRecords; i++ )
+      {
+      itksys::SystemTools::Delay( 1 );
+      }
+    return m_WrittenRecords >= numberOfRecords;
+    }
+
+  mutable itk::AtomicInt< int > m_WrittenRecords;
+  itk::AtomicInt< int >         m_Hold;
+
+protected:
+  TestLogger()
+    {
+    m_WrittenRecords = 0;
+    m_Hold = 0;
+    }
+
+  virtual void WriteRecord( std::ostream & os, const RecordType & record ) const ITK_OVERRIDE
+    {
+    // The slot of the record is released after it is written, so holding
+    // the background thread here keeps the buffer full.
+    while( m_Hold != 0 )
+      {
+      itksys::SystemTools::Delay( 1 );
+      }
+    Superclass::WriteRecord( os, record );
+    m_WrittenRecords++;
+    }
+};
+
+// Read the lines of a file.
+std::vector<std::string>
+ReadLines( const std::string & fileName )
+{
+  std::vector<std::string> lines;
+  std::ifstream file( fileName.c_str() );
+  std::string line;
+  while( std::getline( file, line ) )
+    {
+    lines.push_back( line );
+    }
+  return lines;
+}
+
+// Number of fields of a CSV line.
+unsigned int
+NumberOfFields( const std::string & line )
+{
+  unsigned int fields = 1;
+  for( std::string::size_type i = 0; i < line.size(); i++ )
+    {
+    if( line[i] == ',' )
+      {
+      fields++;
+      }
+    }
+  return fields;
+}
+
+// Check whether a line contains the text.
+bool
+Contains( const std::string & line, const std::string & text )
+{
+  return line.find( text ) != std::string::npos;
+}
+}
+
+int VariationalRegistrationStructuredLoggerTest(int argc, char* argv[] )
+{
+  if( argc < 2 )
+    {
+    std::cerr << "Usage: " << argv[0] << " TemporaryDirectory" << std::endl;
+    return EXIT_FAILURE;
+    }
+  const std::string directory = argv[1];
+
+  //--------------------------------------------------------
+  std::cout << "Test ring buffer wrap-around" << std::endl;
+
+  // Push many more records than the buffer holds, one at a time. Each
+  // record has to wake the background thread, otherwise the wait fails.
+  const std::string jsonFileName = directory + "/VariationalRegistrationStructuredLoggerTest.json";
+  TestLogger::Pointer logger = TestLogger::New();
+  logger->SetBufferSize( 2 );
+  logger->SetFileName( jsonFileName );
+  logger->SetOutputFormatToJSONLines();
+  for( unsigned int i = 0; i < 20; i++ )
+    {
+    logger->Push( false, i, 10.0 - i );
+    if( !logger->WaitForRecords( i + 1 ) )
+      {
+      std::cout << "Test failed - background thread did not write record " << i << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+  logger->Push( true, 19, std::numeric_limits<double>::quiet_NaN() );
+  logger->Flush();
+
+  if( logger->GetNumberOfDroppedRecords() != 0 )
+    {
+    std::cout << "Test failed - " << logger->GetNumberOfDroppedRecords()
+              << " records dropped." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test JSON lines format" << std::endl;
+
+  std::vector<std::string> lines = ReadLines( jsonFileName );
+  if( lines.size() != 21 )
+    {
+    std::cout << "Test failed - " << lines.size() << " instead of 21 JSON lines." << std::endl;
+    return EXIT_FAILURE;
+    }
+  for( unsigned int i = 0; i < 20; i++ )
+    {
+    std::ostringstream iteration;
+    iteration << "{\"event\":\"iteration\",\"level\":1,\"iteration\":" << i
+              << ",\"metric\":" << 10.0 - i << ",";
+    if( lines[i].find( iteration.str() ) != 0
+        || lines[i][lines[i].size() - 1] != '}' )
+      {
+      std::cout << "Test failed - wrong JSON line " << i << ": " << lines[i] << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+  const std::string & levelLine = lines[20];
+  std::cout << levelLine << std::endl;
+  if( !Contains( levelLine, "{\"event\":\"level\"" )
+      || !Contains( levelLine, "\"metric\":null" )
+      || !Contains( levelLine, "\"rms_change\":0.25" )
+      || !Contains( levelLine, "\"stopped\":true" )
+      || !Contains( levelLine, "\"increase_count\":2" )
+      || !Contains( levelLine, "\"phase_time\":{\"" )
+      || !Contains( levelLine, "\"threads\":4" )
+      || !Contains( levelLine, "\"allocated_bytes\":1024" )
+      || !Contains( levelLine, "\"time\":3}" ) )
+    {
+    std::cout << "Test failed - wrong JSON level record." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test dropped records" << std::endl;
+
+  // Hold the background thread in the first record. The buffer is full
+  // after the second record, so the following three are dropped.
+  const std::string csvFileName = directory + "/VariationalRegistrationStructuredLoggerTest.csv";
+  logger = TestLogger::New();
+  logger->SetBufferSize( 2 );
+  logger->SetFileName( csvFileName );
+  logger->SetOutputFormatToCSV();
+  logger->m_Hold = 1;
+  for( unsigned int i = 0; i < 5; i++ )
+    {
+    logger->Push( false, i, 1.0 );
+    }
+  const LoggerType::SizeValueType droppedRecords = logger->GetNumberOfDroppedRecords();
+  logger->m_Hold = 0;
+  logger->Flush();
+
+  if( droppedRecords != 3 || logger->GetNumberOfDroppedRecords() != 3 )
+    {
+    std::cout << "Test failed - " << droppedRecords
+              << " instead of 3 records dropped." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test CSV format" << std::endl;
+
+  lines = ReadLines( csvFileName );
+  if( lines.size() != 3 )
+    {
+    std::cout << "Test failed - " << lines.size() << " instead of 3 CSV lines." << std::endl;
+    return EXIT_FAILURE;
+    }
+  std::cout << lines[0] << std::endl << lines[1] << std::endl;
+
+  // One time column per phase between increase_count and threads.
+  const unsigned int numberOfFields =
+      10 + LoggerType::InstrumentationType::NumberOfPhases;
+  if( lines[0].find( "event,level,iteration,metric,rms_change,stopped,increase_count," ) != 0
+      || !Contains( lines[0], "_time,threads,allocated_bytes,time" )
+      || NumberOfFields( lines[0] ) != numberOfFields )
+    {
+    std::cout << "Test failed - wrong CSV header." << std::endl;
+    return EXIT_FAILURE;
+    }
+  for( unsigned int i = 1; i < 3; i++ )
+    {
+    std::ostringstream record;
+    record << "iteration,1," << i - 1 << ",1,0.25,0,2,0.5,";
+    if( lines[i].find( record.str() ) != 0
+        || !Contains( lines[i], ",4,1024,3" )
+        || NumberOfFields( lines[i] ) != numberOfFields )
+      {
+      std::cout << "Test failed - wrong CSV line " << i << ": " << lines[i] << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  // -----------------------------------------------------------
+  std::cout << "Test printing informations." << std::endl;
+  logger->Print( std::cout );
+
+  std::cout << "Test passed" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,486 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#include "itkVariationalRegistrationFilter.h"
+#include "itkVariationalRegistrationDemonsFunction.h"
+#include "itkVariationalRegistrationDiffusionRegularizer.h"
+
+#include "itkCommand.h"
+#include "itkImageRegionIteratorWithIndex.h"
+#include "vnl/vnl_math.h"
+
+#include <algorithm>
+#include <vector>
+
+namespace{
+typedef unsigned char                          PixelType;
+typedef itk::Image<PixelType,2>                ImageType;
+typedef itk::Vector<float,2>                   VectorType;
+typedef itk::Image<VectorType,2>               FieldType;
+
+typedef itk::VariationalRegistrationDemonsFunction<
+    ImageType, ImageType, FieldType>                           FunctionType;
+typedef itk::VariationalRegistrationDiffusionRegularizer<FieldType> RegularizerType;
+typedef itk::VariationalRegistrationFilter<
+    ImageType, ImageType, FieldType>                           RegistrationFilterType;
+
+// Counts the events of an object.
+class EventCounter : public itk::Command
+{
+public:
+  typedef EventCounter                  Self;
+  typedef itk::Command                  Superclass;
+  typedef itk::SmartPointer< Self >     Pointer;
+
+  itkNewMacro(Self);
+
+  void Execute( itk::Object *, const itk::EventObject & )
+    { m_Count++; }
+
+  void Execute( const itk::Object *, const itk::EventObject & )
+    { m_Count++; }
+
+  unsigned int m_Count;
+
+protected:
+  EventCounter()
+    { m_Count = 0; }
+};
+
+// Registration filter which returns a scripted metric per iteration and
+// records the state of each momentum step.
+class TestRegistrationFilter : public RegistrationFilterType
+{
+public:
+  typedef TestRegistrationFilter        Self;
+  typedef RegistrationFilterType        Superclass;
+  typedef itk::SmartPointer< Self >     Pointer;
+
+  itkNewMacro(Self);
+
+  virtual double GetMetric() const ITK_OVERRIDE
+    {
+    if( this->GetElapsedIterations() < m_ScriptedMetrics.size() )
+      {
+      return m_ScriptedMetrics[this->GetElapsedIterations()];
+      }
+    return Superclass::GetMetric();
+    }
+
+  std::vector< double >       m_ScriptedMetrics;
+  std::vector< double >       m_Momenta;
+  std::vector< unsigned int > m_RegularizationsBeforeMomentum;
+  EventCounter::Pointer       m_RegularizationCounter;
+
+protected:
+  TestRegistrationFilter() {}
+
+  virtual void ApplyMomentum() ITK_OVERRIDE
+    {
+    m_RegularizationsBeforeMomentum.push_back( m_RegularizationCounter->m_Count );
+    Superclass::ApplyMomentum();
+    m_Momenta.push_back( this->GetMomentum() );
+    }
+};
+
+// Copy a field into another, allocating the target.
+void
+CopyField( const FieldType * source, FieldType * target )
+{
+  target->CopyInformation( source );
+  target->SetRegions( source->GetBufferedRegion() );
+  target->Allocate();
+  std::copy( source->GetBufferPointer(),
+      source->GetBufferPointer() + source->GetBufferedRegion().GetNumberOfPixels(),
+      target->GetBufferPointer() );
+}
+
+// Registration filter which records the adapted time steps and momenta and
+// checks that a rejected output is moved back towards the last accepted
+// output.
+class AdaptiveTestFilter : public RegistrationFilterType
+{
+public:
+  typedef AdaptiveTestFilter            Self;
+  typedef RegistrationFilterType        Superclass;
+  typedef itk::SmartPointer< Self >     Pointer;
+
+  itkNewMacro(Self);
+
+  std::vector< bool >   m_AcceptedSteps;
+  std::vector< double > m_TimeSteps;
+  std::vector< double > m_Momenta;
+  unsigned int          m_NumberOfExchangedBuffers;
+  double                m_MaximumBacktrackingError;
+
+protected:
+  AdaptiveTestFilter()
+    {
+    m_NumberOfExchangedBuffers = 0;
+    m_MaximumBacktrackingError = 0.0;
+    m_CurrentField = FieldType::New();
+    m_AcceptedField = FieldType::New();
+    }
+
+  virtual void ApplyUpdate( const TimeStepType & dt ) ITK_OVERRIDE
+    {
+    CopyField( this->GetOutput(), m_CurrentField );
+    const VectorType * buffer = this->GetOutput()->GetBufferPointer();
+    const itk::SizeValueType backtrackingSteps = this->GetNumberOfBacktrackingSteps();
+
+    Superclass::ApplyUpdate( dt );
+
+    const FunctionType * function =
+        dynamic_cast< const FunctionType * >( this->GetDifferenceFunction().GetPointer() );
+    m_TimeSteps.push_back( function->GetTimeStep() );
+    m_Momenta.push_back( this->GetMomentum() );
+
+    const bool accepted = this->GetNumberOfBacktrackingSteps() == backtrackingSteps;
+    m_AcceptedSteps.push_back( accepted );
+    if( accepted )
+      {
+      // The accepted output is kept in the buffer of the last accepted
+      // field, the step is written to the other buffer.
+      if( this->GetOutput()->GetBufferPointer() != buffer )
+        {
+        m_NumberOfExchangedBuffers++;
+        }
+      CopyField( m_CurrentField, m_AcceptedField );
+      return;
+      }
+
+    const float factor = function->GetTimeStepShrinkFactor();
+    const itk::SizeValueType numberOfPixels =
+        this->GetOutput()->GetBufferedRegion().GetNumberOfPixels();
+    for( itk::SizeValueType i = 0; i < numberOfPixels; i++ )
+      {
+      const VectorType last = m_AcceptedField->GetBufferPointer()[i];
+      const VectorType expected = last
+          + ( m_CurrentField->GetBufferPointer()[i] - last ) * factor;
+      const VectorType diff = this->GetOutput()->GetBufferPointer()[i] - expected;
+      m_MaximumBacktrackingError =
+          vnl_math_max( m_MaximumBacktrackingError, static_cast< double >( diff.GetNorm() ) );
+      }
+    }
+
+private:
+  FieldType::Pointer m_CurrentField;
+  FieldType::Pointer m_AcceptedField;
+};
+
+// Inverts the moving image after the given iterations, so that the metric
+// of the next iteration increases.
+class MovingImageInverter : public itk::Command
+{
+public:
+  typedef MovingImageInverter           Self;
+  typedef itk::Command                  Superclass;
+  typedef itk::SmartPointer< Self >     Pointer;
+
+  itkNewMacro(Self);
+
+  void Execute( itk::Object * caller, const itk::EventObject & )
+    {
+    const RegistrationFilterType * filter = dynamic_cast< RegistrationFilterType * >( caller );
+    if( !filter || std::find( m_Iterations.begin(), m_Iterations.end(),
+        filter->GetElapsedIterations() ) == m_Iterations.end() )
+      {
+      return;
+      }
+
+    PixelType * buffer = m_Image->GetBufferPointer();
+    const itk::SizeValueType numberOfPixels = m_Image->GetBufferedRegion().GetNumberOfPixels();
+    for( itk::SizeValueType i = 0; i < numberOfPixels; i++ )
+      {
+      buffer[i] = 255 - buffer[i];
+      }
+    m_Image->Modified();
+    }
+
+  void Execute( const itk::Object * caller, const itk::EventObject & event )
+    { this->Execute( const_cast< itk::Object * >( caller ), event ); }
+
+  ImageType::Pointer                   m_Image;
+  std::vector< itk::SizeValueType >    m_Iterations;
+
+protected:
+  MovingImageInverter() {}
+};
+
+// Create an image of 64x64 pixels with a circle.
+ImageType::Pointer
+CreateImage( double radius )
+{
+  ImageType::SizeType size;
+  size.Fill( 64 );
+  ImageType::RegionType region;
+  region.SetSize( size );
+
+  ImageType::Pointer image = ImageType::New();
+  image->SetRegions( region );
+  image->Allocate();
+
+  itk::ImageRegionIteratorWithIndex<ImageType> it( image, region );
+  for( ; !it.IsAtEnd(); ++it )
+    {
+    const ImageType::IndexType index = it.GetIndex();
+    const double distance = vnl_math_sqr( index[0] - 32.0 ) + vnl_math_sqr( index[1] - 32.0 );
+    it.Set( distance <= vnl_math_sqr( radius ) ? 250 : 15 );
+    }
+  return image;
+}
+
+// Create a Nesterov registration of the circles with the scripted metric.
+TestRegistrationFilter::Pointer
+CreateRegistration( const std::vector< double > & metrics, bool restart )
+{
+  RegularizerType::Pointer regularizer = RegularizerType::New();
+  regularizer->SetAlpha( 0.5 );
+
+  TestRegistrationFilter::Pointer regFilter = TestRegistrationFilter::New();
+  regFilter->SetDifferenceFunction( FunctionType::New() );
+  regFilter->SetRegularizer( regularizer );
+  regFilter->SetFixedImage( CreateImage( 16.0 ) );
+  regFilter->SetMovingImage( CreateImage( 14.0 ) );
+  regFilter->SetNumberOfIterations( metrics.size() );
+  regFilter->SetUpdateSchemeToNesterov();
+  regFilter->SetMomentumRestart( restart );
+  regFilter->m_ScriptedMetrics = metrics;
+
+  regFilter->m_RegularizationCounter = EventCounter::New();
+  regularizer->AddObserver( itk::EndEvent(), regFilter->m_RegularizationCounter );
+  return regFilter;
+}
+}
+
+int VariationalRegistrationUpdateSchemeTest(int, char* [] )
+{
+  // The metric decreases except in iteration 4.
+  const double metricArray[10] = { 10.0, 9.0, 8.0, 7.0, 8.0, 6.0, 5.0, 4.0, 3.0, 2.0 };
+  const std::vector< double > metrics( metricArray, metricArray + 10 );
+
+  //--------------------------------------------------------
+  std::cout << "Test order of regularization and extrapolation" << std::endl;
+
+  TestRegistrationFilter::Pointer regFilter = CreateRegistration( metrics, true );
+  regFilter->Update();
+
+  // The output is regularized once per iteration, before the extrapolation.
+  if( regFilter->m_Momenta.size() != metrics.size() )
+    {
+    std::cout << "Test failed - " << regFilter->m_Momenta.size()
+              << " instead of " << metrics.size() << " momentum steps." << std::endl;
+    return EXIT_FAILURE;
+    }
+  for( unsigned int i = 0; i < metrics.size(); i++ )
+    {
+    if( regFilter->m_RegularizationsBeforeMomentum[i] != i + 1 )
+      {
+      std::cout << "Test failed - output of iteration " << i
+                << " extrapolated before the regularization." << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test momentum restart" << std::endl;
+
+  for( unsigned int i = 0; i < metrics.size(); i++ )
+    {
+    std::cout << "Iteration " << i << ": metric " << metrics[i]
+              << ", momentum " << regFilter->m_Momenta[i] << std::endl;
+    }
+
+  // The increase in iteration 4 resets the momentum to zero, which then
+  // grows again as in the first iterations.
+  if( regFilter->GetNumberOfMomentumRestarts() != 1
+      || regFilter->m_Momenta[0] != 0.0
+      || regFilter->m_Momenta[4] != 0.0
+      || regFilter->m_Momenta[3] <= regFilter->m_Momenta[1]
+      || regFilter->m_Momenta[5] != regFilter->m_Momenta[1] )
+    {
+    std::cout << "Test failed - " << regFilter->GetNumberOfMomentumRestarts()
+              << " instead of 1 restart." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test without momentum restart" << std::endl;
+
+  TestRegistrationFilter::Pointer noRestartFilter = CreateRegistration( metrics, false );
+  noRestartFilter->Update();
+
+  if( noRestartFilter->GetNumberOfMomentumRestarts() != 0 )
+    {
+    std::cout << "Test failed - momentum restarted although restart is off." << std::endl;
+    return EXIT_FAILURE;
+    }
+  for( unsigned int i = 1; i < metrics.size(); i++ )
+    {
+    if( noRestartFilter->m_Momenta[i] <= noRestartFilter->m_Momenta[i - 1]
+        && noRestartFilter->m_Momenta[i] < noRestartFilter->GetMaximumMomentum() )
+      {
+      std::cout << "Test failed - momentum of iteration " << i << " did not grow." << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test adaptive time step" << std::endl;
+
+  // The time step grows by 4 and shrinks by 0.1, but is limited to
+  // [0.25, 2]. The moving image is inverted in iteration 3, which
+  // increases the metric, and restored afterwards.
+  FunctionType::Pointer function = FunctionType::New();
+  function->SetTimeStep( 1.0 );
+  function->SetAdaptiveTimeStep( true );
+  function->SetTimeStepGrowthFactor( 4.0 );
+  function->SetTimeStepShrinkFactor( 0.1 );
+  function->SetTimeStepRange( 0.25, 2.0 );
+
+  // The regularizer does not run in place, so the output shares the buffer
+  // with the output of the regularizer.
+  RegularizerType::Pointer regularizer = RegularizerType::New();
+  regularizer->SetAlpha( 0.5 );
+  regularizer->InPlaceOff();
+
+  ImageType::Pointer moving = CreateImage( 14.0 );
+  MovingImageInverter::Pointer inverter = MovingImageInverter::New();
+  inverter->m_Image = moving;
+  inverter->m_Iterations.push_back( 3 );
+  inverter->m_Iterations.push_back( 4 );
+
+  AdaptiveTestFilter::Pointer adaptiveFilter = AdaptiveTestFilter::New();
+  adaptiveFilter->SetDifferenceFunction( function );
+  adaptiveFilter->SetRegularizer( regularizer );
+  adaptiveFilter->SetFixedImage( CreateImage( 16.0 ) );
+  adaptiveFilter->SetMovingImage( moving );
+  adaptiveFilter->SetNumberOfIterations( 10 );
+  adaptiveFilter->AddObserver( itk::IterationEvent(), inverter );
+  adaptiveFilter->Update();
+
+  unsigned int numberOfAcceptedSteps = 0;
+  for( unsigned int i = 0; i < adaptiveFilter->m_TimeSteps.size(); i++ )
+    {
+    std::cout << "Iteration " << i << ": time step " << adaptiveFilter->m_TimeSteps[i]
+              << ( adaptiveFilter->m_AcceptedSteps[i] ? ", accepted" : ", rejected" ) << std::endl;
+    if( adaptiveFilter->m_AcceptedSteps[i] )
+      {
+      numberOfAcceptedSteps++;
+      }
+    if( adaptiveFilter->m_TimeSteps[i] < 0.25 || adaptiveFilter->m_TimeSteps[i] > 2.0 )
+      {
+      std::cout << "Test failed - time step outside of the range." << std::endl;
+      return EXIT_FAILURE;
+      }
+    }
+
+  // The first iteration is accepted and its time step clamped to the
+  // maximum, the iteration with the inverted image is rejected and its
+  // time step clamped to the minimum.
+  if( adaptiveFilter->m_TimeSteps.size() != 10
+      || !adaptiveFilter->m_AcceptedSteps[0] || adaptiveFilter->m_TimeSteps[0] != 2.0
+      || adaptiveFilter->m_AcceptedSteps[3] || adaptiveFilter->m_TimeSteps[3] != 0.25 )
+    {
+    std::cout << "Test failed - time step not clamped." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test backtracking" << std::endl;
+
+  std::cout << "Backtracking steps: " << adaptiveFilter->GetNumberOfBacktrackingSteps()
+            << ", maximum error: " << adaptiveFilter->m_MaximumBacktrackingError
+            << ", exchanged buffers: " << adaptiveFilter->m_NumberOfExchangedBuffers << std::endl;
+
+  // A rejected output is moved back towards the last accepted output, which
+  // has to survive the regularization of the accepted steps in between.
+  if( adaptiveFilter->GetNumberOfBacktrackingSteps() == 0
+      || adaptiveFilter->GetNumberOfBacktrackingSteps() + numberOfAcceptedSteps != 10
+      || adaptiveFilter->m_MaximumBacktrackingError > 1e-5 )
+    {
+    std::cout << "Test failed - rejected output not moved back to the last accepted output." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // The accepted output is not copied.
+  if( adaptiveFilter->m_NumberOfExchangedBuffers != numberOfAcceptedSteps )
+    {
+    std::cout << "Test failed - accepted output was copied." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test backtracking with momentum and frozen blocks" << std::endl;
+
+  // A rejected output restarts the momentum and counts as an iteration of
+  // the blocks. With a huge freeze threshold, all blocks are frozen after
+  // four iterations including the rejected iteration 3.
+  FunctionType::Pointer nesterovFunction = FunctionType::New();
+  nesterovFunction->SetTimeStep( 1.0 );
+  nesterovFunction->SetAdaptiveTimeStep( true );
+  nesterovFunction->SetTimeStepGrowthFactor( 4.0 );
+  nesterovFunction->SetTimeStepShrinkFactor( 0.1 );
+  nesterovFunction->SetTimeStepRange( 0.25, 2.0 );
+
+  RegularizerType::Pointer nesterovRegularizer = RegularizerType::New();
+  nesterovRegularizer->SetAlpha( 0.5 );
+
+  AdaptiveTestFilter::Pointer nesterovFilter = AdaptiveTestFilter::New();
+  nesterovFilter->SetDifferenceFunction( nesterovFunction );
+  nesterovFilter->SetRegularizer( nesterovRegularizer );
+  nesterovFilter->SetFixedImage( CreateImage( 16.0 ) );
+  nesterovFilter->SetMovingImage( moving );
+  nesterovFilter->SetNumberOfIterations( 10 );
+  nesterovFilter->SetUpdateSchemeToNesterov();
+  nesterovFilter->MomentumRestartOff();
+  nesterovFilter->FreezeConvergedBlocksOn();
+  nesterovFilter->SetFreezeThreshold( 1e10 );
+  nesterovFilter->SetFreezeIterations( 4 );
+  nesterovFilter->AddObserver( itk::IterationEvent(), inverter );
+  nesterovFilter->Update();
+
+  for( unsigned int i = 0; i < nesterovFilter->m_Momenta.size(); i++ )
+    {
+    std::cout << "Iteration " << i << ": momentum " << nesterovFilter->m_Momenta[i]
+              << ( nesterovFilter->m_AcceptedSteps[i] ? ", accepted" : ", rejected" ) << std::endl;
+    }
+
+  if( nesterovFilter->GetElapsedIterations() != 4 || nesterovFilter->m_Momenta.size() != 4
+      || !nesterovFilter->GetStopRegistrationFlag() )
+    {
+    std::cout << "Test failed - " << nesterovFilter->GetElapsedIterations()
+              << " instead of 4 iterations until all blocks froze." << std::endl;
+    return EXIT_FAILURE;
+    }
+  // Without MomentumRestart, only the rejected outputs restart the momentum.
+  if( nesterovFilter->m_AcceptedSteps[3] || nesterovFilter->m_Momenta[3] != 0.0
+      || nesterovFilter->GetNumberOfMomentumRestarts() != nesterovFilter->GetNumberOfBacktrackingSteps() )
+    {
+    std::cout << "Test failed - momentum not restarted by the rejected output." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // -----------------------------------------------------------
+  std::cout << "Test printing informations." << std::endl;
+  regFilter->Print( std::cout );
+  adaptiveFilter->Print( std::cout );
+
+  std::cout << "Test passed" << std::endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,335 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+
+#include "itkVariationalRegistrationWorkspace.h"
+#include "itkVariationalRegistrationFilter.h"
+#include "itkVariationalRegistrationMultiResolutionFilter.h"
+#include "itkVariationalRegistrationDemonsFunction.h"
+#include "itkVariationalRegistrationDiffusionRegularizer.h"
+
+#include "itkImageRegionIteratorWithIndex.h"
+#include "vnl/vnl_math.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+namespace{
+typedef unsigned char                          PixelType;
+typedef itk::Image<PixelType,2>                ImageType;
+typedef itk::Vector<float,2>                   VectorType;
+typedef itk::Image<VectorType,2>               FieldType;
+typedef itk::VariationalRegistrationWorkspace<FieldType> WorkspaceType;
+
+typedef itk::VariationalRegistrationDemonsFunction<
+    ImageType, ImageType, FieldType>                           FunctionType;
+typedef itk::VariationalRegistrationDiffusionRegularizer<FieldType> RegularizerType;
+typedef itk::VariationalRegistrationFilter<
+    ImageType, ImageType, FieldType>                           RegistrationFilterType;
+typedef itk::VariationalRegistrationMultiResolutionFilter<
+    ImageType, ImageType, FieldType>                           MRRegistrationFilterType;
+
+// Fill an image with a circle.
+void
+FillCircle( ImageType * image, double centerX, double centerY, double radius )
+{
+  itk::ImageRegionIteratorWithIndex<ImageType> it( image, image->GetBufferedRegion() );
+  for( ; !it.IsAtEnd(); ++it )
+    {
+    const ImageType::IndexType index = it.GetIndex();
+    const double distance = vnl_math_sqr( index[0] - centerX )
+        + vnl_math_sqr( index[1] - centerY );
+    it.Set( distance <= vnl_math_sqr( radius ) ? 250 : 15 );
+    }
+}
+
+// Set up a two-level registration.
+MRRegistrationFilterType::Pointer
+CreateRegistration( ImageType * fixed, ImageType * moving )
+{
+  RegularizerType::Pointer regularizer = RegularizerType::New();
+  regularizer->SetAlpha( 0.5 );
+
+  RegistrationFilterType::Pointer regFilter = RegistrationFilterType::New();
+  regFilter->SetDifferenceFunction( FunctionType::New() );
+  regFilter->SetRegularizer( regularizer );
+
+  itk::Array<unsigned int> iterations( 2 );
+  iterations.Fill( 10 );
+
+  MRRegistrationFilterType::Pointer mrRegFilter = MRRegistrationFilterType::New();
+  mrRegFilter->SetRegistrationFilter( regFilter );
+  mrRegFilter->SetFixedImage( fixed );
+  mrRegFilter->SetMovingImage( moving );
+  mrRegFilter->SetNumberOfLevels( 2 );
+  mrRegFilter->SetNumberOfIterations( iterations );
+  return mrRegFilter;
+}
+
+// Run a two-level registration with the given workspace directory and
+// return the displacement field.
+FieldType::Pointer
+RunRegistration( ImageType * fixed, ImageType * moving,
+    const std::string & backingDirectory, WorkspaceType::SizeValueType & mappedBytes )
+{
+  MRRegistrationFilterType::Pointer mrRegFilter = CreateRegistration( fixed, moving );
+  mrRegFilter->GetWorkspace()->SetBackingDirectory( backingDirectory );
+  mrRegFilter->Update();
+
+  mappedBytes = mrRegFilter->GetWorkspace()->GetMappedBytes();
+
+  FieldType::Pointer output = mrRegFilter->GetOutput();
+  output->DisconnectPipeline();
+  return output;
+}
+}
+
+int VariationalRegistrationWorkspaceTest(int argc, char* argv[] )
+{
+  if( argc < 2 )
+    {
+    std::cerr << "Usage: " << argv[0] << " TemporaryDirectory" << std::endl;
+    return EXIT_FAILURE;
+    }
+  const std::string directory = argv[1];
+
+  FieldType::SizeType size;
+  size.Fill( 64 );
+  FieldType::RegionType region;
+  region.SetSize( size );
+
+  //--------------------------------------------------------
+  std::cout << "Test first touch of an unaligned block" << std::endl;
+
+  // Every byte of the block has to be zeroed exactly once, and no byte
+  // outside of it, for any alignment and number of threads.
+  const std::size_t pageSize = WorkspaceType::GetPageSize();
+  std::vector<char> memory( 5 * pageSize + 64, 1 );
+  for( itk::ThreadIdType threads = 1; threads <= 8; threads++ )
+    {
+    std::fill( memory.begin(), memory.end(), 1 );
+    const std::size_t numberOfBytes = 3 * pageSize + 17 * threads;
+    WorkspaceType::FirstTouch( &memory[threads], numberOfBytes, threads );
+    for( std::size_t i = 0; i < memory.size(); i++ )
+      {
+      const bool inBlock = i >= threads && i < threads + numberOfBytes;
+      if( memory[i] != ( inBlock ? 0 : 1 ) )
+        {
+        std::cout << "Test failed - wrong value at byte " << i
+                  << " with " << threads << " threads." << std::endl;
+        return EXIT_FAILURE;
+        }
+      }
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test heap buffers" << std::endl;
+
+  WorkspaceType::Pointer workspace = WorkspaceType::New();
+  workspace->SetNumberOfPixels( region.GetNumberOfPixels() );
+
+  FieldType::Pointer field = FieldType::New();
+  field->SetRegions( region );
+  workspace->AttachBuffer( field.GetPointer(), "Field" );
+  field->Allocate();
+
+  if( field->GetPixelContainer()->GetContainerManageMemory()
+      || reinterpret_cast<std::size_t>( field->GetBufferPointer() ) % pageSize != 0 )
+    {
+    std::cout << "Test failed - heap buffer not attached or not page aligned." << std::endl;
+    return EXIT_FAILURE;
+    }
+  if( workspace->GetAllocatedBytes() < region.GetNumberOfPixels() * sizeof( VectorType )
+      || workspace->GetMappedBytes() != 0 )
+    {
+    std::cout << "Test failed - wrong number of heap bytes." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // Releasing the buffers empties the container of the field, which then
+  // allocates its own memory.
+  workspace->ReleaseBuffers();
+  if( field->GetBufferPointer() != NULL || workspace->GetAllocatedBytes() != 0 )
+    {
+    std::cout << "Test failed - container not emptied by ReleaseBuffers()." << std::endl;
+    return EXIT_FAILURE;
+    }
+  field->Allocate();
+  if( !field->GetPixelContainer()->GetContainerManageMemory()
+      || field->GetBufferPointer() == NULL )
+    {
+    std::cout << "Test failed - released field does not allocate its own memory." << std::endl;
+    return EXIT_FAILURE;
+    }
+  field = NULL;
+
+  //--------------------------------------------------------
+  std::cout << "Test file-backed buffers" << std::endl;
+
+  workspace->SetBackingDirectory( directory );
+  field = FieldType::New();
+  field->SetRegions( region );
+  workspace->AttachBuffer( field.GetPointer(), "Field" );
+  field->Allocate();
+
+#if !defined( _WIN32 )
+  if( workspace->GetMappedBytes() != workspace->GetAllocatedBytes()
+      || workspace->GetMappedBytes() < region.GetNumberOfPixels() * sizeof( VectorType ) )
+    {
+    std::cout << "Test failed - buffer is not file-backed." << std::endl;
+    return EXIT_FAILURE;
+    }
+#endif
+
+  // Mapped buffers are zero-initialized and writable.
+  VectorType value;
+  value.Fill( 1.5 );
+  itk::ImageRegionIteratorWithIndex<FieldType> it( field, region );
+  for( ; !it.IsAtEnd(); ++it )
+    {
+    if( it.Get().GetNorm() != 0.0 )
+      {
+      std::cout << "Test failed - mapped buffer is not zero." << std::endl;
+      return EXIT_FAILURE;
+      }
+    it.Set( value );
+    }
+  if( field->GetPixel( region.GetIndex() ) != value )
+    {
+    std::cout << "Test failed - mapped buffer is not writable." << std::endl;
+    return EXIT_FAILURE;
+    }
+  field = NULL;
+  workspace->ReleaseBuffers();
+
+  //--------------------------------------------------------
+  std::cout << "Compare registration with heap and file-backed workspace" << std::endl;
+
+  ImageType::Pointer fixed = ImageType::New();
+  fixed->SetRegions( region );
+  fixed->Allocate();
+  FillCircle( fixed, 30, 32, 16 );
+
+  ImageType::Pointer moving = ImageType::New();
+  moving->SetRegions( region );
+  moving->Allocate();
+  FillCircle( moving, 32, 32, 14 );
+
+  WorkspaceType::SizeValueType heapMappedBytes = 0;
+  WorkspaceType::SizeValueType fileMappedBytes = 0;
+  FieldType::Pointer heapField = RunRegistration( fixed, moving, "", heapMappedBytes );
+  FieldType::Pointer fileField = RunRegistration( fixed, moving, directory, fileMappedBytes );
+
+#if !defined( _WIN32 )
+  if( heapMappedBytes != 0 || fileMappedBytes == 0 )
+    {
+    std::cout << "Test failed - registration did not use file-backed buffers." << std::endl;
+    return EXIT_FAILURE;
+    }
+#endif
+
+  // The buffers only differ in where they are stored, so the results have
+  // to be identical.
+  if( std::memcmp( heapField->GetBufferPointer(), fileField->GetBufferPointer(),
+        region.GetNumberOfPixels() * sizeof( VectorType ) ) != 0 )
+    {
+    std::cout << "Test failed - results with heap and file-backed workspace differ." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  //--------------------------------------------------------
+  std::cout << "Test memory budget policies" << std::endl;
+
+  // With the fixed pyramid kept, the estimate exceeds the budget set to the
+  // estimate without kept pyramid. Releasing memory early meets it.
+  MRRegistrationFilterType::Pointer mrRegFilter = CreateRegistration( fixed, moving );
+  mrRegFilter->Update();
+  if( mrRegFilter->GetWorkspace()->GetAllocatedBytes() == 0 )
+    {
+    std::cout << "Test failed - registration did not use the workspace." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  const itk::SizeValueType budget = mrRegFilter->EstimatePeakMemory();
+  mrRegFilter->KeepFixedImagePyramidOn();
+  std::cout << "Budget: " << budget << ", estimate with kept pyramid: "
+            << mrRegFilter->EstimatePeakMemory() << std::endl;
+  if( mrRegFilter->EstimatePeakMemory() <= budget )
+    {
+    std::cout << "Test failed - kept pyramid does not increase the estimate." << std::endl;
+    return EXIT_FAILURE;
+    }
+  mrRegFilter->SetMemoryBudget( budget );
+
+  bool caught = false;
+  mrRegFilter->SetMemoryBudgetPolicyToFail();
+  mrRegFilter->Modified();
+  try
+    {
+    mrRegFilter->Update();
+    }
+  catch( itk::ExceptionObject & error )
+    {
+    std::cout << "Caught expected exception: " << error.GetDescription() << std::endl;
+    caught = true;
+    }
+  if( !caught )
+    {
+    std::cout << "Test failed - exceeded budget did not fail." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  mrRegFilter->SetMemoryBudgetPolicyToRelease();
+  mrRegFilter->Modified();
+  mrRegFilter->Update();
+
+  std::cout << "Estimated peak memory: " << mrRegFilter->GetEstimatedPeakMemory()
+            << ", peak buffer memory: " << mrRegFilter->GetPeakBufferMemory()
+            << ", peak resident set size: " << mrRegFilter->GetPeakMemory() << std::endl;
+
+  // The update ran without the workspace, whose buffers have been freed.
+  if( mrRegFilter->GetEstimatedPeakMemory() > budget
+      || mrRegFilter->GetWorkspace()->GetAllocatedBytes() != 0
+      || mrRegFilter->GetPeakBufferMemory() == 0 )
+    {
+    std::cout << "Test failed - memory was not released." << std::endl;
+    return EXIT_FAILURE;
+    }
+#if defined( __linux__ )
+  if( mrRegFilter->GetPeakMemory() == 0 )
+    {
+    std::cout << "Test failed - resident set size not measured." << std::endl;
+    return EXIT_FAILURE;
+    }
+#endif
+
+  // Only the location of the buffers differs.
+  if( std::memcmp( heapField->GetBufferPointer(), mrRegFilter->GetOutput()->GetBufferPointer(),
+        region.GetNumberOfPixels() * sizeof( VectorType ) ) != 0 )
+    {
+    std::cout << "Test failed - result with released memory differs." << std::endl;
+    return EXIT_FAILURE;
+    }
+
+  // -----------------------------------------------------------
+  std::cout << "Test printing informations." << std::endl;
+  workspace->Print( std::cout );
+
+  std::cout << "Test passed" << std::endl;
+  return EXIT_SUCCESS;
+}